@@ -30,6 +30,18 @@
 #define CBLIP_API __attribute__ ((visibility ("default")))
 #endif
 
+/**
+ * The layout version of the public structures, bumped whenever one of them changes size or
+ * field offsets.  Version 2 changed blip_message_t:
+ * - added profile and profile_size
+ * - grew private from 8 to 11 slots, for the buffers a message keeps when it is read into again
+ */
+#define CBLIP_ABI_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** A connection handle, created by blip_connection_new() */
 typedef struct blip_connection blip_connection_t;
 
@@ -44,7 +56,13 @@ struct blip_message
     size_t body_size;               ///< The size of the message body
     int32_t checksum;               ///< The checksum for this message in the context of the entire connection
     int32_t calculated_checksum;    ///< The checksum that was calculated from the connection (if this doesn't match checksum, this message is not valid)
-    uint64_t private[4];            ///< Internal use information
+    const uint8_t* profile;         ///< The value of the Profile property (points into properties, *not* null terminated), or NULL
+    size_t profile_size;            ///< The size of the Profile property value
+#ifdef __cplusplus
+    uint64_t private_[11];          ///< Internal use information (private is a C++ keyword)
+#else
+    uint64_t private[11];           ///< Internal use information
+#endif
 };
 
 /**
@@ -76,6 +94,13 @@ static inline uint8_t* put_varint(uint64_t varint, uint8_t* data) {
 /** A message received from a BLIP connection */
 typedef struct blip_message blip_message_t;
 
+/**
+ * Called with messages as they are decoded (by a parser, dispatcher, etc)
+ * @param context   The context pointer registered along with the callback
+ * @param msg       The decoded message, which is only valid until the callback returns
+ */
+typedef void (*blip_message_callback)(void* context, blip_message_t* msg);
+
 
 /***********************
  * BLIP Connection API *
@@ -95,6 +120,64 @@ CBLIP_API blip_connection_t* blip_connection_new();
  */
 CBLIP_API void blip_connection_free(blip_connection_t* connection);
 
+/** How a connection compresses the messages it serializes with the Compressed flag */
+typedef struct {
+    int level;          ///< zlib compression level, 0-9 or Z_DEFAULT_COMPRESSION (-1)
+    int strategy;       ///< zlib strategy (Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED)
+    int mem_level;      ///< zlib memory level, 1-9
+    int window_bits;    ///< log2 of the deflate window, 9-15
+    size_t min_size;    ///< Messages whose properties and body add up to less than this are sent uncompressed
+} blip_compression_options;
+
+/**
+ * Changes how a connection compresses outgoing messages.  The deflate stream is created when
+ * the first compressed message is serialized, so settings made before then cost nothing;
+ * later changes end the current stream and start a new one with the next compressed message.
+ * The defaults are Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, memory level 9, a 15 bit window
+ * and no minimum size.  Lower memory levels and smaller windows shrink the deflate state
+ * (roughly 2^(window_bits + 2) + 2^(mem_level + 9) bytes) at some cost in compression.
+ * @param connection    The connection to configure
+ * @param options       The compression settings
+ * @return              0 on success, negative values on failure (invalid settings)
+ */
+CBLIP_API int blip_connection_set_compression(blip_connection_t* connection, const blip_compression_options* options);
+
+/**
+ * Gets the number of bytes a connection currently has allocated, including the zlib streams
+ * it has created so far (allocator overhead is not included)
+ * @param connection    The connection to measure
+ * @return              The number of bytes
+ */
+CBLIP_API size_t blip_connection_memory_usage(const blip_connection_t* connection);
+
+/**
+ * Frees the scratch space that decoding keeps for the calling thread (for inflating compressed
+ * messages).  Threads that decode should call this before they exit.
+ */
+CBLIP_API void blip_thread_release_memory(void);
+
+/**
+ * Writes a checkpoint of the inbound decoding state of a connection (the inflate window,
+ * the rolling CRCs and the set of partially received messages) so that decoding can later
+ * resume from this point without replaying earlier frames.  Call once with a NULL buffer
+ * to find out how much space is needed.
+ * @param connection    The connection to checkpoint (must be between frames)
+ * @param buf           The buffer to write the checkpoint into, or NULL
+ * @param capacity      The size of buf
+ * @return              The number of bytes written, the required capacity if buf is NULL or
+ *                      too small, or 0 on failure
+ */
+CBLIP_API size_t blip_connection_checkpoint(const blip_connection_t* connection, uint8_t* buf, size_t capacity);
+
+/**
+ * Replaces the decoding state of a connection with one saved by blip_connection_checkpoint()
+ * @param connection    The connection to restore into
+ * @param data          The checkpoint data
+ * @param size          The size of the checkpoint data
+ * @return              0 on success, negative values on failure (the connection is unchanged)
+ */
+CBLIP_API int blip_connection_restore(blip_connection_t* connection, const uint8_t* data, size_t size);
+
 /********************
  * BLIP Message API *
  *******************/
@@ -114,6 +197,67 @@ CBLIP_API blip_message_t* blip_message_new();
  */
 CBLIP_API blip_message_t* blip_message_read(const blip_connection_t* connection, uint8_t* data, size_t size);
 
+/**
+ * Reads a message into an existing message object, recycling the buffers of whatever it held
+ * before, so that reading frame after frame into one object stops allocating once its buffers
+ * are big enough.  Anything previously pointing into the message becomes invalid.
+ * @param connection    The connection to derive the message from
+ * @param msg           A message from blip_message_new() or an earlier read
+ * @param data          The raw data received over the wire (not modified)
+ * @param size          The size of the received data
+ * @return              0 on success, negative values on failure (msg then holds no message, but
+ *                      can still be read into or freed)
+ */
+CBLIP_API int blip_message_read_into(const blip_connection_t* connection, blip_message_t* msg, const uint8_t* data,
+                                     size_t size);
+
+/** Where blip_message_read_streaming() delivers the parts of a message */
+typedef struct {
+    size_t chunk_size;  ///< The most body bytes handed to on_body at once (0 for 64 KiB)
+
+    /**
+     * Called once the properties are decoded, before any of the body (may be NULL)
+     * @param context   The context pointer below
+     * @param msg       The message so far (properties and profile are set, body is not)
+     * @return          0 to carry on, negative values to stop delivering this message
+     */
+    int (*on_properties)(void* context, const blip_message_t* msg);
+
+    /**
+     * Called with each piece of the (decompressed) body, in order
+     * @param context   The context pointer below
+     * @param msg       The message so far
+     * @param chunk     The next body bytes, only valid during the call
+     * @param size      The size of chunk (never 0)
+     * @return          0 to carry on, negative values to stop delivering this message
+     */
+    int (*on_body)(void* context, const blip_message_t* msg, const uint8_t* chunk, size_t size);
+
+    void* context;      ///< An arbitrary pointer handed back to the callbacks
+} blip_body_stream;
+
+/**
+ * Reads a message like blip_message_read(), but hands the body to callbacks as it is
+ * decompressed instead of collecting it.  Neither the frame nor the body is copied, so the
+ * memory used is bounded by the properties and one chunk no matter how big the body is.  The
+ * checksum is calculated along the way and set on the returned message, whose body is NULL
+ * and whose body_size is that of the whole body (all passed to on_body, unless delivery was
+ * stopped).  ACK messages have no properties or body, so the callbacks are not called for
+ * them.  Stopped messages are recorded in connection stats like the rest.  The callbacks must
+ * not read from the same connection.
+ * @param connection    The connection to derive the message from
+ * @param data          The raw data received over the wire (not modified)
+ * @param size          The size of the received data
+ * @param stream        The callbacks to deliver the message to
+ * @param out_msg       Receives the message unless reading failed, NULL otherwise.  A message
+ *                      that a callback stopped is still read to the end (the connection stays
+ *                      in step with the peer), so its checksum and body_size are complete.
+ * @return              1 if the message was delivered in full, 0 if a callback stopped
+ *                      delivery, negative values on failure
+ */
+CBLIP_API int blip_message_read_streaming(const blip_connection_t* connection, const uint8_t* data, size_t size,
+                                          const blip_body_stream* stream, blip_message_t** out_msg);
+
 /**
  * Frees the memory associated with a BLIP message
  * @param msg The message to free
@@ -127,6 +271,17 @@ CBLIP_API void blip_message_free(blip_message_t* msg);
  */
 CBLIP_API const char* blip_get_message_type(const blip_message_t* msg);
 
+/**
+ * Looks up the value of a property on a message
+ * @param msg           The message to look in
+ * @param key           The property name, for example "Profile"
+ * @param value         On success, points to the value inside msg->properties (*not* null terminated)
+ * @param value_size    On success, contains the size of the value
+ * @return              0 if the property was found, negative values otherwise
+ */
+CBLIP_API int blip_message_get_property(const blip_message_t* msg, const char* key, const uint8_t** value,
+                                        size_t* value_size);
+
 /**
  * Gets the number of acknowledged bytes that an ACK type message reported
  * (Calling this method on a non-ACK type message returns 0)
@@ -136,10 +291,44 @@ CBLIP_API const char* blip_get_message_type(const blip_message_t* msg);
 CBLIP_API uint64_t blip_get_message_ack_size(const blip_message_t* msg);
 
 /**
- * Serializes a BLIP message into raw bytes for transport
+ * Gets the size of the frame that a message was read from, as it was on the wire
+ * @param msg   The message to inspect
+ * @return      The frame size, or 0 if the message was not read from a frame
+ */
+CBLIP_API size_t blip_get_message_wire_size(const blip_message_t* msg);
+
+/**
+ * Serializes a BLIP message into raw bytes for transport.  On success msg->flags holds the
+ * flags written into the frame, which lack Compressed if the message was below the
+ * connection's minimum compressed size.
  * @param connection    The connection to use during serialization (CRC / GZIP)
  * @param msg           The message to serialize
  * @param out_size      On successful completion, contains the size of the returned bytes
  * @return              The encoded BLIP message as a pointer to byte data
  */
-CBLIP_API const uint8_t* blip_message_serialize(blip_connection_t* connection, blip_message_t* msg, size_t* out_size);
\ No newline at end of file
+CBLIP_API const uint8_t* blip_message_serialize(blip_connection_t* connection, blip_message_t* msg, size_t* out_size);
+
+/**
+ * Gets the most bytes that serializing a message can take, whatever the compression settings
+ * @param msg   The message to be serialized
+ * @return      The upper bound, in bytes
+ */
+CBLIP_API size_t blip_message_serialize_bound(const blip_message_t* msg);
+
+/**
+ * Serializes a BLIP message into a buffer supplied by the caller instead of allocating one.
+ * msg->flags is updated as by blip_message_serialize().
+ * @param connection    The connection to use during serialization (CRC / GZIP)
+ * @param msg           The message to serialize
+ * @param buf           The buffer to write the encoded message into
+ * @param capacity      The size of buf, at least blip_message_serialize_bound() bytes
+ * @param out_size      On successful completion, contains the number of bytes written
+ * @return              0 on success, negative values on failure (if capacity is too small nothing
+ *                      is written and the connection is unchanged)
+ */
+CBLIP_API int blip_message_serialize_into(blip_connection_t* connection, blip_message_t* msg, uint8_t* buf,
+                                          size_t capacity, size_t* out_size);
+
+#ifdef __cplusplus
+}
+#endif
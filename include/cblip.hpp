@@ -0,0 +1,258 @@
+//
+//  cblip.hpp
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+// A header-only C++17 layer over the C API.  The classes own their C handles, are move-only and
+// add no allocations of their own: accessors return views into the message, a Message is reused
+// from read to read, and serialization writes into the caller's buffer.
+
+namespace blip {
+
+/** A read-only view of bytes (the C++17 stand-in for std::span<const uint8_t>) */
+class Bytes
+{
+public:
+    constexpr Bytes() noexcept = default;
+    constexpr Bytes(const uint8_t* data, size_t size) noexcept : _data(data), _size(size) {}
+
+    constexpr const uint8_t* data() const noexcept { return _data; }
+    constexpr size_t size() const noexcept { return _size; }
+    constexpr bool empty() const noexcept { return _size == 0; }
+    constexpr const uint8_t* begin() const noexcept { return _data; }
+    constexpr const uint8_t* end() const noexcept { return _data + _size; }
+    constexpr uint8_t operator[](size_t index) const noexcept { return _data[index]; }
+
+    /** The bytes as text, for bodies that are JSON or other strings */
+    std::string_view as_string() const noexcept { return {reinterpret_cast<const char*>(_data), _size}; }
+
+#if __cplusplus >= 202002L
+    operator std::span<const uint8_t>() const noexcept { return {_data, _size}; }
+#endif
+
+private:
+    const uint8_t* _data {nullptr};
+    size_t _size {0};
+};
+
+/** Owns a blip_connection_t.  One connection is needed per direction of a BLIP conversation. */
+class Connection
+{
+public:
+    /** Creates a connection (check with operator bool, creation only fails without memory) */
+    Connection() noexcept : _handle(blip_connection_new()) {}
+
+    /** Takes ownership of a connection created by the C API */
+    explicit Connection(blip_connection_t* handle) noexcept : _handle(handle) {}
+
+    ~Connection() { reset(); }
+
+    Connection(Connection&& other) noexcept : _handle(other.release()) {}
+    Connection& operator=(Connection&& other) noexcept
+    {
+        if (this != &other) {
+            reset(other.release());
+        }
+
+        return *this;
+    }
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    explicit operator bool() const noexcept { return _handle != nullptr; }
+    blip_connection_t* get() const noexcept { return _handle; }
+
+    /** Gives up ownership of the C handle, which the caller must free */
+    blip_connection_t* release() noexcept { return std::exchange(_handle, nullptr); }
+
+    /** Frees the current connection and takes ownership of another (or none) */
+    void reset(blip_connection_t* handle = nullptr) noexcept
+    {
+        if (_handle) {
+            blip_connection_free(_handle);
+        }
+
+        _handle = handle;
+    }
+
+    /** See blip_connection_set_compression() */
+    bool set_compression(const blip_compression_options& options) noexcept
+    {
+        return blip_connection_set_compression(_handle, &options) == 0;
+    }
+
+    /** See blip_connection_memory_usage() */
+    size_t memory_usage() const noexcept { return blip_connection_memory_usage(_handle); }
+
+private:
+    blip_connection_t* _handle;
+};
+
+/**
+ * Owns a blip_message_t.  Reading into the same Message over and over recycles its buffers,
+ * which is the allocation free way to decode a stream of frames.
+ */
+class Message
+{
+public:
+    /** An empty message, its storage is created by the first read() */
+    Message() noexcept : _handle(nullptr) {}
+
+    /** Takes ownership of a message created by the C API */
+    explicit Message(blip_message_t* handle) noexcept : _handle(handle) {}
+
+    ~Message() { reset(); }
+
+    Message(Message&& other) noexcept : _handle(other.release()) {}
+    Message& operator=(Message&& other) noexcept
+    {
+        if (this != &other) {
+            reset(other.release());
+        }
+
+        return *this;
+    }
+
+    Message(const Message&) = delete;
+    Message& operator=(const Message&) = delete;
+
+    /**
+     * Reads a frame into this message, replacing (and reusing the storage of) what it held
+     * @param connection    The connection the frame arrived on
+     * @param data          The raw frame (not modified)
+     * @param size          The size of the raw frame
+     * @return              true on success, false if the frame could not be decoded
+     */
+    bool read(const Connection& connection, const uint8_t* data, size_t size) noexcept
+    {
+        if (!_handle && !(_handle = blip_message_new())) {
+            return false;
+        }
+
+        return blip_message_read_into(connection.get(), _handle, data, size) == 0;
+    }
+
+    bool read(const Connection& connection, Bytes frame) noexcept
+    {
+        return read(connection, frame.data(), frame.size());
+    }
+
+    explicit operator bool() const noexcept { return _handle != nullptr; }
+    blip_message_t* get() const noexcept { return _handle; }
+
+    /** Gives up ownership of the C handle, which the caller must free */
+    blip_message_t* release() noexcept { return std::exchange(_handle, nullptr); }
+
+    /** Frees the current message and takes ownership of another (or none) */
+    void reset(blip_message_t* handle = nullptr) noexcept
+    {
+        if (_handle) {
+            blip_message_free(_handle);
+        }
+
+        _handle = handle;
+    }
+
+    MessageNo number() const noexcept { return _handle->msg_no; }
+    MessageType type() const noexcept { return _handle->type; }
+    FrameFlags flags() const noexcept { return _handle->flags; }
+    const char* type_name() const noexcept { return blip_get_message_type(_handle); }
+    bool is_ack() const noexcept { return _handle->type >= kAckRequestType; }
+
+    /** Whether the checksum in the frame matches the one calculated along the connection */
+    bool checksum_valid() const noexcept { return _handle->checksum == _handle->calculated_checksum; }
+
+    /** The properties, colon separated (empty if there are none) */
+    std::string_view properties() const noexcept
+    {
+        const char* properties = reinterpret_cast<const char*>(_handle->properties);
+        return properties ? std::string_view(properties, std::strlen(properties)) : std::string_view();
+    }
+
+    /** Looks up a property, see blip_message_get_property() */
+    std::optional<std::string_view> property(const char* key) const noexcept
+    {
+        const uint8_t* value;
+        size_t value_size;
+        if (blip_message_get_property(_handle, key, &value, &value_size) < 0) {
+            return std::nullopt;
+        }
+
+        return std::string_view(reinterpret_cast<const char*>(value), value_size);
+    }
+
+    /** The value of the Profile property (empty if there is none) */
+    std::string_view profile() const noexcept
+    {
+        return {reinterpret_cast<const char*>(_handle->profile), _handle->profile_size};
+    }
+
+    Bytes body() const noexcept { return {_handle->body, _handle->body_size}; }
+
+    /** See blip_get_message_ack_size() */
+    uint64_t ack_size() const noexcept { return blip_get_message_ack_size(_handle); }
+
+    /** See blip_get_message_wire_size() */
+    size_t wire_size() const noexcept { return blip_get_message_wire_size(_handle); }
+
+private:
+    blip_message_t* _handle;
+};
+
+/**
+ * See blip_message_serialize_bound()
+ * @param msg   The message to be serialized
+ * @return      The buffer size that serialize() is guaranteed to fit in
+ */
+inline size_t serialize_bound(const blip_message_t& msg) noexcept
+{
+    return blip_message_serialize_bound(&msg);
+}
+
+/**
+ * Serializes a message into the caller's buffer, see blip_message_serialize_into()
+ * @param connection    The connection to serialize on
+ * @param msg           The message to serialize
+ * @param buf           The buffer to write into
+ * @param capacity      The size of buf, at least serialize_bound(msg)
+ * @return              The number of bytes written, or nullopt on failure
+ */
+inline std::optional<size_t> serialize(Connection& connection, blip_message_t& msg, uint8_t* buf,
+                                       size_t capacity) noexcept
+{
+    size_t size;
+    if (blip_message_serialize_into(connection.get(), &msg, buf, capacity, &size) < 0) {
+        return std::nullopt;
+    }
+
+    return size;
+}
+
+} // namespace blip
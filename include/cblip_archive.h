@@ -0,0 +1,195 @@
+//
+//  cblip_archive.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An archive is a directory of numbered segments.  Each segment is a data file, which only
+ * ever grows, and an index file written once the data file is complete (sealing it).  All
+ * integers are little endian.
+ *
+ *   NNNNNNNN.cbad:  "CBAD" <version:u8> <zero padding to 8 bytes>  { block }
+ *   block:          "CBAB" <record count:u32> <raw size:u32> <stored size:u32> <crc32 of raw bytes:u32>
+ *                   <stored bytes: the records deflated, or as they are if that didn't shrink them>
+ *   record:         <timestamp_ns:u64> <msg_no:u64> <properties size:u32> <body size:u32>
+ *                   <direction:u8> <type:u8> <flags:u8> <checksum:u8> <doc ID count:u32>
+ *                   { <doc ID key:u64> } <properties (NUL separated, as on the wire)> <body>
+ *
+ *   NNNNNNNN.cbai:  "CBAI" <version:u8> <zero padding to 8 bytes>
+ *                   <record count:u64> <block count:u64> <first timestamp:u64> <last timestamp:u64>
+ *                   { <entry offset:u64> <entry count:u64> }                  (profile, msg_no, doc ID)
+ *                   { <block offset:u64> <first timestamp:u64> <last timestamp:u64> }  (one per block)
+ *                   { <key:u64> <timestamp_ns:u64> <block:u32> <record offset:u32> }   (entries)
+ *
+ * Index entries are sorted by key, then by position, so the records with a given key are one
+ * binary search away and come out in the order they were archived.  Profile and doc ID keys
+ * are 64-bit FNV-1a hashes of the string, msg_no keys are the message number.  Doc IDs come
+ * from the "id" and "docID" properties and from the entries of changes and proposeChanges
+ * requests.  The checksum byte is 0 for a mismatch, 1 for a match and 2 for ACKs, which carry
+ * none.  "First" and "last" timestamps are the smallest and largest.
+ */
+
+/** The version written into segment headers */
+#define BLIP_ARCHIVE_VERSION 1
+
+/** An archive writer, created by blip_archive_writer_open() */
+typedef struct blip_archive_writer blip_archive_writer_t;
+
+/** An archive opened for queries, created by blip_archive_open() */
+typedef struct blip_archive blip_archive_t;
+
+/**
+ * Receives a line describing something an archive ran into: a file that couldn't be written,
+ * an unsealed segment being recovered, a damaged segment or block being skipped
+ * @param context   The context pointer given along with the callback
+ * @param message   The description, without a trailing newline
+ */
+typedef void (*blip_archive_report)(void* context, const char* message);
+
+/** How an archive writer lays out segments */
+typedef struct {
+    size_t segment_size;        ///< Data bytes after which a segment is sealed and a new one started
+    size_t block_size;          ///< Raw record bytes per compressed block (a query inflates whole blocks)
+    int level;                  ///< The zlib compression level of blocks
+    blip_archive_report report; ///< Told about recoveries and failures (NULL to stay quiet)
+    void* report_context;       ///< An arbitrary pointer handed back to report
+} blip_archive_options;
+
+/** A message read back out of an archive, only valid during the visit callback */
+typedef struct {
+    uint64_t timestamp_ns;          ///< The timestamp the message was archived with
+    MessageNo msg_no;               ///< The message number
+    MessageType type;               ///< The type of message
+    FrameFlags flags;               ///< The frame flags
+    uint8_t direction;              ///< The direction the message was archived with
+    uint8_t checksum;               ///< 0 for a checksum mismatch, 1 for a match, 2 for ACKs
+    const uint8_t* properties;      ///< The properties, NUL separated as on the wire (may be NULL)
+    size_t properties_size;         ///< The size of properties, including the final NUL
+    const uint8_t* body;            ///< The message body
+    size_t body_size;               ///< The size of the body
+} blip_archive_record_t;
+
+/** What to look for in an archive.  Every criterion that is set must match. */
+typedef struct {
+    const char* profile;    ///< Only messages with this Profile property (NULL for any)
+    const char* doc_id;     ///< Only messages about this document (NULL for any)
+    bool match_msg_no;      ///< Whether to only return messages numbered msg_no
+    MessageNo msg_no;       ///< The message number to look for
+    uint64_t since_ns;      ///< Only messages timestamped at or after this
+    uint64_t until_ns;      ///< Only messages timestamped before this (0 for no limit)
+} blip_archive_query_t;
+
+/**
+ * Receives the messages a query finds, in the order they were archived
+ * @param context   The context pointer passed to blip_archive_query()
+ * @param record    The message
+ * @return          0 to carry on, anything else to stop the query
+ */
+typedef int (*blip_archive_visit)(void* context, const blip_archive_record_t* record);
+
+/*********************
+ * BLIP Archive API  *
+ ********************/
+
+/**
+ * Gets the default archive options: 256MB segments of 64KB blocks, compressed at level 6, with
+ * nothing reported
+ * @param options   Receives the defaults
+ */
+CBLIP_API void blip_archive_default_options(blip_archive_options* options);
+
+/**
+ * Opens an archive directory for appending, creating it if needed.  Writing always starts a
+ * new segment; a segment left unsealed by a writer that didn't close (a crash, say) is cut
+ * back to its last complete block and sealed first.  Only one writer may use a directory at
+ * a time.
+ * @param directory The archive directory
+ * @param options   How to lay out segments (NULL for the defaults)
+ * @return          The writer, or NULL on failure
+ */
+CBLIP_API blip_archive_writer_t* blip_archive_writer_open(const char* directory, const blip_archive_options* options);
+
+/**
+ * Appends a decoded message to an archive
+ * @param writer        The writer to append with
+ * @param msg           The message to archive (its properties and body are copied)
+ * @param direction     The direction the message travelled, as numbered by the caller
+ * @param timestamp_ns  When the message was seen, in nanoseconds since the epoch
+ * @return              0 on success, negative values on failure (the writer is then unusable)
+ */
+CBLIP_API int blip_archive_append(blip_archive_writer_t* writer, const blip_message_t* msg, uint8_t direction,
+                                  uint64_t timestamp_ns);
+
+/**
+ * Seals the segment being written and frees the writer
+ * @param writer    The writer to close
+ * @return          0 on success, negative values if the segment couldn't be sealed
+ */
+CBLIP_API int blip_archive_writer_close(blip_archive_writer_t* writer);
+
+/**
+ * Opens an archive for queries by mapping the sealed segments of a directory.  Nothing is
+ * read up front beyond the index headers, queries only touch the index entries and blocks
+ * they need.  Segments sealed after opening aren't seen, damaged ones are skipped.
+ * @param directory The archive directory
+ * @param report    Told about damaged segments, here and in later queries (may be NULL)
+ * @param context   An arbitrary pointer handed back to report
+ * @return          The archive, or NULL on failure
+ */
+CBLIP_API blip_archive_t* blip_archive_open(const char* directory, blip_archive_report report, void* context);
+
+/**
+ * Finds archived messages.  A doc ID, msg_no or profile criterion is looked up in the
+ * matching index (in that order of preference); with none of those, the blocks in the time
+ * range are scanned.  Segments and blocks outside the time range are never touched.  Queries
+ * may run concurrently on one archive.
+ * @param archive   The archive to search
+ * @param query     What to look for
+ * @param visit     Called with every message found
+ * @param context   An arbitrary pointer handed back to visit
+ * @return          The number of messages visited, or negative values on failure (a corrupt block,
+ *                  which is also reported)
+ */
+CBLIP_API int64_t blip_archive_query(const blip_archive_t* archive, const blip_archive_query_t* query,
+                                     blip_archive_visit visit, void* context);
+
+/**
+ * Gets the value of a property of an archived message
+ * @param record        The message
+ * @param key           The property name
+ * @param value         On success, points to the value (*not* null terminated)
+ * @param value_size    On success, contains the size of the value
+ * @return              0 on success, negative values if there is no such property
+ */
+CBLIP_API int blip_archive_record_get_property(const blip_archive_record_t* record, const char* key,
+                                               const uint8_t** value, size_t* value_size);
+
+/**
+ * Unmaps an archive and frees the memory associated with it
+ * @param archive The archive to close
+ */
+CBLIP_API void blip_archive_close(blip_archive_t* archive);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,99 @@
+//
+//  cblip_batch.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** An outbound batch of serialized messages, created by blip_batch_new() */
+typedef struct blip_batch blip_batch_t;
+
+/** How each frame in a batch is delimited */
+typedef enum {
+    kBlipBatchLengthPrefixed,   ///< Each frame is preceded by its size as a varint
+    kBlipBatchWebSocket,        ///< Each frame is an unmasked binary WebSocket message (server to client)
+} blip_batch_framing;
+
+/**
+ * Receives the contents of a batch when it is flushed
+ * @param context   The context pointer passed to blip_batch_new()
+ * @param data      The framed messages, back to back, only valid during the call
+ * @param size      The size of data
+ * @return          0 on success, negative values on failure
+ */
+typedef int (*blip_batch_write)(void* context, const uint8_t* data, size_t size);
+
+/*********************
+ * BLIP Batch API    *
+ ********************/
+
+/**
+ * Creates a batch that serializes messages one after another into a single reusable buffer,
+ * so a burst of small messages goes out as one contiguous write.  The messages are serialized
+ * as they are added, which is what moves the outgoing checksum chain and compression state of
+ * the connection forward, so anything else serialized on the connection has to be written
+ * after the batch has been flushed.
+ * @param connection    The connection whose outgoing state is used
+ * @param framing       How each frame is delimited in the output
+ * @param flush_bytes   Flush once the buffer holds at least this many bytes (0 for no limit)
+ * @param flush_count   Flush once the buffer holds this many messages (0 for no limit)
+ * @param write         Receives the buffer contents on every flush
+ * @param context       An arbitrary pointer handed back to write
+ * @return              The created batch, or NULL on failure
+ */
+CBLIP_API blip_batch_t* blip_batch_new(blip_connection_t* connection, blip_batch_framing framing,
+                                       size_t flush_bytes, size_t flush_count,
+                                       blip_batch_write write, void* context);
+
+/**
+ * Serializes a message onto the end of a batch, flushing if a threshold has been reached
+ * @param batch The batch to add to
+ * @param msg   The message to serialize (the batch does not keep it)
+ * @return      0 on success, 1 if the message was added but the flush it triggered failed (the
+ *              data stays in the batch for a later blip_batch_flush()), negative values if
+ *              the message could not be added
+ */
+CBLIP_API int blip_batch_add(blip_batch_t* batch, blip_message_t* msg);
+
+/**
+ * Hands everything in a batch to its write callback, and empties it on success
+ * @param batch The batch to flush
+ * @return      0 on success (including when the batch is empty), negative values on failure
+ */
+CBLIP_API int blip_batch_flush(blip_batch_t* batch);
+
+/**
+ * Gets the amount of data waiting in a batch
+ * @param batch The batch to inspect
+ * @param count Receives the number of messages waiting (optional)
+ * @return      The number of bytes waiting
+ */
+CBLIP_API size_t blip_batch_pending(const blip_batch_t* batch, size_t* count);
+
+/**
+ * Frees the memory associated with a batch, without flushing it
+ * @param batch The batch to free
+ */
+CBLIP_API void blip_batch_free(blip_batch_t* batch);
+
+#ifdef __cplusplus
+}
+#endif
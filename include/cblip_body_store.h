@@ -0,0 +1,129 @@
+//
+//  cblip_body_store.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A store of deduplicated message bodies, created by blip_body_store_new() */
+typedef struct blip_body_store blip_body_store_t;
+
+/** A counted reference to one body held by a store */
+typedef struct blip_body_ref blip_body_ref_t;
+
+/** What a body store holds */
+typedef struct {
+    uint64_t distinct;          ///< The number of distinct bodies held (referenced or idle)
+    uint64_t stored_bytes;      ///< The bytes of body held, one copy per distinct body
+    uint64_t idle_bytes;        ///< The part of stored_bytes that nothing references (evictable)
+    uint64_t references;        ///< The number of outstanding references
+    uint64_t referenced_bytes;  ///< The bytes the outstanding references would take as separate copies
+    uint64_t hits;              ///< Interns that found their body already held (compared in full)
+    uint64_t misses;            ///< Interns that had to copy their body, hash collisions included
+    uint64_t evictions;         ///< Idle bodies dropped to stay within the budget
+} blip_body_store_stats_t;
+
+/*************************
+ * BLIP Body Store API   *
+ ************************/
+
+/**
+ * Creates a body store, which keeps one copy of each distinct body however many messages
+ * carry it (replication fans the same revision out to every client).  Bodies are found by
+ * their XXH64 hash and size, then compared in full, so different bodies are never merged.
+ * A body stays held while it has references, and once released it is kept idle (so that it
+ * can still be found) until the store goes over its budget, when the least recently released
+ * idle bodies are dropped first.  Referenced bodies are never dropped, so a store can go over
+ * its budget while they are in use.  A store can be shared between threads: the hashing and
+ * copying happen outside of its lock, which only guards the table.
+ * @param budget_bytes  The most body bytes to keep held once idle bodies are counted in
+ * @return              The created store, or NULL on failure
+ */
+CBLIP_API blip_body_store_t* blip_body_store_new(size_t budget_bytes);
+
+/**
+ * Gets a reference to a copy of a body held by a store, copying it only if no identical body
+ * is held already
+ * @param store     The store to intern into
+ * @param data      The body
+ * @param size      The size of the body
+ * @return          A reference to release with blip_body_ref_release(), or NULL on failure
+ */
+CBLIP_API blip_body_ref_t* blip_body_store_intern(blip_body_store_t* store, const uint8_t* data, size_t size);
+
+/**
+ * Interns the (decompressed) body of a decoded message, so that it can be kept after the
+ * message is freed or reused for the next read
+ * @param store     The store to intern into
+ * @param msg       The message, straight from blip_message_read() or a message callback
+ * @return          A reference to release with blip_body_ref_release(), or NULL for ACK
+ *                  messages (which have no body) or on failure
+ */
+CBLIP_API blip_body_ref_t* blip_body_store_retain_message(blip_body_store_t* store, const blip_message_t* msg);
+
+/**
+ * Adds a reference to a body that is already held
+ * @param store     The store that holds the body
+ * @param ref       An outstanding reference to the body
+ * @return          ref, which must now be released once more
+ */
+CBLIP_API blip_body_ref_t* blip_body_ref_retain(blip_body_store_t* store, blip_body_ref_t* ref);
+
+/**
+ * Releases a reference to a body.  The body stays held idle if it was the last one (until the
+ * budget calls for it to be dropped).
+ * @param store     The store that holds the body
+ * @param ref       The reference to release (NULL is ignored)
+ */
+CBLIP_API void blip_body_ref_release(blip_body_store_t* store, blip_body_ref_t* ref);
+
+/**
+ * Gets the bytes of a body, which stay valid (and unchanged) until the reference is released
+ * @param ref       A reference to the body
+ * @param size      Receives the size of the body
+ * @return          The body
+ */
+CBLIP_API const uint8_t* blip_body_ref_data(const blip_body_ref_t* ref, size_t* size);
+
+/**
+ * Gets the XXH64 hash (seed 0) of a body, which identifies its content
+ * @param ref   A reference to the body
+ * @return      The hash
+ */
+CBLIP_API uint64_t blip_body_ref_hash(const blip_body_ref_t* ref);
+
+/**
+ * Gets what a store holds
+ * @param store     The store to describe
+ * @param stats     Receives the figures
+ */
+CBLIP_API void blip_body_store_get_stats(blip_body_store_t* store, blip_body_store_stats_t* stats);
+
+/**
+ * Frees a store and every body it holds, including those kept apart after a hash collision.
+ * Any references still outstanding become invalid.
+ * @param store The store to free
+ */
+CBLIP_API void blip_body_store_free(blip_body_store_t* store);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,95 @@
+//
+//  cblip_builder.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A message builder, created by blip_message_builder_new() */
+typedef struct blip_message_builder blip_message_builder_t;
+
+/*********************
+ * BLIP Builder API  *
+ ********************/
+
+/**
+ * Creates a builder that puts outgoing messages together directly in wire format.  Properties
+ * are written NUL separated as they are added (so values may contain colons, unlike the
+ * properties string of blip_message_serialize()) and body segments are appended after them,
+ * with room for the frame header left in front.  Finishing an uncompressed message only writes
+ * the header and the checksum around the payload, no copy is made.  A builder is reused from
+ * message to message, keeping its buffers.
+ * @return The created builder, or NULL on failure
+ */
+CBLIP_API blip_message_builder_t* blip_message_builder_new(void);
+
+/**
+ * Starts a new message, discarding anything from the previous one
+ * @param builder   The builder to use
+ * @param msg_no    The message number
+ * @param type      The message type (ACK messages can't be built)
+ * @param flags     The frame flags, for example kCompressed or kUrgent
+ * @return          0 on success, negative values on failure (out of memory or an ACK type)
+ */
+CBLIP_API int blip_message_builder_begin(blip_message_builder_t* builder, MessageNo msg_no, MessageType type,
+                                         FrameFlags flags);
+
+/**
+ * Adds a property to the message being built.  All properties must come before the body.
+ * @param builder   The builder to add to
+ * @param key       The property name, for example "Profile"
+ * @param value     The property value
+ * @return          0 on success, negative values on failure (out of memory, no message begun or
+ *                  the body already started)
+ */
+CBLIP_API int blip_message_builder_add_property(blip_message_builder_t* builder, const char* key, const char* value);
+
+/**
+ * Appends a segment to the body of the message being built
+ * @param builder   The builder to append to
+ * @param data      The bytes to append
+ * @param size      The number of bytes
+ * @return          0 on success, negative values on failure (out of memory or no message begun)
+ */
+CBLIP_API int blip_message_builder_append_body(blip_message_builder_t* builder, const void* data, size_t size);
+
+/**
+ * Completes the message being built: compresses it if it was begun with kCompressed (and is
+ * at least the connection's minimum compression size), then writes the frame header and the
+ * checksum
+ * @param builder   The builder to finish
+ * @param connection    The connection to send the message on (CRC / GZIP)
+ * @param out_size  On successful completion, contains the size of the returned bytes
+ * @return          The encoded frame, which stays valid until the builder is next used or freed,
+ *                  or NULL on failure
+ */
+CBLIP_API const uint8_t* blip_message_builder_finish(blip_message_builder_t* builder, blip_connection_t* connection,
+                                                     size_t* out_size);
+
+/**
+ * Frees the memory associated with a builder
+ * @param builder The builder to free
+ */
+CBLIP_API void blip_message_builder_free(blip_message_builder_t* builder);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,53 @@
+//
+//  cblip_cpu.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library is built for the baseline of its target architecture, and picks faster
+// implementations of its hot loops (CRC, varints, property separators) at runtime from what
+// the CPU supports.  The choice can be capped with the CBLIP_CPU environment variable, set
+// to one of "scalar", "sse2", "sse4.2", "avx2" or "avx512" (other values are ignored).  Setting
+// CBLIP_CPU_CHECK makes the library run blip_cpu_self_test() when it first picks its kernels,
+// and fall back to the scalar ones if anything disagrees, which blip_cpu_kernels() then notes.
+// The library prints nothing either way.
+
+/********************
+ * BLIP CPU API     *
+ *******************/
+
+/**
+ * Describes the kernels the library is using, for example "crc32=pclmul varint=bmi2 properties=avx2"
+ * @return A static, null terminated description
+ */
+CBLIP_API const char* blip_cpu_kernels(void);
+
+/**
+ * Cross-checks every kernel variant this CPU can run against the scalar one on generated
+ * inputs (independent of the CBLIP_CPU cap)
+ * @return 0 if every variant agrees, otherwise the number of disagreements
+ */
+CBLIP_API int blip_cpu_self_test(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,91 @@
+//
+//  cblip_dispatch.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A profile dispatch registry, created by blip_dispatcher_new() */
+typedef struct blip_dispatcher blip_dispatcher_t;
+
+/*************************
+ * BLIP Dispatcher API   *
+ ************************/
+
+/**
+ * Creates a registry that routes messages to handlers by their Profile property.  Requests
+ * are routed by profile, and responses (plus the later frames of multi-frame requests, which
+ * carry no properties) are routed to the handler of the request with the same message number.
+ * Messages from both directions of a peer pair should go through the same dispatcher.
+ * @param fallback          The handler for messages with no registered profile (may be NULL)
+ * @param fallback_context  An arbitrary pointer handed back to the fallback handler
+ * @return                  The created dispatcher, or NULL on failure
+ */
+CBLIP_API blip_dispatcher_t* blip_dispatcher_new(blip_message_callback fallback, void* fallback_context);
+
+/**
+ * Registers (or replaces) the handler for a profile
+ * @param dispatcher    The dispatcher to register with
+ * @param profile       The profile name, for example "rev" or "subChanges"
+ * @param handler       The handler to invoke for messages of this profile
+ * @param context       An arbitrary pointer handed back to the handler
+ * @return              0 on success, negative values on failure
+ */
+CBLIP_API int blip_dispatcher_register(blip_dispatcher_t* dispatcher, const char* profile,
+                                       blip_message_callback handler, void* context);
+
+/**
+ * Drops the requests still waiting for a reply or for more frames on a connection.  Call this
+ * before freeing a connection, since a request whose reply never arrives is otherwise only
+ * dropped once 65536 requests are pending (when all but the newest half of them are dropped).
+ * @param dispatcher    The dispatcher the connection's messages were routed through
+ * @param connection    The connection that is going away
+ * @return              The number of requests that were dropped
+ */
+CBLIP_API int blip_dispatcher_forget_connection(blip_dispatcher_t* dispatcher, const blip_connection_t* connection);
+
+/**
+ * Routes a message read from a connection to its handler.  This costs one lookup of the
+ * profile hash computed when the message was read, with no string scanning.
+ * @param dispatcher    The dispatcher to route through
+ * @param msg           The message to route
+ * @return              1 if a registered handler was invoked, 0 if the fallback was used,
+ *                      negative values on failure
+ */
+CBLIP_API int blip_dispatch(blip_dispatcher_t* dispatcher, blip_message_t* msg);
+
+/**
+ * Same as blip_dispatch(), but shaped as a blip_message_callback so that a dispatcher can be
+ * handed directly to a parser as its callback (with the dispatcher as the context)
+ * @param dispatcher    The dispatcher to route through
+ * @param msg           The message to route
+ */
+CBLIP_API void blip_dispatch_message(void* dispatcher, blip_message_t* msg);
+
+/**
+ * Frees the memory associated with a dispatcher
+ * @param dispatcher The dispatcher to free
+ */
+CBLIP_API void blip_dispatcher_free(blip_dispatcher_t* dispatcher);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,115 @@
+//
+//  cblip_export.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Column chunk file layout (all integers little endian):
+ *
+ *   header:  "CBCF" <version:u8> <column count:u8>
+ *            { <type:u8> <name length:u8> <name> }                    (one per column)
+ *   batch:   "CBCB" <row count:u32> <new dictionary entries:u32>
+ *            { <length:u16> <profile bytes> }                           (one per new entry)
+ *            { <zero padding to a multiple of 8> <row count * width bytes> }   (one per column)
+ *   footer:  { <batch offset:u64> }                                     (one per batch)
+ *            <batch count:u64> <total rows:u64> "CBCF"
+ *
+ * Column types are kBlipColumnU8, kBlipColumnU32 and kBlipColumnU64 (plain integers of that
+ * width) and kBlipColumnDictionary (a u32 code).  Dictionary codes index the profile names in
+ * the order they first appear in the file, starting at 1 with 0 meaning no profile, and each
+ * batch only carries the names that are new since the previous batch.  Column data always
+ * starts on an 8 byte aligned file offset, so a mapped file can be read in place.
+ *
+ * The columns, in order: msg_no (u64), direction (u8), type (u8), flags (u8), profile
+ * (dictionary), properties_size (u32), body_size (u64), wire_size (u64), checksum (u8: 0 for a
+ * mismatch, 1 for a match, 2 for ACKs which carry none) and timestamp_ns (u64).
+ */
+
+/** The version written into the file header */
+#define BLIP_EXPORT_VERSION 1
+
+/** The most distinct profiles a file can hold, the rest share one "(other)" entry */
+#define BLIP_EXPORT_MAX_PROFILES 65535
+
+/** The type codes that describe each column in the file header */
+typedef enum {
+    kBlipColumnU8 = 1,
+    kBlipColumnU32 = 4,
+    kBlipColumnU64 = 8,
+    kBlipColumnDictionary = 0x84,
+} blip_column_type;
+
+/** A columnar exporter, created by blip_export_new() */
+typedef struct blip_export blip_export_t;
+
+/**
+ * Receives the bytes of an export file as they are produced
+ * @param context   The context pointer passed to blip_export_new()
+ * @param data      The next bytes of the file, only valid during the call
+ * @param size      The size of data
+ * @return          0 on success, negative values on failure
+ */
+typedef int (*blip_export_write)(void* context, const uint8_t* data, size_t size);
+
+/*********************
+ * BLIP Export API   *
+ ********************/
+
+/**
+ * Creates an exporter that writes message metadata as a column chunk file (see above).  Rows
+ * are buffered one batch at a time, so memory use is bounded by the batch size no matter how
+ * many messages are exported.
+ * @param batch_rows    The number of rows per batch
+ * @param write         Receives the file contents (the header is written straight away)
+ * @param context       An arbitrary pointer handed back to write
+ * @return              The created exporter, or NULL on failure
+ */
+CBLIP_API blip_export_t* blip_export_new(size_t batch_rows, blip_export_write write, void* context);
+
+/**
+ * Adds a message to an export, writing out a batch once it is full
+ * @param exporter      The exporter to add to
+ * @param msg           The message to describe (only its metadata is kept)
+ * @param direction     The direction the message travelled, as numbered by the caller
+ * @param timestamp_ns  When the message was seen, in nanoseconds (0 if unknown)
+ * @return              0 on success, negative values on failure (the exporter is then unusable)
+ */
+CBLIP_API int blip_export_add(blip_export_t* exporter, const blip_message_t* msg, uint8_t direction,
+                              uint64_t timestamp_ns);
+
+/**
+ * Writes out any buffered rows and the footer, completing the file
+ * @param exporter  The exporter to finish (nothing more can be added afterwards)
+ * @return          0 on success, negative values on failure
+ */
+CBLIP_API int blip_export_finish(blip_export_t* exporter);
+
+/**
+ * Frees the memory associated with an exporter, without finishing the file
+ * @param exporter The exporter to free
+ */
+CBLIP_API void blip_export_free(blip_export_t* exporter);
+
+#ifdef __cplusplus
+}
+#endif
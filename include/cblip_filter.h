@@ -0,0 +1,104 @@
+//
+//  cblip_filter.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The most filters a set can hold (one bit each in a match mask) */
+#define BLIP_FILTER_MAX 64
+
+/** A set of compiled filters, created by blip_filter_set_new() */
+typedef struct blip_filter_set blip_filter_set_t;
+
+/*********************
+ * BLIP Filter API   *
+ ********************/
+
+/**
+ * Creates an empty filter set.  Filter expressions are compiled once, when they are added, and
+ * look like:
+ *
+ *     type == REQ && profile == "rev" && body_size > 1MB
+ *     flags & Urgent
+ *     !(type == ACKREQ || type == AKRES) && prop("Error-Code") != "404"
+ *
+ * Comparisons are ==, !=, <, <=, >, >= and & (bitwise and, true when non-zero), combined with
+ * &&, || and ! (and parentheses).  Numeric fields are type, flags, msg_no, body_size (the
+ * inflated size) and wire_size, compared with numbers (optionally suffixed KB, MB or GB), the
+ * types REQ, RES, ERR, ACKREQ, AKRES and the flags Compressed, Urgent, NoReply and MoreComing.
+ * The string fields profile and prop("Key") compare with "quoted strings" (== and != only), and
+ * on their own are true when the property is present.  Frames after the first one of a message
+ * carry no properties.
+ * @return The created set, or NULL on failure
+ */
+CBLIP_API blip_filter_set_t* blip_filter_set_new(void);
+
+/**
+ * Compiles a filter expression and adds it to a set
+ * @param filters       The set to add to
+ * @param expression    The filter expression
+ * @param error         Receives a description of what is wrong with a rejected expression (optional)
+ * @param error_size    The size of error
+ * @return              The index of the filter (its bit in match masks), or negative values if the
+ *                      expression is invalid or the set is full
+ */
+CBLIP_API int blip_filter_set_add(blip_filter_set_t* filters, const char* expression, char* error,
+                                  size_t error_size);
+
+/**
+ * Gets how many frames a filter has matched so far (counted by blip_message_read_filtered(),
+ * safe to call while other threads are reading)
+ * @param filters   The filter set
+ * @param index     The index returned by blip_filter_set_add()
+ * @return          The number of matching frames
+ */
+CBLIP_API uint64_t blip_filter_set_matches(const blip_filter_set_t* filters, int index);
+
+/**
+ * Frees the memory associated with a filter set
+ * @param filters The set to free
+ */
+CBLIP_API void blip_filter_set_free(blip_filter_set_t* filters);
+
+/**
+ * Reads a frame only if at least one filter matches it.  The filters run against the frame
+ * header and the raw properties before anything is copied, checksummed or scanned, and frames
+ * that no filter wants only move the connection on (message tracking, the checksum chain and,
+ * for compressed frames, the inflate stream), so they cost little more than the varints in
+ * their header.  Skipped frames are not recorded in connection stats.
+ * @param connection    The connection the frame arrived on
+ * @param msg           The message to decode a matching frame into (reusing its buffers, as
+ *                      blip_message_read_into() does), untouched otherwise
+ * @param data          The raw frame (not modified)
+ * @param size          The size of the raw frame
+ * @param filters       The filters to run, which may be shared between threads
+ * @param matched       Receives a mask with bit n set if filter n matched
+ * @return              1 if the frame matched and was decoded, 0 if it was skipped, negative
+ *                      values on failure
+ */
+CBLIP_API int blip_message_read_filtered(const blip_connection_t* connection, blip_message_t* msg,
+                                         const uint8_t* data, size_t size, const blip_filter_set_t* filters,
+                                         uint64_t* matched);
+
+#ifdef __cplusplus
+}
+#endif
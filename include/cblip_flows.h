@@ -0,0 +1,162 @@
+//
+//  cblip_flows.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A table of connections looked up by flow, created by blip_flow_table_new() */
+typedef struct blip_flow_table blip_flow_table_t;
+
+/**
+ * One direction of a TCP connection.  The two directions of a connection are separate flows
+ * (with the addresses and ports swapped), each with its own blip_connection_t.  Unused bytes
+ * must be zero, which the blip_flow_key_* helpers take care of.
+ */
+typedef struct {
+    uint8_t src_addr[16];   ///< IPv6 address, or an IPv4 address mapped into ::ffff:0:0/96
+    uint8_t dst_addr[16];
+    uint16_t src_port;
+    uint16_t dst_port;
+} blip_flow_key;
+
+/** How a flow table manages its memory */
+typedef struct {
+    size_t capacity;            ///< The most flows tracked at once, the least recently used flow makes way
+    size_t memory_budget;       ///< Bytes the connections may use before the least recently used ones are
+                                ///< hibernated, and then evicted (0 for no budget)
+    uint64_t hibernate_after_ns;    ///< blip_flow_table_expire() hibernates flows idle this long (0 for never)
+    uint64_t evict_after_ns;        ///< blip_flow_table_expire() evicts flows idle this long (0 for never)
+} blip_flow_table_options;
+
+/** Running totals of a flow table */
+typedef struct {
+    size_t flows;               ///< Flows in the table
+    size_t hibernated;          ///< Flows that are currently hibernated
+    size_t memory;              ///< Bytes used by all connections and hibernated state, as last measured
+    uint64_t hibernations;      ///< Times a flow was hibernated
+    uint64_t revivals;          ///< Times a hibernated flow was brought back by traffic
+    uint64_t evictions;         ///< Flows dropped for capacity, memory or idleness
+} blip_flow_table_stats;
+
+/**
+ * Fills in the key of an IPv4 flow
+ * @param key       The key to fill in
+ * @param src_addr  The source address, in network byte order
+ * @param src_port  The source port
+ * @param dst_addr  The destination address, in network byte order
+ * @param dst_port  The destination port
+ */
+static inline void blip_flow_key_ipv4(blip_flow_key* key, const uint8_t src_addr[4], uint16_t src_port,
+                                      const uint8_t dst_addr[4], uint16_t dst_port)
+{
+    memset(key, 0, sizeof(blip_flow_key));
+    key->src_addr[10] = key->src_addr[11] = 0xff;
+    key->dst_addr[10] = key->dst_addr[11] = 0xff;
+    memcpy(key->src_addr + 12, src_addr, 4);
+    memcpy(key->dst_addr + 12, dst_addr, 4);
+    key->src_port = src_port;
+    key->dst_port = dst_port;
+}
+
+/**
+ * Fills in the key of an IPv6 flow
+ * @param key       The key to fill in
+ * @param src_addr  The source address, in network byte order
+ * @param src_port  The source port
+ * @param dst_addr  The destination address, in network byte order
+ * @param dst_port  The destination port
+ */
+static inline void blip_flow_key_ipv6(blip_flow_key* key, const uint8_t src_addr[16], uint16_t src_port,
+                                      const uint8_t dst_addr[16], uint16_t dst_port)
+{
+    memset(key, 0, sizeof(blip_flow_key));
+    memcpy(key->src_addr, src_addr, 16);
+    memcpy(key->dst_addr, dst_addr, 16);
+    key->src_port = src_port;
+    key->dst_port = dst_port;
+}
+
+/*********************
+ * BLIP Flows API    *
+ ********************/
+
+/**
+ * Creates a table that owns one connection per flow.  Flows live in a fixed open addressed
+ * table with an LRU order.  An idle flow can be hibernated: its decoding state is compacted
+ * into a small compressed blob (see blip_connection_checkpoint()), its zlib memory is
+ * released and its set of partially received messages is emptied.  What a hibernated flow
+ * still holds is that blob plus the bare connection structure (so that the pointer stays the
+ * same throughout) with an empty set.  The next lookup revives it transparently.  The
+ * outgoing compression history is not kept, which the peer can still decode.  A table is not
+ * thread safe.
+ * @param options   How the table manages its memory
+ * @return          The created table, or NULL on failure
+ */
+CBLIP_API blip_flow_table_t* blip_flow_table_new(const blip_flow_table_options* options);
+
+/**
+ * Gets the connection of a flow, creating it for a new flow and reviving it if it was
+ * hibernated.  A hibernated flow that can't be revived is evicted and started over with a new
+ * connection.  This counts as activity on the flow, and may hibernate or evict other flows to
+ * stay within the limits.
+ * @param table     The table to look in
+ * @param key       The flow
+ * @param now_ns    The current time, in nanoseconds (any monotonic clock)
+ * @return          The connection, which stays valid until the flow is evicted or removed, or
+ *                  NULL on failure
+ */
+CBLIP_API blip_connection_t* blip_flow_table_get(blip_flow_table_t* table, const blip_flow_key* key,
+                                                 uint64_t now_ns);
+
+/**
+ * Removes a flow (for example when its TCP connection closes), freeing its connection
+ * @param table The table to remove from
+ * @param key   The flow
+ * @return      0 if the flow was removed, negative values if it wasn't in the table
+ */
+CBLIP_API int blip_flow_table_remove(blip_flow_table_t* table, const blip_flow_key* key);
+
+/**
+ * Hibernates and evicts flows that have been idle for longer than the configured times
+ * @param table     The table to expire flows from
+ * @param now_ns    The current time, on the same clock as blip_flow_table_get()
+ * @return          The number of flows that were hibernated or evicted
+ */
+CBLIP_API size_t blip_flow_table_expire(blip_flow_table_t* table, uint64_t now_ns);
+
+/**
+ * Gets the running totals of a table
+ * @param table The table to inspect
+ * @param stats Receives the totals
+ */
+CBLIP_API void blip_flow_table_get_stats(const blip_flow_table_t* table, blip_flow_table_stats* stats);
+
+/**
+ * Frees the memory associated with a table, including all of its connections
+ * @param table The table to free
+ */
+CBLIP_API void blip_flow_table_free(blip_flow_table_t* table);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,300 @@
+//
+//  cblip_frames.hpp
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.hpp"
+#include "cblip_parser.h"
+#include <algorithm>
+#include <concepts>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <span>
+
+#if __cplusplus < 202002L
+#error "cblip_frames.hpp needs C++20 coroutines"
+#endif
+
+// A coroutine generator that decodes the BLIP frames of one direction of a WebSocket byte
+// stream, pulling bytes from an awaitable source only when the frames it has run out.
+//
+//     blip::Frames frames = blip::frames(socket);
+//     while (const blip::Message* msg = co_await frames.next()) {
+//         ...
+//     }
+//
+// Frames are decoded into one recycled blip::Message, and only frames split across reads are
+// staged by the parser, so once warmed up the generator doesn't allocate.
+
+namespace blip {
+
+/**
+ * Anything with a read(std::span<uint8_t>) that returns an awaiter giving the number of bytes
+ * written into the span, 0 meaning the end of the stream.  Synchronous sources can return
+ * ReadyRead.
+ */
+template <typename Source>
+concept ByteSource = requires(Source& source, std::span<uint8_t> buffer) {
+    { source.read(buffer).await_resume() } -> std::convertible_to<size_t>;
+};
+
+/** An awaiter that is already complete, for sources whose reads never need to wait */
+struct ReadyRead
+{
+    size_t size;
+
+    bool await_ready() const noexcept { return true; }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    size_t await_resume() const noexcept { return size; }
+};
+
+/** A ByteSource over bytes that are already in memory (a capture file that was read in, say) */
+class BufferSource
+{
+public:
+    BufferSource(const uint8_t* data, size_t size) noexcept : _data(data), _size(size) {}
+    explicit BufferSource(Bytes bytes) noexcept : _data(bytes.data()), _size(bytes.size()) {}
+
+    ReadyRead read(std::span<uint8_t> buffer) noexcept
+    {
+        const size_t size = std::min(buffer.size(), _size);
+        std::copy_n(_data, size, buffer.data());
+        _data += size;
+        _size -= size;
+        return {size};
+    }
+
+private:
+    const uint8_t* _data;
+    size_t _size;
+};
+
+namespace detail {
+    /** Yielded by the generator body when the stream turns out to be corrupt */
+    struct FrameError {};
+
+    struct ParserDeleter
+    {
+        void operator()(blip_parser_t* parser) const noexcept { blip_parser_free(parser); }
+    };
+}
+
+/** The asynchronous generator returned by frames() */
+class Frames
+{
+public:
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    /** Hands control back to whoever is awaiting next() */
+    struct ResumeConsumer
+    {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type handle) const noexcept
+        {
+            return handle.promise().consumer;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type
+    {
+        const Message* current {nullptr};
+        std::coroutine_handle<> consumer;
+        std::exception_ptr exception;
+        bool failed {false};
+
+        Frames get_return_object() noexcept { return Frames(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        ResumeConsumer final_suspend() noexcept
+        {
+            current = nullptr;
+            return {};
+        }
+
+        ResumeConsumer yield_value(const Message& msg) noexcept
+        {
+            current = &msg;
+            return {};
+        }
+
+        ResumeConsumer yield_value(detail::FrameError) noexcept
+        {
+            current = nullptr;
+            failed = true;
+            return {};
+        }
+
+        void return_void() const noexcept {}
+
+        // Whatever the source throws is rethrown to the consumer by next()
+        void unhandled_exception() noexcept { exception = std::current_exception(); }
+    };
+
+    /** Resumes the generator until it yields the next message or finishes */
+    class NextAwaiter
+    {
+    public:
+        explicit NextAwaiter(handle_type handle) noexcept : _handle(handle) {}
+
+        bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept
+        {
+            _handle.promise().consumer = consumer;
+            return _handle;
+        }
+
+        const Message* await_resume() const
+        {
+            if (!_handle) {
+                return nullptr;
+            }
+
+            promise_type& promise = _handle.promise();
+            if (promise.exception) {
+                std::rethrow_exception(std::exchange(promise.exception, nullptr));
+            }
+
+            return _handle.done() ? nullptr : promise.current;
+        }
+
+    private:
+        handle_type _handle;
+    };
+
+    Frames(Frames&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    Frames& operator=(Frames&& other) noexcept
+    {
+        if (this != &other) {
+            if (_handle) {
+                _handle.destroy();
+            }
+
+            _handle = std::exchange(other._handle, nullptr);
+        }
+
+        return *this;
+    }
+
+    Frames(const Frames&) = delete;
+    Frames& operator=(const Frames&) = delete;
+
+    ~Frames()
+    {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    /**
+     * Awaits the next message.  The message is only valid until next() is awaited again (its
+     * storage is reused), and nullptr means the stream ended or was corrupt (see failed()),
+     * which includes a stream that ends partway through a frame.
+     */
+    NextAwaiter next() noexcept { return NextAwaiter(_handle); }
+
+    /** Whether the generator stopped because the stream could not be decoded */
+    bool failed() const noexcept { return _handle && _handle.promise().failed; }
+
+private:
+    explicit Frames(handle_type handle) noexcept : _handle(handle) {}
+
+    handle_type _handle;
+};
+
+namespace detail {
+    // The connection is passed raw so both frames() overloads can share this body, with owned
+    // keeping alive the connection that the single argument overload creates
+    template <ByteSource Source>
+    Frames read_frames(blip_connection_t* connection, [[maybe_unused]] Connection owned, Source& source, size_t buffer_size)
+    {
+        std::unique_ptr<blip_parser_t, ParserDeleter> parser(blip_parser_new(connection, nullptr, nullptr));
+        std::unique_ptr<uint8_t[]> buffer(new uint8_t[buffer_size]);
+        Message msg(blip_message_new());
+        if (!connection || !parser || !msg) {
+            co_yield FrameError {};
+            co_return;
+        }
+
+        size_t begin = 0;
+        size_t end = 0;
+        for (;;) {
+            if (begin == end) {
+                // Only suspends on the source once everything already read has been decoded
+                end = co_await source.read(std::span<uint8_t>(buffer.get(), buffer_size));
+                begin = 0;
+                if (end == 0) {
+                    // A stream that stops partway through a frame (or the handshake) is corrupt too
+                    if (blip_parser_finish(parser.get()) < 0) {
+                        co_yield FrameError {};
+                    }
+
+                    co_return;
+                }
+            }
+
+            size_t consumed;
+            const uint8_t* frame;
+            size_t frame_size;
+            const int rc = blip_parser_next(parser.get(), buffer.get() + begin, end - begin, &consumed, &frame,
+                                            &frame_size);
+            begin += consumed;
+            if (rc < 0 || (rc > 0 && blip_message_read_into(connection, msg.get(), frame, frame_size) < 0)) {
+                co_yield FrameError {};
+                co_return;
+            }
+
+            if (rc > 0) {
+                co_yield msg;
+            }
+        }
+    }
+}
+
+/**
+ * Decodes the frames of a byte stream on a connection the caller owns (so it can also be used for
+ * checkpoints, stats and so on)
+ * @param connection    The connection the stream belongs to, which must outlive the generator
+ * @param source        Where the bytes come from, which must outlive the generator
+ * @param buffer_size   How many bytes to ask the source for at a time
+ * @return              The generator
+ */
+template <ByteSource Source>
+Frames frames(Connection& connection, Source& source, size_t buffer_size = 64 * 1024)
+{
+    return detail::read_frames(connection.get(), Connection(static_cast<blip_connection_t*>(nullptr)), source,
+                               buffer_size);
+}
+
+/**
+ * Decodes the frames of a byte stream on a connection of its own
+ * @param source        Where the bytes come from, which must outlive the generator
+ * @param buffer_size   How many bytes to ask the source for at a time
+ * @return              The generator
+ */
+template <ByteSource Source>
+Frames frames(Source& source, size_t buffer_size = 64 * 1024)
+{
+    Connection owned;
+    blip_connection_t* connection = owned.get();
+    return detail::read_frames(connection, std::move(owned), source, buffer_size);
+}
+
+} // namespace blip
@@ -0,0 +1,55 @@
+//
+//  cblip_json.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*********************
+ * BLIP Body API     *
+ ********************/
+
+/**
+ * Looks up a top-level key of a JSON object message body without parsing the body into a DOM.
+ * The first lookup on a message builds a structural index of the body (the positions of its
+ * brackets, colons, commas and quotes, found 64 bytes at a time) in place over the existing
+ * body buffer, and later lookups only walk that index.
+ * @param msg           The message whose body to search
+ * @param key           The key to look for (compared against the raw, unescaped key text)
+ * @param value         On success, points to the value inside the body.  String values are
+ *                      returned without their quotes (escape sequences are left as they
+ *                      are), everything else as its raw JSON text.
+ * @param value_size    On success, contains the size of the value
+ * @return              0 if the key was found, negative values if it was not or the body is
+ *                      not a well formed JSON object
+ */
+CBLIP_API int blip_body_find(blip_message_t* msg, const char* key, const uint8_t** value, size_t* value_size);
+
+/**
+ * Releases the structural index built by blip_body_find() ahead of blip_message_free() (which
+ * releases it in any case).  Call this if the body is modified after a lookup.
+ * @param msg The message whose index to release
+ */
+CBLIP_API void blip_body_index_free(blip_message_t* msg);
+
+#ifdef __cplusplus
+}
+#endif
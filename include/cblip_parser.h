@@ -0,0 +1,97 @@
+//
+//  cblip_parser.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** An incremental parser handle, created by blip_parser_new() */
+typedef struct blip_parser blip_parser_t;
+
+/*********************
+ * BLIP Parser API   *
+ ********************/
+
+/**
+ * Creates a push-style parser that decodes BLIP frames out of one direction of a WebSocket
+ * byte stream, however it happens to be chunked.  Each WebSocket message carries one BLIP
+ * frame.  An HTTP upgrade header at the very start of the stream is skipped, so raw TCP
+ * payload captures can be fed in as-is.
+ * @param connection    The connection that the frames belong to
+ * @param callback      The callback to invoke as soon as each frame is complete (may be NULL if
+ *                      the parser is only used through blip_parser_next())
+ * @param context       An arbitrary pointer handed back to the callback
+ * @return              The created parser, or NULL on failure
+ */
+CBLIP_API blip_parser_t* blip_parser_new(blip_connection_t* connection, blip_message_callback callback, void* context);
+
+/**
+ * Feeds the next chunk of the byte stream to a parser.  Frames that are wholly contained in
+ * the chunk are handed to decoding straight out of it, only frames split across chunks (or
+ * masked by the sender) are staged in an internal buffer first.  Decoding itself copies each
+ * frame into a message that the parser reuses from one frame to the next.  Frames that break
+ * the WebSocket framing rules (RSV bits set, unknown opcodes, fragmented or oversized control
+ * frames, stray continuations) make the stream corrupt.
+ * @param parser    The parser to feed
+ * @param data      The received bytes
+ * @param size      The number of received bytes
+ * @return          0 on success, negative values if the stream is corrupt (the parser is
+ *                  then unusable)
+ */
+CBLIP_API int blip_parser_feed(blip_parser_t* parser, const uint8_t* data, size_t size);
+
+/**
+ * Pulls the next BLIP frame out of the byte stream, for callers that decode frames themselves
+ * (with blip_message_read_into(), say) instead of receiving them through the callback.  Input is
+ * consumed up to the end of the first complete frame, so call again with the rest of the chunk
+ * until it is used up.  Don't mix with blip_parser_feed() on the same parser.
+ * @param parser        The parser to pull from
+ * @param data          The received bytes
+ * @param size          The number of received bytes
+ * @param consumed      Receives how many of the bytes were used
+ * @param frame         Receives the frame, which points into data or the parser's staging buffer
+ *                      and stays valid until the next call
+ * @param frame_size    Receives the size of the frame
+ * @return              1 if a frame was returned, 0 if all of the input was used without completing
+ *                      one, negative values if the stream is corrupt
+ */
+CBLIP_API int blip_parser_next(blip_parser_t* parser, const uint8_t* data, size_t size, size_t* consumed,
+                               const uint8_t** frame, size_t* frame_size);
+
+/**
+ * Tells a parser that the byte stream has ended, to tell a clean end from one that cuts a
+ * frame off (which blip_parser_feed() can't know about, since the rest might still come)
+ * @param parser    The parser to check
+ * @return          0 if the stream ended between frames or after a close frame, negative
+ *                  values if part of a frame or of the upgrade header is still buffered, or
+ *                  the stream was found to be corrupt
+ */
+CBLIP_API int blip_parser_finish(const blip_parser_t* parser);
+
+/**
+ * Frees the memory associated with a parser (but not its connection)
+ * @param parser The parser to free
+ */
+CBLIP_API void blip_parser_free(blip_parser_t* parser);
+
+#ifdef __cplusplus
+}
+#endif
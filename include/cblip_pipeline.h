@@ -0,0 +1,81 @@
+//
+//  cblip_pipeline.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Only available where the library is built with POSIX threads
+
+/** A multi-threaded decoder for one connection, created by blip_pipeline_new() */
+typedef struct blip_pipeline blip_pipeline_t;
+
+/***********************
+ * BLIP Pipeline API   *
+ **********************/
+
+/**
+ * Creates a pipeline that spreads the decoding of one busy connection over three threads:
+ * an ordered stage (frame header, inflate and the checksum chain, the only stage that
+ * touches the connection), a post-processing stage (checksum calculation and property
+ * scanning) and a consumer stage that invokes the callback.  Frames come in from the thread
+ * calling blip_pipeline_push().  The stages are joined by bounded lock-free single producer /
+ * single consumer rings, so a slow stage holds back the ones before it.
+ * @param connection    The connection the frames belong to (it must not be used elsewhere
+ *                      until the pipeline is finished).  Stats for a connection with a shard
+ *                      attached are recorded on the post-processing thread, so a pipelined
+ *                      connection needs a shard of its own that nothing else records into
+ *                      until then (which also means its responses aren't matched with the
+ *                      requests of the other direction)
+ * @param capacity      The number of frames each ring holds (rounded up to a power of two)
+ * @param callback      Invoked in frame order, on the consumer thread, for every frame that
+ *                      decoded successfully.  The message is freed when it returns.
+ * @param context       An arbitrary pointer handed back to the callback
+ * @return              The created pipeline (with its threads running), or NULL on failure
+ */
+CBLIP_API blip_pipeline_t* blip_pipeline_new(blip_connection_t* connection, size_t capacity,
+                                             blip_message_callback callback, void* context);
+
+/**
+ * Hands the next raw frame of the connection to a pipeline, blocking while the first ring is full
+ * @param pipeline  The pipeline to push to (only ever from one thread)
+ * @param data      The raw frame, which is copied
+ * @param size      The size of the raw frame
+ * @return          0 on success, negative values on failure
+ */
+CBLIP_API int blip_pipeline_push(blip_pipeline_t* pipeline, const uint8_t* data, size_t size);
+
+/**
+ * Waits for every pushed frame to make it through the pipeline, and stops its threads
+ * @param pipeline  The pipeline to finish
+ * @return          The number of frames that failed to decode
+ */
+CBLIP_API size_t blip_pipeline_finish(blip_pipeline_t* pipeline);
+
+/**
+ * Frees the memory associated with a pipeline, finishing it first if needed
+ * @param pipeline The pipeline to free
+ */
+CBLIP_API void blip_pipeline_free(blip_pipeline_t* pipeline);
+
+#ifdef __cplusplus
+}
+#endif
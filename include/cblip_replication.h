@@ -0,0 +1,158 @@
+//
+//  cblip_replication.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Typed views of the Couchbase replication protocol messages
+// https://github.com/couchbase/couchbase-lite-core/blob/master/modules/docs/pages/replication-protocol.adoc
+//
+// Nothing in here allocates or copies: every slice points into the properties or body of
+// the message it was decoded from, and is only valid for as long as that message is.
+
+/** A view of a run of bytes inside a message (*not* null terminated) */
+typedef struct {
+    const uint8_t* buf;
+    size_t size;
+} blip_slice_t;
+
+/** One entry of a "changes" or "proposeChanges" request */
+typedef struct {
+    blip_slice_t sequence;      ///< The sequence (changes only, raw JSON text unless it is a string)
+    blip_slice_t doc_id;        ///< The document ID
+    blip_slice_t rev_id;        ///< The revision ID
+    blip_slice_t parent_rev_id; ///< The revision the proposed one replaces (proposeChanges only, may be empty)
+    bool deleted;               ///< Whether the revision is a deletion (changes only)
+    uint64_t body_size;         ///< The approximate size of the revision body, 0 if not given
+} blip_change_t;
+
+/** A lazy iterator over the entries of a "changes" or "proposeChanges" request body */
+typedef struct {
+    const uint8_t* json;        // The message body
+    const void* tape;           // The structural index of the body, kept in the message
+    size_t index;               // The position in the index of the next entry
+    bool proposed;
+} blip_changes_iter_t;
+
+/** A "rev" request */
+typedef struct {
+    blip_slice_t doc_id;        ///< The document ID ("id" property)
+    blip_slice_t rev_id;        ///< The revision ID ("rev" property)
+    blip_slice_t sequence;      ///< The sender's sequence ("sequence" property, may be empty)
+    blip_slice_t history;       ///< Comma separated ancestor revision IDs ("history" property, may be empty)
+    bool deleted;               ///< Whether the revision is a deletion ("deleted" property)
+    blip_slice_t body;          ///< The revision body (JSON)
+} blip_rev_t;
+
+/** A "subChanges" request */
+typedef struct {
+    blip_slice_t since;         ///< The checkpointed sequence to start after (may be empty)
+    blip_slice_t filter;        ///< The name of the filter function (may be empty)
+    blip_slice_t channels;      ///< Comma separated channel names for the sync_gateway/bychannel filter (may be empty)
+    uint64_t batch;             ///< The maximum number of changes per "changes" message, 0 if not given
+    bool continuous;            ///< Whether to keep sending changes after catching up
+    bool active_only;           ///< Whether to skip deleted and removed documents
+    blip_slice_t body;          ///< Optional JSON body (e.g. {"docIDs": [...]}, may be empty)
+} blip_sub_changes_t;
+
+/** A "getAttachment" or "proveAttachment" request */
+typedef struct {
+    blip_slice_t digest;        ///< The attachment digest ("digest" property)
+    blip_slice_t doc_id;        ///< The owning document ("docID" property, getAttachment only, may be empty)
+    blip_slice_t nonce;         ///< The nonce to prove against (the body, proveAttachment only)
+} blip_attachment_request_t;
+
+/**
+ * Receives the document IDs a message refers to
+ * @param context   The context pointer passed to blip_message_doc_ids()
+ * @param doc_id    One document ID, only valid during the call
+ * @return          0 to carry on, anything else to stop
+ */
+typedef int (*blip_doc_id_visit)(void* context, blip_slice_t doc_id);
+
+/****************************
+ * BLIP Replication API     *
+ ***************************/
+
+/**
+ * Starts iterating the entries of a "changes" or "proposeChanges" request.  Entries are
+ * decoded one at a time by blip_changes_next(), directly out of the body, by walking the
+ * same structural index blip_body_find() uses (built on first use and kept in the message).
+ * @param msg   The message to iterate
+ * @param iter  The iterator to initialize
+ * @return      0 on success, negative values if the message is not a changes request
+ */
+CBLIP_API int blip_changes_begin(const blip_message_t* msg, blip_changes_iter_t* iter);
+
+/**
+ * Decodes the next entry of a "changes" or "proposeChanges" request
+ * @param iter      The iterator created by blip_changes_begin()
+ * @param change    On success, receives the entry
+ * @return          1 if an entry was decoded, 0 at the end, negative values if the body is malformed
+ */
+CBLIP_API int blip_changes_next(blip_changes_iter_t* iter, blip_change_t* change);
+
+/**
+ * Decodes a "rev" request
+ * @param msg   The message to decode
+ * @param rev   On success, receives the decoded request
+ * @return      0 on success, negative values if the message is not a valid rev request
+ */
+CBLIP_API int blip_decode_rev(const blip_message_t* msg, blip_rev_t* rev);
+
+/**
+ * Pops the next revision ID off a comma separated revision history (as found in blip_rev_t)
+ * @param history   The remaining history, advanced past the returned revision ID
+ * @param rev_id    On success, receives the next revision ID
+ * @return          true if a revision ID was returned, false at the end of the history
+ */
+CBLIP_API bool blip_history_next(blip_slice_t* history, blip_slice_t* rev_id);
+
+/**
+ * Decodes a "subChanges" request
+ * @param msg   The message to decode
+ * @param sub   On success, receives the decoded request
+ * @return      0 on success, negative values if the message is not a subChanges request
+ */
+CBLIP_API int blip_decode_sub_changes(const blip_message_t* msg, blip_sub_changes_t* sub);
+
+/**
+ * Decodes a "getAttachment" or "proveAttachment" request
+ * @param msg       The message to decode
+ * @param request   On success, receives the decoded request
+ * @return          0 on success, negative values if the message is not an attachment request
+ */
+CBLIP_API int blip_decode_attachment_request(const blip_message_t* msg, blip_attachment_request_t* request);
+
+/**
+ * Finds the documents a message refers to: the "id" and "docID" properties of any request or
+ * response, then the entries of a "changes" or "proposeChanges" request.  ACKs refer to none.
+ * @param msg       The message to look through
+ * @param visit     Called with every document ID, in that order (duplicates included)
+ * @param context   An arbitrary pointer handed back to visit
+ * @return          0 once every ID has been visited, otherwise the first non-zero value visit returned
+ */
+CBLIP_API int blip_message_doc_ids(const blip_message_t* msg, blip_doc_id_visit visit, void* context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,126 @@
+//
+//  cblip_session.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The longest profile name that is kept for an exchange (longer names are truncated) */
+#define BLIP_SESSION_MAX_PROFILE 31
+
+/** Both directions of a BLIP conversation, created by blip_session_new() */
+typedef struct blip_session blip_session_t;
+
+/** A request and its completed response */
+typedef struct {
+    MessageNo msg_no;               ///< The message number shared by the request and response
+    int direction;                  ///< The direction the request travelled in (0 or 1)
+    const char* profile;            ///< The Profile property of the request ("" if it had none)
+    MessageType response_type;      ///< kResponseType or kErrorType
+    uint64_t request_first_ns;      ///< The timestamp of the first request frame
+    uint64_t request_last_ns;       ///< The timestamp of the last request frame
+    uint64_t response_first_ns;     ///< The timestamp of the first response frame
+    uint64_t response_last_ns;      ///< The timestamp of the last response frame
+    uint64_t rtt_ns;                ///< From the first request frame to the last response frame
+    uint64_t ttfb_ns;               ///< From the last request frame to the first response frame
+    uint64_t request_size;          ///< The total body size of the request frames
+    uint64_t response_size;         ///< The total body size of the response frames
+} blip_exchange_t;
+
+/**
+ * Called every time a response completes a tracked request
+ * @param context   The context pointer passed to blip_session_new()
+ * @param exchange  The request / response pair, only valid during the call
+ */
+typedef void (*blip_exchange_callback)(void* context, const blip_exchange_t* exchange);
+
+/**********************
+ * BLIP Session API   *
+ *********************/
+
+/**
+ * Creates a session, which owns one connection per direction of a peer pair and pairs each
+ * request with the response that comes back the other way.  Requests that are still waiting
+ * are kept in an open addressed table keyed by message number; NoReply requests are never
+ * kept.  Once 65536 requests are waiting, all but the newest half of them are dropped.
+ * @param callback  Receives every completed exchange
+ * @param context   An arbitrary pointer handed back to the callback
+ * @return          The created session, or NULL on failure
+ */
+CBLIP_API blip_session_t* blip_session_new(blip_exchange_callback callback, void* context);
+
+/**
+ * Gets the connection that frames travelling in one direction must be read with
+ * @param session   The session to get the connection from
+ * @param direction 0 or 1
+ * @return          The connection (owned by the session)
+ */
+CBLIP_API blip_connection_t* blip_session_connection(blip_session_t* session, int direction);
+
+/**
+ * Reads a frame travelling in one direction and tracks it, see blip_message_read() and
+ * blip_session_track()
+ * @param session       The session the frame belongs to
+ * @param direction     The direction the frame travelled in (0 or 1)
+ * @param data          The raw frame
+ * @param size          The size of the raw frame
+ * @param timestamp_ns  When the frame was seen, in nanoseconds on any monotonic clock
+ * @return              The decoded message (free with blip_message_free()), or NULL on failure
+ */
+CBLIP_API blip_message_t* blip_session_read(blip_session_t* session, int direction, uint8_t* data, size_t size,
+                                            uint64_t timestamp_ns);
+
+/**
+ * Tracks a message that was read with one of the session's connections (for example by a
+ * parser).  Frames must be tracked in the order they were seen.
+ * @param session       The session the message belongs to
+ * @param msg           The message to track
+ * @param timestamp_ns  When the frame was seen, in nanoseconds on any monotonic clock
+ * @return              1 if the message completed an exchange, 0 if not, negative values
+ *                      if it was not read from this session or on failure
+ */
+CBLIP_API int blip_session_track(blip_session_t* session, const blip_message_t* msg, uint64_t timestamp_ns);
+
+/**
+ * Gets the number of requests that are still waiting for a response
+ * @param session   The session to query
+ * @return          The number of outstanding requests
+ */
+CBLIP_API size_t blip_session_outstanding(const blip_session_t* session);
+
+/**
+ * Drops the requests that travelled in one direction and are still waiting for a response,
+ * for example when the peer that should answer them has gone away
+ * @param session   The session to drop the requests from
+ * @param direction The direction the requests travelled in (0 or 1)
+ * @return          The number of requests that were dropped
+ */
+CBLIP_API int blip_session_forget(blip_session_t* session, int direction);
+
+/**
+ * Frees the memory associated with a session, including both of its connections
+ * @param session The session to free
+ */
+CBLIP_API void blip_session_free(blip_session_t* session);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,379 @@
+//
+//  cblip_sketch.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+#include "cblip_stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed size, mergeable summaries of traffic too large to count exactly.  Each sketch has one
+ * writing thread at a time, but any number of threads may read it (estimate, list, serialize
+ * or merge it into another sketch) while it is being written, so a decoding thread never
+ * waits.  Sketches only merge with sketches created with the same parameters.  Keys are
+ * hashed with XXH64 (seed 0), so sketches from different nodes line up.  Serialized sketches
+ * are little endian:
+ *
+ *   HyperLogLog:    "CBHL" <version:u8> <precision:u8> <zero:u16> { <register:u8> }  (2^precision)
+ *   Top-k:          "CBTK" <version:u8> <zero:u8 x3> <capacity:u32> <width:u32> <depth:u32> <used:u32>
+ *                   <total:u64> { <hash:u64> <count:u64> <error:u64> <key size:u8> <key> }  (used)
+ *                   { <counter:u64> }  (depth * width, row by row)
+ *   Quantiles:      "CBQS" <version:u8> <sub bits:u8> <zero:u16> <count:u64> <min:u64> <max:u64>
+ *                   <bucket count:u32> { <bucket:u32> <count:u64> }  (only buckets that aren't empty)
+ *   Traffic:        "CBTS" <version:u8> <zero:u8 x3> { <size:u32> <sketch> }  (doc IDs, hot documents,
+ *                   client bytes, body sizes)
+ */
+
+/** The version written into serialized sketches */
+#define BLIP_SKETCH_VERSION 1
+
+/** The longest top-k key that is kept (longer keys are counted in full, but reported truncated) */
+#define BLIP_SKETCH_MAX_KEY 47
+
+/** A HyperLogLog distinct count estimator, created by blip_hll_new() */
+typedef struct blip_hll blip_hll_t;
+
+/** A SpaceSaving heavy hitter summary backed by a Count-Min sketch, created by blip_topk_new() */
+typedef struct blip_topk blip_topk_t;
+
+/** A log-linear histogram for quantiles with bounded relative error, created by blip_quantiles_new() */
+typedef struct blip_quantiles blip_quantiles_t;
+
+/** One heavy hitter reported by blip_topk_list() */
+typedef struct {
+    char key[BLIP_SKETCH_MAX_KEY + 1];  ///< The key, null terminated (truncated if longer)
+    size_t key_size;                    ///< The size of key
+    uint64_t count;                     ///< An upper bound of the key's weight
+    uint64_t error;                     ///< How far count may be over (count - error is a lower bound)
+} blip_topk_entry_t;
+
+/** The sizes of the sketches kept per stats shard */
+typedef struct {
+    unsigned hll_precision;     ///< log2 of the number of HyperLogLog registers (4-18)
+    unsigned top_k;             ///< The number of keys each top-k sketch tracks (1-4096)
+    unsigned cms_width;         ///< The counters per Count-Min row (rounded up to a power of two)
+    unsigned cms_depth;         ///< The number of Count-Min rows (1-16)
+    unsigned quantile_bits;     ///< Sub-buckets per power of two, as log2 (1-10)
+} blip_sketch_options;
+
+/** The sketches that describe a stream of decoded messages */
+typedef struct {
+    blip_hll_t* doc_ids;            ///< Distinct document IDs (see blip_message_doc_ids())
+    blip_topk_t* hot_docs;          ///< Document IDs by the number of messages about them
+    blip_topk_t* client_bytes;      ///< Client names (see blip_connection_set_client()) by wire bytes
+    blip_quantiles_t* body_sizes;   ///< The body sizes of requests, responses and errors
+} blip_traffic_sketches_t;
+
+/*********************
+ * BLIP Sketch API   *
+ ********************/
+
+/**
+ * Creates a HyperLogLog sketch, whose estimates have a standard error of about
+ * 1.04 / sqrt(2^precision) (0.8% at the default of 14, which takes 16KB)
+ * @param precision log2 of the number of registers (4-18)
+ * @return          The created sketch, or NULL on failure
+ */
+CBLIP_API blip_hll_t* blip_hll_new(unsigned precision);
+
+/**
+ * Counts a key into a HyperLogLog sketch
+ * @param hll   The sketch to add to
+ * @param key   The key
+ * @param size  The size of the key
+ */
+CBLIP_API void blip_hll_add(blip_hll_t* hll, const uint8_t* key, size_t size);
+
+/**
+ * Estimates the number of distinct keys added to a HyperLogLog sketch
+ * @param hll   The sketch to read
+ * @return      The estimate
+ */
+CBLIP_API uint64_t blip_hll_estimate(const blip_hll_t* hll);
+
+/**
+ * Merges one HyperLogLog sketch into another, after which the destination estimates the
+ * distinct keys added to either
+ * @param into  The sketch to merge into (which must not be written meanwhile)
+ * @param from  The sketch to merge
+ * @return      0 on success, negative values if the precisions differ
+ */
+CBLIP_API int blip_hll_merge(blip_hll_t* into, const blip_hll_t* from);
+
+/**
+ * Serializes a HyperLogLog sketch.  Call once with a NULL buffer to find out how much space
+ * is needed.
+ * @param hll       The sketch to serialize
+ * @param buf       The buffer to write into, or NULL
+ * @param capacity  The size of buf
+ * @return          The number of bytes written, or the required capacity if buf is NULL or too small
+ */
+CBLIP_API size_t blip_hll_serialize(const blip_hll_t* hll, uint8_t* buf, size_t capacity);
+
+/**
+ * Creates a HyperLogLog sketch from one serialized by blip_hll_serialize()
+ * @param data  The serialized sketch
+ * @param size  The size of data
+ * @return      The created sketch, or NULL if the data is malformed
+ */
+CBLIP_API blip_hll_t* blip_hll_deserialize(const uint8_t* data, size_t size);
+
+/**
+ * Frees a HyperLogLog sketch
+ * @param hll   The sketch to free (NULL is ignored)
+ */
+CBLIP_API void blip_hll_free(blip_hll_t* hll);
+
+/**
+ * Creates a top-k sketch.  The k heaviest keys are tracked with SpaceSaving, whose counts
+ * are upper bounds that are off by at most total / k, and every key is also counted into a
+ * Count-Min sketch, whose estimates are upper bounds that are off by at most e * total /
+ * width with probability 1 - e^-depth.  Reported counts take the lower of the two.
+ * @param k         The number of keys to track (1-4096)
+ * @param width     The counters per Count-Min row (rounded up to a power of two)
+ * @param depth     The number of Count-Min rows (1-16)
+ * @return          The created sketch, or NULL on failure
+ */
+CBLIP_API blip_topk_t* blip_topk_new(unsigned k, unsigned width, unsigned depth);
+
+/**
+ * Adds weight to a key of a top-k sketch
+ * @param topk      The sketch to add to
+ * @param key       The key
+ * @param size      The size of the key
+ * @param weight    How much to add (a message, a byte count...)
+ */
+CBLIP_API void blip_topk_add(blip_topk_t* topk, const uint8_t* key, size_t size, uint64_t weight);
+
+/**
+ * Estimates the weight added to any key of a top-k sketch, tracked or not
+ * @param topk  The sketch to read
+ * @param key   The key
+ * @param size  The size of the key
+ * @return      An upper bound of the key's weight
+ */
+CBLIP_API uint64_t blip_topk_estimate(const blip_topk_t* topk, const uint8_t* key, size_t size);
+
+/**
+ * Gets the total weight added to a top-k sketch
+ * @param topk  The sketch to read
+ * @return      The total weight
+ */
+CBLIP_API uint64_t blip_topk_total(const blip_topk_t* topk);
+
+/**
+ * Lists the heaviest keys of a top-k sketch, heaviest first
+ * @param topk      The sketch to read
+ * @param entries   Receives the keys
+ * @param max       The number of entries there is room for
+ * @return          The number of entries filled in
+ */
+CBLIP_API size_t blip_topk_list(const blip_topk_t* topk, blip_topk_entry_t* entries, size_t max);
+
+/**
+ * Merges one top-k sketch into another.  Keys tracked by only one side are credited with the
+ * smallest tracked count of the other (and that much error), so the merged counts are still
+ * upper bounds.
+ * @param into  The sketch to merge into (which must not be written meanwhile)
+ * @param from  The sketch to merge
+ * @return      0 on success, negative values if the sizes differ or on allocation failure
+ */
+CBLIP_API int blip_topk_merge(blip_topk_t* into, const blip_topk_t* from);
+
+/**
+ * Serializes a top-k sketch.  Call once with a NULL buffer to find out how much space is
+ * needed.
+ * @param topk      The sketch to serialize
+ * @param buf       The buffer to write into, or NULL
+ * @param capacity  The size of buf
+ * @return          The number of bytes written, the required capacity if buf is NULL or too small,
+ *                  or 0 on failure
+ */
+CBLIP_API size_t blip_topk_serialize(const blip_topk_t* topk, uint8_t* buf, size_t capacity);
+
+/**
+ * Creates a top-k sketch from one serialized by blip_topk_serialize()
+ * @param data  The serialized sketch
+ * @param size  The size of data
+ * @return      The created sketch, or NULL if the data is malformed
+ */
+CBLIP_API blip_topk_t* blip_topk_deserialize(const uint8_t* data, size_t size);
+
+/**
+ * Frees a top-k sketch
+ * @param topk  The sketch to free (NULL is ignored)
+ */
+CBLIP_API void blip_topk_free(blip_topk_t* topk);
+
+/**
+ * Creates a quantile sketch: a histogram with 2^bits buckets per power of two, exact below
+ * 2^bits and otherwise within 2^-(bits+1) of the true value (1.6% at the default of 5, which
+ * takes 15KB)
+ * @param bits  log2 of the number of buckets per power of two (1-10)
+ * @return      The created sketch, or NULL on failure
+ */
+CBLIP_API blip_quantiles_t* blip_quantiles_new(unsigned bits);
+
+/**
+ * Adds a value to a quantile sketch
+ * @param quantiles The sketch to add to
+ * @param value     The value
+ */
+CBLIP_API void blip_quantiles_add(blip_quantiles_t* quantiles, uint64_t value);
+
+/**
+ * Gets the number of values added to a quantile sketch
+ * @param quantiles The sketch to read
+ * @return          The number of values
+ */
+CBLIP_API uint64_t blip_quantiles_count(const blip_quantiles_t* quantiles);
+
+/**
+ * Estimates a quantile of the values added to a quantile sketch
+ * @param quantiles The sketch to read
+ * @param q         The quantile, from 0 (the smallest value) to 1 (the largest)
+ * @return          The estimate, or 0 if nothing was added
+ */
+CBLIP_API uint64_t blip_quantiles_get(const blip_quantiles_t* quantiles, double q);
+
+/**
+ * Merges one quantile sketch into another
+ * @param into  The sketch to merge into (which must not be written meanwhile)
+ * @param from  The sketch to merge
+ * @return      0 on success, negative values if the bucket sizes differ
+ */
+CBLIP_API int blip_quantiles_merge(blip_quantiles_t* into, const blip_quantiles_t* from);
+
+/**
+ * Serializes a quantile sketch.  Call once with a NULL buffer to find out how much space is
+ * needed.
+ * @param quantiles The sketch to serialize
+ * @param buf       The buffer to write into, or NULL
+ * @param capacity  The size of buf
+ * @return          The number of bytes written, or the required capacity if buf is NULL or too small
+ */
+CBLIP_API size_t blip_quantiles_serialize(const blip_quantiles_t* quantiles, uint8_t* buf, size_t capacity);
+
+/**
+ * Creates a quantile sketch from one serialized by blip_quantiles_serialize()
+ * @param data  The serialized sketch
+ * @param size  The size of data
+ * @return      The created sketch, or NULL if the data is malformed
+ */
+CBLIP_API blip_quantiles_t* blip_quantiles_deserialize(const uint8_t* data, size_t size);
+
+/**
+ * Frees a quantile sketch
+ * @param quantiles The sketch to free (NULL is ignored)
+ */
+CBLIP_API void blip_quantiles_free(blip_quantiles_t* quantiles);
+
+/**
+ * Gets the default sketch options: 16K HyperLogLog registers, the top 64 keys over a 4 x 2048
+ * Count-Min sketch and 32 quantile buckets per power of two
+ * @param options   Receives the defaults
+ */
+CBLIP_API void blip_sketch_default_options(blip_sketch_options* options);
+
+/**
+ * Creates a set of traffic sketches
+ * @param options   The sizes of the sketches (NULL for the defaults)
+ * @param sketches  Receives the sketches
+ * @return          0 on success, negative values on failure (nothing is left allocated)
+ */
+CBLIP_API int blip_traffic_sketches_new(const blip_sketch_options* options, blip_traffic_sketches_t* sketches);
+
+/**
+ * Records one message into a set of traffic sketches
+ * @param sketches  The sketches to record into (written by the calling thread only)
+ * @param msg       The message to record
+ * @param wire_size The size of the frame the message was read from
+ */
+CBLIP_API void blip_traffic_sketches_record(blip_traffic_sketches_t* sketches, const blip_message_t* msg,
+                                            size_t wire_size);
+
+/**
+ * Merges one set of traffic sketches into another, sketch by sketch
+ * @param into  The sketches to merge into (which must not be written meanwhile)
+ * @param from  The sketches to merge
+ * @return      0 on success, negative values if the sizes differ
+ */
+CBLIP_API int blip_traffic_sketches_merge(blip_traffic_sketches_t* into, const blip_traffic_sketches_t* from);
+
+/**
+ * Serializes a set of traffic sketches, for merging on another node.  Call once with a NULL
+ * buffer to find out how much space is needed.
+ * @param sketches  The sketches to serialize
+ * @param buf       The buffer to write into, or NULL
+ * @param capacity  The size of buf
+ * @return          The number of bytes written, the required capacity if buf is NULL or too small,
+ *                  or 0 on failure (including a top-k sketch growing past the size first reported)
+ */
+CBLIP_API size_t blip_traffic_sketches_serialize(const blip_traffic_sketches_t* sketches, uint8_t* buf,
+                                                 size_t capacity);
+
+/**
+ * Creates a set of traffic sketches from one serialized by blip_traffic_sketches_serialize()
+ * @param data      The serialized sketches
+ * @param size      The size of data
+ * @param sketches  Receives the sketches
+ * @return          0 on success, negative values if the data is malformed
+ */
+CBLIP_API int blip_traffic_sketches_deserialize(const uint8_t* data, size_t size, blip_traffic_sketches_t* sketches);
+
+/**
+ * Frees the sketches of a set (the set itself belongs to the caller)
+ * @param sketches  The sketches to free
+ */
+CBLIP_API void blip_traffic_sketches_free(blip_traffic_sketches_t* sketches);
+
+/**
+ * Names the client on the other end of a connection, which is what its messages' wire bytes
+ * are counted against in the client_bytes sketch (messages of unnamed connections aren't)
+ * @param connection    The connection to name
+ * @param client        The name, copied (NULL to clear it)
+ * @return              0 on success, negative values on allocation failure
+ */
+CBLIP_API int blip_connection_set_client(blip_connection_t* connection, const char* client);
+
+/**
+ * Makes every shard of a set of aggregates keep traffic sketches as well, fed by
+ * blip_stats_record() (and so by blip_message_read() on attached connections).  Call before
+ * anything is recorded.
+ * @param stats     The stats to extend
+ * @param options   The sizes of the sketches (NULL for the defaults)
+ * @return          0 on success, negative values on failure
+ */
+CBLIP_API int blip_stats_enable_sketches(blip_stats_t* stats, const blip_sketch_options* options);
+
+/**
+ * Merges the traffic sketches of every shard into a set, concurrently with the decoding
+ * threads.  Unlike the flushed aggregates the sketches are never reset, so merging into a
+ * fresh set gives everything recorded so far.
+ * @param stats     The stats whose sketches to merge (enabled by blip_stats_enable_sketches())
+ * @param into      The sketches to merge into, created with the same options
+ * @return          0 on success, negative values on failure
+ */
+CBLIP_API int blip_stats_merge_sketches(blip_stats_t* stats, blip_traffic_sketches_t* into);
+
+#ifdef __cplusplus
+}
+#endif
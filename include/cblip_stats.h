@@ -0,0 +1,143 @@
+//
+//  cblip_stats.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The number of body size histogram buckets (bucket n counts bodies of [2^(n-1), 2^n) bytes) */
+#define BLIP_STATS_HISTOGRAM_BUCKETS 32
+
+/** The longest profile name that is kept (longer names are truncated) */
+#define BLIP_STATS_MAX_PROFILE 31
+
+/** A set of running traffic aggregates, created by blip_stats_new() */
+typedef struct blip_stats blip_stats_t;
+
+/** The part of a blip_stats_t that one decoding thread writes to */
+typedef struct blip_stats_shard blip_stats_shard_t;
+
+/** The aggregates for one (connection, profile, message type, error code) combination */
+typedef struct {
+    const blip_connection_t* connection;    ///< The connection the messages were read from
+    const char* profile;                    ///< The Profile property, for responses and errors the one of the
+                                            ///< request they answer ("" for ACKs and unmatched replies)
+    MessageType type;                       ///< The message type
+    int32_t error_code;                     ///< The Error-Code property of ERR messages, 0 otherwise
+    uint64_t messages;                      ///< The number of frames
+    uint64_t compressed_messages;           ///< The number of frames that had the Compressed flag
+    uint64_t wire_bytes;                    ///< The number of bytes on the wire
+    uint64_t body_bytes;                    ///< The number of (uncompressed) body bytes
+    uint64_t compressed_body_bytes;         ///< The part of body_bytes carried by frames with the Compressed flag
+    uint64_t deflated_bytes;                ///< The number of deflated bytes those frames carried on the wire
+                                            ///< (properties included, since they are compressed with the body)
+    uint64_t body_size_histogram[BLIP_STATS_HISTOGRAM_BUCKETS];  ///< log2 buckets of body sizes
+} blip_stats_record_t;
+
+/**
+ * Receives the aggregates accumulated since the previous flush, one record at a time
+ * @param context   The context pointer passed to blip_stats_new()
+ * @param record    The aggregates for one combination, only valid during the call
+ */
+typedef void (*blip_stats_callback)(void* context, const blip_stats_record_t* record);
+
+/*********************
+ * BLIP Stats API    *
+ ********************/
+
+/**
+ * Creates a set of traffic aggregates.  Each decoding thread writes to its own shard, a
+ * fixed size open addressed table keyed by the interned profile, so recording never takes a
+ * lock or shares a cache line with another decoding thread.  A single flushing thread can
+ * read all shards concurrently with the writers.
+ * @param shard_count       The number of shards (usually one per decoding thread)
+ * @param shard_capacity    The number of distinct combinations each shard can hold (rounded
+ *                          up to a power of two), anything beyond is folded into one
+ *                          overflow record with the profile "(other)"
+ * @param interval_ms       The interval for blip_stats_poll(), in milliseconds
+ * @param callback          Receives the flushed aggregates
+ * @param context           An arbitrary pointer handed back to the callback
+ * @return                  The created stats, or NULL on failure
+ */
+CBLIP_API blip_stats_t* blip_stats_new(size_t shard_count, size_t shard_capacity, uint64_t interval_ms,
+                                       blip_stats_callback callback, void* context);
+
+/**
+ * Gets one of the shards of a set of aggregates
+ * @param stats The stats to get the shard from
+ * @param index The index of the shard, less than the shard count
+ * @return      The shard
+ */
+CBLIP_API blip_stats_shard_t* blip_stats_shard(blip_stats_t* stats, size_t index);
+
+/**
+ * Makes every message read from a connection get recorded into a shard automatically, as
+ * part of blip_message_read().  A connection should only ever be read (and freed) from the
+ * thread that owns the shard, which for a connection decoded by a pipeline is the pipeline's
+ * own post-processing thread (see blip_pipeline_new()).  Responses and errors are recorded under the profile of the
+ * request they answer, when both directions of the conversation record into the same shard.
+ * Detaching a connection, or freeing it, retires its aggregates: they are flushed one last
+ * time and their slots are then reused.
+ * @param connection    The connection to attach to
+ * @param shard         The shard to record into, or NULL to stop recording
+ */
+CBLIP_API void blip_connection_set_stats(blip_connection_t* connection, blip_stats_shard_t* shard);
+
+/**
+ * Records one message into a shard by hand.  Call blip_stats_forget_connection() before
+ * freeing a connection whose messages were recorded this way.
+ * @param shard     The shard to record into (owned by the calling thread)
+ * @param msg       The message to record
+ * @param wire_size The size of the frame the message was read from
+ */
+CBLIP_API void blip_stats_record(blip_stats_shard_t* shard, const blip_message_t* msg, size_t wire_size);
+
+/**
+ * Retires the aggregates of a connection in a shard, and forgets the requests read from it
+ * that were waiting for a reply.  The aggregates are flushed one last time before their slots
+ * are reused.  blip_connection_free() does this for the shard a connection is attached to.
+ * @param shard         The shard the connection's messages were recorded into (owned by the calling thread)
+ * @param connection    The connection that is going away
+ */
+CBLIP_API void blip_stats_forget_connection(blip_stats_shard_t* shard, const blip_connection_t* connection);
+
+/**
+ * Reports everything recorded since the previous flush, merged across shards
+ * @param stats The stats to flush (only one thread may flush at a time)
+ */
+CBLIP_API void blip_stats_flush(blip_stats_t* stats);
+
+/**
+ * Flushes if at least the configured interval has passed since the previous flush
+ * @param stats The stats to flush (only one thread may flush at a time)
+ * @return      true if a flush happened
+ */
+CBLIP_API bool blip_stats_poll(blip_stats_t* stats);
+
+/**
+ * Frees the memory associated with a set of aggregates (connections must be detached first)
+ * @param stats The stats to free
+ */
+CBLIP_API void blip_stats_free(blip_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,6 +22,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Based on varint implementation from the Go language (src/pkg/encoding/binary/varint.go)
 // This file implements "varint" encoding of unsigned 64-bit integers.
 // The encoding is:
@@ -73,4 +77,8 @@ static inline size_t GetUVarInt32(uint8_t* buf, size_t size, uint32_t *n) {
         return 1;
     }
     return _GetUVarInt32(buf, size, n);
-}
\ No newline at end of file
+}
+
+#ifdef __cplusplus
+}
+#endif
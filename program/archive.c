@@ -0,0 +1,255 @@
+//
+//  archive.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "archive.h"
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_archive.h"
+#include "cblip_parser.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define NS_PER_HOUR (3600ULL * 1000000000ULL)
+#define MAX_BODY_PRINTED 200
+
+static const char* const kTypeNames[] = {"REQ", "RES", "ERR", "???", "ACKREQ", "AKRES", "???", "???"};
+
+typedef struct {
+    blip_archive_writer_t* writer;
+    uint8_t direction;
+    uint64_t timestamp_ns;      // For stream captures, which have no per-frame times
+    uint64_t messages;
+    bool failed;
+} archive_context;
+
+static void print_report(void* context, const char* message)
+{
+    (void)context;
+    printf("%s\n", message);
+}
+
+static void archive_message(archive_context* ctx, const blip_message_t* msg, uint64_t timestamp_ns)
+{
+    if (blip_archive_append(ctx->writer, msg, ctx->direction, timestamp_ns) < 0) {
+        ctx->failed = true;
+    }
+
+    ctx->messages++;
+}
+
+static void on_stream_message(void* context, blip_message_t* msg)
+{
+    archive_context* ctx = (archive_context*)context;
+    archive_message(ctx, msg, ctx->timestamp_ns);
+}
+
+static int archive_capture(archive_context* ctx, const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        printf("%s: cannot be read\n", path);
+        return -1;
+    }
+
+    blip_connection_t* connection = blip_connection_new();
+    if (!connection) {
+        return -1;
+    }
+
+    int retVal = 0;
+    if (S_ISDIR(st.st_mode)) {
+        for (uint64_t i = 1; retVal == 0 && !ctx->failed; i++) {
+            size_t length;
+            uint8_t* data = read_packet(path, i, &length);
+            if (!data) {
+                break;
+            }
+
+            blip_message_t* msg = blip_message_read(connection, data, length);
+            free(data);
+            if (!msg) {
+                printf("%s: packet %"PRIu64" could not be decoded\n", path, i);
+                retVal = -1;
+                break;
+            }
+
+            archive_message(ctx, msg, packet_time_ns(path, i));
+            blip_message_free(msg);
+        }
+    } else {
+        ctx->timestamp_ns = file_time_ns(path);
+        size_t length;
+        uint8_t* data = read_file(path, &length);
+        blip_parser_t* parser = data ? blip_parser_new(connection, on_stream_message, ctx) : NULL;
+        if (!parser || blip_parser_feed(parser, data, length) < 0 || blip_parser_finish(parser) < 0) {
+            printf("%s: stream could not be decoded\n", path);
+            retVal = -1;
+        }
+
+        blip_parser_free(parser);
+        free(data);
+    }
+
+    blip_connection_free(connection);
+    return ctx->failed ? -1 : retVal;
+}
+
+int run_archive(int argc, char** argv)
+{
+    blip_archive_options options;
+    blip_archive_default_options(&options);
+    options.report = print_report;
+    int first = 1;
+    while (first + 1 < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (strcmp(argv[first], "--segment-size") == 0) {
+            options.segment_size = (size_t)strtoull(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "--block-size") == 0) {
+            options.block_size = (size_t)strtoull(argv[first + 1], NULL, 10);
+        } else {
+            break;
+        }
+
+        first += 2;
+    }
+
+    if (argc - first < 2) {
+        printf("Usage: CBlipDriver %s [--segment-size N] [--block-size N] <archive directory> <capture>...\n", argv[0]);
+        return -1;
+    }
+
+    archive_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.writer = blip_archive_writer_open(argv[first], &options);
+    int retVal = ctx.writer ? 0 : -1;
+    for (int i = first + 1; i < argc && retVal == 0; i++) {
+        ctx.direction = (uint8_t)(i - first - 1);
+        retVal = archive_capture(&ctx, argv[i]);
+    }
+
+    if (blip_archive_writer_close(ctx.writer) < 0) {
+        retVal = -1;
+    }
+
+    if (retVal == 0) {
+        printf("Archived %"PRIu64" messages to %s\n", ctx.messages, argv[first]);
+    } else {
+        printf("Archiving to %s failed\n", argv[first]);
+    }
+
+    return retVal;
+}
+
+typedef struct {
+    uint64_t limit;
+    bool bodies;
+} query_context;
+
+static int print_record(void* context, const blip_archive_record_t* record)
+{
+    const query_context* ctx = (const query_context*)context;
+    const uint8_t* profile = NULL;
+    size_t profile_size = 0;
+    blip_archive_record_get_property(record, "Profile", &profile, &profile_size);
+    const time_t seconds = (time_t)(record->timestamp_ns / 1000000000);
+    struct tm tm;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", gmtime_r(&seconds, &tm));
+    printf("%s.%09"PRIu64"Z  dir %u  %-6s #%-6"PRIu64" %-16.*s %8zu bytes%s\n", when,
+           record->timestamp_ns % 1000000000, record->direction, kTypeNames[record->type & 7], record->msg_no,
+           (int)profile_size, profile ? (const char*)profile : "", record->body_size,
+           record->checksum == 0 ? "  (checksum mismatch)" : "");
+    if (ctx->bodies && record->body_size > 0) {
+        const int shown = record->body_size < MAX_BODY_PRINTED ? (int)record->body_size : MAX_BODY_PRINTED;
+        printf("    %.*s%s\n", shown, (const char*)record->body, (size_t)shown < record->body_size ? "..." : "");
+    }
+
+    return ctx->limit > 0 && --((query_context*)context)->limit == 0;
+}
+
+int run_query(int argc, char** argv)
+{
+    if (argc < 2) {
+        printf("Usage: CBlipDriver %s <archive directory> [--profile P] [--doc ID] [--msg-no N] [--since-hours H]"
+               " [--limit N] [--bodies]\n", argv[0]);
+        return -1;
+    }
+
+    blip_archive_query_t query;
+    memset(&query, 0, sizeof(query));
+    query_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    for (int i = 2; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--bodies") == 0) {
+            ctx.bodies = true;
+            continue;
+        }
+
+        if (!value) {
+            printf("%s needs a value\n", argv[i]);
+            return -1;
+        }
+
+        if (strcmp(argv[i], "--profile") == 0) {
+            query.profile = value;
+        } else if (strcmp(argv[i], "--doc") == 0) {
+            query.doc_id = value;
+        } else if (strcmp(argv[i], "--msg-no") == 0) {
+            query.match_msg_no = true;
+            query.msg_no = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--since-hours") == 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            const uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+            const uint64_t back_ns = (uint64_t)(strtod(value, NULL) * NS_PER_HOUR);
+            query.since_ns = back_ns < now_ns ? now_ns - back_ns : 0;
+        } else if (strcmp(argv[i], "--limit") == 0) {
+            ctx.limit = strtoull(value, NULL, 10);
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+
+        i++;
+    }
+
+    blip_archive_t* archive = blip_archive_open(argv[1], print_report, NULL);
+    if (!archive) {
+        return -1;
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const int64_t found = blip_archive_query(archive, &query, print_record, &ctx);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    blip_archive_close(archive);
+    if (found < 0) {
+        printf("Query failed\n");
+        return -1;
+    }
+
+    const double ms = (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("%"PRId64" messages in %.3f ms\n", found, ms);
+    return 0;
+}
@@ -0,0 +1,44 @@
+//
+//  archive.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+
+/**
+ * Decodes the captures named on the command line and appends their messages to an archive
+ * (see cblip_archive.h):
+ *
+ *   CBlipDriver archive [--segment-size N] [--block-size N] <archive directory> <capture>...
+ *
+ * Messages are archived with the position of their capture on the command line as the
+ * direction.  Packets are timestamped with the modification time of their files, frames from
+ * WebSocket stream captures with that of the stream file.
+ * @return 0 on success, negative values on failure
+ */
+int run_archive(int argc, char** argv);
+
+/**
+ * Lists the archived messages that match the criteria on the command line, one per line:
+ *
+ *   CBlipDriver query <archive directory> [--profile P] [--doc ID] [--msg-no N]
+ *                     [--since-hours H] [--limit N] [--bodies]
+ *
+ * For example "--doc X --profile rev --since-hours 24" lists every rev of document X in the
+ * last day.
+ * @return 0 on success, negative values on failure
+ */
+int run_query(int argc, char** argv);
@@ -0,0 +1,402 @@
+//
+//  batch.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _GNU_SOURCE
+#include "batch.h"
+#include "capture.h"
+#include "ingest.h"
+#include "verify.h"
+#include "cblip_parser.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_DEPTH 64
+#define DEFAULT_BUFFER_SIZE (1024 * 1024)
+#define MAX_WINDOW 64
+#define NO_BUFFER UINT32_MAX
+
+// A read that has finished but can't be decoded until the ones before it are
+typedef struct {
+    bool ready;
+    unsigned buffer;            // NO_BUFFER if the data was too big for a buffer and is in heap
+    uint8_t* heap;
+    int64_t result;
+    int fd;
+} window_slot;
+
+typedef struct {
+    const char* path;
+    bool is_stream;
+    blip_connection_t* connection;
+    blip_parser_t* parser;
+    int stream_fd;
+    uint64_t stream_size;
+    uint64_t next_submit;       // Sequence number of the next read (packet number - 1, or chunk index)
+    uint64_t next_deliver;
+    unsigned in_flight;
+    bool exhausted;             // No more reads to submit
+    bool failed;
+    window_slot* window;
+    verify_counts counts;
+} capture;
+
+// What each buffer is being read for, handed to the backend as the read's tag
+typedef struct {
+    capture* capture;
+    uint64_t seq;
+    int fd;
+} read_info;
+
+typedef struct {
+    ingest_t* ingest;
+    size_t buffer_size;
+    unsigned window;
+    unsigned* free_buffers;
+    unsigned free_count;
+    read_info* infos;
+} batch;
+
+static void on_stream_message(void* context, blip_message_t* msg)
+{
+    verify_message(msg, &((capture*)context)->counts);
+}
+
+static int open_capture(capture* cap, const char* path, unsigned window)
+{
+    memset(cap, 0, sizeof(capture));
+    cap->path = path;
+    cap->stream_fd = -1;
+    cap->window = calloc(window, sizeof(window_slot));
+    cap->connection = blip_connection_new();
+    if (!cap->window || !cap->connection) {
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        printf("%s: cannot be read\n", path);
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+
+    cap->is_stream = true;
+    cap->stream_size = (uint64_t)st.st_size;
+    cap->stream_fd = open(path, O_RDONLY);
+    cap->parser = blip_parser_new(cap->connection, on_stream_message, cap);
+    return cap->stream_fd >= 0 && cap->parser ? 0 : -1;
+}
+
+static void close_capture(capture* cap)
+{
+    if (cap->stream_fd >= 0) {
+        close(cap->stream_fd);
+    }
+
+    if (cap->parser) {
+        blip_parser_free(cap->parser);
+    }
+
+    if (cap->connection) {
+        blip_connection_free(cap->connection);
+    }
+
+    free(cap->window);
+}
+
+// Starts the next read of a capture, returning false once there is nothing left to read
+static bool submit_next(batch* b, capture* cap)
+{
+    const uint64_t seq = cap->next_submit;
+    window_slot* slot = &cap->window[seq % b->window];
+    int fd = cap->stream_fd;
+    uint64_t offset = 0;
+    size_t size;
+    if (cap->is_stream) {
+        offset = seq * b->buffer_size;
+        if (offset >= cap->stream_size) {
+            return false;
+        }
+
+        const uint64_t remaining = cap->stream_size - offset;
+        size = remaining < b->buffer_size ? (size_t)remaining : b->buffer_size;
+    } else {
+        char path[1100];
+        snprintf(path, sizeof(path), "%s/BLIP_Packet%"PRIu64, cap->path, seq + 1);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+
+        size = (size_t)st.st_size;
+        if (size > b->buffer_size) {
+            // Frames are almost always far smaller than a buffer, so just read outliers directly
+            close(fd);
+            memset(slot, 0, sizeof(window_slot));
+            slot->ready = true;
+            slot->buffer = NO_BUFFER;
+            slot->fd = -1;
+            size_t length;
+            slot->heap = read_packet(cap->path, seq + 1, &length);
+            slot->result = slot->heap ? (int64_t)length : -1;
+            cap->next_submit++;
+            cap->in_flight++;
+            return true;
+        }
+    }
+
+    const unsigned buffer = b->free_buffers[--b->free_count];
+    read_info* info = &b->infos[buffer];
+    info->capture = cap;
+    info->seq = seq;
+    info->fd = cap->is_stream ? -1 : fd;
+    memset(slot, 0, sizeof(window_slot));
+    if (ingest_submit(b->ingest, fd, offset, buffer, size, info) < 0) {
+        b->free_count++;
+        if (!cap->is_stream) {
+            close(fd);
+        }
+
+        cap->failed = true;
+        return false;
+    }
+
+    cap->next_submit++;
+    cap->in_flight++;
+    return true;
+}
+
+static void deliver(batch* b, capture* cap, window_slot* slot)
+{
+    uint8_t* data = slot->buffer == NO_BUFFER ? slot->heap : ingest_buffer(b->ingest, slot->buffer);
+    if (slot->result < 0) {
+        cap->failed = true;
+    }
+
+    if (!cap->failed) {
+        const size_t size = (size_t)slot->result;
+        const int rc = cap->is_stream ? blip_parser_feed(cap->parser, data, size)
+                                      : verify_frame(cap->connection, data, size, false, &cap->counts);
+        if (rc < 0) {
+            printf("%s: failed to decode frame %"PRIu64"\n", cap->path, cap->next_deliver + 1);
+            cap->failed = true;
+        }
+    }
+
+    if (slot->fd >= 0) {
+        close(slot->fd);
+    }
+
+    if (slot->buffer == NO_BUFFER) {
+        free(slot->heap);
+    } else {
+        b->free_buffers[b->free_count++] = slot->buffer;
+    }
+
+    slot->ready = false;
+    cap->next_deliver++;
+    cap->in_flight--;
+    if (cap->failed) {
+        // Everything after a bad frame depends on it, so stop reading this capture
+        cap->exhausted = true;
+    }
+}
+
+static void print_usage(const char* program)
+{
+    printf("Usage: %s [--backend auto|uring|threads] [--depth N] [--buffer-size BYTES] <capture>...\n", program);
+}
+
+// Catches the captures that decoded without an error but still aren't whole: a stream that
+// stops partway through a frame (or its handshake), or anything that held no frames at all
+static void check_complete(capture* cap)
+{
+    if (cap->failed) {
+        return;
+    }
+
+    if (cap->is_stream && blip_parser_finish(cap->parser) < 0) {
+        printf("%s: ends in the middle of a frame\n", cap->path);
+        cap->failed = true;
+    } else if (cap->counts.frames == 0) {
+        printf("%s: no frames found\n", cap->path);
+        cap->failed = true;
+    }
+}
+
+static double seconds_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int run_batch(int argc, char** argv)
+{
+    ingest_backend backend = kIngestAuto;
+    unsigned depth = DEFAULT_DEPTH;
+    size_t buffer_size = DEFAULT_BUFFER_SIZE;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+        if (first + 1 >= argc) {
+            printf("Missing value for %s\n", argv[first]);
+            return -1;
+        }
+
+        const char* value = argv[first + 1];
+        if (strcmp(argv[first], "--backend") == 0) {
+            if (strcmp(value, "auto") == 0) {
+                backend = kIngestAuto;
+            } else if (strcmp(value, "uring") == 0) {
+                backend = kIngestUring;
+            } else if (strcmp(value, "threads") == 0) {
+                backend = kIngestThreads;
+            } else {
+                print_usage(argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[first], "--depth") == 0) {
+            depth = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[first], "--buffer-size") == 0) {
+            buffer_size = (size_t)strtoull(value, NULL, 10);
+        } else {
+            printf("Unknown option %s\n", argv[first]);
+            return -1;
+        }
+    }
+
+    const size_t capture_count = (size_t)(argc - first);
+    if (capture_count == 0 || depth == 0 || depth > UINT16_MAX || buffer_size == 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    batch b;
+    memset(&b, 0, sizeof(b));
+    b.buffer_size = buffer_size;
+    b.ingest = ingest_new(backend, depth, buffer_size);
+    b.free_buffers = calloc(depth, sizeof(unsigned));
+    b.infos = calloc(depth, sizeof(read_info));
+    capture* captures = calloc(capture_count, sizeof(capture));
+    if (!b.ingest || !b.free_buffers || !b.infos || !captures) {
+        printf("Couldn't set up the %s backend\n", backend == kIngestUring ? "io_uring" : "ingestion");
+        return -1;
+    }
+
+    for (unsigned i = 0; i < depth; i++) {
+        b.free_buffers[b.free_count++] = i;
+    }
+
+    // Share the buffers between the captures, but let each keep several reads in flight
+    b.window = depth / (unsigned)capture_count;
+    b.window = b.window < 2 ? 2 : b.window > MAX_WINDOW ? MAX_WINDOW : b.window;
+
+    int retVal = 0;
+    for (size_t i = 0; i < capture_count; i++) {
+        if (open_capture(&captures[i], argv[first + i], b.window) < 0) {
+            captures[i].failed = captures[i].exhausted = true;
+            retVal = 1;
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true) {
+        unsigned in_flight = 0;
+        for (size_t i = 0; i < capture_count; i++) {
+            capture* cap = &captures[i];
+            while (!cap->exhausted && b.free_count > 0 && cap->in_flight < b.window) {
+                if (!submit_next(&b, cap)) {
+                    cap->exhausted = true;
+                }
+            }
+
+            // Oversized frames are read on the spot, so they may be ready without any waiting
+            while (cap->window[cap->next_deliver % b.window].ready) {
+                deliver(&b, cap, &cap->window[cap->next_deliver % b.window]);
+            }
+
+            in_flight += cap->in_flight;
+        }
+
+        if (in_flight == 0) {
+            break;
+        }
+
+        ingest_completion completion;
+        if (ingest_wait(b.ingest, &completion) < 0) {
+            printf("Waiting for reads failed\n");
+            retVal = -1;
+            break;
+        }
+
+        const read_info* info = (const read_info*)completion.tag;
+        capture* cap = info->capture;
+        window_slot* slot = &cap->window[info->seq % b.window];
+        slot->ready = true;
+        slot->buffer = completion.buffer;
+        slot->result = completion.result;
+        slot->fd = info->fd;
+        while (cap->window[cap->next_deliver % b.window].ready) {
+            deliver(&b, cap, &cap->window[cap->next_deliver % b.window]);
+        }
+    }
+
+    const double elapsed = seconds_since(&start);
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < capture_count; i++) {
+        capture* cap = &captures[i];
+        check_complete(cap);
+        const verify_counts* counts = &cap->counts;
+        printf("%s: %"PRIu64" frames, %"PRIu64" checksum mismatches", cap->path, counts->frames,
+               counts->checksum_mismatches);
+        if (!cap->is_stream) {
+            printf(", %"PRIu64" re-encode mismatches", counts->reencode_mismatches);
+        }
+
+        printf("%s\n", cap->failed ? " (FAILED)" : "");
+        if (cap->failed || counts->checksum_mismatches > 0 || counts->reencode_mismatches > 0) {
+            retVal = retVal < 0 ? retVal : 1;
+        }
+
+        total_bytes += cap->is_stream ? cap->stream_size : counts->bytes;
+        close_capture(&captures[i]);
+    }
+
+    printf("%zu captures, %"PRIu64" bytes in %.3f s using %s\n", capture_count, total_bytes, elapsed,
+           ingest_name(b.ingest));
+    free(captures);
+    free(b.infos);
+    free(b.free_buffers);
+    ingest_free(b.ingest);
+    return retVal;
+}
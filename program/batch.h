@@ -0,0 +1,31 @@
+//
+//  batch.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+
+/**
+ * Checks every capture named on the command line, all at once:
+ *
+ *   CBlipDriver [--backend auto|uring|threads] [--depth N] [--buffer-size BYTES] <capture>...
+ *
+ * A capture is either a packet directory (BLIP_Packet1, BLIP_Packet2, ...) or a file holding
+ * one direction of a WebSocket byte stream.  Reads for all captures are kept in flight
+ * together, and each capture is decoded in order as its reads complete.
+ * @return 0 if every capture decoded cleanly, 1 if any had mismatches, negative values on failure
+ */
+int run_batch(int argc, char** argv);
@@ -0,0 +1,89 @@
+// 
+//  capture.c
+// 
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+// 
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+// 
+//  http://www.apache.org/licenses/LICENSE-2.0
+// 
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// 
+
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+uint8_t* read_file(const char* path, size_t* length)
+{
+    FILE* fin = fopen(path, "rb");
+    if (fin == NULL) {
+        return NULL;
+    }
+
+    fseek(fin, 0, SEEK_END);
+    *length = ftell(fin);
+    rewind(fin);
+
+    uint8_t* buffer = malloc(*length);
+    if (buffer && *length > 0 && fread(buffer, *length, 1, fin) != 1) {
+        free(buffer);
+        buffer = NULL;
+    }
+
+    fclose(fin);
+    return buffer;
+}
+
+static void packet_path(char* path, size_t size, const char* dir, uint64_t number)
+{
+    snprintf(path, size, "%s/BLIP_Packet%"PRIu64, dir, number);
+}
+
+uint8_t* read_packet(const char* dir, uint64_t number, size_t* length)
+{
+    char path[1100];
+    packet_path(path, sizeof(path), dir, number);
+    return read_file(path, length);
+}
+
+uint64_t file_time_ns(const char* path)
+{
+#if defined(_WIN32)
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0) {
+        return 0;
+    }
+
+    return (uint64_t)st.st_mtime * 1000000000;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+
+#if defined(__APPLE__)
+    return (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + (uint64_t)st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+    return (uint64_t)st.st_mtim.tv_sec * 1000000000 + (uint64_t)st.st_mtim.tv_nsec;
+#else
+    return (uint64_t)st.st_mtime * 1000000000;
+#endif
+#endif
+}
+
+uint64_t packet_time_ns(const char* dir, uint64_t number)
+{
+    char path[1100];
+    packet_path(path, sizeof(path), dir, number);
+    return file_time_ns(path);
+}
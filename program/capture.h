@@ -0,0 +1,59 @@
+// 
+//  capture.h
+// 
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+// 
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+// 
+//  http://www.apache.org/licenses/LICENSE-2.0
+// 
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+// 
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Helpers for reading packet captures, which are directories containing one file
+ * per BLIP frame, named BLIP_Packet1, BLIP_Packet2, ... in the order they were sent.
+ */
+
+/**
+ * Reads the entire contents of a file
+ * @param path      The path of the file to read
+ * @param length    On successful completion, contains the size of the file
+ * @return          The malloc'd file contents, or NULL if the file could not be read
+ */
+uint8_t* read_file(const char* path, size_t* length);
+
+/**
+ * Reads one frame out of a packet capture directory
+ * @param dir       The capture directory
+ * @param number    The 1-based number of the packet to read
+ * @param length    On successful completion, contains the size of the frame
+ * @return          The malloc'd frame, or NULL if there is no such packet
+ */
+uint8_t* read_packet(const char* dir, uint64_t number, size_t* length);
+
+/**
+ * Gets the modification time of a file, to the nanosecond where the platform keeps it and to
+ * the second elsewhere
+ * @param path      The path of the file
+ * @return          The time in nanoseconds since the epoch, or 0 if the file can't be found
+ */
+uint64_t file_time_ns(const char* path);
+
+/**
+ * Gets the time a packet of a capture was written, from the modification time of its file
+ * @param dir       The capture directory
+ * @param number    The 1-based number of the packet
+ * @return          The time in nanoseconds since the epoch, or 0 if there is no such packet
+ */
+uint64_t packet_time_ns(const char* dir, uint64_t number);
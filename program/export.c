@@ -0,0 +1,160 @@
+//
+//  export.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "export.h"
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_export.h"
+#include "cblip_parser.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define DEFAULT_BATCH_ROWS 65536
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    blip_export_t* exporter;
+    uint8_t direction;
+    uint64_t timestamp_ns;      // What stream rows are stamped with, since frames in a stream carry no time
+    uint64_t rows;
+    bool failed;
+} export_context;
+
+static int write_output(void* context, const uint8_t* data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE*)context) == size ? 0 : -1;
+}
+
+static void add_row(export_context* ctx, const blip_message_t* msg, uint64_t timestamp_ns)
+{
+    if (blip_export_add(ctx->exporter, msg, ctx->direction, timestamp_ns) < 0) {
+        ctx->failed = true;
+    }
+
+    ctx->rows++;
+}
+
+static void on_stream_message(void* context, blip_message_t* msg)
+{
+    export_context* ctx = (export_context*)context;
+    add_row(ctx, msg, ctx->timestamp_ns);
+}
+
+static int export_capture(export_context* ctx, const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        printf("%s: cannot be read\n", path);
+        return -1;
+    }
+
+    blip_connection_t* connection = blip_connection_new();
+    if (!connection) {
+        return -1;
+    }
+
+    int retVal = 0;
+    if (S_ISDIR(st.st_mode)) {
+        for (uint64_t i = 1; retVal == 0 && !ctx->failed; i++) {
+            size_t length;
+            uint8_t* data = read_packet(path, i, &length);
+            if (!data) {
+                break;
+            }
+
+            blip_message_t* msg = blip_message_read(connection, data, length);
+            free(data);
+            if (!msg) {
+                printf("%s: packet %"PRIu64" could not be decoded\n", path, i);
+                retVal = -1;
+                break;
+            }
+
+            add_row(ctx, msg, packet_time_ns(path, i));
+            blip_message_free(msg);
+        }
+    } else {
+        // Like packet directories, streams are stamped with file times (here the whole file's)
+        ctx->timestamp_ns = file_time_ns(path);
+        size_t length;
+        uint8_t* data = read_file(path, &length);
+        blip_parser_t* parser = data ? blip_parser_new(connection, on_stream_message, ctx) : NULL;
+        if (!parser || blip_parser_feed(parser, data, length) < 0 || blip_parser_finish(parser) < 0) {
+            printf("%s: stream could not be decoded\n", path);
+            retVal = -1;
+        }
+
+        blip_parser_free(parser);
+        free(data);
+    }
+
+    blip_connection_free(connection);
+    return ctx->failed ? -1 : retVal;
+}
+
+int run_export(int argc, char** argv)
+{
+    size_t batch_rows = DEFAULT_BATCH_ROWS;
+    int first = 1;
+    if (first + 1 < argc && strcmp(argv[first], "--batch-rows") == 0) {
+        batch_rows = (size_t)strtoull(argv[first + 1], NULL, 10);
+        first += 2;
+    }
+
+    if (argc - first < 2) {
+        printf("Usage: CBlipDriver %s [--batch-rows N] <output file> <capture>...\n", argv[0]);
+        return -1;
+    }
+
+    FILE* fout = fopen(argv[first], "wb");
+    if (!fout) {
+        printf("Unable to open %s for writing\n", argv[first]);
+        return -1;
+    }
+
+    setvbuf(fout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    export_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.exporter = blip_export_new(batch_rows, write_output, fout);
+    int retVal = ctx.exporter ? 0 : -1;
+    for (int i = first + 1; i < argc && retVal == 0; i++) {
+        ctx.direction = (uint8_t)(i - first - 1);
+        retVal = export_capture(&ctx, argv[i]);
+    }
+
+    if (retVal == 0 && blip_export_finish(ctx.exporter) < 0) {
+        retVal = -1;
+    }
+
+    if (fclose(fout) != 0) {
+        retVal = -1;
+    }
+
+    if (retVal == 0) {
+        printf("Exported %"PRIu64" messages to %s\n", ctx.rows, argv[first]);
+    } else {
+        printf("Export to %s failed\n", argv[first]);
+    }
+
+    blip_export_free(ctx.exporter);
+    return retVal;
+}
@@ -0,0 +1,32 @@
+//
+//  export.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+
+/**
+ * Decodes the captures named on the command line and writes the metadata of every message
+ * to a column chunk file (see cblip_export.h):
+ *
+ *   CBlipDriver export [--batch-rows N] <output file> <capture>...
+ *
+ * The direction column holds the position of the capture on the command line (0, 1, ...).
+ * Packets are timestamped with the modification time of their files, frames from WebSocket
+ * stream captures get 0.
+ * @return 0 on success, negative values on failure
+ */
+int run_export(int argc, char** argv);
@@ -0,0 +1,329 @@
+//
+//  indexer.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include "cblip.h"
+#include "capture.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Builds a seek index of connection checkpoints alongside a packet capture, and uses it to
+ * decode any packet in the capture after replaying at most one checkpoint interval.
+ *
+ * Index file layout (fixed width integers are little endian):
+ *
+ *   "CBIX" <version:u8> <interval:u32>
+ *   entries:  <packet:u64> <checkpoint size:u32> <checkpoint bytes>     (repeated)
+ *   table:    <packet:u64> <entry offset:u64>                           (one per entry)
+ *   trailer:  <entry count:u64> "CBIX"
+ *
+ * Each entry holds the connection state as it was just *before* decoding its packet.
+ */
+
+// Offsets are 64 bit, so that captures (and their indexes) can grow past 2 GB where long is 32 bit
+#if defined(_WIN32)
+#define index_seek _fseeki64
+#define index_tell _ftelli64
+#else
+#define index_seek fseeko
+#define index_tell ftello
+#endif
+
+static const char kIndexMagic[4] = {'C', 'B', 'I', 'X'};
+static const uint8_t kIndexVersion = 1;
+
+typedef struct {
+    uint64_t packet;
+    uint64_t offset;
+} index_entry_t;
+
+static bool write_bytes(FILE* fout, const void* data, size_t size)
+{
+    return fwrite(data, 1, size, fout) == size;
+}
+
+static bool write_le(FILE* fout, uint64_t value, int width)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < width; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+
+    return write_bytes(fout, bytes, (size_t)width);
+}
+
+static bool read_le(FILE* fin, uint64_t* value, int width)
+{
+    uint8_t bytes[8];
+    if (fread(bytes, 1, width, fin) != (size_t)width) {
+        return false;
+    }
+
+    *value = 0;
+    for (int i = 0; i < width; i++) {
+        *value |= (uint64_t)bytes[i] << (8 * i);
+    }
+
+    return true;
+}
+
+static int build_index(const char* capture_dir, const char* index_path, uint64_t interval)
+{
+    FILE* fout = fopen(index_path, "wb");
+    if (!fout) {
+        fprintf(stderr, "Unable to open %s for writing\n", index_path);
+        return -1;
+    }
+
+    int retVal = -1;
+    blip_connection_t* connection = blip_connection_new();
+    size_t checkpoint_capacity = connection ? blip_connection_checkpoint(connection, NULL, 0) : 0;
+    uint8_t* checkpoint = malloc(checkpoint_capacity);
+    size_t table_capacity = 64;
+    size_t entry_count = 0;
+    index_entry_t* table = malloc(table_capacity * sizeof(index_entry_t));
+    if (!connection || !checkpoint || !table) {
+        goto cleanup;
+    }
+
+    if (!write_bytes(fout, kIndexMagic, sizeof(kIndexMagic)) || !write_bytes(fout, &kIndexVersion, 1)
+        || !write_le(fout, interval, 4)) {
+        goto write_failed;
+    }
+
+    uint64_t packet = 1;
+    while (true) {
+        size_t length;
+        uint8_t* data = read_packet(capture_dir, packet, &length);
+        if (!data) {
+            break;
+        }
+
+        if ((packet - 1) % interval == 0) {
+            size_t size = blip_connection_checkpoint(connection, checkpoint, checkpoint_capacity);
+            if (size > checkpoint_capacity) {
+                uint8_t* grown = realloc(checkpoint, size);
+                if (grown) {
+                    checkpoint = grown;
+                    checkpoint_capacity = size;
+                    size = blip_connection_checkpoint(connection, checkpoint, checkpoint_capacity);
+                }
+            }
+
+            if (size == 0 || size > checkpoint_capacity) {
+                fprintf(stderr, "Unable to checkpoint before packet %"PRIu64"\n", packet);
+                free(data);
+                goto cleanup;
+            }
+
+            if (entry_count == table_capacity) {
+                index_entry_t* grown = realloc(table, table_capacity * 2 * sizeof(index_entry_t));
+                if (!grown) {
+                    free(data);
+                    goto cleanup;
+                }
+
+                table = grown;
+                table_capacity *= 2;
+            }
+
+            const int64_t offset = index_tell(fout);
+            table[entry_count].packet = packet;
+            table[entry_count].offset = (uint64_t)offset;
+            entry_count++;
+            if (offset < 0 || !write_le(fout, packet, 8) || !write_le(fout, size, 4)
+                || !write_bytes(fout, checkpoint, size)) {
+                free(data);
+                goto write_failed;
+            }
+        }
+
+        blip_message_t* msg = blip_message_read(connection, data, length);
+        free(data);
+        if (!msg) {
+            fprintf(stderr, "Unable to decode packet %"PRIu64"\n", packet);
+            goto cleanup;
+        }
+
+        blip_message_free(msg);
+        packet++;
+    }
+
+    for (size_t i = 0; i < entry_count; i++) {
+        if (!write_le(fout, table[i].packet, 8) || !write_le(fout, table[i].offset, 8)) {
+            goto write_failed;
+        }
+    }
+
+    if (!write_le(fout, entry_count, 8) || !write_bytes(fout, kIndexMagic, sizeof(kIndexMagic))) {
+        goto write_failed;
+    }
+
+    // Buffered data is only known to have been written once the file is closed
+    const int closed = fclose(fout);
+    fout = NULL;
+    if (closed != 0) {
+        goto write_failed;
+    }
+
+    printf("Indexed %"PRIu64" packets with %zu checkpoints\n", packet - 1, entry_count);
+    retVal = 0;
+    goto cleanup;
+
+write_failed:
+    fprintf(stderr, "Unable to write %s\n", index_path);
+
+cleanup:
+    if (fout) {
+        fclose(fout);
+    }
+
+    free(table);
+    free(checkpoint);
+    if (connection) {
+        blip_connection_free(connection);
+    }
+
+    return retVal;
+}
+
+// Finds the last entry at or before the target packet with a binary search over the table
+static bool find_entry(FILE* fin, uint64_t target, index_entry_t* out)
+{
+    char magic[4];
+    uint64_t entry_count;
+    if (index_seek(fin, 0, SEEK_END) != 0) {
+        return false;
+    }
+
+    const int64_t file_size = index_tell(fin);
+    if (file_size < 12 || index_seek(fin, file_size - 12, SEEK_SET) != 0 || !read_le(fin, &entry_count, 8)
+        || fread(magic, 1, 4, fin) != 4 || memcmp(magic, kIndexMagic, 4) != 0 || entry_count == 0
+        || entry_count > (uint64_t)(file_size - 12) / 16) {
+        return false;
+    }
+
+    const int64_t table_start = file_size - 12 - (int64_t)(entry_count * 16);
+    uint64_t lo = 0, hi = entry_count;
+    bool found = false;
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        index_entry_t entry;
+        if (index_seek(fin, table_start + (int64_t)(mid * 16), SEEK_SET) != 0 || !read_le(fin, &entry.packet, 8)
+            || !read_le(fin, &entry.offset, 8)) {
+            return false;
+        }
+
+        if (entry.packet <= target) {
+            *out = entry;
+            found = true;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return found;
+}
+
+static int seek_packet(const char* capture_dir, const char* index_path, uint64_t target)
+{
+    FILE* fin = fopen(index_path, "rb");
+    if (!fin) {
+        fprintf(stderr, "Unable to open %s\n", index_path);
+        return -1;
+    }
+
+    int retVal = -1;
+    uint8_t* checkpoint = NULL;
+    blip_connection_t* connection = NULL;
+    index_entry_t entry;
+    uint64_t packet, checkpoint_size;
+    if (!find_entry(fin, target, &entry) || entry.offset > INT64_MAX
+        || index_seek(fin, (int64_t)entry.offset, SEEK_SET) != 0
+        || !read_le(fin, &packet, 8) || !read_le(fin, &checkpoint_size, 4)) {
+        fprintf(stderr, "No usable checkpoint for packet %"PRIu64"\n", target);
+        goto cleanup;
+    }
+
+    checkpoint = malloc(checkpoint_size);
+    connection = blip_connection_new();
+    if (!checkpoint || !connection || fread(checkpoint, 1, checkpoint_size, fin) != checkpoint_size
+        || blip_connection_restore(connection, checkpoint, checkpoint_size) < 0) {
+        fprintf(stderr, "Corrupt checkpoint at packet %"PRIu64"\n", packet);
+        goto cleanup;
+    }
+
+    for (; packet <= target; packet++) {
+        size_t length;
+        uint8_t* data = read_packet(capture_dir, packet, &length);
+        if (!data) {
+            fprintf(stderr, "Packet %"PRIu64" is missing from the capture\n", packet);
+            goto cleanup;
+        }
+
+        blip_message_t* msg = blip_message_read(connection, data, length);
+        free(data);
+        if (!msg) {
+            fprintf(stderr, "Unable to decode packet %"PRIu64"\n", packet);
+            goto cleanup;
+        }
+
+        if (packet == target) {
+            printf("Restored from packet %"PRIu64"\n", entry.packet);
+            printf("Message Number:\t\t%"PRIu64"\n", msg->msg_no);
+            printf("Message Type:\t\t%s\n", blip_get_message_type(msg));
+            printf("Message Properties:\t%s\n", msg->properties);
+            printf("Message Body:\t\t%.*s\n", (int)msg->body_size, msg->body);
+            printf(msg->calculated_checksum == msg->checksum ? "Checksum OK\n" : "Checksum mismatch\n");
+        }
+
+        blip_message_free(msg);
+    }
+
+    retVal = 0;
+
+cleanup:
+    fclose(fin);
+    free(checkpoint);
+    if (connection) {
+        blip_connection_free(connection);
+    }
+
+    return retVal;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 4 && strcmp(argv[1], "build") == 0) {
+        const uint64_t interval = argc >= 5 ? strtoull(argv[4], NULL, 10) : 1000;
+        return build_index(argv[2], argv[3], interval > 0 ? interval : 1) < 0 ? 1 : 0;
+    }
+
+    if (argc >= 5 && strcmp(argv[1], "seek") == 0) {
+        return seek_packet(argv[2], argv[3], strtoull(argv[4], NULL, 10)) < 0 ? 1 : 0;
+    }
+
+    fprintf(stderr, "Usage: %s build <capture dir> <index file> [interval]\n", argv[0]);
+    fprintf(stderr, "       %s seek <capture dir> <index file> <packet number>\n", argv[0]);
+    return 1;
+}
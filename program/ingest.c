@@ -0,0 +1,509 @@
+//
+//  ingest.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _GNU_SOURCE
+#include "ingest.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define INGEST_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#define MAX_THREADS 16
+
+// What is being read into each buffer, so that short reads can be continued
+typedef struct {
+    int fd;
+    uint64_t offset;
+    size_t size;
+    size_t done;
+    void* tag;
+} read_request;
+
+#ifdef INGEST_URING
+// The mapped submission and completion rings (raw syscalls, so there is no liburing dependency)
+typedef struct {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned to_submit;
+    bool registered;            // Whether the buffers are registered (so READ_FIXED can be used)
+    struct iovec* iovecs;
+} uring;
+#endif
+
+struct ingest
+{
+    ingest_backend backend;
+    unsigned depth;
+    size_t buffer_size;
+    uint8_t* memory;
+    read_request* requests;     // Indexed by buffer
+    unsigned in_flight;
+
+#ifdef INGEST_URING
+    uring ring;
+#endif
+
+    // Thread pool backend: a queue of buffers to read into and a queue of finished reads
+    pthread_t threads[MAX_THREADS];
+    unsigned thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t done_ready;
+    unsigned* pending;
+    unsigned pending_head;
+    unsigned pending_count;
+    ingest_completion* finished;
+    unsigned finished_head;
+    unsigned finished_count;
+    bool stopping;
+};
+
+/********************
+ * io_uring         *
+ *******************/
+
+#ifdef INGEST_URING
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_close(uring* ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+
+    if (ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    free(ring->iovecs);
+}
+
+static int uring_open(ingest_t* ingest)
+{
+    uring* ring = &ingest->ring;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, ingest->depth, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        ring->sq_len = ring->cq_len = ring->sq_len > ring->cq_len ? ring->sq_len : ring->cq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        return -1;
+    }
+
+    ring->cq_ptr = single_mmap ? ring->sq_ptr
+                               : mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+        ring->cq_ptr = NULL;
+        return -1;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    uint8_t* sq = (uint8_t*)ring->sq_ptr;
+    uint8_t* cq = (uint8_t*)ring->cq_ptr;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    ring->iovecs = calloc(ingest->depth, sizeof(struct iovec));
+    if (!ring->iovecs) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < ingest->depth; i++) {
+        ring->iovecs[i].iov_base = ingest->memory + (size_t)i * ingest->buffer_size;
+        ring->iovecs[i].iov_len = ingest->buffer_size;
+    }
+
+    // Registering pins the buffers so the kernel skips mapping them on every read.  It counts
+    // against RLIMIT_MEMLOCK, so carry on with plain vectored reads if it is refused.
+    ring->registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, ring->iovecs,
+                               ingest->depth) == 0;
+    return 0;
+}
+
+static void uring_queue(ingest_t* ingest, unsigned buffer)
+{
+    uring* ring = &ingest->ring;
+    const read_request* request = &ingest->requests[buffer];
+    uint8_t* dst = ingest->memory + (size_t)buffer * ingest->buffer_size + request->done;
+    const unsigned tail = *ring->sq_tail;
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = request->fd;
+    sqe->off = request->offset + request->done;
+    sqe->user_data = buffer;
+    if (ring->registered) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)dst;
+        sqe->len = (uint32_t)(request->size - request->done);
+        sqe->buf_index = (uint16_t)buffer;
+    } else {
+        ring->iovecs[buffer].iov_base = dst;
+        ring->iovecs[buffer].iov_len = request->size - request->done;
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uint64_t)(uintptr_t)&ring->iovecs[buffer];
+        sqe->len = 1;
+    }
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static int uring_wait(ingest_t* ingest, ingest_completion* completion)
+{
+    uring* ring = &ingest->ring;
+    while (true) {
+        const unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            const unsigned buffer = (unsigned)cqe->user_data;
+            const int res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            read_request* request = &ingest->requests[buffer];
+            if (res > 0 && request->done + res < request->size) {
+                // A short read that isn't the end of the file, so ask for the rest
+                request->done += res;
+                uring_queue(ingest, buffer);
+                continue;
+            }
+
+            ingest->in_flight--;
+            completion->tag = request->tag;
+            completion->buffer = buffer;
+            completion->result = res < 0 ? res : (int64_t)(request->done + res);
+            return 0;
+        }
+
+        if (ingest->in_flight == 0) {
+            return -1;
+        }
+
+        const int submitted = uring_enter(ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        ring->to_submit -= (unsigned)submitted;
+    }
+}
+#endif
+
+/********************
+ * Thread pool      *
+ *******************/
+
+static void* read_thread(void* arg)
+{
+    ingest_t* ingest = (ingest_t*)arg;
+    pthread_mutex_lock(&ingest->lock);
+    while (true) {
+        while (ingest->pending_count == 0 && !ingest->stopping) {
+            pthread_cond_wait(&ingest->work_ready, &ingest->lock);
+        }
+
+        if (ingest->pending_count == 0) {
+            break;
+        }
+
+        const unsigned buffer = ingest->pending[ingest->pending_head];
+        ingest->pending_head = (ingest->pending_head + 1) % ingest->depth;
+        ingest->pending_count--;
+        pthread_mutex_unlock(&ingest->lock);
+
+        read_request* request = &ingest->requests[buffer];
+        uint8_t* dst = ingest->memory + (size_t)buffer * ingest->buffer_size;
+        int64_t result = 0;
+        while (request->done < request->size) {
+            const ssize_t n = pread(request->fd, dst + request->done, request->size - request->done,
+                                    (off_t)(request->offset + request->done));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                result = n < 0 ? -errno : 0;
+                break;
+            }
+
+            request->done += (size_t)n;
+        }
+
+        pthread_mutex_lock(&ingest->lock);
+        ingest_completion* completion = &ingest->finished[(ingest->finished_head + ingest->finished_count) % ingest->depth];
+        completion->tag = request->tag;
+        completion->buffer = buffer;
+        completion->result = result < 0 ? result : (int64_t)request->done;
+        ingest->finished_count++;
+        pthread_cond_signal(&ingest->done_ready);
+    }
+
+    pthread_mutex_unlock(&ingest->lock);
+    return NULL;
+}
+
+static int pool_open(ingest_t* ingest)
+{
+    ingest->pending = calloc(ingest->depth, sizeof(unsigned));
+    ingest->finished = calloc(ingest->depth, sizeof(ingest_completion));
+    if (!ingest->pending || !ingest->finished) {
+        return -1;
+    }
+
+    pthread_mutex_init(&ingest->lock, NULL);
+    pthread_cond_init(&ingest->work_ready, NULL);
+    pthread_cond_init(&ingest->done_ready, NULL);
+    const unsigned count = ingest->depth < MAX_THREADS ? ingest->depth : MAX_THREADS;
+    for (unsigned i = 0; i < count; i++) {
+        if (pthread_create(&ingest->threads[i], NULL, read_thread, ingest) != 0) {
+            return -1;
+        }
+
+        ingest->thread_count++;
+    }
+
+    return 0;
+}
+
+static void pool_close(ingest_t* ingest)
+{
+    if (ingest->thread_count > 0) {
+        pthread_mutex_lock(&ingest->lock);
+        ingest->stopping = true;
+        pthread_cond_broadcast(&ingest->work_ready);
+        pthread_mutex_unlock(&ingest->lock);
+        for (unsigned i = 0; i < ingest->thread_count; i++) {
+            pthread_join(ingest->threads[i], NULL);
+        }
+    }
+
+    if (ingest->pending) {
+        pthread_mutex_destroy(&ingest->lock);
+        pthread_cond_destroy(&ingest->work_ready);
+        pthread_cond_destroy(&ingest->done_ready);
+    }
+
+    free(ingest->pending);
+    free(ingest->finished);
+}
+
+static int pool_wait(ingest_t* ingest, ingest_completion* completion)
+{
+    pthread_mutex_lock(&ingest->lock);
+    if (ingest->in_flight == 0) {
+        pthread_mutex_unlock(&ingest->lock);
+        return -1;
+    }
+
+    while (ingest->finished_count == 0) {
+        pthread_cond_wait(&ingest->done_ready, &ingest->lock);
+    }
+
+    *completion = ingest->finished[ingest->finished_head];
+    ingest->finished_head = (ingest->finished_head + 1) % ingest->depth;
+    ingest->finished_count--;
+    ingest->in_flight--;
+    pthread_mutex_unlock(&ingest->lock);
+    return 0;
+}
+
+/********************
+ * Common           *
+ *******************/
+
+ingest_t* ingest_new(ingest_backend backend, unsigned depth, size_t buffer_size)
+{
+    if (depth == 0 || buffer_size == 0) {
+        return NULL;
+    }
+
+    ingest_t* retVal = calloc(1, sizeof(ingest_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->depth = depth;
+    retVal->buffer_size = buffer_size;
+    retVal->requests = calloc(depth, sizeof(read_request));
+    void* memory = NULL;
+    if (!retVal->requests || posix_memalign(&memory, 4096, (size_t)depth * buffer_size) != 0) {
+        free(retVal->requests);
+        free(retVal);
+        return NULL;
+    }
+
+    retVal->memory = (uint8_t*)memory;
+#ifdef INGEST_URING
+    retVal->ring.fd = -1;
+    if (backend != kIngestThreads) {
+        if (uring_open(retVal) == 0) {
+            retVal->backend = kIngestUring;
+            return retVal;
+        }
+
+        uring_close(&retVal->ring);
+        memset(&retVal->ring, 0, sizeof(retVal->ring));
+        retVal->ring.fd = -1;
+    }
+#endif
+
+    if (backend == kIngestUring || pool_open(retVal) < 0) {
+        ingest_free(retVal);
+        return NULL;
+    }
+
+    retVal->backend = kIngestThreads;
+    return retVal;
+}
+
+const char* ingest_name(const ingest_t* ingest)
+{
+#ifdef INGEST_URING
+    if (ingest->backend == kIngestUring) {
+        return ingest->ring.registered ? "io_uring (registered buffers)" : "io_uring";
+    }
+#endif
+
+    return "pread threads";
+}
+
+uint8_t* ingest_buffer(ingest_t* ingest, unsigned buffer)
+{
+    return ingest->memory + (size_t)buffer * ingest->buffer_size;
+}
+
+int ingest_submit(ingest_t* ingest, int fd, uint64_t offset, unsigned buffer, size_t size, void* tag)
+{
+    if (buffer >= ingest->depth || size > ingest->buffer_size) {
+        return -1;
+    }
+
+    read_request* request = &ingest->requests[buffer];
+    request->fd = fd;
+    request->offset = offset;
+    request->size = size;
+    request->done = 0;
+    request->tag = tag;
+#ifdef INGEST_URING
+    if (ingest->backend == kIngestUring) {
+        // Submission is deferred to ingest_wait(), so one syscall covers a whole batch
+        uring_queue(ingest, buffer);
+        ingest->in_flight++;
+        return 0;
+    }
+#endif
+
+    pthread_mutex_lock(&ingest->lock);
+    ingest->pending[(ingest->pending_head + ingest->pending_count) % ingest->depth] = buffer;
+    ingest->pending_count++;
+    ingest->in_flight++;
+    pthread_cond_signal(&ingest->work_ready);
+    pthread_mutex_unlock(&ingest->lock);
+    return 0;
+}
+
+int ingest_wait(ingest_t* ingest, ingest_completion* completion)
+{
+#ifdef INGEST_URING
+    if (ingest->backend == kIngestUring) {
+        return uring_wait(ingest, completion);
+    }
+#endif
+
+    return pool_wait(ingest, completion);
+}
+
+void ingest_free(ingest_t* ingest)
+{
+    if (!ingest) {
+        return;
+    }
+
+#ifdef INGEST_URING
+    uring_close(&ingest->ring);
+#endif
+    pool_close(ingest);
+    free(ingest->requests);
+    free(ingest->memory);
+    free(ingest);
+}
@@ -0,0 +1,80 @@
+//
+//  ingest.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous file reads for capture ingestion.  A fixed set of equally sized buffers is
+ * allocated up front (and registered with the kernel when io_uring is used), and each read
+ * goes into one of them, so that many reads can be in flight at once without any copying.
+ */
+
+typedef enum {
+    kIngestAuto,        ///< io_uring if the kernel allows it, threads otherwise
+    kIngestUring,       ///< io_uring (Linux 5.1+)
+    kIngestThreads      ///< A pool of threads doing blocking pread()
+} ingest_backend;
+
+/** A finished read */
+typedef struct {
+    void* tag;          ///< The tag passed to ingest_submit()
+    unsigned buffer;    ///< The buffer that was read into
+    int64_t result;     ///< The number of bytes read, or a negative errno
+} ingest_completion;
+
+typedef struct ingest ingest_t;
+
+/**
+ * Creates an ingestion backend
+ * @param backend       The backend to use
+ * @param depth         The number of buffers, which is also the maximum number of reads in flight
+ * @param buffer_size   The size of each buffer
+ * @return              The backend, or NULL if it isn't available
+ */
+ingest_t* ingest_new(ingest_backend backend, unsigned depth, size_t buffer_size);
+
+/** Returns a short name for the backend actually in use */
+const char* ingest_name(const ingest_t* ingest);
+
+/** Returns the memory of one of the buffers */
+uint8_t* ingest_buffer(ingest_t* ingest, unsigned buffer);
+
+/**
+ * Starts reading from a file into a buffer (short reads are only returned at end of file)
+ * @param ingest    The backend
+ * @param fd        The file to read from, which must stay open until the read completes
+ * @param offset    The position in the file to read from
+ * @param buffer    The buffer to read into (not otherwise in use)
+ * @param size      The number of bytes to read, at most the buffer size
+ * @param tag       An arbitrary pointer handed back with the completion
+ * @return          0 on success, negative values on failure
+ */
+int ingest_submit(ingest_t* ingest, int fd, uint64_t offset, unsigned buffer, size_t size, void* tag);
+
+/**
+ * Waits for the next read to finish
+ * @param ingest        The backend
+ * @param completion    Receives the finished read
+ * @return              0 on success, negative values on failure (or if nothing is in flight)
+ */
+int ingest_wait(ingest_t* ingest, ingest_completion* completion);
+
+/** Frees a backend (with nothing in flight) */
+void ingest_free(ingest_t* ingest);
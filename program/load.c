@@ -0,0 +1,932 @@
+//
+//  load.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _GNU_SOURCE
+#include "load.h"
+#include "responder.h"
+#include "websocket.h"
+#include "cblip.h"
+#include "cblip_parser.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SESSIONS 16
+#define DEFAULT_RATE 10000.0
+#define DEFAULT_DURATION 10.0
+#define DEFAULT_WARMUP 1.0
+#define DEFAULT_BODY "64-4096"
+#define DEFAULT_MIX "changes=4,rev=4,getCheckpoint=1,setCheckpoint=1"
+#define DEFAULT_PATH "/db/_blipsync"
+#define MAX_PROFILES 16
+#define MAX_PROFILE_NAME 48
+#define READ_BUFFER_SIZE (64 * 1024)
+#define MAX_HANDSHAKE 8192
+#define DRAIN_NS 5000000000ULL          // How long responses are waited for once sending stops
+#define EXPONENTIAL_CAP 16              // Exponential body sizes are cut off at this many times the mean
+
+// Latency histogram: exact below 128ns, then 64 buckets per power of two (under 1.6% error)
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF (HISTOGRAM_SUB / 2)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB + (64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_HALF)
+
+static const double kPercentiles[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+
+typedef enum {
+    kBodyFixed,
+    kBodyUniform,
+    kBodyExponential
+} body_distribution;
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} latency_histogram;
+
+typedef struct {
+    char name[MAX_PROFILE_NAME];
+    char properties[MAX_PROFILE_NAME + 16];     // Profile:<name>
+    uint32_t cumulative_weight;
+} profile_spec;
+
+typedef struct {
+    unsigned sessions;
+    unsigned threads;
+    double rate;
+    double duration;
+    double warmup;
+    bool compress;
+    int port;
+    const char* path;
+
+    profile_spec profiles[MAX_PROFILES];
+    unsigned profile_count;
+    body_distribution body;
+    size_t body_min;            // Fixed size, uniform minimum or exponential mean
+    size_t body_max;
+    uint8_t* body_pool;         // Bodies are slices of this
+    size_t body_pool_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned connected;         // The threads that have connected their sessions
+    bool aborted;
+    uint64_t start;             // When the first request is due, set once every session connected
+} load_config;
+
+typedef struct {
+    MessageNo msg_no;           // 0 when the slot is free
+    uint32_t profile;
+    uint64_t due;               // When the schedule said the request should go out
+    uint64_t sent;              // When it actually did
+} pending_request;
+
+typedef struct {
+    unsigned index;
+    int fd;
+    bool failed;
+    blip_connection_t* outgoing;
+    blip_connection_t* incoming;
+    blip_parser_t* parser;
+    blip_message_t* request;    // Reused for every request
+    blip_message_t* response;   // Reused for every response
+
+    uint8_t* out;               // Framed requests the socket hasn't taken yet
+    size_t out_capacity;
+    size_t out_used;
+    size_t out_sent;
+
+    pending_request* pending;   // Indexed by message number, a power of two in size
+    size_t pending_capacity;
+    size_t outstanding;
+    MessageNo next_msg_no;
+    uint64_t next_due;
+} session;
+
+typedef struct {
+    load_config* config;
+    session* sessions;
+    size_t count;
+    uint64_t rng;
+    pthread_t thread;
+
+    latency_histogram corrected;
+    latency_histogram uncorrected;
+    latency_histogram* profile_corrected;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t measured_received;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t errors;            // Error responses and bad checksums
+    uint64_t unanswered;
+    uint64_t failed_sessions;
+} load_worker;
+
+static uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB) {
+        return (unsigned)value;
+    }
+
+    const unsigned shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+    return HISTOGRAM_SUB + (shift - 1) * HISTOGRAM_HALF + (unsigned)(value >> shift) - HISTOGRAM_HALF;
+}
+
+// The highest value that lands in a bucket
+static uint64_t histogram_value(unsigned bucket)
+{
+    if (bucket < HISTOGRAM_SUB) {
+        return bucket;
+    }
+
+    const unsigned shift = (bucket - HISTOGRAM_SUB) / HISTOGRAM_HALF + 1;
+    const uint64_t sub = (bucket - HISTOGRAM_SUB) % HISTOGRAM_HALF + HISTOGRAM_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histogram_record(latency_histogram* histogram, uint64_t value)
+{
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->total++;
+    histogram->max = value > histogram->max ? value : histogram->max;
+}
+
+static void histogram_merge(latency_histogram* into, const latency_histogram* from)
+{
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+
+    into->total += from->total;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+static uint64_t histogram_percentile(const latency_histogram* histogram, double percentile)
+{
+    const uint64_t rank = (uint64_t)ceil(histogram->total * percentile / 100.0);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank && seen > 0) {
+            const uint64_t value = histogram_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+static int parse_mix(load_config* config, const char* spec)
+{
+    char* copy = strdup(spec);
+    if (!copy) {
+        return -1;
+    }
+
+    int retVal = 0;
+    uint32_t total = 0;
+    char* save = NULL;
+    config->profile_count = 0;
+    for (char* item = strtok_r(copy, ",", &save); item && retVal == 0; item = strtok_r(NULL, ",", &save)) {
+        char* weight = strchr(item, '=');
+        if (weight) {
+            *weight++ = 0;
+        }
+
+        const long value = weight ? atol(weight) : 1;
+        if (config->profile_count == MAX_PROFILES || *item == 0 || strlen(item) >= MAX_PROFILE_NAME || value <= 0) {
+            retVal = -1;
+            break;
+        }
+
+        profile_spec* profile = &config->profiles[config->profile_count++];
+        total += (uint32_t)value;
+        profile->cumulative_weight = total;
+        strcpy(profile->name, item);
+        snprintf(profile->properties, sizeof(profile->properties), "Profile:%s", item);
+    }
+
+    free(copy);
+    return config->profile_count > 0 ? retVal : -1;
+}
+
+static int parse_body(load_config* config, const char* spec)
+{
+    char* end;
+    if (strncmp(spec, "exp:", 4) == 0) {
+        config->body = kBodyExponential;
+        config->body_min = (size_t)strtoull(spec + 4, &end, 10);
+        config->body_max = config->body_min * EXPONENTIAL_CAP;
+        return *end == 0 && config->body_min > 0 ? 0 : -1;
+    }
+
+    config->body_min = (size_t)strtoull(spec, &end, 10);
+    if (*end == '-') {
+        config->body = kBodyUniform;
+        config->body_max = (size_t)strtoull(end + 1, &end, 10);
+    } else {
+        config->body = kBodyFixed;
+        config->body_max = config->body_min;
+    }
+
+    return *end == 0 && config->body_min <= config->body_max ? 0 : -1;
+}
+
+// Fills the body pool with something shaped like replication traffic, so compression has a
+// realistic amount to work with
+static int make_body_pool(load_config* config)
+{
+    config->body_pool_size = config->body_max + 4096;
+    config->body_pool = malloc(config->body_pool_size + 64);
+    if (!config->body_pool) {
+        return -1;
+    }
+
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    size_t used = 0;
+    for (unsigned doc = 0; used < config->body_pool_size; doc++) {
+        used += (size_t)snprintf((char*)config->body_pool + used, 64, "{\"_id\":\"doc-%06u\",\"_rev\":\"%u-%08" PRIx64
+                                 "\",\"n\":%u},", doc, doc % 7 + 1, next_random(&rng) >> 32, doc * 31 % 1000);
+    }
+
+    return 0;
+}
+
+static size_t pick_body_size(const load_config* config, uint64_t* rng)
+{
+    switch (config->body) {
+        case kBodyUniform:
+            return config->body_min + next_random(rng) % (config->body_max - config->body_min + 1);
+        case kBodyExponential: {
+            const double u = (next_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+            const double size = -log(1.0 - u) * config->body_min;
+            return size < config->body_max ? (size_t)size : config->body_max;
+        }
+        default:
+            return config->body_min;
+    }
+}
+
+static uint32_t pick_profile(const load_config* config, uint64_t* rng)
+{
+    const uint32_t point = (uint32_t)(next_random(rng) % config->profiles[config->profile_count - 1].cumulative_weight);
+    uint32_t retVal = 0;
+    while (config->profiles[retVal].cumulative_weight <= point) {
+        retVal++;
+    }
+
+    return retVal;
+}
+
+static void fail_session(load_worker* worker, session* s, const char* reason)
+{
+    if (s->failed) {
+        return;
+    }
+
+    printf("Session %u: %s\n", s->index, reason);
+    s->failed = true;
+    worker->failed_sessions++;
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static int track(session* s, const pending_request* request)
+{
+    for (;;) {
+        if (s->pending_capacity > 0) {
+            pending_request* slot = &s->pending[request->msg_no & (s->pending_capacity - 1)];
+            if (slot->msg_no == 0) {
+                *slot = *request;
+                s->outstanding++;
+                return 0;
+            }
+        }
+
+        // Outstanding message numbers no longer fit the table, so double it (entries that were
+        // apart in the smaller table stay apart in the bigger one)
+        const size_t capacity = s->pending_capacity ? s->pending_capacity * 2 : 64;
+        pending_request* grown = calloc(capacity, sizeof(pending_request));
+        if (!grown) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < s->pending_capacity; i++) {
+            if (s->pending[i].msg_no != 0) {
+                grown[s->pending[i].msg_no & (capacity - 1)] = s->pending[i];
+            }
+        }
+
+        free(s->pending);
+        s->pending = grown;
+        s->pending_capacity = capacity;
+    }
+}
+
+static void flush_output(load_worker* worker, session* s)
+{
+    while (s->out_sent < s->out_used) {
+        const ssize_t written = send(s->fd, s->out + s->out_sent, s->out_used - s->out_sent, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail_session(worker, s, "send failed");
+            }
+
+            return;
+        }
+
+        s->out_sent += (size_t)written;
+    }
+
+    s->out_used = s->out_sent = 0;
+}
+
+static void send_request(load_worker* worker, session* s)
+{
+    const load_config* config = worker->config;
+    const uint32_t profile = pick_profile(config, &worker->rng);
+    const size_t body_size = pick_body_size(config, &worker->rng);
+    blip_message_t* msg = s->request;
+    msg->msg_no = s->next_msg_no++;
+    msg->type = kRequestType;
+    msg->flags = config->compress ? kCompressed : 0;
+    msg->properties = (uint8_t*)config->profiles[profile].properties;
+    msg->body = config->body_pool + next_random(&worker->rng) % (config->body_pool_size - body_size + 1);
+    msg->body_size = body_size;
+
+    size_t size;
+    const uint8_t* encoded = blip_message_serialize(s->outgoing, msg, &size);
+    const size_t framed = size + WS_MAX_HEADER;
+    if (!encoded || s->out_used + framed > s->out_capacity) {
+        const size_t capacity = s->out_used + framed > s->out_capacity * 2 ? s->out_used + framed : s->out_capacity * 2;
+        uint8_t* grown = encoded ? realloc(s->out, capacity) : NULL;
+        if (!grown) {
+            fail_session(worker, s, "request could not be serialized");
+            return;
+        }
+
+        s->out = grown;
+        s->out_capacity = capacity;
+    }
+
+    // Client to server messages are masked
+    const uint64_t mask = next_random(&worker->rng);
+    const size_t header_size = ws_put_header(s->out + s->out_used, size, (const uint8_t*)&mask);
+    uint8_t* payload = s->out + s->out_used + header_size;
+    memcpy(payload, encoded, size);
+    ws_mask(payload, size, (const uint8_t*)&mask);
+    s->out_used += header_size + size;
+    worker->bytes_out += header_size + size;
+    worker->sent++;
+
+    const pending_request request = {msg->msg_no, profile, s->next_due, now_ns()};
+    if (track(s, &request) < 0) {
+        fail_session(worker, s, "out of memory");
+        return;
+    }
+
+    flush_output(worker, s);
+}
+
+static void record_latency(load_worker* worker, const pending_request* request, uint64_t now)
+{
+    const load_config* config = worker->config;
+    if (request->due >= config->start + (uint64_t)(config->warmup * 1e9)) {
+        histogram_record(&worker->corrected, now - request->due);
+        histogram_record(&worker->uncorrected, now - request->sent);
+        histogram_record(&worker->profile_corrected[request->profile], now - request->due);
+    }
+}
+
+static void complete_request(load_worker* worker, session* s, const blip_message_t* msg, uint64_t now)
+{
+    if (s->pending_capacity == 0) {
+        return;
+    }
+
+    pending_request* slot = &s->pending[msg->msg_no & (s->pending_capacity - 1)];
+    if (slot->msg_no != msg->msg_no) {
+        return;
+    }
+
+    const load_config* config = worker->config;
+    const uint64_t measure_from = config->start + (uint64_t)(config->warmup * 1e9);
+    record_latency(worker, slot, now);
+    if (now >= measure_from && now < config->start + (uint64_t)(config->duration * 1e9)) {
+        worker->measured_received++;
+    }
+
+    worker->received++;
+    worker->errors += msg->type == kErrorType || msg->checksum != msg->calculated_checksum;
+    slot->msg_no = 0;
+    s->outstanding--;
+}
+
+static int handle_frames(load_worker* worker, session* s, const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        size_t consumed;
+        const uint8_t* frame;
+        size_t frame_size;
+        const int rc = blip_parser_next(s->parser, data, size, &consumed, &frame, &frame_size);
+        data += consumed;
+        size -= consumed;
+        if (rc <= 0) {
+            return rc;
+        }
+
+        if (blip_message_read_into(s->incoming, s->response, frame, frame_size) < 0) {
+            return -1;
+        }
+
+        if (s->response->type == kResponseType || s->response->type == kErrorType) {
+            complete_request(worker, s, s->response, now_ns());
+        }
+    }
+
+    return 0;
+}
+
+static void read_responses(load_worker* worker, session* s, uint8_t* buffer)
+{
+    for (;;) {
+        const ssize_t received = recv(s->fd, buffer, READ_BUFFER_SIZE, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+
+        if (received <= 0) {
+            fail_session(worker, s, "connection closed by the peer");
+            return;
+        }
+
+        worker->bytes_in += (size_t)received;
+        if (handle_frames(worker, s, buffer, (size_t)received) < 0) {
+            fail_session(worker, s, "response stream could not be decoded");
+            return;
+        }
+    }
+}
+
+static int connect_session(load_worker* worker, session* s, uint8_t* buffer)
+{
+    const load_config* config = worker->config;
+    s->outgoing = blip_connection_new();
+    s->incoming = blip_connection_new();
+    s->parser = s->incoming ? blip_parser_new(s->incoming, NULL, NULL) : NULL;
+    s->request = blip_message_new();
+    s->response = blip_message_new();
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (!s->outgoing || !s->parser || !s->request || !s->response || s->fd < 0) {
+        fail_session(worker, s, "could not be set up");
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)config->port);
+    const int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    char request[512];
+    char accept[WS_KEY_SIZE];
+    const int request_size = ws_client_request(request, sizeof(request), config->port, config->path,
+                                               worker->rng ^ s->index, accept);
+    if (connect(s->fd, (struct sockaddr*)&address, sizeof(address)) < 0 || request_size < 0
+        || ws_send_all(s->fd, (const uint8_t*)request, (size_t)request_size) < 0) {
+        fail_session(worker, s, "could not connect");
+        return -1;
+    }
+
+    size_t used = 0;
+    size_t header_size = 0;
+    while (header_size == 0) {
+        const ssize_t received = recv(s->fd, buffer + used, MAX_HANDSHAKE - used, 0);
+        if (received <= 0) {
+            fail_session(worker, s, "no upgrade response");
+            return -1;
+        }
+
+        used += (size_t)received;
+        header_size = ws_header_end(buffer, used);
+        if (header_size == 0 && used == MAX_HANDSHAKE) {
+            fail_session(worker, s, "upgrade response too long");
+            return -1;
+        }
+    }
+
+    if (strncmp((const char*)buffer, "HTTP/1.1 101", 12) != 0 || !memmem(buffer, header_size, accept, strlen(accept))) {
+        fail_session(worker, s, "upgrade refused");
+        return -1;
+    }
+
+    if (fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK) < 0
+        || handle_frames(worker, s, buffer + header_size, used - header_size) < 0) {
+        fail_session(worker, s, "could not be set up");
+        return -1;
+    }
+
+    s->next_msg_no = 1;
+    return 0;
+}
+
+static void close_session(session* s)
+{
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+
+    if (s->request) {
+        s->request->properties = NULL;
+        s->request->body = NULL;
+        blip_message_free(s->request);
+    }
+
+    if (s->response) {
+        blip_message_free(s->response);
+    }
+
+    if (s->parser) {
+        blip_parser_free(s->parser);
+    }
+
+    if (s->outgoing) {
+        blip_connection_free(s->outgoing);
+    }
+
+    if (s->incoming) {
+        blip_connection_free(s->incoming);
+    }
+
+    free(s->out);
+    free(s->pending);
+}
+
+static void* run_worker(void* arg)
+{
+    load_worker* worker = (load_worker*)arg;
+    load_config* config = worker->config;
+    uint8_t* buffer = malloc(READ_BUFFER_SIZE);
+    struct pollfd* fds = calloc(worker->count, sizeof(struct pollfd));
+    session** polled = calloc(worker->count, sizeof(session*));
+    for (size_t i = 0; i < worker->count; i++) {
+        worker->sessions[i].fd = -1;
+        if (!buffer || !fds || !polled) {
+            fail_session(worker, &worker->sessions[i], "could not be set up");
+        } else {
+            connect_session(worker, &worker->sessions[i], buffer);
+        }
+    }
+
+    // The clock starts once every thread has connected its sessions
+    pthread_mutex_lock(&config->lock);
+    config->connected++;
+    pthread_cond_broadcast(&config->changed);
+    while (config->start == 0 && !config->aborted) {
+        pthread_cond_wait(&config->changed, &config->lock);
+    }
+
+    const bool aborted = config->aborted;
+    pthread_mutex_unlock(&config->lock);
+
+    // Spread the sessions' schedules out evenly, so the requests of all of them together arrive
+    // at the configured rate rather than in bursts
+    const uint64_t interval = (uint64_t)(config->sessions * 1e9 / config->rate);
+    const uint64_t end = config->start + (uint64_t)(config->duration * 1e9);
+    for (size_t i = 0; i < worker->count; i++) {
+        worker->sessions[i].next_due = config->start + (uint64_t)(worker->sessions[i].index * 1e9 / config->rate);
+    }
+
+    while (buffer && fds && polled && !aborted) {
+        uint64_t now = now_ns();
+        uint64_t wake = end + DRAIN_NS;
+        bool busy = false;
+        nfds_t count = 0;
+        for (size_t i = 0; i < worker->count; i++) {
+            session* s = &worker->sessions[i];
+            // Requests that are overdue go out now, and are still timed from when they were due
+            while (!s->failed && s->next_due <= now && s->next_due < end) {
+                send_request(worker, s);
+                s->next_due += interval;
+            }
+
+            if (s->failed) {
+                continue;
+            }
+
+            if (s->next_due < end) {
+                wake = s->next_due < wake ? s->next_due : wake;
+            }
+
+            busy |= s->outstanding > 0 || s->next_due < end;
+            fds[count] = (struct pollfd){s->fd, (short)(POLLIN | (s->out_sent < s->out_used ? POLLOUT : 0)), 0};
+            polled[count++] = s;
+        }
+
+        now = now_ns();
+        if (!busy || now >= end + DRAIN_NS) {
+            break;
+        }
+
+        const uint64_t wait = wake > now ? wake - now : 0;
+        const struct timespec timeout = {(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)};
+        if (ppoll(fds, count, &timeout, NULL) <= 0) {
+            continue;
+        }
+
+        for (nfds_t i = 0; i < count; i++) {
+            if (fds[i].revents & POLLOUT) {
+                flush_output(worker, polled[i]);
+            }
+
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !polled[i]->failed) {
+                read_responses(worker, polled[i], buffer);
+            }
+        }
+    }
+
+    // Requests that never got an answer were waited on until now, which is the least their latency
+    // would have been, so leaving them out would flatter the percentiles
+    const uint64_t finished = now_ns();
+    for (size_t i = 0; i < worker->count; i++) {
+        session* s = &worker->sessions[i];
+        for (size_t p = 0; p < s->pending_capacity; p++) {
+            if (s->pending[p].msg_no != 0) {
+                record_latency(worker, &s->pending[p], finished);
+                worker->unanswered++;
+            }
+        }
+
+        close_session(s);
+    }
+
+    free(polled);
+    free(fds);
+    free(buffer);
+    blip_thread_release_memory();
+    return NULL;
+}
+
+static void print_latencies(const char* label, const latency_histogram* histogram)
+{
+    printf("%-24.24s %10"PRIu64, label, histogram->total);
+    for (size_t i = 0; i < sizeof(kPercentiles) / sizeof(kPercentiles[0]); i++) {
+        printf(" %10.1f", histogram_percentile(histogram, kPercentiles[i]) / 1e3);
+    }
+
+    printf(" %10.1f\n", histogram->max / 1e3);
+}
+
+int run_load(int argc, char** argv)
+{
+    load_config config;
+    memset(&config, 0, sizeof(config));
+    config.sessions = DEFAULT_SESSIONS;
+    config.rate = DEFAULT_RATE;
+    config.duration = DEFAULT_DURATION;
+    config.warmup = DEFAULT_WARMUP;
+    config.path = DEFAULT_PATH;
+    const char* mix = DEFAULT_MIX;
+    const char* body = DEFAULT_BODY;
+    long threads = 0;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--compress") == 0) {
+            config.compress = true;
+            continue;
+        }
+
+        if (first + 1 >= argc) {
+            printf("Missing value for %s\n", argv[first]);
+            return -1;
+        }
+
+        const char* value = argv[++first];
+        if (strcmp(argv[first - 1], "--sessions") == 0) {
+            config.sessions = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[first - 1], "--threads") == 0) {
+            threads = atol(value);
+        } else if (strcmp(argv[first - 1], "--rate") == 0) {
+            config.rate = atof(value);
+        } else if (strcmp(argv[first - 1], "--duration") == 0) {
+            config.duration = atof(value);
+        } else if (strcmp(argv[first - 1], "--warmup") == 0) {
+            config.warmup = atof(value);
+        } else if (strcmp(argv[first - 1], "--mix") == 0) {
+            mix = value;
+        } else if (strcmp(argv[first - 1], "--body") == 0) {
+            body = value;
+        } else if (strcmp(argv[first - 1], "--port") == 0) {
+            config.port = atoi(value);
+        } else if (strcmp(argv[first - 1], "--path") == 0) {
+            config.path = value;
+        } else {
+            printf("Unknown option %s\n", argv[first - 1]);
+            return -1;
+        }
+    }
+
+    if (first < argc || config.sessions == 0 || config.rate <= 0 || config.duration <= 0 || config.warmup < 0
+        || config.warmup >= config.duration || threads < 0 || config.port < 0 || config.port > UINT16_MAX
+        || parse_mix(&config, mix) < 0 || parse_body(&config, body) < 0) {
+        printf("Usage: CBlipDriver %s [--sessions N] [--threads N] [--rate REQUESTS/S] [--duration SECONDS] "
+               "[--warmup SECONDS] [--mix PROFILE=WEIGHT,...] [--body BYTES|MIN-MAX|exp:MEAN] [--compress] "
+               "[--port N] [--path PATH]\n", argv[0]);
+        return -1;
+    }
+
+    // With the bundled responder on the same machine, the cores are split between the two
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (threads == 0) {
+        threads = config.port ? cores : (cores > 1 ? cores / 2 : 1);
+    }
+
+    config.threads = (unsigned)threads < config.sessions ? (unsigned)threads : config.sessions;
+    responder_t* responder = NULL;
+    if (config.port == 0) {
+        responder = responder_start(0, config.threads);
+        if (!responder) {
+            return -1;
+        }
+
+        config.port = responder_port(responder);
+    }
+
+    load_worker* workers = calloc(config.threads, sizeof(load_worker));
+    session* sessions = calloc(config.sessions, sizeof(session));
+    if (!workers || !sessions || make_body_pool(&config) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_init(&config.lock, NULL);
+    pthread_cond_init(&config.changed, NULL);
+
+    // Sessions are dealt out to the threads in contiguous runs
+    int retVal = 0;
+    for (unsigned i = 0; i < config.sessions; i++) {
+        sessions[i].index = i;
+    }
+
+    unsigned started = 0;
+    for (unsigned t = 0; t < config.threads; t++) {
+        load_worker* worker = &workers[t];
+        const size_t begin = (size_t)config.sessions * t / config.threads;
+        worker->config = &config;
+        worker->sessions = sessions + begin;
+        worker->count = (size_t)config.sessions * (t + 1) / config.threads - begin;
+        worker->rng = 0x853C49E6748FEA9BULL * (t + 1);
+        worker->profile_corrected = calloc(config.profile_count, sizeof(latency_histogram));
+        if (!worker->profile_corrected || pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+            printf("Unable to start load thread %u\n", t);
+            retVal = -1;
+            break;
+        }
+
+        started++;
+    }
+
+    pthread_mutex_lock(&config.lock);
+    while (config.connected < started) {
+        pthread_cond_wait(&config.changed, &config.lock);
+    }
+
+    if (retVal == 0) {
+        config.start = now_ns();
+    } else {
+        config.aborted = true;
+    }
+
+    pthread_cond_broadcast(&config.changed);
+    pthread_mutex_unlock(&config.lock);
+
+    for (unsigned t = 0; t < started; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    if (responder) {
+        responder_stop(responder);
+    }
+
+    if (retVal == 0) {
+        load_worker total;
+        memset(&total, 0, sizeof(total));
+        total.profile_corrected = calloc(config.profile_count, sizeof(latency_histogram));
+        for (unsigned t = 0; t < config.threads && total.profile_corrected; t++) {
+            const load_worker* worker = &workers[t];
+            histogram_merge(&total.corrected, &worker->corrected);
+            histogram_merge(&total.uncorrected, &worker->uncorrected);
+            for (unsigned p = 0; p < config.profile_count; p++) {
+                histogram_merge(&total.profile_corrected[p], &worker->profile_corrected[p]);
+            }
+
+            total.sent += worker->sent;
+            total.received += worker->received;
+            total.measured_received += worker->measured_received;
+            total.bytes_out += worker->bytes_out;
+            total.bytes_in += worker->bytes_in;
+            total.errors += worker->errors;
+            total.unanswered += worker->unanswered;
+            total.failed_sessions += worker->failed_sessions;
+        }
+
+        const double measured = config.duration - config.warmup;
+        printf("%u sessions on %u threads against ws://127.0.0.1:%d%s%s\n", config.sessions, config.threads,
+               config.port, config.path, responder ? " (bundled responder)" : "");
+        printf("Target %.0f requests/s for %.1f s after %.1f s of warmup, body sizes %s%s\n", config.rate,
+               measured, config.warmup, body, config.compress ? ", compressed" : "");
+        printf("%"PRIu64" requests (%"PRIu64" bytes), %"PRIu64" responses (%"PRIu64" bytes), %"PRIu64" errors, "
+               "%"PRIu64" unanswered, %"PRIu64" failed sessions\n", total.sent, total.bytes_out, total.received,
+               total.bytes_in, total.errors, total.unanswered, total.failed_sessions);
+        printf("Throughput %.1f responses/s (%.1f%% of target)\n\n", total.measured_received / measured,
+               100.0 * total.measured_received / measured / config.rate);
+
+        printf("%-24s %10s", "latency (us)", "count");
+        for (size_t i = 0; i < sizeof(kPercentiles) / sizeof(kPercentiles[0]); i++) {
+            char label[16];
+            snprintf(label, sizeof(label), "p%g", kPercentiles[i]);
+            printf(" %10s", label);
+        }
+
+        printf(" %10s\n", "max");
+        print_latencies("corrected", &total.corrected);
+        print_latencies("uncorrected", &total.uncorrected);
+        for (unsigned p = 0; total.profile_corrected && p < config.profile_count; p++) {
+            char label[MAX_PROFILE_NAME + 4];
+            snprintf(label, sizeof(label), "  %s", config.profiles[p].name);
+            print_latencies(label, &total.profile_corrected[p]);
+        }
+
+        retVal = total.errors || total.unanswered || total.failed_sessions ? 1 : 0;
+        free(total.profile_corrected);
+    }
+
+    for (unsigned t = 0; t < config.threads; t++) {
+        free(workers[t].profile_corrected);
+    }
+
+    pthread_cond_destroy(&config.changed);
+    pthread_mutex_destroy(&config.lock);
+    free(config.body_pool);
+    free(sessions);
+    free(workers);
+    return retVal;
+}
@@ -0,0 +1,38 @@
+//
+//  load.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+
+/**
+ * Drives concurrent synthetic BLIP sessions over loopback WebSockets and reports throughput and
+ * latency percentiles:
+ *
+ *   CBlipDriver load [--sessions N] [--threads N] [--rate REQUESTS/S] [--duration SECONDS]
+ *                    [--warmup SECONDS] [--mix PROFILE=WEIGHT,...] [--body BYTES|MIN-MAX|exp:MEAN]
+ *                    [--compress] [--port N] [--path PATH]
+ *
+ * Requests go out on a fixed schedule (the rate spread evenly over the sessions) whether or not
+ * earlier ones have been answered, and latency is measured from when each request was due
+ * rather than from when it was sent.  A peer or generator that stalls therefore shows up in the
+ * percentiles instead of quietly lowering the request rate (coordinated omission), and requests
+ * still unanswered at the end count with the time they were waited on.  The plain send to
+ * response latency is reported next to it.  Without --port a bundled responder (see
+ * responder.h) is started on a free port, otherwise the one listening on that port is used.
+ * @return 0 on success, 1 if requests failed or went unanswered, negative values on failure
+ */
+int run_load(int argc, char** argv);
@@ -17,150 +17,113 @@
 // 
 
 #include "cblip.h"
+#include "capture.h"
+#include "verify.h"
+#include "export.h"
+#include "memory.h"
+#ifdef CBLIP_ARCHIVE
+#include "archive.h"
+#endif
+#ifdef CBLIP_INGEST
+#include "batch.h"
+#include "load.h"
+#include "responder.h"
+#include "whatif.h"
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <inttypes.h>
 
 /*
  * A simple program that reads BLIP packets from a directory and deserializes them.
- * Used to check the correctness of the library
+ * Used to check the correctness of the library.  Given capture paths on the command line
+ * it checks all of them concurrently instead (see batch.h).  Other subcommands:
+ * - what-if: re-encodes captures under different compression settings (whatif.h)
+ * - export: writes the metadata of their messages out in columns (export.h)
+ * - memory: measures what connections cost (memory.h)
+ * - load, respond: drive synthetic sessions, and run the responder on its own (load.h, responder.h)
+ * - archive, query: append messages to an indexed archive, and search it (archive.h)
  */
 
-static uint8_t* read_file(const char* path, size_t* length)
+static char* gets_nonewline(char* buffer, int size)
 {
-    FILE* fin = fopen(path, "rb");
-    if (fin == NULL) {
+    if(!fgets(buffer, size, stdin)) {
         return NULL;
     }
 
-    fseek(fin, 0, SEEK_END);
-    *length = ftell(fin);
-    rewind(fin);
+    char* pos;
+    if((pos = strchr(buffer, '\n')) != NULL) {
+        *pos = 0;
+    }
 
-    uint8_t* buffer = malloc(*length);
-    fread(buffer, *length, 1, fin);
-    fclose(fin);
     return buffer;
 }
 
-static char* flags_to_str(FrameFlags flags)
+int main(int argc, char** argv)
 {
-    char* retVal = malloc(38);
-    size_t current_size = 0;
-    if (flags & kCompressed) {
-        current_size = strlen("Compressed");
-        strcpy(retVal, "Compressed");
+    if (argc > 1 && strcmp(argv[1], "export") == 0) {
+        return run_export(argc - 1, argv + 1);
     }
 
-    if (flags & kUrgent) {
-        if (current_size == 0) {
-            current_size = strlen("Urgent");
-            strcpy(retVal, "Urgent");
-        } else {
-            strcpy(retVal + current_size, "|Urgent");
-            current_size += strlen("|Urgent");
-        }
+    if (argc > 1 && strcmp(argv[1], "memory") == 0) {
+        return run_memory(argc - 1, argv + 1);
     }
 
-    if (flags & kNoReply) {
-        if (current_size == 0) {
-            current_size = strlen("NoReply");
-            strcpy(retVal, "NoReply");
-        } else {
-            strcpy(retVal + current_size, "|NoReply");
-            current_size += strlen("|NoReply");
-        }
+#ifdef CBLIP_ARCHIVE
+    if (argc > 1 && strcmp(argv[1], "archive") == 0) {
+        return run_archive(argc - 1, argv + 1);
     }
 
-    if (flags & kMoreComing) {
-        if (current_size == 0) {
-            strcpy(retVal, "MoreComing");
-        } else {
-            strcpy(retVal + current_size, "|MoreComing");
-        }
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return run_query(argc - 1, argv + 1);
     }
+#endif
 
-    if (current_size == 0) {
-        strcpy(retVal, "None");
-    }
+    if (argc > 1) {
+#ifdef CBLIP_INGEST
+        if (strcmp(argv[1], "what-if") == 0) {
+            return run_what_if(argc - 1, argv + 1);
+        }
 
-    return retVal;
-}
+        if (strcmp(argv[1], "load") == 0) {
+            return run_load(argc - 1, argv + 1);
+        }
 
-static char* gets_nonewline(char* buffer, int size)
-{
-    if(!fgets(buffer, size, stdin)) {
-        return NULL;
-    }
+        if (strcmp(argv[1], "respond") == 0) {
+            return run_responder(argc - 1, argv + 1);
+        }
 
-    char* pos;
-    if((pos = strchr(buffer, '\n')) != NULL) {
-        *pos = 0;
+        return run_batch(argc, argv);
+#else
+        printf("This build can only check captures interactively\n");
+        return -1;
+#endif
     }
 
-    return buffer;
-}
-
-int main(int argc, char** argv)
-{
     blip_connection_t* connection = blip_connection_new();
     if(connection == NULL) {
         return -1;
     }
 
     int i = 1;
-    char buffer[1040];
     char packet_dir[1024];
     printf("Enter the directory with BLIP Packets: ");
     gets_nonewline(packet_dir, 1024);
-    
-    while (true) {
-        const int l = sprintf(buffer, "%s\\BLIP_Packet%d", packet_dir, i);
-        buffer[l] = 0;
 
+    verify_counts counts;
+    memset(&counts, 0, sizeof(counts));
+    while (true) {
         size_t length;
-        uint8_t* data = read_file(buffer, &length);
+        uint8_t* data = read_packet(packet_dir, i, &length);
         if (!data) {
             break;
         }
 
-        blip_message_t* msg = blip_message_new(connection, data, length);
-        if(!msg) {
+        if (verify_frame(connection, data, length, true, &counts) < 0) {
             return -2;
         }
 
-        char* flags_str = flags_to_str(msg->flags);
-
-        printf("Message Number:\t\t%llu\n", msg->msg_no);
-        printf("Message Flags:\t\t%s\n", flags_str);
-        printf("Message Type:\t\t%s\n", blip_get_message_type(msg));
-        printf("Message Properties:\t%s\n", msg->properties);
-        printf("Message Body:\t\t%.*s\n", msg->body_size, msg->body);
-        printf("Message Checksum:\t%u\n", msg->checksum);
-        if(msg->calculated_checksum == msg->checksum) {
-            printf("Checksum OK\n\n");
-        } else {
-            printf("Checksum mismatch, got %d but expected %d\n\n", msg->calculated_checksum, msg->checksum);
-        }
-
-        free(flags_str);
-        size_t reencoded_length;
-        uint8_t* reencoded = blip_message_serialize(msg, &reencoded_length);
-        if(length != reencoded_length) {
-            printf("Mismatch data length during reencode (original %li, result %"PRIu64, length, reencoded_length);
-        }
-        int result = memcmp(data, reencoded, length);
-        if(result != 0) {
-            for(size_t i = 0; i < length; i++) {
-                if(data[i] != reencoded[i]) {
-                    printf("%02X != %02X at %"PRIu64, data[i], reencoded[i], i);
-                }
-            }
-        } else {
-            printf("Successful reencode\r\n");
-        }
-        blip_message_free(msg);
+        free(data);
         i++;
     }
 
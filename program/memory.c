@@ -0,0 +1,263 @@
+//
+//  memory.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "memory.h"
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_parser.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#endif
+
+#define DEFAULT_CONNECTIONS 10000
+#define DEFAULT_TARGET 1024
+
+typedef struct {
+    uint8_t** frames;           // Packet directories are read once, then replayed into every connection
+    size_t* sizes;
+    size_t count;
+    uint8_t* stream;            // WebSocket stream captures are fed whole
+    size_t stream_size;
+} loaded_capture;
+
+static void ignore_message(void* context, blip_message_t* msg)
+{
+    (void)context;
+    (void)msg;
+}
+
+// The number of bytes the heap has handed out, or 0 where that can't be found out
+static uint64_t heap_in_use()
+{
+#ifdef HAVE_MALLINFO2
+    const struct mallinfo2 info = mallinfo2();
+    return (uint64_t)info.uordblks + (uint64_t)info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static void report(const char* stage, blip_connection_t** connections, size_t count, uint64_t heap_before)
+{
+    uint64_t usage = 0;
+    for (size_t i = 0; i < count; i++) {
+        usage += blip_connection_memory_usage(connections[i]);
+    }
+
+    printf("%-26s %12.0f", stage, (double)usage / count);
+    const uint64_t heap = heap_in_use();
+    if (heap >= heap_before && heap_before > 0) {
+        printf(" %12.0f", (double)(heap - heap_before) / count);
+    } else {
+        printf(" %12s", "n/a");
+    }
+
+    printf("\n");
+}
+
+static int load_capture(loaded_capture* capture, const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        printf("%s: cannot be read\n", path);
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        capture->stream = read_file(path, &capture->stream_size);
+        return capture->stream ? 0 : -1;
+    }
+
+    size_t capacity = 0;
+    while (true) {
+        size_t length;
+        uint8_t* data = read_packet(path, capture->count + 1, &length);
+        if (!data) {
+            return 0;
+        }
+
+        if (capture->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            uint8_t** frames = realloc(capture->frames, capacity * sizeof(uint8_t*));
+            size_t* sizes = frames ? realloc(capture->sizes, capacity * sizeof(size_t)) : NULL;
+            if (frames) {
+                capture->frames = frames;
+            }
+
+            if (!sizes) {
+                free(data);
+                return -1;
+            }
+
+            capture->sizes = sizes;
+        }
+
+        capture->frames[capture->count] = data;
+        capture->sizes[capture->count++] = length;
+    }
+}
+
+static int replay(const loaded_capture* capture, blip_connection_t* connection)
+{
+    if (capture->stream) {
+        blip_parser_t* parser = blip_parser_new(connection, ignore_message, NULL);
+        int retVal = parser ? blip_parser_feed(parser, capture->stream, capture->stream_size) : -1;
+        if (retVal == 0 && blip_parser_finish(parser) < 0) {
+            retVal = -1;
+        }
+
+        blip_parser_free(parser);
+        return retVal;
+    }
+
+    for (size_t i = 0; i < capture->count; i++) {
+        blip_message_t* msg = blip_message_read(connection, capture->frames[i], capture->sizes[i]);
+        if (!msg) {
+            return -1;
+        }
+
+        blip_message_free(msg);
+    }
+
+    return 0;
+}
+
+static int send_compressed(blip_connection_t* connection)
+{
+    char properties[] = "Profile:memoryProbe";
+    uint8_t body[] = "{\"probe\":true}";
+    blip_message_t* msg = blip_message_new();
+    if (!msg) {
+        return -1;
+    }
+
+    msg->type = kRequestType;
+    msg->flags = kCompressed;
+    msg->msg_no = 1;
+    msg->properties = (uint8_t*)properties;
+    msg->body = body;
+    msg->body_size = sizeof(body) - 1;
+    size_t size;
+    const int retVal = blip_message_serialize(connection, msg, &size) ? 0 : -1;
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+    return retVal;
+}
+
+int run_memory(int argc, char** argv)
+{
+    size_t count = DEFAULT_CONNECTIONS;
+    uint64_t target = DEFAULT_TARGET;
+    blip_compression_options options = {Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, MAX_MEM_LEVEL, MAX_WBITS, 0};
+    int first = 1;
+    for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+        const char* value = argv[first + 1];
+        if (strcmp(argv[first], "--connections") == 0) {
+            count = (size_t)strtoull(value, NULL, 10);
+        } else if (strcmp(argv[first], "--target") == 0) {
+            target = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[first], "--mem") == 0) {
+            options.mem_level = atoi(value);
+        } else if (strcmp(argv[first], "--window") == 0) {
+            options.window_bits = atoi(value);
+        } else {
+            printf("Unknown option %s\n", argv[first]);
+            return -1;
+        }
+    }
+
+    loaded_capture capture;
+    memset(&capture, 0, sizeof(capture));
+    if (count == 0 || (first < argc && load_capture(&capture, argv[first]) < 0)) {
+        printf("Usage: CBlipDriver %s [--connections N] [--target BYTES] [--mem N] [--window N] [<capture>]\n", argv[0]);
+        return -1;
+    }
+
+    blip_connection_t** connections = calloc(count, sizeof(blip_connection_t*));
+    if (!connections) {
+        return -1;
+    }
+
+    printf("%zu connections\n%-26s %12s %12s\n", count, "bytes per connection", "reported", "heap");
+    int retVal = 0;
+    const uint64_t heap_before = heap_in_use();
+    for (size_t i = 0; i < count && retVal == 0; i++) {
+        connections[i] = blip_connection_new();
+        if (!connections[i] || blip_connection_set_compression(connections[i], &options) < 0) {
+            printf("Unable to create connection %zu\n", i);
+            retVal = -1;
+        }
+    }
+
+    uint64_t idle = 0;
+    if (retVal == 0) {
+        for (size_t i = 0; i < count; i++) {
+            idle += blip_connection_memory_usage(connections[i]);
+        }
+
+        idle /= count;
+        report("idle", connections, count, heap_before);
+    }
+
+    if (retVal == 0 && (capture.count > 0 || capture.stream)) {
+        for (size_t i = 0; i < count && retVal == 0; i++) {
+            retVal = replay(&capture, connections[i]);
+        }
+
+        if (retVal == 0) {
+            report("after decoding capture", connections, count, heap_before);
+        } else {
+            printf("The capture could not be decoded\n");
+        }
+    }
+
+    for (size_t i = 0; i < count && retVal == 0; i++) {
+        retVal = send_compressed(connections[i]);
+    }
+
+    if (retVal == 0) {
+        report("after a compressed send", connections, count, heap_before);
+        printf("Idle target %"PRIu64" bytes: %s\n", target, idle <= target ? "met" : "MISSED");
+        retVal = idle <= target ? 0 : 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (connections[i]) {
+            blip_connection_free(connections[i]);
+        }
+    }
+
+    for (size_t i = 0; i < capture.count; i++) {
+        free(capture.frames[i]);
+    }
+
+    free(capture.frames);
+    free(capture.sizes);
+    free(capture.stream);
+    free(connections);
+    return retVal;
+}
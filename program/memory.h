@@ -0,0 +1,32 @@
+//
+//  memory.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+
+/**
+ * Measures how much memory connections take, idle and after traffic:
+ *
+ *   CBlipDriver memory [--connections N] [--target BYTES] [--mem N] [--window N] [<capture>]
+ *
+ * N connections are created and measured while idle, then (given a capture) after each has
+ * decoded the whole capture, and then after each has also sent one compressed message with
+ * the given deflate memory level and window bits.  Both blip_connection_memory_usage() and
+ * (with glibc) the growth of the heap are reported per connection.
+ * @return 0 if idle connections stay within the target, 1 if not, negative values on failure
+ */
+int run_memory(int argc, char** argv);
@@ -0,0 +1,381 @@
+//
+//  responder.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _GNU_SOURCE
+#include "responder.h"
+#include "websocket.h"
+#include "cblip.h"
+#include "cblip_batch.h"
+#include "cblip_parser.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 4990
+#define READ_BUFFER_SIZE (64 * 1024)
+#define MAX_HANDSHAKE 8192
+#define POLL_INTERVAL_MS 100
+
+typedef struct {
+    int fd;
+    uint8_t* handshake;         // The upgrade request as it arrives, NULL once answered
+    size_t handshake_used;
+    blip_connection_t* incoming;
+    blip_connection_t* outgoing;
+    blip_parser_t* parser;
+    blip_batch_t* batch;        // Responses to one read go out in one write
+} peer;
+
+typedef struct {
+    struct responder* owner;
+    int listen_fd;
+    pthread_t thread;
+    bool started;
+} responder_thread;
+
+struct responder
+{
+    int port;
+    unsigned thread_count;
+    atomic_bool stopping;
+    responder_thread* threads;
+};
+
+static int write_batch(void* context, const uint8_t* data, size_t size)
+{
+    return ws_send_all((int)(intptr_t)context, data, size);
+}
+
+static void close_peer(peer* p)
+{
+    if (p->batch) {
+        blip_batch_free(p->batch);
+    }
+
+    if (p->parser) {
+        blip_parser_free(p->parser);
+    }
+
+    if (p->incoming) {
+        blip_connection_free(p->incoming);
+    }
+
+    if (p->outgoing) {
+        blip_connection_free(p->outgoing);
+    }
+
+    free(p->handshake);
+    close(p->fd);
+}
+
+static int open_peer(peer* p, int fd)
+{
+    memset(p, 0, sizeof(peer));
+    p->fd = fd;
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    p->handshake = malloc(MAX_HANDSHAKE);
+    p->incoming = blip_connection_new();
+    p->outgoing = blip_connection_new();
+    p->parser = p->incoming ? blip_parser_new(p->incoming, NULL, NULL) : NULL;
+    p->batch = p->outgoing ? blip_batch_new(p->outgoing, kBlipBatchWebSocket, READ_BUFFER_SIZE, 0, write_batch,
+                                            (void*)(intptr_t)fd) : NULL;
+    if (!p->handshake || !p->parser || !p->batch) {
+        close_peer(p);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Answers the upgrade request once it is complete, leaving whatever followed it in data / size
+static int upgrade(peer* p, const uint8_t** data, size_t* size)
+{
+    if (p->handshake_used + *size > MAX_HANDSHAKE) {
+        return -1;
+    }
+
+    memcpy(p->handshake + p->handshake_used, *data, *size);
+    p->handshake_used += *size;
+    const size_t end = ws_header_end(p->handshake, p->handshake_used);
+    if (end == 0) {
+        *size = 0;
+        return 0;
+    }
+
+    char response[256];
+    const int response_size = ws_server_response((const char*)p->handshake, end, response, sizeof(response));
+    if (response_size < 0 || ws_send_all(p->fd, (const uint8_t*)response, (size_t)response_size) < 0) {
+        return -1;
+    }
+
+    // Frames sent straight after the request arrived with it, so they are moved to the front
+    *size = p->handshake_used - end;
+    memmove(p->handshake, p->handshake + end, *size);
+    *data = p->handshake;
+    return 0;
+}
+
+static int serve_peer(peer* p, uint8_t* buffer, blip_message_t* request, blip_message_t* response)
+{
+    const ssize_t received = recv(p->fd, buffer, READ_BUFFER_SIZE, 0);
+    if (received <= 0) {
+        return -1;
+    }
+
+    const uint8_t* data = buffer;
+    size_t size = (size_t)received;
+    if (p->handshake) {
+        if (upgrade(p, &data, &size) < 0) {
+            return -1;
+        }
+
+        if (data != p->handshake) {
+            // Still waiting for the rest of the request
+            return 0;
+        }
+    }
+
+    int retVal = 0;
+    while (size > 0 && retVal == 0) {
+        size_t consumed;
+        const uint8_t* frame;
+        size_t frame_size;
+        const int rc = blip_parser_next(p->parser, data, size, &consumed, &frame, &frame_size);
+        data += consumed;
+        size -= consumed;
+        if (rc <= 0) {
+            retVal = rc;
+            break;
+        }
+
+        if (blip_message_read_into(p->incoming, request, frame, frame_size) < 0) {
+            retVal = -1;
+        } else if (request->type == kRequestType && !(request->flags & kNoReply)) {
+            response->msg_no = request->msg_no;
+            response->type = kResponseType;
+            response->flags = request->flags & kCompressed;
+            response->body = request->body;
+            response->body_size = request->body_size;
+            // A write that failed part of the way through a read means the client is gone
+            retVal = blip_batch_add(p->batch, response) == 0 ? 0 : -1;
+        }
+    }
+
+    // Anything that arrived with the upgrade request has been parsed (or staged) by now
+    free(p->handshake);
+    p->handshake = NULL;
+
+    return retVal == 0 ? blip_batch_flush(p->batch) : retVal;
+}
+
+static void* serve(void* arg)
+{
+    responder_thread* self = (responder_thread*)arg;
+    peer* peers = NULL;
+    struct pollfd* fds = NULL;
+    size_t count = 0, capacity = 0;
+    uint8_t* buffer = malloc(READ_BUFFER_SIZE);
+    blip_message_t* request = blip_message_new();
+    blip_message_t* response = blip_message_new();
+    if (!buffer || !request || !response) {
+        printf("Responder thread could not start\n");
+        atomic_store(&self->owner->stopping, true);
+    }
+
+    while (!atomic_load(&self->owner->stopping)) {
+        if (count + 1 > capacity) {
+            const size_t grown_capacity = capacity ? capacity * 2 : 16;
+            peer* grown_peers = realloc(peers, grown_capacity * sizeof(peer));
+            peers = grown_peers ? grown_peers : peers;
+            struct pollfd* grown_fds = realloc(fds, (grown_capacity + 1) * sizeof(struct pollfd));
+            fds = grown_fds ? grown_fds : fds;
+            if (!grown_peers || !grown_fds) {
+                break;
+            }
+
+            capacity = grown_capacity;
+        }
+
+        fds[0] = (struct pollfd){self->listen_fd, POLLIN, 0};
+        for (size_t i = 0; i < count; i++) {
+            fds[i + 1] = (struct pollfd){peers[i].fd, POLLIN, 0};
+        }
+
+        if (poll(fds, count + 1, POLL_INTERVAL_MS) <= 0) {
+            continue;
+        }
+
+        // Back to front, so that a closed peer can be replaced by the (already served) last one
+        for (size_t i = count; i-- > 0;) {
+            if (fds[i + 1].revents && serve_peer(&peers[i], buffer, request, response) < 0) {
+                close_peer(&peers[i]);
+                peers[i] = peers[--count];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            const int fd = accept(self->listen_fd, NULL, NULL);
+            if (fd >= 0 && open_peer(&peers[count], fd) == 0) {
+                count++;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        close_peer(&peers[i]);
+    }
+
+    if (response) {
+        response->body = NULL;
+        blip_message_free(response);
+    }
+
+    if (request) {
+        blip_message_free(request);
+    }
+
+    free(buffer);
+    free(fds);
+    free(peers);
+    blip_thread_release_memory();
+    return NULL;
+}
+
+static int listen_on(int port, int* bound_port)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    socklen_t address_size = sizeof(address);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0
+        || getsockname(fd, (struct sockaddr*)&address, &address_size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    *bound_port = ntohs(address.sin_port);
+    return fd;
+}
+
+responder_t* responder_start(int port, unsigned threads)
+{
+    responder_t* retVal = calloc(1, sizeof(responder_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->threads = calloc(threads, sizeof(responder_thread));
+    retVal->thread_count = threads;
+    retVal->port = port;
+    atomic_init(&retVal->stopping, false);
+    bool failed = !retVal->threads;
+    for (unsigned i = 0; i < threads && !failed; i++) {
+        retVal->threads[i].owner = retVal;
+        // Once the first listener has been given a port, the others share it
+        retVal->threads[i].listen_fd = listen_on(retVal->port, &retVal->port);
+        failed = retVal->threads[i].listen_fd < 0;
+    }
+
+    for (unsigned i = 0; i < threads && !failed; i++) {
+        failed = pthread_create(&retVal->threads[i].thread, NULL, serve, &retVal->threads[i]) != 0;
+        retVal->threads[i].started = !failed;
+    }
+
+    if (failed) {
+        printf("Unable to listen on port %d\n", port);
+        responder_stop(retVal);
+        return NULL;
+    }
+
+    return retVal;
+}
+
+int responder_port(const responder_t* responder)
+{
+    return responder->port;
+}
+
+void responder_stop(responder_t* responder)
+{
+    atomic_store(&responder->stopping, true);
+    for (unsigned i = 0; responder->threads && i < responder->thread_count; i++) {
+        if (responder->threads[i].started) {
+            pthread_join(responder->threads[i].thread, NULL);
+        }
+
+        if (responder->threads[i].listen_fd > 0) {
+            close(responder->threads[i].listen_fd);
+        }
+    }
+
+    free(responder->threads);
+    free(responder);
+}
+
+int run_responder(int argc, char** argv)
+{
+    int port = DEFAULT_PORT;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+        const char* value = argv[first + 1];
+        if (strcmp(argv[first], "--port") == 0) {
+            port = atoi(value);
+        } else if (strcmp(argv[first], "--threads") == 0) {
+            threads = atol(value);
+        } else {
+            printf("Unknown option %s\n", argv[first]);
+            return -1;
+        }
+    }
+
+    if (first < argc || threads <= 0 || port < 0 || port > UINT16_MAX) {
+        printf("Usage: CBlipDriver %s [--port N] [--threads N]\n", argv[0]);
+        return -1;
+    }
+
+    responder_t* responder = responder_start(port, (unsigned)threads);
+    if (!responder) {
+        return -1;
+    }
+
+    printf("Answering BLIP requests on ws://127.0.0.1:%d with %ld threads\n", responder_port(responder), threads);
+    fflush(stdout);
+    for (;;) {
+        pause();
+    }
+}
@@ -0,0 +1,51 @@
+//
+//  responder.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+
+/*
+ * A BLIP echo peer for load testing.  It accepts WebSocket connections on the loopback
+ * interface and answers every request (unless it is NoReply) with a response carrying the
+ * request's body, compressed if the request was.  Each thread has its own listening socket on
+ * the shared port (SO_REUSEPORT), so the kernel spreads connections between them.
+ */
+
+typedef struct responder responder_t;
+
+/**
+ * Starts a responder in the background
+ * @param port      The port to listen on, or 0 to pick a free one
+ * @param threads   The number of threads to answer on
+ * @return          The running responder, or NULL on failure
+ */
+responder_t* responder_start(int port, unsigned threads);
+
+/** Returns the port a responder listens on */
+int responder_port(const responder_t* responder);
+
+/** Stops a responder, closing its connections, and frees it */
+void responder_stop(responder_t* responder);
+
+/**
+ * Runs a responder in the foreground until the process is interrupted:
+ *
+ *   CBlipDriver respond [--port N] [--threads N]
+ *
+ * @return negative values on failure
+ */
+int run_responder(int argc, char** argv);
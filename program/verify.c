@@ -0,0 +1,128 @@
+//
+//  verify.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "verify.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char* flags_to_str(FrameFlags flags)
+{
+    char* retVal = malloc(38);
+    size_t current_size = 0;
+    if (flags & kCompressed) {
+        current_size = strlen("Compressed");
+        strcpy(retVal, "Compressed");
+    }
+
+    if (flags & kUrgent) {
+        if (current_size == 0) {
+            current_size = strlen("Urgent");
+            strcpy(retVal, "Urgent");
+        } else {
+            strcpy(retVal + current_size, "|Urgent");
+            current_size += strlen("|Urgent");
+        }
+    }
+
+    if (flags & kNoReply) {
+        if (current_size == 0) {
+            current_size = strlen("NoReply");
+            strcpy(retVal, "NoReply");
+        } else {
+            strcpy(retVal + current_size, "|NoReply");
+            current_size += strlen("|NoReply");
+        }
+    }
+
+    if (flags & kMoreComing) {
+        if (current_size == 0) {
+            strcpy(retVal, "MoreComing");
+        } else {
+            strcpy(retVal + current_size, "|MoreComing");
+        }
+    }
+
+    if (current_size == 0) {
+        strcpy(retVal, "None");
+    }
+
+    return retVal;
+}
+
+void verify_message(const blip_message_t* msg, verify_counts* counts)
+{
+    counts->frames++;
+    if (msg->type < kAckRequestType && msg->calculated_checksum != msg->checksum) {
+        counts->checksum_mismatches++;
+    }
+}
+
+int verify_frame(blip_connection_t* connection, uint8_t* data, size_t length, bool verbose, verify_counts* counts)
+{
+    blip_message_t* msg = blip_message_read(connection, data, length);
+    if(!msg) {
+        return -1;
+    }
+
+    verify_message(msg, counts);
+    counts->bytes += length;
+    if (verbose) {
+        char* flags_str = flags_to_str(msg->flags);
+
+        printf("Message Number:\t\t%"PRIu64"\n", msg->msg_no);
+        printf("Message Flags:\t\t%s\n", flags_str);
+        printf("Message Type:\t\t%s\n", blip_get_message_type(msg));
+        printf("Message Properties:\t%s\n", msg->properties);
+        printf("Message Body:\t\t%.*s\n", (int)msg->body_size, msg->body);
+        printf("Message Checksum:\t%u\n", msg->checksum);
+        if(msg->calculated_checksum == msg->checksum) {
+            printf("Checksum OK\n\n");
+        } else {
+            printf("Checksum mismatch, got %d but expected %d\n\n", msg->calculated_checksum, msg->checksum);
+        }
+
+        free(flags_str);
+    }
+
+    size_t reencoded_length;
+    const uint8_t* reencoded = blip_message_serialize(connection, msg, &reencoded_length);
+    if(length != reencoded_length) {
+        if (verbose) {
+            printf("Mismatch data length during reencode (original %zu, result %zu)\n", length, reencoded_length);
+        }
+
+        counts->reencode_mismatches++;
+    } else if(memcmp(data, reencoded, length) != 0) {
+        if (verbose) {
+            for(size_t i = 0; i < length; i++) {
+                if(data[i] != reencoded[i]) {
+                    printf("%02X != %02X at %zu\n", data[i], reencoded[i], i);
+                }
+            }
+        }
+
+        counts->reencode_mismatches++;
+    } else if (verbose) {
+        printf("Successful reencode\r\n");
+    }
+
+    blip_message_free(msg);
+    return 0;
+}
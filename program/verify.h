@@ -0,0 +1,46 @@
+//
+//  verify.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+
+/** Running totals of the checks made on a capture */
+typedef struct {
+    uint64_t frames;                ///< The number of frames decoded
+    uint64_t bytes;                 ///< The number of frame bytes decoded
+    uint64_t checksum_mismatches;   ///< Frames whose calculated checksum was wrong
+    uint64_t reencode_mismatches;   ///< Frames that didn't re-encode to the same bytes
+} verify_counts;
+
+/**
+ * Decodes a frame, checks its checksum, and checks that it re-encodes to the same bytes
+ * @param connection    The connection the frame belongs to
+ * @param data          The raw frame
+ * @param length        The size of the raw frame
+ * @param verbose       Whether to print the message and the outcome of each check
+ * @param counts        The totals to add to
+ * @return              0 if the frame could be decoded, negative values otherwise
+ */
+int verify_frame(blip_connection_t* connection, uint8_t* data, size_t length, bool verbose, verify_counts* counts);
+
+/**
+ * Checks the checksum of a message that was decoded elsewhere (e.g. by a parser)
+ * @param msg       The decoded message
+ * @param counts    The totals to add to
+ */
+void verify_message(const blip_message_t* msg, verify_counts* counts);
@@ -0,0 +1,262 @@
+//
+//  websocket.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _GNU_SOURCE
+#include "websocket.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#define WS_OPCODE_BINARY 0x2
+#define WS_FLAG_FIN 0x80
+#define WS_FLAG_MASK 0x80
+#define SHA1_SIZE 20
+
+static const char kHandshakeGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char kBase64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t ws_put_header(uint8_t* out, size_t payload_size, const uint8_t* mask_key)
+{
+    size_t pos = 2;
+    out[0] = WS_FLAG_FIN | WS_OPCODE_BINARY;
+    if (payload_size < 126) {
+        out[1] = (uint8_t)payload_size;
+    } else if (payload_size <= UINT16_MAX) {
+        out[1] = 126;
+        out[pos++] = (uint8_t)(payload_size >> 8);
+        out[pos++] = (uint8_t)payload_size;
+    } else {
+        out[1] = 127;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out[pos++] = (uint8_t)((uint64_t)payload_size >> shift);
+        }
+    }
+
+    if (mask_key) {
+        out[1] |= WS_FLAG_MASK;
+        memcpy(out + pos, mask_key, 4);
+        pos += 4;
+    }
+
+    return pos;
+}
+
+void ws_mask(uint8_t* data, size_t size, const uint8_t* mask_key)
+{
+    for (size_t i = 0; i < size; i++) {
+        data[i] ^= mask_key[i & 3];
+    }
+}
+
+static uint32_t rotl(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+// SHA-1 is only needed for the 60 odd bytes of a handshake, so this favours size over speed
+static void sha1(const uint8_t* data, size_t size, uint8_t digest[SHA1_SIZE])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    const uint64_t bits = (uint64_t)size * 8;
+    const size_t padded = (size + 8) / 64 * 64 + 64;
+    for (size_t offset = 0; offset < padded; offset += 64) {
+        uint8_t block[64];
+        for (size_t i = 0; i < 64; i++) {
+            const size_t at = offset + i;
+            block[i] = at < size ? data[at] : at == size ? 0x80 : 0;
+        }
+
+        if (offset + 64 == padded) {
+            for (int i = 0; i < 8; i++) {
+                block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+            }
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+                   | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            const uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        digest[4 * i] = (uint8_t)(h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)h[i];
+    }
+}
+
+static void base64(const uint8_t* data, size_t size, char* out)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < size; i += 3) {
+        const uint32_t group = (uint32_t)data[i] << 16 | (i + 1 < size ? (uint32_t)data[i + 1] << 8 : 0)
+                               | (i + 2 < size ? data[i + 2] : 0);
+        out[pos++] = kBase64[group >> 18];
+        out[pos++] = kBase64[(group >> 12) & 0x3F];
+        out[pos++] = i + 1 < size ? kBase64[(group >> 6) & 0x3F] : '=';
+        out[pos++] = i + 2 < size ? kBase64[group & 0x3F] : '=';
+    }
+
+    out[pos] = 0;
+}
+
+void ws_accept_key(const char* key, size_t key_size, char accept[WS_KEY_SIZE])
+{
+    uint8_t joined[64 + sizeof(kHandshakeGuid)];
+    if (key_size > 64) {
+        key_size = 64;
+    }
+
+    memcpy(joined, key, key_size);
+    memcpy(joined + key_size, kHandshakeGuid, sizeof(kHandshakeGuid) - 1);
+    uint8_t digest[SHA1_SIZE];
+    sha1(joined, key_size + sizeof(kHandshakeGuid) - 1, digest);
+    base64(digest, SHA1_SIZE, accept);
+}
+
+int ws_client_request(char* out, size_t capacity, int port, const char* path, uint64_t seed,
+                      char accept[WS_KEY_SIZE])
+{
+    uint8_t nonce[16];
+    for (int i = 0; i < 16; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        nonce[i] = (uint8_t)(seed >> 56);
+    }
+
+    char key[WS_KEY_SIZE];
+    base64(nonce, sizeof(nonce), key);
+    ws_accept_key(key, strlen(key), accept);
+    const int written = snprintf(out, capacity,
+                                 "GET %s HTTP/1.1\r\n"
+                                 "Host: 127.0.0.1:%d\r\n"
+                                 "Upgrade: websocket\r\n"
+                                 "Connection: Upgrade\r\n"
+                                 "Sec-WebSocket-Version: 13\r\n"
+                                 "Sec-WebSocket-Key: %s\r\n"
+                                 "Sec-WebSocket-Protocol: " WS_BLIP_PROTOCOL "\r\n\r\n",
+                                 path, port, key);
+    return written > 0 && (size_t)written < capacity ? written : -1;
+}
+
+int ws_server_response(const char* request, size_t request_size, char* out, size_t capacity)
+{
+    static const char kKeyHeader[] = "Sec-WebSocket-Key:";
+    const char* end = request + request_size;
+    for (const char* line = request; line < end;) {
+        const char* eol = memchr(line, '\n', (size_t)(end - line));
+        if (!eol) {
+            break;
+        }
+
+        if ((size_t)(eol - line) > sizeof(kKeyHeader) && strncasecmp(line, kKeyHeader, sizeof(kKeyHeader) - 1) == 0) {
+            const char* key = line + sizeof(kKeyHeader) - 1;
+            const char* key_end = eol;
+            while (key < key_end && *key == ' ') {
+                key++;
+            }
+
+            while (key_end > key && (key_end[-1] == '\r' || key_end[-1] == ' ')) {
+                key_end--;
+            }
+
+            char accept[WS_KEY_SIZE];
+            ws_accept_key(key, (size_t)(key_end - key), accept);
+            const int written = snprintf(out, capacity,
+                                         "HTTP/1.1 101 Switching Protocols\r\n"
+                                         "Upgrade: websocket\r\n"
+                                         "Connection: Upgrade\r\n"
+                                         "Sec-WebSocket-Accept: %s\r\n"
+                                         "Sec-WebSocket-Protocol: " WS_BLIP_PROTOCOL "\r\n\r\n",
+                                         accept);
+            return written > 0 && (size_t)written < capacity ? written : -1;
+        }
+
+        line = eol + 1;
+    }
+
+    return -1;
+}
+
+size_t ws_header_end(const uint8_t* data, size_t size)
+{
+    for (size_t i = 3; i < size; i++) {
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+int ws_send_all(int fd, const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += written;
+        size -= (size_t)written;
+    }
+
+    return 0;
+}
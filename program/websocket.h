@@ -0,0 +1,102 @@
+//
+//  websocket.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Just enough of RFC 6455 for the load generator and its responder to talk to each other (and
+ * to real BLIP services): the upgrade handshake and binary message headers.  Reading frames is
+ * left to the BLIP parser, which already understands WebSocket framing.
+ */
+
+/** The largest WebSocket frame header (a 64-bit length and a mask key) */
+#define WS_MAX_HEADER 14
+
+/** The size of a Sec-WebSocket-Key or Sec-WebSocket-Accept value, plus a NUL */
+#define WS_KEY_SIZE 29
+
+/** The WebSocket subprotocol that BLIP is spoken over */
+#define WS_BLIP_PROTOCOL "BLIP_3+CBMobile_2"
+
+/**
+ * Writes the header of a single frame binary WebSocket message
+ * @param out           Receives the header (at least WS_MAX_HEADER bytes)
+ * @param payload_size  The size of the payload that follows
+ * @param mask_key      The 4 byte mask key for client to server messages, or NULL to not mask
+ * @return              The size of the header
+ */
+size_t ws_put_header(uint8_t* out, size_t payload_size, const uint8_t* mask_key);
+
+/**
+ * Masks (or unmasks) a payload in place
+ * @param data      The payload
+ * @param size      The size of the payload
+ * @param mask_key  The 4 byte mask key from the header
+ */
+void ws_mask(uint8_t* data, size_t size, const uint8_t* mask_key);
+
+/**
+ * Computes the Sec-WebSocket-Accept value that answers a Sec-WebSocket-Key
+ * @param key       The key sent by the client
+ * @param key_size  The size of the key
+ * @param accept    Receives the NUL terminated accept value
+ */
+void ws_accept_key(const char* key, size_t key_size, char accept[WS_KEY_SIZE]);
+
+/**
+ * Writes a client's upgrade request, choosing a key for it
+ * @param out       Receives the request
+ * @param capacity  The size of out
+ * @param port      The port being connected to, for the Host header
+ * @param path      The path to request
+ * @param seed      Varies the key from request to request
+ * @param accept    Receives the accept value the server has to answer with
+ * @return          The size of the request, or negative values if it doesn't fit
+ */
+int ws_client_request(char* out, size_t capacity, int port, const char* path, uint64_t seed,
+                      char accept[WS_KEY_SIZE]);
+
+/**
+ * Writes the server's answer to an upgrade request
+ * @param request       The request, up to and including its blank line
+ * @param request_size  The size of the request
+ * @param out           Receives the response
+ * @param capacity      The size of out
+ * @return              The size of the response, or negative values if the request isn't a
+ *                      WebSocket upgrade
+ */
+int ws_server_response(const char* request, size_t request_size, char* out, size_t capacity);
+
+/**
+ * Finds the end of an HTTP header
+ * @param data  The bytes received so far
+ * @param size  The number of bytes received so far
+ * @return      The size of the header including its blank line, or 0 if it isn't complete yet
+ */
+size_t ws_header_end(const uint8_t* data, size_t size);
+
+/**
+ * Sends all of a buffer on a blocking socket
+ * @param fd    The socket
+ * @param data  The bytes to send
+ * @param size  The number of bytes
+ * @return      0 on success, negative values if the connection failed
+ */
+int ws_send_all(int fd, const uint8_t* data, size_t size);
@@ -0,0 +1,618 @@
+//
+//  whatif.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _GNU_SOURCE
+#include "whatif.h"
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_parser.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>
+
+#define MAX_CONFIGS 32
+#define MAX_PROFILE_NAME 64
+
+// Reserved profile slots for frames that don't carry a Profile property
+enum {
+    kProfileNone,
+    kProfileResponse,
+    kProfileError,
+    kProfileAck,
+    kReservedProfiles
+};
+
+static const char* const kReservedProfileNames[] = {"(no profile)", "(response)", "(error)", "(ack)"};
+
+static const char* const kDefaultConfigs[] = {
+    "level=6",
+    "level=1",
+    "level=9",
+    "level=6,mem=8,window=12",
+    "level=6,min=256",
+};
+
+// A decoded frame, kept in a form every configuration can re-encode from
+typedef struct {
+    MessageNo msg_no;
+    MessageType type;
+    FrameFlags flags;
+    uint32_t profile;
+    uint8_t* properties;        // Colon separated, NULL if there were none
+    size_t properties_size;     // Including the terminating NUL
+    uint8_t* body;
+    size_t body_size;
+    size_t wire_size;           // The size of the captured frame
+} frame_template;
+
+typedef struct {
+    const char* path;
+    frame_template* frames;
+    size_t count;
+    size_t capacity;
+    bool failed;
+} capture_frames;
+
+typedef struct {
+    char** names;
+    size_t count;
+    size_t capacity;
+} profile_table;
+
+typedef struct {
+    const char* spec;
+    blip_compression_options options;
+    bool force;
+
+    uint64_t wire_bytes;
+    uint64_t compressed_frames;
+    uint64_t verify_failures;
+    uint64_t* profile_bytes;
+    double cpu_seconds;
+    bool failed;
+} what_if_config;
+
+typedef struct {
+    what_if_config* config;
+    const capture_frames* captures;
+    size_t capture_count;
+    bool verify;
+} worker_args;
+
+typedef struct {
+    capture_frames* capture;
+    profile_table* profiles;
+} decode_context;
+
+static uint32_t intern_profile(profile_table* profiles, const blip_message_t* msg)
+{
+    if (msg->type == kResponseType) {
+        return kProfileResponse;
+    }
+
+    if (msg->type == kErrorType) {
+        return kProfileError;
+    }
+
+    if (msg->type >= kAckRequestType) {
+        return kProfileAck;
+    }
+
+    if (!msg->profile) {
+        return kProfileNone;
+    }
+
+    const size_t size = msg->profile_size < MAX_PROFILE_NAME ? msg->profile_size : MAX_PROFILE_NAME;
+    for (size_t i = kReservedProfiles; i < profiles->count; i++) {
+        if (strncmp(profiles->names[i], (const char*)msg->profile, size) == 0 && profiles->names[i][size] == 0) {
+            return (uint32_t)i;
+        }
+    }
+
+    if (profiles->count == profiles->capacity) {
+        const size_t capacity = profiles->capacity * 2;
+        char** grown = realloc(profiles->names, capacity * sizeof(char*));
+        if (!grown) {
+            return kProfileNone;
+        }
+
+        profiles->names = grown;
+        profiles->capacity = capacity;
+    }
+
+    profiles->names[profiles->count] = strndup((const char*)msg->profile, size);
+    return profiles->names[profiles->count] ? (uint32_t)profiles->count++ : kProfileNone;
+}
+
+static int add_frame(capture_frames* capture, profile_table* profiles, const blip_message_t* msg, size_t wire_size)
+{
+    if (capture->count == capture->capacity) {
+        const size_t capacity = capture->capacity ? capture->capacity * 2 : 256;
+        frame_template* grown = realloc(capture->frames, capacity * sizeof(frame_template));
+        if (!grown) {
+            return -1;
+        }
+
+        capture->frames = grown;
+        capture->capacity = capacity;
+    }
+
+    frame_template* frame = &capture->frames[capture->count];
+    memset(frame, 0, sizeof(frame_template));
+    frame->msg_no = msg->msg_no;
+    frame->type = msg->type;
+    frame->flags = msg->flags;
+    frame->profile = intern_profile(profiles, msg);
+    frame->wire_size = wire_size;
+    if (msg->type < kAckRequestType) {
+        if (msg->properties) {
+            frame->properties_size = strlen((const char*)msg->properties) + 1;
+            frame->properties = malloc(frame->properties_size);
+            if (!frame->properties) {
+                return -1;
+            }
+
+            memcpy(frame->properties, msg->properties, frame->properties_size);
+        }
+
+        frame->body_size = msg->body_size;
+        frame->body = malloc(msg->body_size ? msg->body_size : 1);
+        if (!frame->body) {
+            free(frame->properties);
+            return -1;
+        }
+
+        memcpy(frame->body, msg->body, msg->body_size);
+    }
+
+    capture->count++;
+    return 0;
+}
+
+static void on_stream_message(void* context, blip_message_t* msg)
+{
+    decode_context* ctx = (decode_context*)context;
+    if (add_frame(ctx->capture, ctx->profiles, msg, blip_get_message_wire_size(msg)) < 0) {
+        ctx->capture->failed = true;
+    }
+}
+
+static int decode_capture(capture_frames* capture, profile_table* profiles)
+{
+    struct stat st;
+    if (stat(capture->path, &st) != 0) {
+        printf("%s: cannot be read\n", capture->path);
+        return -1;
+    }
+
+    blip_connection_t* connection = blip_connection_new();
+    if (!connection) {
+        return -1;
+    }
+
+    int retVal = 0;
+    if (S_ISDIR(st.st_mode)) {
+        for (uint64_t i = 1; retVal == 0; i++) {
+            size_t length;
+            uint8_t* data = read_packet(capture->path, i, &length);
+            if (!data) {
+                break;
+            }
+
+            blip_message_t* msg = blip_message_read(connection, data, length);
+            if (!msg) {
+                printf("%s: packet %"PRIu64" could not be decoded\n", capture->path, i);
+                retVal = -1;
+            } else {
+                retVal = add_frame(capture, profiles, msg, length);
+                blip_message_free(msg);
+            }
+
+            free(data);
+        }
+    } else {
+        size_t length;
+        uint8_t* data = read_file(capture->path, &length);
+        decode_context ctx = {capture, profiles};
+        blip_parser_t* parser = data ? blip_parser_new(connection, on_stream_message, &ctx) : NULL;
+        if (!parser || blip_parser_feed(parser, data, length) < 0 || blip_parser_finish(parser) < 0
+            || capture->failed) {
+            printf("%s: stream could not be decoded\n", capture->path);
+            retVal = -1;
+        }
+
+        blip_parser_free(parser);
+        free(data);
+    }
+
+    blip_connection_free(connection);
+    return retVal;
+}
+
+static int parse_config(what_if_config* config, const char* spec)
+{
+    memset(config, 0, sizeof(what_if_config));
+    config->spec = spec;
+    config->options.level = Z_DEFAULT_COMPRESSION;
+    config->options.strategy = Z_DEFAULT_STRATEGY;
+    config->options.mem_level = MAX_MEM_LEVEL;
+    config->options.window_bits = MAX_WBITS;
+
+    char* copy = strdup(spec);
+    if (!copy) {
+        return -1;
+    }
+
+    int retVal = 0;
+    char* save = NULL;
+    for (char* item = strtok_r(copy, ",", &save); item && retVal == 0; item = strtok_r(NULL, ",", &save)) {
+        char* value = strchr(item, '=');
+        if (value) {
+            *value++ = 0;
+        }
+
+        if (strcmp(item, "force") == 0) {
+            config->force = true;
+        } else if (!value) {
+            retVal = -1;
+        } else if (strcmp(item, "level") == 0) {
+            config->options.level = atoi(value);
+        } else if (strcmp(item, "mem") == 0) {
+            config->options.mem_level = atoi(value);
+        } else if (strcmp(item, "window") == 0) {
+            config->options.window_bits = atoi(value);
+        } else if (strcmp(item, "min") == 0) {
+            config->options.min_size = (size_t)strtoull(value, NULL, 10);
+        } else if (strcmp(item, "strategy") == 0) {
+            config->options.strategy = strcmp(value, "filtered") == 0 ? Z_FILTERED
+                                       : strcmp(value, "huffman") == 0 ? Z_HUFFMAN_ONLY
+                                       : strcmp(value, "rle") == 0 ? Z_RLE
+                                       : strcmp(value, "fixed") == 0 ? Z_FIXED
+                                       : strcmp(value, "default") == 0 ? Z_DEFAULT_STRATEGY : -1;
+        } else {
+            retVal = -1;
+        }
+    }
+
+    free(copy);
+    return retVal;
+}
+
+static double thread_cpu_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Decodes a capture's worth of re-encoded frames, counting the ones that don't come back intact
+static uint64_t verify_output(const capture_frames* capture, uint8_t* output, const size_t* offsets)
+{
+    blip_connection_t* connection = blip_connection_new();
+    if (!connection) {
+        return capture->count;
+    }
+
+    uint64_t failures = 0;
+    for (size_t i = 0; i < capture->count; i++) {
+        const frame_template* frame = &capture->frames[i];
+        blip_message_t* msg = blip_message_read(connection, output + offsets[i], offsets[i + 1] - offsets[i]);
+        if (!msg) {
+            failures++;
+            continue;
+        }
+
+        if ((msg->type < kAckRequestType && msg->calculated_checksum != msg->checksum)
+            || msg->body_size != frame->body_size || (frame->body_size && memcmp(msg->body, frame->body, frame->body_size))) {
+            failures++;
+        }
+
+        blip_message_free(msg);
+    }
+
+    blip_connection_free(connection);
+    return failures;
+}
+
+static void* run_config(void* arg)
+{
+    const worker_args* args = (const worker_args*)arg;
+    what_if_config* config = args->config;
+    uint8_t* output = NULL;
+    size_t output_capacity = 0;
+    size_t* offsets = NULL;
+    for (size_t c = 0; c < args->capture_count && !config->failed; c++) {
+        const capture_frames* capture = &args->captures[c];
+        blip_connection_t* connection = blip_connection_new();
+        blip_message_t* msg = blip_message_new();
+        if (!connection || !msg || blip_connection_set_compression(connection, &config->options) < 0) {
+            config->failed = true;
+        }
+
+        if (args->verify) {
+            free(offsets);
+            offsets = malloc((capture->count + 1) * sizeof(size_t));
+            config->failed |= !offsets;
+            if (offsets) {
+                offsets[0] = 0;
+            }
+        }
+
+        const double start = thread_cpu_seconds();
+        for (size_t i = 0; i < capture->count && !config->failed; i++) {
+            const frame_template* frame = &capture->frames[i];
+            if (frame->type >= kAckRequestType) {
+                // ACKs carry no payload, so nothing about them depends on the compression settings
+                config->wire_bytes += frame->wire_size;
+                config->profile_bytes[frame->profile] += frame->wire_size;
+                if (args->verify) {
+                    offsets[i + 1] = offsets[i];
+                }
+
+                continue;
+            }
+
+            msg->msg_no = frame->msg_no;
+            msg->type = frame->type;
+            msg->flags = config->force ? frame->flags | kCompressed : frame->flags;
+            msg->properties = frame->properties;
+            msg->body = frame->body;
+            msg->body_size = frame->body_size;
+
+            size_t size;
+            const uint8_t* encoded = blip_message_serialize(connection, msg, &size);
+            if (!encoded) {
+                config->failed = true;
+                break;
+            }
+
+            config->wire_bytes += size;
+            config->profile_bytes[frame->profile] += size;
+            // The connection drops the Compressed flag below its minimum size
+            config->compressed_frames += (msg->flags & kCompressed) != 0;
+
+            if (args->verify) {
+                // Copying the output is kept out of the timing below
+                const double copy_start = thread_cpu_seconds();
+                if (offsets[i] + size > output_capacity) {
+                    output_capacity = (offsets[i] + size) * 2;
+                    uint8_t* grown = realloc(output, output_capacity);
+                    if (!grown) {
+                        config->failed = true;
+                        break;
+                    }
+
+                    output = grown;
+                }
+
+                memcpy(output + offsets[i], encoded, size);
+                offsets[i + 1] = offsets[i] + size;
+                config->cpu_seconds -= thread_cpu_seconds() - copy_start;
+            }
+        }
+
+        config->cpu_seconds += thread_cpu_seconds() - start;
+        if (args->verify && !config->failed) {
+            config->verify_failures += verify_output(capture, output, offsets);
+        }
+
+        if (msg) {
+            msg->properties = NULL;
+            msg->body = NULL;
+            blip_message_free(msg);
+        }
+
+        if (connection) {
+            blip_connection_free(connection);
+        }
+    }
+
+    free(output);
+    free(offsets);
+    blip_thread_release_memory();
+    return NULL;
+}
+
+static void sort_profiles(uint32_t* order, size_t count, const uint64_t* bytes)
+{
+    for (size_t i = 1; i < count; i++) {
+        const uint32_t current = order[i];
+        size_t j = i;
+        for (; j > 0 && bytes[order[j - 1]] < bytes[current]; j--) {
+            order[j] = order[j - 1];
+        }
+
+        order[j] = current;
+    }
+}
+
+int run_what_if(int argc, char** argv)
+{
+    const char* specs[MAX_CONFIGS];
+    size_t config_count = 0;
+    bool verify = false;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[first], "--config") == 0 && first + 1 < argc && config_count < MAX_CONFIGS) {
+            specs[config_count++] = argv[++first];
+        } else {
+            printf("Unknown or incomplete option %s\n", argv[first]);
+            return -1;
+        }
+    }
+
+    if (first >= argc) {
+        printf("Usage: CBlipDriver %s [--config SPEC]... [--verify] <capture>...\n", argv[0]);
+        return -1;
+    }
+
+    if (config_count == 0) {
+        config_count = sizeof(kDefaultConfigs) / sizeof(kDefaultConfigs[0]);
+        memcpy(specs, kDefaultConfigs, sizeof(kDefaultConfigs));
+    }
+
+    const size_t capture_count = (size_t)(argc - first);
+    capture_frames* captures = calloc(capture_count, sizeof(capture_frames));
+    what_if_config* configs = calloc(config_count, sizeof(what_if_config));
+    worker_args* args = calloc(config_count, sizeof(worker_args));
+    pthread_t* threads = calloc(config_count, sizeof(pthread_t));
+    profile_table profiles = {calloc(16, sizeof(char*)), kReservedProfiles, 16};
+    if (!captures || !configs || !args || !threads || !profiles.names) {
+        return -1;
+    }
+
+    int retVal = 0;
+    // A throwaway connection catches settings that zlib would refuse before any work is done
+    blip_connection_t* check = blip_connection_new();
+    for (size_t i = 0; i < config_count && retVal == 0; i++) {
+        if (!check || parse_config(&configs[i], specs[i]) < 0
+            || blip_connection_set_compression(check, &configs[i].options) < 0) {
+            printf("Invalid configuration %s\n", specs[i]);
+            retVal = -1;
+        }
+    }
+
+    if (check) {
+        blip_connection_free(check);
+    }
+
+    for (size_t i = 0; i < capture_count && retVal == 0; i++) {
+        captures[i].path = argv[first + i];
+        retVal = decode_capture(&captures[i], &profiles);
+    }
+
+    uint64_t* captured_bytes = calloc(profiles.count, sizeof(uint64_t));
+    uint64_t* captured_frames = calloc(profiles.count, sizeof(uint64_t));
+    uint32_t* order = calloc(profiles.count, sizeof(uint32_t));
+    if (retVal == 0 && (!captured_bytes || !captured_frames || !order)) {
+        retVal = -1;
+    }
+
+    uint64_t total_frames = 0, total_wire = 0, total_payload = 0, total_compressed = 0;
+    for (size_t i = 0; i < capture_count && retVal == 0; i++) {
+        for (size_t j = 0; j < captures[i].count; j++) {
+            const frame_template* frame = &captures[i].frames[j];
+            captured_bytes[frame->profile] += frame->wire_size;
+            captured_frames[frame->profile]++;
+            total_frames++;
+            total_wire += frame->wire_size;
+            total_payload += frame->properties_size + frame->body_size;
+            total_compressed += (frame->flags & kCompressed) != 0;
+        }
+    }
+
+    // Every configuration works through the same decoded frames, each on its own thread
+    size_t started = 0;
+    for (; started < config_count && retVal == 0; started++) {
+        configs[started].profile_bytes = calloc(profiles.count, sizeof(uint64_t));
+        args[started] = (worker_args){&configs[started], captures, capture_count, verify};
+        if (!configs[started].profile_bytes
+            || pthread_create(&threads[started], NULL, run_config, &args[started]) != 0) {
+            retVal = -1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (configs[i].failed) {
+            printf("Configuration %s failed\n", configs[i].spec);
+            retVal = -1;
+        }
+    }
+
+    if (retVal == 0) {
+        printf("%zu captures, %"PRIu64" frames (%"PRIu64" compressed), %"PRIu64" bytes on the wire, "
+               "%"PRIu64" payload bytes\n\n", capture_count, total_frames, total_compressed, total_wire, total_payload);
+        printf("%-32s %14s %9s %11s %10s %10s%s\n", "configuration", "wire bytes", "vs capture", "compressed",
+               "cpu ms", "MB/s", verify ? "  verify" : "");
+        for (size_t i = 0; i < config_count; i++) {
+            const what_if_config* config = &configs[i];
+            const double cpu = config->cpu_seconds > 0 ? config->cpu_seconds : 1e-9;
+            printf("%-32.32s %14"PRIu64" %9.1f%% %11"PRIu64" %10.2f %10.1f", config->spec, config->wire_bytes,
+                   total_wire ? 100.0 * config->wire_bytes / total_wire : 0.0, config->compressed_frames,
+                   config->cpu_seconds * 1000, total_payload / cpu / 1e6);
+            if (verify) {
+                printf("  %"PRIu64" bad", config->verify_failures);
+                retVal = config->verify_failures ? 1 : retVal;
+            }
+
+            printf("\n");
+        }
+
+        for (uint32_t i = 0; i < profiles.count; i++) {
+            order[i] = i;
+        }
+
+        sort_profiles(order, profiles.count, captured_bytes);
+        printf("\n%-24s %10s %14s", "profile", "frames", "captured");
+        for (size_t i = 0; i < config_count; i++) {
+            printf(" %14.14s", configs[i].spec);
+        }
+
+        printf("\n");
+        for (size_t p = 0; p < profiles.count; p++) {
+            const uint32_t index = order[p];
+            if (captured_frames[index] == 0) {
+                continue;
+            }
+
+            const char* name = index < kReservedProfiles ? kReservedProfileNames[index] : profiles.names[index];
+            printf("%-24.24s %10"PRIu64" %14"PRIu64, name, captured_frames[index], captured_bytes[index]);
+            for (size_t i = 0; i < config_count; i++) {
+                printf(" %14"PRIu64, configs[i].profile_bytes[index]);
+            }
+
+            printf("\n");
+        }
+    }
+
+    for (size_t i = 0; i < capture_count; i++) {
+        for (size_t j = 0; j < captures[i].count; j++) {
+            free(captures[i].frames[j].properties);
+            free(captures[i].frames[j].body);
+        }
+
+        free(captures[i].frames);
+    }
+
+    for (size_t i = 0; i < config_count; i++) {
+        free(configs[i].profile_bytes);
+    }
+
+    for (size_t i = kReservedProfiles; i < profiles.count; i++) {
+        free(profiles.names[i]);
+    }
+
+    free(profiles.names);
+    free(captured_bytes);
+    free(captured_frames);
+    free(order);
+    free(threads);
+    free(args);
+    free(configs);
+    free(captures);
+    return retVal;
+}
@@ -0,0 +1,33 @@
+//
+//  whatif.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+
+/**
+ * Re-encodes the captures named on the command line under several compression settings at
+ * once, and reports what each would have put on the wire:
+ *
+ *   CBlipDriver what-if [--config SPEC]... [--verify] <capture>...
+ *
+ * SPEC is a comma separated list of level=N, strategy=default|filtered|huffman|rle|fixed,
+ * mem=N, window=N, min=BYTES and force (compress every message, not just the ones that were
+ * captured compressed).  Each configuration runs on its own thread with its own connections.
+ * --verify decodes the re-encoded frames again to check them (outside of the CPU timing).
+ * @return 0 on success, 1 if a re-encoded frame failed verification, negative values on failure
+ */
+int run_what_if(int argc, char** argv);
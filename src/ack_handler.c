@@ -17,6 +17,7 @@
 // 
 
 #include "ack_handler.h"
+#include "types.h"
 #include <stdlib.h>
 
 void handle_ack_msg(blip_message_t* msg, uint8_t* data, size_t size)
@@ -29,13 +30,15 @@ void handle_ack_msg(blip_message_t* msg, uint8_t* data, size_t size)
     msg->private[1] = ack_size;
 }
 
-uint8_t* serialize_ack_msg(blip_message_t* msg, size_t* out_size) {
-    *out_size += SizeOfVarInt(msg->private[1]);
-    uint8_t* writeBuf = (uint8_t*)malloc(*out_size);
-    uint8_t* pos = put_varint(msg->msg_no, writeBuf);
+int serialize_ack_msg_append(blip_message_t* msg, uint8_t** buf, size_t* capacity, size_t* used, bool growable) {
+    const size_t size = SizeOfVarInt(msg->msg_no) + SizeOfVarInt(msg->flags | msg->type) + SizeOfVarInt(msg->private[1]);
+    if (blip_reserve_output_in(buf, capacity, *used, size, growable) < 0) {
+        return -1;
+    }
+
+    uint8_t* pos = put_varint(msg->msg_no, *buf + *used);
     pos = put_varint(msg->flags | msg->type, pos);
     pos = put_varint(msg->private[1], pos);
-    msg->private[2] = (uint64_t)writeBuf;
-
-    return writeBuf;
+    *used = pos - *buf;
+    return 0;
 }
@@ -28,9 +28,12 @@
 void handle_ack_msg(blip_message_t* msg, uint8_t* data, size_t size);
 
 /**
- * Serializes an ACK type BLIP message
+ * Serializes an ACK type BLIP message, appending it to a buffer
  * @param msg       The message to serialize
- * @param out_size  Holds the size of the returned data on completion
- * @return          The serialized byte data of the ACK message
+ * @param buf       The buffer to append to (may be realloc'd if growable, and may then start out NULL)
+ * @param capacity  The allocated size of *buf
+ * @param used      The number of bytes of *buf in use, advanced past the message
+ * @param growable  Whether *buf may be realloc'd, false for buffers the caller owns
+ * @return          0 on success, negative values on failure
  */
-uint8_t* serialize_ack_msg(blip_message_t* msg, size_t* out_size);
\ No newline at end of file
+int serialize_ack_msg_append(blip_message_t* msg, uint8_t** buf, size_t* capacity, size_t* used, bool growable);
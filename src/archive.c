@@ -0,0 +1,1163 @@
+//
+//  archive.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "cblip_archive.h"
+#include "cblip_endian.h"
+#include "cblip_replication.h"
+#include "cpu.h"
+#include "types.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEFAULT_SEGMENT_SIZE (256 * 1024 * 1024)
+#define DEFAULT_BLOCK_SIZE (64 * 1024)
+#define DEFAULT_LEVEL 6
+#define FILE_HEADER_SIZE 8
+#define BLOCK_HEADER_SIZE 20
+#define RECORD_HEADER_SIZE 32
+#define BLOCK_INFO_SIZE 24
+#define ENTRY_SIZE 24
+#define INDEX_HEADER_SIZE (FILE_HEADER_SIZE + 4 * 8 + kIndexCount * 16)
+#define SEGMENT_NAME_SIZE 13        // "NNNNNNNN.cbad"
+#define MAX_PATH_SIZE 4096
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define REPORT_SIZE (MAX_PATH_SIZE + 128)
+#define FNV64_SEED 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+static const char kDataMagic[4] = {'C', 'B', 'A', 'D'};
+static const char kBlockMagic[4] = {'C', 'B', 'A', 'B'};
+static const char kIndexMagic[4] = {'C', 'B', 'A', 'I'};
+
+enum {
+    kIndexProfile,
+    kIndexMsgNo,
+    kIndexDocId,
+    kIndexCount
+};
+
+typedef struct {
+    uint64_t key;
+    uint64_t timestamp_ns;
+    uint32_t block;
+    uint32_t offset;        // Of the record within the raw bytes of its block
+} index_entry;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t first_ns;
+    uint64_t last_ns;
+} block_info;
+
+typedef struct {
+    index_entry* entries;
+    size_t count;
+    size_t capacity;
+} entry_list;
+
+// What the index of a segment will hold, gathered as its records are written (or recovered)
+typedef struct {
+    block_info* blocks;
+    size_t block_count;
+    size_t blocks_capacity;
+    entry_list indexes[kIndexCount];
+    uint64_t record_count;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint32_t block_records;     // Records so far in the block being filled
+    uint64_t block_first_ns;
+    uint64_t block_last_ns;
+} segment_builder;
+
+// A record as laid out in the raw bytes of a block
+typedef struct {
+    blip_archive_record_t record;
+    const uint8_t* doc_keys;
+    uint32_t doc_count;
+    size_t size;
+} record_view;
+
+typedef struct {
+    const uint8_t* records;
+    uint32_t count;
+    uint32_t raw_size;
+    size_t size;                // Of the block in the data file, header included
+} block_view;
+
+struct blip_archive_writer
+{
+    char* directory;
+    blip_archive_options options;
+    bool failed;
+
+    uint32_t segment;           // The number of the segment being written
+    FILE* data;                 // Opened by the first record of a segment
+    uint64_t data_size;
+    segment_builder builder;
+
+    uint8_t* block;             // The raw records of the block being filled
+    size_t block_size;
+    size_t block_capacity;
+    uint8_t* stored;            // The block deflated
+    size_t stored_capacity;
+    uint64_t* doc_keys;
+    size_t doc_count;
+    size_t doc_capacity;
+};
+
+typedef struct {
+    uint32_t number;
+    const uint8_t* index;
+    size_t index_size;
+    const uint8_t* data;
+    size_t data_size;
+    uint64_t block_count;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    const uint8_t* blocks;
+    const uint8_t* entries[kIndexCount];
+    uint64_t entry_counts[kIndexCount];
+} segment_map;
+
+struct blip_archive
+{
+    segment_map* segments;
+    size_t count;
+    blip_archive_report report;
+    void* report_context;
+};
+
+static void report(blip_archive_report callback, void* context, const char* format, ...)
+{
+    if (!callback) {
+        return;
+    }
+
+    char message[REPORT_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    callback(context, message);
+}
+
+static uint64_t fnv64(const uint8_t* data, size_t size)
+{
+    uint64_t hash = FNV64_SEED;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * FNV64_PRIME;
+    }
+
+    return hash;
+}
+
+static void put_u32(uint8_t* out, uint32_t value)
+{
+    const uint32_t le = _encLittle32(value);
+    memcpy(out, &le, 4);
+}
+
+static void put_u64(uint8_t* out, uint64_t value)
+{
+    const uint64_t le = _encLittle64(value);
+    memcpy(out, &le, 8);
+}
+
+static uint32_t get_u32(const uint8_t* in)
+{
+    uint32_t le;
+    memcpy(&le, in, 4);
+    return _decLittle32(le);
+}
+
+static uint64_t get_u64(const uint8_t* in)
+{
+    uint64_t le;
+    memcpy(&le, in, 8);
+    return _decLittle64(le);
+}
+
+static void segment_path(char* path, const char* directory, uint32_t number, const char* extension)
+{
+    snprintf(path, MAX_PATH_SIZE, "%s/%08u.%s", directory, number, extension);
+}
+
+// Gets the number of a segment from its file name, or 0 if the name isn't one
+static uint32_t segment_number(const char* name, const char* extension)
+{
+    unsigned number;
+    char suffix[8];
+    if (strlen(name) != SEGMENT_NAME_SIZE || sscanf(name, "%8u.%4s", &number, suffix) != 2
+        || strcmp(suffix, extension) != 0) {
+        return 0;
+    }
+
+    return number;
+}
+
+static bool file_exists(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+/*************
+ * Recording *
+ *************/
+
+static bool parse_record(const uint8_t* pos, size_t available, record_view* view)
+{
+    if (available < RECORD_HEADER_SIZE) {
+        return false;
+    }
+
+    const uint64_t properties_size = get_u32(pos + 16);
+    const uint64_t body_size = get_u32(pos + 20);
+    const uint64_t doc_count = get_u32(pos + 28);
+    const uint64_t size = RECORD_HEADER_SIZE + doc_count * 8 + properties_size + body_size;
+    if (size > available) {
+        return false;
+    }
+
+    blip_archive_record_t* record = &view->record;
+    record->timestamp_ns = get_u64(pos);
+    record->msg_no = get_u64(pos + 8);
+    record->direction = pos[24];
+    record->type = (MessageType)pos[25];
+    record->flags = (FrameFlags)pos[26];
+    record->checksum = pos[27];
+    view->doc_keys = pos + RECORD_HEADER_SIZE;
+    view->doc_count = (uint32_t)doc_count;
+    record->properties = properties_size > 0 ? view->doc_keys + doc_count * 8 : NULL;
+    record->properties_size = properties_size;
+    record->body = view->doc_keys + doc_count * 8 + properties_size;
+    record->body_size = body_size;
+    view->size = size;
+    return true;
+}
+
+static int add_entry(entry_list* list, uint64_t key, uint64_t timestamp_ns, uint32_t block, uint32_t offset)
+{
+    if (list->count == list->capacity) {
+        const size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        index_entry* grown = realloc(list->entries, capacity * sizeof(index_entry));
+        if (!grown) {
+            return -1;
+        }
+
+        list->entries = grown;
+        list->capacity = capacity;
+    }
+
+    list->entries[list->count++] = (index_entry){key, timestamp_ns, block, offset};
+    return 0;
+}
+
+// Adds a record of the block being filled to the indexes of its segment
+static int index_record(segment_builder* builder, const record_view* view, uint32_t offset)
+{
+    const blip_archive_record_t* record = &view->record;
+    const uint64_t ts = record->timestamp_ns;
+    const uint32_t block = (uint32_t)builder->block_count;
+    int retVal = add_entry(&builder->indexes[kIndexMsgNo], record->msg_no, ts, block, offset);
+    const uint8_t* profile;
+    size_t profile_size;
+    if (blip_find_wire_property(record->properties, record->properties_size, "Profile", 7, &profile, &profile_size)) {
+        retVal |= add_entry(&builder->indexes[kIndexProfile], fnv64(profile, profile_size), ts, block, offset);
+    }
+
+    for (uint32_t i = 0; i < view->doc_count; i++) {
+        retVal |= add_entry(&builder->indexes[kIndexDocId], get_u64(view->doc_keys + i * 8), ts, block, offset);
+    }
+
+    if (builder->record_count++ == 0 || ts < builder->first_ns) {
+        builder->first_ns = ts;
+    }
+
+    builder->last_ns = ts > builder->last_ns ? ts : builder->last_ns;
+    if (builder->block_records++ == 0 || ts < builder->block_first_ns) {
+        builder->block_first_ns = ts;
+    }
+
+    builder->block_last_ns = ts > builder->block_last_ns ? ts : builder->block_last_ns;
+    return retVal < 0 ? -1 : 0;
+}
+
+static int add_block(segment_builder* builder, uint64_t offset)
+{
+    if (builder->block_count == builder->blocks_capacity) {
+        const size_t capacity = builder->blocks_capacity ? builder->blocks_capacity * 2 : 64;
+        block_info* grown = realloc(builder->blocks, capacity * sizeof(block_info));
+        if (!grown) {
+            return -1;
+        }
+
+        builder->blocks = grown;
+        builder->blocks_capacity = capacity;
+    }
+
+    builder->blocks[builder->block_count++] = (block_info){offset, builder->block_first_ns, builder->block_last_ns};
+    builder->block_records = 0;
+    builder->block_last_ns = 0;
+    return 0;
+}
+
+static void builder_reset(segment_builder* builder)
+{
+    free(builder->blocks);
+    for (int i = 0; i < kIndexCount; i++) {
+        free(builder->indexes[i].entries);
+    }
+
+    memset(builder, 0, sizeof(segment_builder));
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    const index_entry* x = (const index_entry*)a;
+    const index_entry* y = (const index_entry*)b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Writes the index of a segment under a temporary name and renames it into place, which is
+// what seals the segment
+static int write_index(const char* directory, uint32_t number, segment_builder* builder,
+                       const blip_archive_options* options)
+{
+    char path[MAX_PATH_SIZE];
+    char temp_path[MAX_PATH_SIZE];
+    segment_path(path, directory, number, "cbai");
+    segment_path(temp_path, directory, number, "cbai.tmp");
+    FILE* fout = fopen(temp_path, "wb");
+    if (!fout) {
+        report(options->report, options->report_context, "Unable to open %s for writing", temp_path);
+        return -1;
+    }
+
+    setvbuf(fout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    uint8_t header[INDEX_HEADER_SIZE] = {0};
+    memcpy(header, kIndexMagic, sizeof(kIndexMagic));
+    header[4] = BLIP_ARCHIVE_VERSION;
+    put_u64(header + 8, builder->record_count);
+    put_u64(header + 16, builder->block_count);
+    put_u64(header + 24, builder->first_ns);
+    put_u64(header + 32, builder->last_ns);
+    uint64_t offset = INDEX_HEADER_SIZE + builder->block_count * BLOCK_INFO_SIZE;
+    for (int i = 0; i < kIndexCount; i++) {
+        entry_list* list = &builder->indexes[i];
+        qsort(list->entries, list->count, sizeof(index_entry), compare_entries);
+        put_u64(header + 40 + i * 16, offset);
+        put_u64(header + 48 + i * 16, list->count);
+        offset += list->count * ENTRY_SIZE;
+    }
+
+    bool ok = fwrite(header, 1, sizeof(header), fout) == sizeof(header);
+    for (size_t i = 0; i < builder->block_count && ok; i++) {
+        uint8_t info[BLOCK_INFO_SIZE];
+        put_u64(info, builder->blocks[i].offset);
+        put_u64(info + 8, builder->blocks[i].first_ns);
+        put_u64(info + 16, builder->blocks[i].last_ns);
+        ok = fwrite(info, 1, sizeof(info), fout) == sizeof(info);
+    }
+
+    for (int i = 0; i < kIndexCount; i++) {
+        for (size_t j = 0; j < builder->indexes[i].count && ok; j++) {
+            const index_entry* entry = &builder->indexes[i].entries[j];
+            uint8_t encoded[ENTRY_SIZE];
+            put_u64(encoded, entry->key);
+            put_u64(encoded + 8, entry->timestamp_ns);
+            put_u32(encoded + 16, entry->block);
+            put_u32(encoded + 20, entry->offset);
+            ok = fwrite(encoded, 1, sizeof(encoded), fout) == sizeof(encoded);
+        }
+    }
+
+    ok = ok && fflush(fout) == 0 && fsync(fileno(fout)) == 0;
+    ok = fclose(fout) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        report(options->report, options->report_context, "Unable to write %s", path);
+        remove(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Checks the block at the start of data and gets at its records, inflating them into scratch
+// if they were stored deflated
+static int decode_block(const uint8_t* data, size_t available, uint8_t** scratch, size_t* scratch_capacity,
+                        block_view* view)
+{
+    if (available < BLOCK_HEADER_SIZE || memcmp(data, kBlockMagic, sizeof(kBlockMagic)) != 0) {
+        return -1;
+    }
+
+    view->count = get_u32(data + 4);
+    view->raw_size = get_u32(data + 8);
+    const uint32_t stored_size = get_u32(data + 12);
+    const uint32_t crc = get_u32(data + 16);
+    if (stored_size > available - BLOCK_HEADER_SIZE || stored_size > view->raw_size) {
+        return -1;
+    }
+
+    const uint8_t* stored = data + BLOCK_HEADER_SIZE;
+    if (stored_size == view->raw_size) {
+        view->records = stored;
+    } else {
+        if (*scratch_capacity < view->raw_size) {
+            uint8_t* grown = realloc(*scratch, view->raw_size);
+            if (!grown) {
+                return -1;
+            }
+
+            *scratch = grown;
+            *scratch_capacity = view->raw_size;
+        }
+
+        uLongf raw_size = view->raw_size;
+        if (uncompress(*scratch, &raw_size, stored, stored_size) != Z_OK || raw_size != view->raw_size) {
+            return -1;
+        }
+
+        view->records = *scratch;
+    }
+
+    if (blip_get_kernels()->crc32(0, view->records, view->raw_size) != crc) {
+        return -1;
+    }
+
+    view->size = BLOCK_HEADER_SIZE + (size_t)stored_size;
+    return 0;
+}
+
+static int map_file(const char* path, const uint8_t** out, size_t* out_size)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+
+    *out = mapped;
+    *out_size = (size_t)st.st_size;
+    return 0;
+}
+
+// Seals a segment that a writer never closed, rebuilding its index from the blocks that made it
+// to disk in one piece and cutting off whatever follows them
+static int recover_segment(const char* directory, uint32_t number, const blip_archive_options* options)
+{
+    char path[MAX_PATH_SIZE];
+    segment_path(path, directory, number, "cbad");
+    const uint8_t* data = NULL;
+    size_t size = 0;
+    map_file(path, &data, &size);
+
+    segment_builder builder;
+    memset(&builder, 0, sizeof(builder));
+    uint8_t* scratch = NULL;
+    size_t scratch_capacity = 0;
+    size_t good_size = 0;
+    int retVal = 0;
+    if (data && size >= FILE_HEADER_SIZE && memcmp(data, kDataMagic, sizeof(kDataMagic)) == 0) {
+        good_size = FILE_HEADER_SIZE;
+        block_view block;
+        while (retVal == 0 && decode_block(data + good_size, size - good_size, &scratch, &scratch_capacity,
+                                           &block) == 0) {
+            record_view view;
+            size_t offset = 0;
+            for (uint32_t i = 0; i < block.count && retVal == 0; i++) {
+                if (!parse_record(block.records + offset, block.raw_size - offset, &view)) {
+                    break;
+                }
+
+                retVal = index_record(&builder, &view, (uint32_t)offset);
+                offset += view.size;
+            }
+
+            retVal = retVal == 0 ? add_block(&builder, good_size) : retVal;
+            good_size += block.size;
+        }
+    }
+
+    if (data) {
+        munmap((void*)data, size);
+    }
+
+    free(scratch);
+    report(options->report, options->report_context, "Recovering unsealed segment %s (%zu of %zu bytes intact)",
+           path, good_size, size);
+    if (retVal == 0 && good_size < size) {
+        retVal = truncate(path, (off_t)good_size);
+    }
+
+    // Not even the header made it, so start the file again
+    if (retVal == 0 && good_size == 0) {
+        uint8_t header[FILE_HEADER_SIZE] = {0};
+        memcpy(header, kDataMagic, sizeof(kDataMagic));
+        header[4] = BLIP_ARCHIVE_VERSION;
+        FILE* fout = fopen(path, "wb");
+        retVal = fout && fwrite(header, 1, sizeof(header), fout) == sizeof(header) ? 0 : -1;
+        retVal = fout && fclose(fout) != 0 ? -1 : retVal;
+    }
+
+    retVal = retVal == 0 ? write_index(directory, number, &builder, options) : retVal;
+    builder_reset(&builder);
+    return retVal;
+}
+
+void blip_archive_default_options(blip_archive_options* options)
+{
+    options->segment_size = DEFAULT_SEGMENT_SIZE;
+    options->block_size = DEFAULT_BLOCK_SIZE;
+    options->level = DEFAULT_LEVEL;
+    options->report = NULL;
+    options->report_context = NULL;
+}
+
+blip_archive_writer_t* blip_archive_writer_open(const char* directory, const blip_archive_options* options)
+{
+    blip_archive_options chosen;
+    if (options) {
+        chosen = *options;
+    } else {
+        blip_archive_default_options(&chosen);
+    }
+
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        report(chosen.report, chosen.report_context, "Unable to create %s", directory);
+        return NULL;
+    }
+
+    DIR* dir = opendir(directory);
+    if (!dir) {
+        report(chosen.report, chosen.report_context, "Unable to read %s", directory);
+        return NULL;
+    }
+
+    uint32_t last = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const uint32_t number = segment_number(entry->d_name, "cbad");
+        last = number > last ? number : last;
+    }
+
+    closedir(dir);
+    for (uint32_t number = 1; number <= last; number++) {
+        char data_path[MAX_PATH_SIZE];
+        char index_path[MAX_PATH_SIZE];
+        segment_path(data_path, directory, number, "cbad");
+        segment_path(index_path, directory, number, "cbai");
+        if (file_exists(data_path) && !file_exists(index_path) && recover_segment(directory, number, &chosen) < 0) {
+            return NULL;
+        }
+    }
+
+    blip_archive_writer_t* retVal = calloc(1, sizeof(blip_archive_writer_t));
+    if (!retVal || !(retVal->directory = strdup(directory))) {
+        free(retVal);
+        return NULL;
+    }
+
+    retVal->options = chosen;
+    // A block that doesn't fit the 32-bit sizes of its header is written as soon as it has a record
+    if (retVal->options.block_size == 0 || retVal->options.block_size > UINT32_MAX) {
+        retVal->options.block_size = UINT32_MAX;
+    }
+
+    retVal->segment = last + 1;
+    return retVal;
+}
+
+static int open_segment(blip_archive_writer_t* writer)
+{
+    char path[MAX_PATH_SIZE];
+    segment_path(path, writer->directory, writer->segment, "cbad");
+    writer->data = fopen(path, "wb");
+    if (!writer->data) {
+        report(writer->options.report, writer->options.report_context, "Unable to open %s for writing", path);
+        return -1;
+    }
+
+    setvbuf(writer->data, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    uint8_t header[FILE_HEADER_SIZE] = {0};
+    memcpy(header, kDataMagic, sizeof(kDataMagic));
+    header[4] = BLIP_ARCHIVE_VERSION;
+    writer->data_size = FILE_HEADER_SIZE;
+    return fwrite(header, 1, sizeof(header), writer->data) == sizeof(header) ? 0 : -1;
+}
+
+static int flush_block(blip_archive_writer_t* writer)
+{
+    if (writer->block_size == 0) {
+        return 0;
+    }
+
+    uLongf stored_size = compressBound(writer->block_size);
+    if (blip_reserve_output(&writer->stored, &writer->stored_capacity, 0, stored_size) < 0) {
+        return -1;
+    }
+
+    const uint8_t* stored = writer->stored;
+    if (compress2(writer->stored, &stored_size, writer->block, writer->block_size, writer->options.level) != Z_OK
+        || stored_size >= writer->block_size) {
+        stored = writer->block;
+        stored_size = writer->block_size;
+    }
+
+    uint8_t header[BLOCK_HEADER_SIZE];
+    memcpy(header, kBlockMagic, sizeof(kBlockMagic));
+    put_u32(header + 4, writer->builder.block_records);
+    put_u32(header + 8, (uint32_t)writer->block_size);
+    put_u32(header + 12, (uint32_t)stored_size);
+    put_u32(header + 16, blip_get_kernels()->crc32(0, writer->block, writer->block_size));
+    if (fwrite(header, 1, sizeof(header), writer->data) != sizeof(header)
+        || fwrite(stored, 1, stored_size, writer->data) != stored_size
+        || add_block(&writer->builder, writer->data_size) < 0) {
+        return -1;
+    }
+
+    writer->data_size += sizeof(header) + stored_size;
+    writer->block_size = 0;
+    return 0;
+}
+
+static int seal_segment(blip_archive_writer_t* writer)
+{
+    if (!writer->data) {
+        return 0;
+    }
+
+    int retVal = flush_block(writer);
+    if (retVal == 0 && (fflush(writer->data) != 0 || fsync(fileno(writer->data)) != 0)) {
+        retVal = -1;
+    }
+
+    if (fclose(writer->data) != 0) {
+        retVal = -1;
+    }
+
+    writer->data = NULL;
+    if (retVal == 0) {
+        retVal = write_index(writer->directory, writer->segment, &writer->builder, &writer->options);
+    }
+
+    builder_reset(&writer->builder);
+    writer->segment++;
+    return retVal;
+}
+
+static int add_doc_id(void* context, blip_slice_t doc_id)
+{
+    blip_archive_writer_t* writer = context;
+    if (writer->doc_count == writer->doc_capacity) {
+        const size_t capacity = writer->doc_capacity ? writer->doc_capacity * 2 : 16;
+        uint64_t* grown = realloc(writer->doc_keys, capacity * sizeof(uint64_t));
+        if (!grown) {
+            return -1;
+        }
+
+        writer->doc_keys = grown;
+        writer->doc_capacity = capacity;
+    }
+
+    writer->doc_keys[writer->doc_count++] = fnv64(doc_id.buf, doc_id.size);
+    return 0;
+}
+
+// Gathers the keys of the documents a message is about
+static int collect_doc_ids(blip_archive_writer_t* writer, const blip_message_t* msg)
+{
+    writer->doc_count = 0;
+    return blip_message_doc_ids(msg, add_doc_id, writer);
+}
+
+// Writes properties back out NUL separated, as they were on the wire
+static void put_wire_properties(uint8_t* out, const blip_message_t* msg, size_t size)
+{
+    memcpy(out, msg->properties, size);
+    const property_separators* separators = (const property_separators*)msg->private[6];
+    if (separators) {
+        for (uint32_t i = 0; i < separators->count; i++) {
+            out[separators->positions[i]] = 0;
+        }
+    } else if (size > 1) {
+        blip_get_kernels()->replace_byte(out, size - 1, ':', 0);
+    }
+}
+
+int blip_archive_append(blip_archive_writer_t* writer, const blip_message_t* msg, uint8_t direction,
+                        uint64_t timestamp_ns)
+{
+    if (writer->failed) {
+        return -1;
+    }
+
+    const bool is_ack = msg->type >= kAckRequestType;
+    const size_t properties_size = !is_ack && msg->properties ? strlen((const char*)msg->properties) + 1 : 0;
+    const size_t body_size = is_ack ? 0 : msg->body_size;
+    if (collect_doc_ids(writer, msg) < 0) {
+        return -1;
+    }
+
+    const uint64_t record_size = RECORD_HEADER_SIZE + (uint64_t)writer->doc_count * 8 + properties_size + body_size;
+    if (record_size > UINT32_MAX) {
+        report(writer->options.report, writer->options.report_context, "Message %llu is too large to archive",
+               (unsigned long long)msg->msg_no);
+        return -1;
+    }
+
+    if (writer->block_size > 0 && writer->block_size + record_size > writer->options.block_size
+        && flush_block(writer) < 0) {
+        writer->failed = true;
+        return -1;
+    }
+
+    if ((!writer->data && open_segment(writer) < 0)
+        || blip_reserve_output(&writer->block, &writer->block_capacity, writer->block_size, record_size) < 0) {
+        writer->failed = true;
+        return -1;
+    }
+
+    uint8_t* record = writer->block + writer->block_size;
+    put_u64(record, timestamp_ns);
+    put_u64(record + 8, msg->msg_no);
+    put_u32(record + 16, (uint32_t)properties_size);
+    put_u32(record + 20, (uint32_t)body_size);
+    record[24] = direction;
+    record[25] = (uint8_t)msg->type;
+    record[26] = (uint8_t)msg->flags;
+    record[27] = is_ack ? 2 : msg->calculated_checksum == msg->checksum;
+    put_u32(record + 28, (uint32_t)writer->doc_count);
+    uint8_t* pos = record + RECORD_HEADER_SIZE;
+    for (size_t i = 0; i < writer->doc_count; i++, pos += 8) {
+        put_u64(pos, writer->doc_keys[i]);
+    }
+
+    if (properties_size > 0) {
+        put_wire_properties(pos, msg, properties_size);
+        pos += properties_size;
+    }
+
+    if (body_size > 0) {
+        memcpy(pos, msg->body, body_size);
+    }
+
+    record_view view;
+    parse_record(record, record_size, &view);
+    if (index_record(&writer->builder, &view, (uint32_t)writer->block_size) < 0) {
+        writer->failed = true;
+        return -1;
+    }
+
+    writer->block_size += record_size;
+    if (writer->block_size >= writer->options.block_size && flush_block(writer) < 0) {
+        writer->failed = true;
+        return -1;
+    }
+
+    if (writer->data_size >= writer->options.segment_size && seal_segment(writer) < 0) {
+        writer->failed = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+int blip_archive_writer_close(blip_archive_writer_t* writer)
+{
+    if (!writer) {
+        return 0;
+    }
+
+    int retVal = writer->failed ? -1 : 0;
+    if (writer->data) {
+        // Even after a failure, seal what made it to disk so far
+        retVal |= seal_segment(writer);
+    }
+
+    builder_reset(&writer->builder);
+    free(writer->directory);
+    free(writer->block);
+    free(writer->stored);
+    free(writer->doc_keys);
+    free(writer);
+    return retVal < 0 ? -1 : 0;
+}
+
+/************
+ * Querying *
+ ************/
+
+static void unmap_segment(segment_map* segment)
+{
+    if (segment->index) {
+        munmap((void*)segment->index, segment->index_size);
+    }
+
+    if (segment->data) {
+        munmap((void*)segment->data, segment->data_size);
+    }
+}
+
+// Maps the index and data files of a sealed segment, checking that the index is in one piece
+static int map_segment(const char* directory, uint32_t number, segment_map* segment)
+{
+    char path[MAX_PATH_SIZE];
+    memset(segment, 0, sizeof(segment_map));
+    segment->number = number;
+    segment_path(path, directory, number, "cbai");
+    if (map_file(path, &segment->index, &segment->index_size) < 0) {
+        return -1;
+    }
+
+    const uint8_t* index = segment->index;
+    if (segment->index_size < INDEX_HEADER_SIZE || memcmp(index, kIndexMagic, sizeof(kIndexMagic)) != 0
+        || index[4] != BLIP_ARCHIVE_VERSION) {
+        return -1;
+    }
+
+    segment->block_count = get_u64(index + 16);
+    segment->first_ns = get_u64(index + 24);
+    segment->last_ns = get_u64(index + 32);
+    segment->blocks = index + INDEX_HEADER_SIZE;
+    if (segment->block_count > (segment->index_size - INDEX_HEADER_SIZE) / BLOCK_INFO_SIZE) {
+        return -1;
+    }
+
+    for (int i = 0; i < kIndexCount; i++) {
+        const uint64_t offset = get_u64(index + 40 + i * 16);
+        segment->entry_counts[i] = get_u64(index + 48 + i * 16);
+        if (offset > segment->index_size || segment->entry_counts[i] > (segment->index_size - offset) / ENTRY_SIZE) {
+            return -1;
+        }
+
+        segment->entries[i] = index + offset;
+    }
+
+    // A segment with no blocks may have nothing but its header
+    segment_path(path, directory, number, "cbad");
+    if (segment->block_count > 0 && map_file(path, &segment->data, &segment->data_size) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compare_segments(const void* a, const void* b)
+{
+    const uint32_t x = ((const segment_map*)a)->number;
+    const uint32_t y = ((const segment_map*)b)->number;
+    return x < y ? -1 : x > y;
+}
+
+blip_archive_t* blip_archive_open(const char* directory, blip_archive_report report_to, void* context)
+{
+    DIR* dir = opendir(directory);
+    if (!dir) {
+        report(report_to, context, "Unable to read %s", directory);
+        return NULL;
+    }
+
+    blip_archive_t* retVal = calloc(1, sizeof(blip_archive_t));
+    if (retVal) {
+        retVal->report = report_to;
+        retVal->report_context = context;
+    }
+
+    size_t capacity = 0;
+    struct dirent* entry;
+    while (retVal && (entry = readdir(dir)) != NULL) {
+        const uint32_t number = segment_number(entry->d_name, "cbai");
+        if (number == 0) {
+            continue;
+        }
+
+        if (retVal->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            segment_map* grown = realloc(retVal->segments, capacity * sizeof(segment_map));
+            if (!grown) {
+                blip_archive_close(retVal);
+                retVal = NULL;
+                break;
+            }
+
+            retVal->segments = grown;
+        }
+
+        segment_map* segment = &retVal->segments[retVal->count];
+        if (map_segment(directory, number, segment) < 0) {
+            report(report_to, context, "Skipping damaged segment %08u of %s", number, directory);
+            unmap_segment(segment);
+            continue;
+        }
+
+        retVal->count++;
+    }
+
+    closedir(dir);
+    if (retVal && retVal->count > 1) {
+        qsort(retVal->segments, retVal->count, sizeof(segment_map), compare_segments);
+    }
+
+    return retVal;
+}
+
+typedef struct {
+    const blip_archive_t* archive;
+    const blip_archive_query_t* query;
+    uint64_t until_ns;
+    uint64_t doc_key;
+    blip_archive_visit visit;
+    void* context;
+    int64_t visited;
+    bool stopped;
+
+    uint8_t* scratch;
+    size_t scratch_capacity;
+    const segment_map* block_segment;   // The block that was decoded last
+    uint64_t block_number;
+    block_view block;
+} query_state;
+
+static const block_view* load_block(query_state* state, const segment_map* segment, uint64_t number)
+{
+    if (state->block_segment == segment && state->block_number == number) {
+        return &state->block;
+    }
+
+    state->block_segment = NULL;
+    const uint64_t offset = number < segment->block_count ? get_u64(segment->blocks + number * BLOCK_INFO_SIZE)
+                                                          : UINT64_MAX;
+    if (offset >= segment->data_size
+        || decode_block(segment->data + offset, segment->data_size - offset, &state->scratch,
+                        &state->scratch_capacity, &state->block) < 0) {
+        report(state->archive->report, state->archive->report_context, "Block %llu of archive segment %08u is damaged",
+               (unsigned long long)number, segment->number);
+        return NULL;
+    }
+
+    state->block_segment = segment;
+    state->block_number = number;
+    return &state->block;
+}
+
+static bool record_matches(const query_state* state, const record_view* view)
+{
+    const blip_archive_query_t* query = state->query;
+    const blip_archive_record_t* record = &view->record;
+    if (record->timestamp_ns < query->since_ns || record->timestamp_ns >= state->until_ns
+        || (query->match_msg_no && record->msg_no != query->msg_no)) {
+        return false;
+    }
+
+    if (query->profile) {
+        const uint8_t* profile;
+        size_t profile_size;
+        if (!blip_find_wire_property(record->properties, record->properties_size, "Profile", 7, &profile,
+                                     &profile_size)
+            || profile_size != strlen(query->profile) || memcmp(profile, query->profile, profile_size) != 0) {
+            return false;
+        }
+    }
+
+    if (query->doc_id) {
+        // Doc IDs are only kept as keys, so a 64-bit hash collision would slip through
+        for (uint32_t i = 0; i < view->doc_count; i++) {
+            if (get_u64(view->doc_keys + i * 8) == state->doc_key) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+static void visit_record(query_state* state, const record_view* view)
+{
+    if (!record_matches(state, view)) {
+        return;
+    }
+
+    state->visited++;
+    if (state->visit(state->context, &view->record) != 0) {
+        state->stopped = true;
+    }
+}
+
+static int scan_segment(query_state* state, const segment_map* segment)
+{
+    for (uint64_t b = 0; b < segment->block_count && !state->stopped; b++) {
+        const uint8_t* info = segment->blocks + b * BLOCK_INFO_SIZE;
+        if (get_u64(info + 16) < state->query->since_ns || get_u64(info + 8) >= state->until_ns) {
+            continue;
+        }
+
+        const block_view* block = load_block(state, segment, b);
+        if (!block) {
+            return -1;
+        }
+
+        size_t offset = 0;
+        record_view view;
+        for (uint32_t i = 0; i < block->count && !state->stopped; i++) {
+            if (!parse_record(block->records + offset, block->raw_size - offset, &view)) {
+                return -1;
+            }
+
+            visit_record(state, &view);
+            offset += view.size;
+        }
+    }
+
+    return 0;
+}
+
+static int search_segment(query_state* state, const segment_map* segment, int index, uint64_t key)
+{
+    // Finds the first entry with the key, then walks the run of them
+    const uint8_t* entries = segment->entries[index];
+    uint64_t low = 0;
+    uint64_t high = segment->entry_counts[index];
+    while (low < high) {
+        const uint64_t mid = low + (high - low) / 2;
+        if (get_u64(entries + mid * ENTRY_SIZE) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    uint32_t last_block = UINT32_MAX;
+    uint32_t last_offset = UINT32_MAX;
+    for (uint64_t i = low; i < segment->entry_counts[index] && !state->stopped; i++) {
+        const uint8_t* entry = entries + i * ENTRY_SIZE;
+        if (get_u64(entry) != key) {
+            break;
+        }
+
+        const uint64_t ts = get_u64(entry + 8);
+        const uint32_t block_number = get_u32(entry + 16);
+        const uint32_t offset = get_u32(entry + 20);
+        if (ts < state->query->since_ns || ts >= state->until_ns
+            || (block_number == last_block && offset == last_offset)) {
+            continue;
+        }
+
+        last_block = block_number;
+        last_offset = offset;
+        const block_view* block = load_block(state, segment, block_number);
+        record_view view;
+        if (!block || offset >= block->raw_size
+            || !parse_record(block->records + offset, block->raw_size - offset, &view)) {
+            return -1;
+        }
+
+        visit_record(state, &view);
+    }
+
+    return 0;
+}
+
+int64_t blip_archive_query(const blip_archive_t* archive, const blip_archive_query_t* query,
+                           blip_archive_visit visit, void* context)
+{
+    query_state state;
+    memset(&state, 0, sizeof(state));
+    state.archive = archive;
+    state.query = query;
+    state.until_ns = query->until_ns ? query->until_ns : UINT64_MAX;
+    state.visit = visit;
+    state.context = context;
+
+    int index = -1;
+    uint64_t key = 0;
+    if (query->doc_id) {
+        index = kIndexDocId;
+        key = state.doc_key = fnv64((const uint8_t*)query->doc_id, strlen(query->doc_id));
+    } else if (query->match_msg_no) {
+        index = kIndexMsgNo;
+        key = query->msg_no;
+    } else if (query->profile) {
+        index = kIndexProfile;
+        key = fnv64((const uint8_t*)query->profile, strlen(query->profile));
+    }
+
+    int retVal = 0;
+    for (size_t i = 0; i < archive->count && retVal == 0 && !state.stopped; i++) {
+        const segment_map* segment = &archive->segments[i];
+        if (segment->block_count == 0 || segment->last_ns < query->since_ns || segment->first_ns >= state.until_ns) {
+            continue;
+        }
+
+        retVal = index < 0 ? scan_segment(&state, segment) : search_segment(&state, segment, index, key);
+    }
+
+    free(state.scratch);
+    return retVal < 0 ? -1 : state.visited;
+}
+
+int blip_archive_record_get_property(const blip_archive_record_t* record, const char* key, const uint8_t** value,
+                                     size_t* value_size)
+{
+    return blip_find_wire_property(record->properties, record->properties_size, key, strlen(key), value, value_size)
+           ? 0 : -1;
+}
+
+void blip_archive_close(blip_archive_t* archive)
+{
+    if (!archive) {
+        return;
+    }
+
+    for (size_t i = 0; i < archive->count; i++) {
+        unmap_segment(&archive->segments[i]);
+    }
+
+    free(archive->segments);
+    free(archive);
+}
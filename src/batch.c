@@ -0,0 +1,165 @@
+//
+//  batch.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_batch.h"
+#include "msg_handler.h"
+#include "types.h"
+#include "varint.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_INITIAL_CAPACITY 4096
+#define BATCH_MAX_PREFIX 10     // Both a varint and a WebSocket header fit in this much
+#define WS_BINARY_FIN 0x82
+
+struct blip_batch
+{
+    blip_connection_t* connection;
+    blip_batch_framing framing;
+    size_t flush_bytes;
+    size_t flush_count;
+    blip_batch_write write;
+    void* context;
+
+    uint8_t* buf;
+    size_t capacity;
+    size_t used;
+    size_t count;
+};
+
+// Writes the delimiter for a frame of the given size, returning its length
+static size_t put_prefix(blip_batch_framing framing, uint8_t* dst, size_t size)
+{
+    if (framing == kBlipBatchLengthPrefixed) {
+        return PutUVarInt(dst, size);
+    }
+
+    dst[0] = WS_BINARY_FIN;
+    if (size < 126) {
+        dst[1] = (uint8_t)size;
+        return 2;
+    }
+
+    if (size <= UINT16_MAX) {
+        dst[1] = 126;
+        dst[2] = (uint8_t)(size >> 8);
+        dst[3] = (uint8_t)size;
+        return 4;
+    }
+
+    dst[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        dst[2 + i] = (uint8_t)((uint64_t)size >> (56 - 8 * i));
+    }
+
+    return 10;
+}
+
+blip_batch_t* blip_batch_new(blip_connection_t* connection, blip_batch_framing framing,
+                             size_t flush_bytes, size_t flush_count,
+                             blip_batch_write write, void* context)
+{
+    if (!connection || !write) {
+        return NULL;
+    }
+
+    blip_batch_t* retVal = calloc(1, sizeof(blip_batch_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->capacity = flush_bytes > BATCH_INITIAL_CAPACITY ? flush_bytes : BATCH_INITIAL_CAPACITY;
+    retVal->buf = malloc(retVal->capacity);
+    if (!retVal->buf) {
+        free(retVal);
+        return NULL;
+    }
+
+    retVal->connection = connection;
+    retVal->framing = framing;
+    retVal->flush_bytes = flush_bytes;
+    retVal->flush_count = flush_count;
+    retVal->write = write;
+    retVal->context = context;
+    return retVal;
+}
+
+int blip_batch_add(blip_batch_t* batch, blip_message_t* msg)
+{
+    // Serialize past the largest possible delimiter, then slide the frame back once its size
+    // (and so the real delimiter length) is known
+    const size_t start = batch->used;
+    if (blip_reserve_output(&batch->buf, &batch->capacity, start, BATCH_MAX_PREFIX) < 0) {
+        return -1;
+    }
+
+    size_t used = start + BATCH_MAX_PREFIX;
+    if (serialize_msg_append(batch->connection, msg, &batch->buf, &batch->capacity, &used, true) < 0) {
+        return -1;
+    }
+
+    const size_t frame_size = used - start - BATCH_MAX_PREFIX;
+    const size_t prefix_size = put_prefix(batch->framing, batch->buf + start, frame_size);
+    if (prefix_size < BATCH_MAX_PREFIX) {
+        memmove(batch->buf + start + prefix_size, batch->buf + start + BATCH_MAX_PREFIX, frame_size);
+    }
+
+    batch->used = start + prefix_size + frame_size;
+    batch->count++;
+    if ((batch->flush_bytes && batch->used >= batch->flush_bytes)
+        || (batch->flush_count && batch->count >= batch->flush_count)) {
+        // The message is in the batch (and the connection has moved past it) either way
+        return blip_batch_flush(batch) < 0 ? 1 : 0;
+    }
+
+    return 0;
+}
+
+int blip_batch_flush(blip_batch_t* batch)
+{
+    if (batch->used == 0) {
+        return 0;
+    }
+
+    if (batch->write(batch->context, batch->buf, batch->used) < 0) {
+        return -1;
+    }
+
+    batch->used = 0;
+    batch->count = 0;
+    return 0;
+}
+
+size_t blip_batch_pending(const blip_batch_t* batch, size_t* count)
+{
+    if (count) {
+        *count = batch->count;
+    }
+
+    return batch->used;
+}
+
+void blip_batch_free(blip_batch_t* batch)
+{
+    if (!batch) {
+        return;
+    }
+
+    free(batch->buf);
+    free(batch);
+}
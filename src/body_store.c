@@ -0,0 +1,418 @@
+//
+//  body_store.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "cblip_body_store.h"
+#include "xxhash.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#include <time.h>
+#endif
+
+#define INITIAL_BUCKETS 256
+#define SPIN_LIMIT 256
+
+struct blip_body_ref
+{
+    uint64_t hash;
+    size_t size;
+    uint64_t refs;
+    bool shared;                    // Whether it is in the table (a body whose hash collided isn't)
+    blip_body_ref_t* chain;         // The next body in the same bucket
+    blip_body_ref_t* idle_prev;     // Neighbours in the idle list while nothing references it, or
+    blip_body_ref_t* idle_next;     // in the private list for a body that isn't shared
+    uint8_t data[];
+};
+
+struct blip_body_store
+{
+    atomic_flag lock;
+    size_t budget;
+    blip_body_ref_t** buckets;
+    size_t bucket_mask;
+    blip_body_ref_t* idle_head;     // Released longest ago, evicted first
+    blip_body_ref_t* idle_tail;
+    blip_body_ref_t* private_head;  // Bodies kept apart after a hash collision, freed with the store
+    blip_body_store_stats_t stats;
+    atomic_uint_fast64_t hits;      // Counted outside the lock, once the bytes have been compared
+};
+
+// Spins for a while, then yields, then sleeps, so that a waiter doesn't keep a core busy while
+// the holder of the lock isn't running
+static void backoff(unsigned* spins)
+{
+    if (*spins < SPIN_LIMIT) {
+        (*spins)++;
+    } else if (*spins < 2 * SPIN_LIMIT) {
+        (*spins)++;
+#if defined(_WIN32)
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    } else {
+#if defined(_WIN32)
+        Sleep(1);
+#else
+        const struct timespec pause = {0, 50000};
+        nanosleep(&pause, NULL);
+#endif
+    }
+}
+
+static void lock(blip_body_store_t* store)
+{
+    unsigned spins = 0;
+    while (atomic_flag_test_and_set_explicit(&store->lock, memory_order_acquire)) {
+        backoff(&spins);
+    }
+}
+
+static void unlock(blip_body_store_t* store)
+{
+    atomic_flag_clear_explicit(&store->lock, memory_order_release);
+}
+
+blip_body_store_t* blip_body_store_new(size_t budget_bytes)
+{
+    blip_body_store_t* retVal = calloc(1, sizeof(blip_body_store_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->buckets = calloc(INITIAL_BUCKETS, sizeof(blip_body_ref_t*));
+    if (!retVal->buckets) {
+        free(retVal);
+        return NULL;
+    }
+
+    atomic_flag_clear(&retVal->lock);
+    atomic_init(&retVal->hits, 0);
+    retVal->budget = budget_bytes;
+    retVal->bucket_mask = INITIAL_BUCKETS - 1;
+    return retVal;
+}
+
+static void idle_unlink(blip_body_store_t* store, blip_body_ref_t* ref)
+{
+    if (ref->idle_prev) {
+        ref->idle_prev->idle_next = ref->idle_next;
+    } else {
+        store->idle_head = ref->idle_next;
+    }
+
+    if (ref->idle_next) {
+        ref->idle_next->idle_prev = ref->idle_prev;
+    } else {
+        store->idle_tail = ref->idle_prev;
+    }
+
+    ref->idle_prev = ref->idle_next = NULL;
+    store->stats.idle_bytes -= ref->size;
+}
+
+static void idle_append(blip_body_store_t* store, blip_body_ref_t* ref)
+{
+    ref->idle_prev = store->idle_tail;
+    ref->idle_next = NULL;
+    if (store->idle_tail) {
+        store->idle_tail->idle_next = ref;
+    } else {
+        store->idle_head = ref;
+    }
+
+    store->idle_tail = ref;
+    store->stats.idle_bytes += ref->size;
+}
+
+static void count_ref(blip_body_store_t* store, const blip_body_ref_t* ref)
+{
+    store->stats.references++;
+    store->stats.referenced_bytes += ref->size;
+}
+
+// Takes another reference on behalf of a caller, bringing the body back from the idle list if
+// that is where it was
+static void add_ref(blip_body_store_t* store, blip_body_ref_t* ref)
+{
+    if (ref->refs++ == 0 && ref->shared) {
+        idle_unlink(store, ref);
+    }
+
+    count_ref(store, ref);
+}
+
+static blip_body_ref_t* find(const blip_body_store_t* store, uint64_t hash, size_t size)
+{
+    blip_body_ref_t* ref = store->buckets[hash & store->bucket_mask];
+    while (ref && (ref->hash != hash || ref->size != size)) {
+        ref = ref->chain;
+    }
+
+    return ref;
+}
+
+static void grow(blip_body_store_t* store)
+{
+    const size_t bucket_count = (store->bucket_mask + 1) * 2;
+    blip_body_ref_t** buckets = calloc(bucket_count, sizeof(blip_body_ref_t*));
+    if (!buckets) {
+        // Longer chains are slower, not wrong
+        return;
+    }
+
+    for (size_t i = 0; i <= store->bucket_mask; i++) {
+        blip_body_ref_t* ref = store->buckets[i];
+        while (ref) {
+            blip_body_ref_t* next = ref->chain;
+            const size_t bucket = ref->hash & (bucket_count - 1);
+            ref->chain = buckets[bucket];
+            buckets[bucket] = ref;
+            ref = next;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucket_mask = bucket_count - 1;
+}
+
+static void remove_from_table(blip_body_store_t* store, blip_body_ref_t* ref)
+{
+    blip_body_ref_t** link = &store->buckets[ref->hash & store->bucket_mask];
+    while (*link != ref) {
+        link = &(*link)->chain;
+    }
+
+    *link = ref->chain;
+    store->stats.distinct--;
+    store->stats.stored_bytes -= ref->size;
+}
+
+// Drops idle bodies, oldest first, until the store is within its budget.  They are returned
+// chained together, to be freed once the lock is let go.
+static blip_body_ref_t* evict(blip_body_store_t* store)
+{
+    blip_body_ref_t* retVal = NULL;
+    while (store->stats.stored_bytes > store->budget && store->idle_head) {
+        blip_body_ref_t* victim = store->idle_head;
+        idle_unlink(store, victim);
+        remove_from_table(store, victim);
+        store->stats.evictions++;
+        victim->chain = retVal;
+        retVal = victim;
+    }
+
+    return retVal;
+}
+
+static void free_chain(blip_body_ref_t* ref)
+{
+    while (ref) {
+        blip_body_ref_t* next = ref->chain;
+        free(ref);
+        ref = next;
+    }
+}
+
+static blip_body_ref_t* new_ref(const uint8_t* data, size_t size, uint64_t hash, bool shared)
+{
+    blip_body_ref_t* retVal = malloc(sizeof(blip_body_ref_t) + size);
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->hash = hash;
+    retVal->size = size;
+    retVal->refs = 1;
+    retVal->shared = shared;
+    retVal->chain = retVal->idle_prev = retVal->idle_next = NULL;
+    if (size > 0) {
+        memcpy(retVal->data, data, size);
+    }
+
+    return retVal;
+}
+
+// Checks a body found by its hash against the one being interned, outside the lock (the
+// reference already taken keeps it from being evicted meanwhile)
+static blip_body_ref_t* confirm(blip_body_store_t* store, blip_body_ref_t* found, const uint8_t* data, size_t size,
+                                uint64_t hash)
+{
+    if (size == 0 || memcmp(found->data, data, size) == 0) {
+        atomic_fetch_add_explicit(&store->hits, 1, memory_order_relaxed);
+        return found;
+    }
+
+    // A 64-bit collision: keep this body to itself rather than displace the other
+    blip_body_ref_release(store, found);
+    blip_body_ref_t* retVal = new_ref(data, size, hash, false);
+    if (retVal) {
+        lock(store);
+        retVal->idle_next = store->private_head;
+        if (store->private_head) {
+            store->private_head->idle_prev = retVal;
+        }
+
+        store->private_head = retVal;
+        store->stats.misses++;
+        count_ref(store, retVal);
+        unlock(store);
+    }
+
+    return retVal;
+}
+
+blip_body_ref_t* blip_body_store_intern(blip_body_store_t* store, const uint8_t* data, size_t size)
+{
+    const uint64_t hash = blip_xxh64(data, size, 0);
+    lock(store);
+    blip_body_ref_t* found = find(store, hash, size);
+    if (found) {
+        add_ref(store, found);
+        unlock(store);
+        return confirm(store, found, data, size, hash);
+    }
+
+    unlock(store);
+    blip_body_ref_t* created = new_ref(data, size, hash, true);
+    if (!created) {
+        return NULL;
+    }
+
+    // Another thread may have interned the same body while this one was copying it
+    lock(store);
+    found = find(store, hash, size);
+    if (found) {
+        add_ref(store, found);
+        unlock(store);
+        free(created);
+        return confirm(store, found, data, size, hash);
+    }
+
+    if (store->stats.distinct >= store->bucket_mask + 1) {
+        grow(store);
+    }
+
+    blip_body_ref_t** bucket = &store->buckets[hash & store->bucket_mask];
+    created->chain = *bucket;
+    *bucket = created;
+    store->stats.distinct++;
+    store->stats.stored_bytes += size;
+    store->stats.misses++;
+    count_ref(store, created);
+    blip_body_ref_t* evicted = evict(store);
+    unlock(store);
+    free_chain(evicted);
+    return created;
+}
+
+blip_body_ref_t* blip_body_store_retain_message(blip_body_store_t* store, const blip_message_t* msg)
+{
+    if (msg->type >= kAckRequestType) {
+        return NULL;
+    }
+
+    return blip_body_store_intern(store, msg->body, msg->body_size);
+}
+
+blip_body_ref_t* blip_body_ref_retain(blip_body_store_t* store, blip_body_ref_t* ref)
+{
+    lock(store);
+    add_ref(store, ref);
+    unlock(store);
+    return ref;
+}
+
+void blip_body_ref_release(blip_body_store_t* store, blip_body_ref_t* ref)
+{
+    if (!ref) {
+        return;
+    }
+
+    lock(store);
+    store->stats.references--;
+    store->stats.referenced_bytes -= ref->size;
+    blip_body_ref_t* evicted = NULL;
+    if (--ref->refs == 0) {
+        if (ref->shared) {
+            idle_append(store, ref);
+            evicted = evict(store);
+        } else {
+            if (ref->idle_prev) {
+                ref->idle_prev->idle_next = ref->idle_next;
+            } else {
+                store->private_head = ref->idle_next;
+            }
+
+            if (ref->idle_next) {
+                ref->idle_next->idle_prev = ref->idle_prev;
+            }
+
+            evicted = ref;
+            ref->chain = NULL;
+        }
+    }
+
+    unlock(store);
+    free_chain(evicted);
+}
+
+const uint8_t* blip_body_ref_data(const blip_body_ref_t* ref, size_t* size)
+{
+    *size = ref->size;
+    return ref->data;
+}
+
+uint64_t blip_body_ref_hash(const blip_body_ref_t* ref)
+{
+    return ref->hash;
+}
+
+void blip_body_store_get_stats(blip_body_store_t* store, blip_body_store_stats_t* stats)
+{
+    lock(store);
+    *stats = store->stats;
+    unlock(store);
+    stats->hits = atomic_load_explicit(&store->hits, memory_order_relaxed);
+}
+
+void blip_body_store_free(blip_body_store_t* store)
+{
+    if (!store) {
+        return;
+    }
+
+    for (size_t i = 0; i <= store->bucket_mask; i++) {
+        free_chain(store->buckets[i]);
+    }
+
+    while (store->private_head) {
+        blip_body_ref_t* next = store->private_head->idle_next;
+        free(store->private_head);
+        store->private_head = next;
+    }
+
+    free(store->buckets);
+    free(store);
+}
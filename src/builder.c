@@ -0,0 +1,167 @@
+//
+//  builder.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_builder.h"
+#include "cblip_endian.h"
+#include "cpu.h"
+#include "msg_handler.h"
+#include "types.h"
+#include <string.h>
+
+// Room in front of the payload for the message number, the flags and the properties length,
+// which are written back to front once their sizes are known
+#define BUILDER_HEADROOM (3 * kMaxVarintLen64)
+
+struct blip_message_builder
+{
+    MessageNo msg_no;
+    MessageType type;
+    FrameFlags flags;
+    bool begun;
+    bool in_body;
+
+    uint8_t* buf;               // The payload (properties then body) starts at BUILDER_HEADROOM
+    size_t capacity;
+    size_t used;
+    size_t properties_size;
+
+    uint8_t* compressed;        // Compressed frames are deflated into here
+    size_t compressed_capacity;
+};
+
+blip_message_builder_t* blip_message_builder_new(void)
+{
+    return calloc(1, sizeof(blip_message_builder_t));
+}
+
+int blip_message_builder_begin(blip_message_builder_t* builder, MessageNo msg_no, MessageType type,
+                               FrameFlags flags)
+{
+    if (type >= kAckRequestType || blip_reserve_output(&builder->buf, &builder->capacity, 0, BUILDER_HEADROOM) < 0) {
+        return -1;
+    }
+
+    builder->msg_no = msg_no;
+    builder->type = type;
+    builder->flags = flags & ~kTypeMask;
+    builder->begun = true;
+    builder->in_body = false;
+    builder->used = BUILDER_HEADROOM;
+    builder->properties_size = 0;
+    return 0;
+}
+
+static int append(blip_message_builder_t* builder, const void* data, size_t size)
+{
+    if (blip_reserve_output(&builder->buf, &builder->capacity, builder->used, size) < 0) {
+        return -1;
+    }
+
+    memcpy(builder->buf + builder->used, data, size);
+    builder->used += size;
+    return 0;
+}
+
+int blip_message_builder_add_property(blip_message_builder_t* builder, const char* key, const char* value)
+{
+    if (!builder->begun || builder->in_body) {
+        return -1;
+    }
+
+    // Each key and value is followed by a NUL, which makes the last one the terminator
+    const size_t start = builder->used;
+    if (append(builder, key, strlen(key) + 1) < 0 || append(builder, value, strlen(value) + 1) < 0) {
+        builder->used = start;
+        return -1;
+    }
+
+    builder->properties_size += builder->used - start;
+    return 0;
+}
+
+int blip_message_builder_append_body(blip_message_builder_t* builder, const void* data, size_t size)
+{
+    if (!builder->begun) {
+        return -1;
+    }
+
+    builder->in_body = true;
+    return size > 0 ? append(builder, data, size) : 0;
+}
+
+const uint8_t* blip_message_builder_finish(blip_message_builder_t* builder, blip_connection_t* connection,
+                                           size_t* out_size)
+{
+    if (!builder->begun) {
+        return NULL;
+    }
+
+    const uint8_t* properties = builder->buf + BUILDER_HEADROOM;
+    const size_t prop_size = builder->properties_size;
+    const size_t body_size = builder->used - BUILDER_HEADROOM - prop_size;
+    const size_t prop_size_len = SizeOfVarInt(prop_size);
+    FrameFlags flags = builder->flags;
+    if (flags & kCompressed) {
+        if (prop_size_len + prop_size + body_size >= connection->compression.min_size) {
+            size_t used = 0;
+            int32_t checksum;
+            if (serialize_wire_append(connection, builder->msg_no, builder->type, &flags, properties, prop_size,
+                                      properties + prop_size, body_size, &builder->compressed,
+                                      &builder->compressed_capacity, &used, true, &checksum) < 0) {
+                return NULL;
+            }
+
+            builder->begun = false;
+            *out_size = used;
+            return builder->compressed;
+        }
+
+        flags &= ~kCompressed;
+    }
+
+    if (blip_reserve_output(&builder->buf, &builder->capacity, builder->used, BLIP_BODY_CHECKSUM_SIZE) < 0) {
+        return NULL;
+    }
+
+    // The payload is already in place, so only the header goes in front of it
+    uint8_t* payload = builder->buf + BUILDER_HEADROOM - prop_size_len;
+    uint8_t* start = payload - SizeOfVarInt(builder->msg_no) - SizeOfVarInt(flags | builder->type);
+    PutUVarInt(payload, prop_size);
+    uint8_t* pos = put_varint(builder->msg_no, start);
+    put_varint(flags | builder->type, pos);
+
+    const uint32_t crc = blip_get_kernels()->crc32(connection->crc_out, payload,
+                                                   builder->buf + builder->used - payload);
+    const int32_t encoded = _encBig32(crc);
+    memcpy(builder->buf + builder->used, &encoded, BLIP_BODY_CHECKSUM_SIZE);
+    connection->crc_out = crc;
+    builder->begun = false;
+    *out_size = builder->buf + builder->used + BLIP_BODY_CHECKSUM_SIZE - start;
+    return start;
+}
+
+void blip_message_builder_free(blip_message_builder_t* builder)
+{
+    if (!builder) {
+        return;
+    }
+
+    free(builder->buf);
+    free(builder->compressed);
+    free(builder);
+}
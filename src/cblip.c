@@ -17,8 +17,11 @@
 // 
 
 #include "cblip.h"
+#include "cblip_json.h"
+#include "cblip_stats.h"
 #include "ack_handler.h"
-#include "msg_handler.h"
+#include "decode.h"
+#include "cpu.h"
 #include "hashset.h"
 #include "types.h"
 #include <stdlib.h>
@@ -31,97 +34,338 @@ static const char* const kMessageTypeNames[] = {
     "ACKREQ", "AKRES", "?6?", "?7?"
 };
 
-blip_connection_t* blip_connection_new()
+// zlib allocations carry their size in front, so the connection knows what its streams hold
+#define ZLIB_ALLOC_HEADER 16
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+    blip_connection_t* connection = (blip_connection_t*)opaque;
+    const size_t bytes = (size_t)items * size;
+    uint8_t* block = malloc(bytes + ZLIB_ALLOC_HEADER);
+    if (!block) {
+        return Z_NULL;
+    }
+
+    memcpy(block, &bytes, sizeof(size_t));
+    connection->zlib_bytes += bytes;
+    return block + ZLIB_ALLOC_HEADER;
+}
+
+static void zlib_free(voidpf opaque, voidpf address)
 {
-    blip_connection_t* retVal = malloc(sizeof(blip_connection_t));
+    blip_connection_t* connection = (blip_connection_t*)opaque;
+    uint8_t* block = (uint8_t*)address - ZLIB_ALLOC_HEADER;
+    size_t bytes;
+    memcpy(&bytes, block, sizeof(size_t));
+    connection->zlib_bytes -= bytes;
+    free(block);
+}
+
+static z_stream* new_stream(blip_connection_t* connection)
+{
+    z_stream* retVal = calloc(1, sizeof(z_stream));
     if (!retVal) {
         return NULL;
     }
 
-    retVal->decompress_stream = malloc(sizeof(z_stream));
-    retVal->recompress_stream = malloc(sizeof(z_stream));
-    if (!retVal->decompress_stream || !retVal->recompress_stream) {
+    retVal->zalloc = zlib_alloc;
+    retVal->zfree = zlib_free;
+    retVal->opaque = connection;
+    return retVal;
+}
+
+z_stream* blip_connection_inflater(blip_connection_t* connection)
+{
+    if (connection->decompress_stream) {
+        return connection->decompress_stream;
+    }
+
+    // The peer picks the window size, so the largest one has to be allowed for
+    z_stream* stream = new_stream(connection);
+    if (!stream || inflateInit2(stream, -MAX_WBITS) != Z_OK) {
+        free(stream);
         return NULL;
     }
 
-    memset(retVal->decompress_stream, 0, sizeof(z_stream));
-    memset(retVal->recompress_stream, 0, sizeof(z_stream));
-    int err = inflateInit2(retVal->decompress_stream, -MAX_WBITS);
-    if (err != Z_OK) {
+    connection->decompress_stream = stream;
+    return stream;
+}
+
+z_stream* blip_connection_deflater(blip_connection_t* connection)
+{
+    if (connection->recompress_stream) {
+        return connection->recompress_stream;
+    }
+
+    const blip_compression_options* options = &connection->compression;
+    z_stream* stream = new_stream(connection);
+    if (!stream || deflateInit2(stream, options->level, Z_DEFLATED, -options->window_bits, options->mem_level,
+                                options->strategy) != Z_OK) {
+        free(stream);
         return NULL;
     }
 
-    err = deflateInit2(retVal->recompress_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, MAX_MEM_LEVEL,
-                         Z_DEFAULT_STRATEGY);
-    if (err != Z_OK) {
+    connection->recompress_stream = stream;
+    return stream;
+}
+
+void blip_connection_release_streams(blip_connection_t* connection, bool inflater, bool deflater)
+{
+    if (inflater && connection->decompress_stream) {
+        inflateEnd(connection->decompress_stream);
+        free(connection->decompress_stream);
+        connection->decompress_stream = NULL;
+    }
+
+    if (deflater && connection->recompress_stream) {
+        deflateEnd(connection->recompress_stream);
+        free(connection->recompress_stream);
+        connection->recompress_stream = NULL;
+    }
+}
+
+blip_connection_t* blip_connection_new()
+{
+    // Pick the CPU specific kernels up front rather than in the middle of the first message
+    blip_get_kernels();
+
+    // The zlib streams are only created once something compressed goes by in their direction,
+    // since most connections a monitor follows never need the (much larger) deflate side
+    blip_connection_t* retVal = calloc(1, sizeof(blip_connection_t));
+    if (!retVal) {
         return NULL;
     }
 
     retVal->started_msg_set = hashset_create();
     if (!retVal->started_msg_set) {
+        free(retVal);
         return NULL;
     }
 
-    retVal->crc = 0;
-    retVal->crc_out = 0;
+    retVal->compression.level = Z_DEFAULT_COMPRESSION;
+    retVal->compression.strategy = Z_DEFAULT_STRATEGY;
+    retVal->compression.mem_level = MAX_MEM_LEVEL;
+    retVal->compression.window_bits = MAX_WBITS;
+    retVal->compression.min_size = 0;
     return retVal;
 }
 
 void blip_connection_free(blip_connection_t* connection)
 {
+    if (connection->stats) {
+        // The aggregates are keyed by the connection's address, which may be handed out again
+        blip_stats_forget_connection(connection->stats, connection);
+    }
+
+    blip_connection_release_streams(connection, true, true);
     hashset_destroy(connection->started_msg_set);
-    inflateEnd(connection->decompress_stream);
-    free(connection->decompress_stream);
+    free(connection->client);
     free(connection);
 }
 
+int blip_connection_set_compression(blip_connection_t* connection, const blip_compression_options* options)
+{
+    // zlib refuses 8 bit windows for raw deflate
+    if (options->level < Z_DEFAULT_COMPRESSION || options->level > Z_BEST_COMPRESSION
+        || options->strategy < Z_DEFAULT_STRATEGY || options->strategy > Z_FIXED
+        || options->window_bits < 9 || options->window_bits > MAX_WBITS
+        || options->mem_level < 1 || options->mem_level > MAX_MEM_LEVEL) {
+        return -1;
+    }
+
+    // The next compressed message starts a new deflate stream with these settings
+    blip_connection_release_streams(connection, false, true);
+    connection->compression = *options;
+    return 0;
+}
+
+size_t blip_connection_memory_usage(const blip_connection_t* connection)
+{
+    size_t retVal = sizeof(blip_connection_t) + connection->zlib_bytes;
+    retVal += connection->decompress_stream ? sizeof(z_stream) : 0;
+    retVal += connection->recompress_stream ? sizeof(z_stream) : 0;
+    retVal += sizeof(struct hashset_st) + connection->started_msg_set->capacity * sizeof(size_t);
+    return retVal;
+}
+
 blip_message_t* blip_message_new() {
     return calloc(1, sizeof(blip_message_t));
 }
 
-blip_message_t* blip_message_read(const blip_connection_t* connection, uint8_t* data, size_t size)
+// Copies a raw frame into the frame buffer of a message, reusing the buffer when it is big enough
+static int frame_store(blip_message_t* msg, const blip_connection_t* connection, const uint8_t* data, size_t size)
 {
-    blip_message_t* retVal = malloc(sizeof(blip_message_t));
+    uint8_t* frame = (uint8_t*)msg->private[3];
+    size_t capacity = (size_t)msg->private[8];
+    if (blip_reserve_output(&frame, &capacity, 0, size ? size : 1) < 0) {
+        return -1;
+    }
+
+    memcpy(frame, data, size);
+    msg->private[3] = (uint64_t)frame;
+    msg->private[8] = capacity;
+    msg->private[0] = (uint64_t)connection;
+    msg->private[7] = size;
+    return 0;
+}
+
+blip_message_t* frame_copy(const blip_connection_t* connection, const uint8_t* data, size_t size)
+{
+    blip_message_t* retVal = calloc(1, sizeof(blip_message_t));
     if (!retVal) {
         return NULL;
     }
 
-    retVal->private[3] = (uint64_t)malloc(size);
-    if(!retVal->private[3]) {
+    if (frame_store(retVal, connection, data, size) < 0) {
+        free(retVal);
         return NULL;
     }
 
-    memcpy((void *)retVal->private[3], data, size);
-    retVal->private[0] = (uint64_t)connection;
-    retVal->private[2] = 0;
-    uint8_t* pos = (uint8_t *)retVal->private[3];
+    return retVal;
+}
+
+static int frame_decode_ordered_inflated(blip_message_t* msg, size_t size, const uint8_t* inflated,
+                                        size_t inflated_size, frame_state* state)
+{
+    uint8_t* pos = (uint8_t *)msg->private[3];
     size_t rem = size;
+    state->size = size;
 
-    pos = get_varint(pos, &rem, &retVal->msg_no);
-    uint64_t rawFlags;
+    pos = get_varint(pos, &rem, &msg->msg_no);
+    uint64_t rawFlags = 0;
     pos = get_varint(pos, &rem, &rawFlags);
-    retVal->flags = (FrameFlags)(rawFlags & ~kTypeMask);
-    retVal->type = (MessageType)(rawFlags & kTypeMask);
-    if (retVal->type >= kAckRequestType) {
-        handle_ack_msg(retVal, pos, rem);
-    } else {
-        const int rc = handle_normal_msg(retVal, pos, rem);
-        if(rc < 0) {
-            return NULL;
-        }
+    msg->flags = (FrameFlags)(rawFlags & ~kTypeMask);
+    msg->type = (MessageType)(rawFlags & kTypeMask);
+    if (msg->type >= kAckRequestType) {
+        handle_ack_msg(msg, pos, rem);
+        return 0;
+    }
+
+    return handle_normal_msg_ordered(msg, pos, rem, inflated, inflated_size, &state->normal);
+}
+
+int frame_decode_ordered(blip_message_t* msg, size_t size, frame_state* state)
+{
+    return frame_decode_ordered_inflated(msg, size, NULL, 0, state);
+}
+
+void frame_decode_post(blip_message_t* msg, const frame_state* state)
+{
+    if (msg->type < kAckRequestType) {
+        handle_normal_msg_post(msg, &state->normal);
+    }
+
+    const blip_connection_t* connection = (const blip_connection_t*)msg->private[0];
+    if (connection->stats) {
+        blip_stats_record(connection->stats, msg, state->size);
     }
+}
 
+blip_message_t* blip_message_read(const blip_connection_t* connection, uint8_t* data, size_t size)
+{
+    blip_message_t* retVal = frame_copy(connection, data, size);
+    if (!retVal) {
+        return NULL;
+    }
+
+    frame_state state;
+    if (frame_decode_ordered(retVal, size, &state) < 0) {
+        blip_message_free(retVal);
+        return NULL;
+    }
+
+    frame_decode_post(retVal, &state);
     return retVal;
 }
 
+// Drops what a message held from its last read, keeping the frame and payload buffers for the next one
+static void blip_message_reset(blip_message_t* msg)
+{
+    blip_body_index_free(msg);
+    free((void*)msg->private[6]);
+    free((void*)msg->private[2]);
+    const uint64_t frame = msg->private[3];
+    const uint64_t frame_capacity = msg->private[8];
+    const uint64_t payload = msg->private[9];
+    const uint64_t payload_capacity = msg->private[10];
+    memset(msg, 0, sizeof(blip_message_t));
+    msg->private[3] = frame;
+    msg->private[8] = frame_capacity;
+    msg->private[9] = payload;
+    msg->private[10] = payload_capacity;
+}
+
+int frame_decode_into(const blip_connection_t* connection, blip_message_t* msg, const uint8_t* data, size_t size,
+                      const uint8_t* inflated, size_t inflated_size)
+{
+    blip_message_reset(msg);
+    if (frame_store(msg, connection, data, size) < 0) {
+        return -1;
+    }
+
+    frame_state state;
+    if (frame_decode_ordered_inflated(msg, size, inflated, inflated_size, &state) < 0) {
+        blip_message_reset(msg);
+        return -1;
+    }
+
+    frame_decode_post(msg, &state);
+    return 0;
+}
+
+int blip_message_read_into(const blip_connection_t* connection, blip_message_t* msg, const uint8_t* data,
+                           size_t size)
+{
+    return frame_decode_into(connection, msg, data, size, NULL, 0);
+}
+
+int blip_message_read_streaming(const blip_connection_t* connection, const uint8_t* data, size_t size,
+                                const blip_body_stream* stream, blip_message_t** out_msg)
+{
+    *out_msg = NULL;
+
+    // Unlike blip_message_read() the frame is not copied, since nothing is left pointing into it
+    blip_message_t* msg = calloc(1, sizeof(blip_message_t));
+    if (!msg) {
+        return -1;
+    }
+
+    msg->private[0] = (uint64_t)connection;
+    msg->private[7] = size;
+    uint8_t* pos = (uint8_t*)data;
+    size_t rem = size;
+    pos = get_varint(pos, &rem, &msg->msg_no);
+    uint64_t rawFlags = 0;
+    pos = get_varint(pos, &rem, &rawFlags);
+    msg->flags = (FrameFlags)(rawFlags & ~kTypeMask);
+    msg->type = (MessageType)(rawFlags & kTypeMask);
+    int stopped = 0;
+    if (msg->type >= kAckRequestType) {
+        handle_ack_msg(msg, pos, rem);
+    } else if ((stopped = handle_normal_msg_streaming(msg, pos, rem, stream)) < 0) {
+        blip_message_free(msg);
+        return -1;
+    }
+
+    // A stopped message was still read in full, so it counts like any other
+    if (connection->stats) {
+        blip_stats_record(connection->stats, msg, size);
+    }
+
+    *out_msg = msg;
+    return stopped ? 0 : 1;
+}
+
 void blip_message_free(blip_message_t* msg)
 {
+    blip_body_index_free(msg);
     if (msg->type < kAckRequestType) {
-        free((void*)msg->private[1]); // decompressed payload (NULL if uncompressed)
+        free((void*)msg->private[6]); // property separators (NULL unless a property contains a colon)
     }
 
     free((void *)msg->private[2]);
     free((void *)msg->private[3]);
+    free((void *)msg->private[9]);
     free(msg);
 }
 
@@ -141,12 +385,51 @@ uint64_t blip_get_message_ack_size(const blip_message_t* msg)
     return 0UL;
 }
 
+size_t blip_get_message_wire_size(const blip_message_t* msg)
+{
+    return (size_t)msg->private[7];
+}
+
 const uint8_t* blip_message_serialize(blip_connection_t* connection, blip_message_t* msg, size_t* out_size) {
-    *out_size = SizeOfVarInt(msg->msg_no);
-    *out_size += SizeOfVarInt(msg->flags | msg->type);
-    if(msg->type >= kAckRequestType) {
-        return serialize_ack_msg(msg, out_size);
+    uint8_t* buf = NULL;
+    size_t capacity = 0;
+    *out_size = 0;
+    if (serialize_msg_append(connection, msg, &buf, &capacity, out_size, true) < 0) {
+        free(buf);
+        return NULL;
+    }
+
+    free((void *)msg->private[2]);
+    msg->private[2] = (uint64_t)buf;
+    return buf;
+}
+
+size_t blip_message_serialize_bound(const blip_message_t* msg)
+{
+    const size_t header_size = SizeOfVarInt(msg->msg_no) + SizeOfVarInt(msg->flags | msg->type);
+    if (msg->type >= kAckRequestType) {
+        return header_size + SizeOfVarInt(msg->private[1]);
+    }
+
+    const size_t prop_size = msg->properties ? strlen((const char*)msg->properties) + 1 : 0;
+    const size_t payload_size = SizeOfVarInt(prop_size) + prop_size + msg->body_size;
+
+    // Without a stream deflateBound gives the most conservative bound, covering any settings,
+    // plus the same slack for the sync flush trailer that serializing reserves
+    const size_t body_bound = msg->flags & kCompressed ? deflateBound(NULL, (uLong)payload_size) + 16 : payload_size;
+    return header_size + body_bound + 4;
+}
+
+int blip_message_serialize_into(blip_connection_t* connection, blip_message_t* msg, uint8_t* buf,
+                                size_t capacity, size_t* out_size)
+{
+    *out_size = 0;
+    if (capacity < blip_message_serialize_bound(msg)) {
+        return -1;
     }
 
-    return serialize_normal_msg(connection, msg, out_size);
+    // Everything serializing reserves fits within the bound, and the caller's buffer must never
+    // be realloc'd in any case, so running out of room fails instead of growing it
+    uint8_t* out = buf;
+    return serialize_msg_append(connection, msg, &out, &capacity, out_size, false);
 }
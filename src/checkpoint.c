@@ -0,0 +1,181 @@
+//
+//  checkpoint.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip.h"
+#include "hashset.h"
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Checkpoint blob layout (all integers are varints):
+ *
+ *   "CBCK" <version> <crc> <crc_out> <dict size> <dict bytes> <key count> <key deltas...>
+ *
+ * The inflate stream is always left on a block boundary after a message (thanks to the
+ * sync flush trailer), so its sliding window is all that is needed to resume decoding.
+ */
+
+static const uint8_t kCheckpointMagic[4] = {'C', 'B', 'C', 'K'};
+static const uint8_t kCheckpointVersion = 1;
+
+static int compare_keys(const void* a, const void* b)
+{
+    const size_t lhs = *(const size_t*)a;
+    const size_t rhs = *(const size_t*)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+size_t blip_connection_checkpoint(const blip_connection_t* connection, uint8_t* buf, size_t capacity)
+{
+    const hashset_t set = connection->started_msg_set;
+    const size_t key_count = hashset_num_items(set);
+    const size_t max_size = sizeof(kCheckpointMagic) + 1 + 4 * kMaxVarintLen64 + (1U << MAX_WBITS)
+                            + key_count * kMaxVarintLen64;
+    if (!buf || capacity < max_size) {
+        return max_size;
+    }
+
+    uint8_t* pos = buf;
+    memcpy(pos, kCheckpointMagic, sizeof(kCheckpointMagic));
+    pos += sizeof(kCheckpointMagic);
+    *pos++ = kCheckpointVersion;
+    pos = put_varint(connection->crc, pos);
+    pos = put_varint(connection->crc_out, pos);
+
+    // Write the window after reserving the largest possible varint for its size, then slide
+    // it down once its real size is known
+    uint8_t* dict_start = pos + kMaxVarintLen32;
+    uInt dict_size = 0;
+    if (connection->decompress_stream
+        && inflateGetDictionary(connection->decompress_stream, dict_start, &dict_size) != Z_OK) {
+        return 0;
+    }
+
+    pos = put_varint(dict_size, pos);
+    memmove(pos, dict_start, dict_size);
+    pos += dict_size;
+
+    size_t* keys = NULL;
+    if (key_count > 0) {
+        keys = (size_t*)malloc(key_count * sizeof(size_t));
+        if (!keys) {
+            return 0;
+        }
+
+        size_t found = 0;
+        for (size_t i = 0; i < set->capacity && found < key_count; i++) {
+            if (set->items[i] > 1) {
+                keys[found++] = set->items[i];
+            }
+        }
+
+        qsort(keys, key_count, sizeof(size_t), compare_keys);
+    }
+
+    pos = put_varint(key_count, pos);
+    size_t previous = 0;
+    for (size_t i = 0; i < key_count; i++) {
+        pos = put_varint(keys[i] - previous, pos);
+        previous = keys[i];
+    }
+
+    free(keys);
+    return pos - buf;
+}
+
+static bool read_varint(uint8_t** pos, size_t* rem, uint64_t* out)
+{
+    const size_t before = *rem;
+    *pos = get_varint(*pos, rem, out);
+    return *rem != before;
+}
+
+int blip_connection_restore(blip_connection_t* connection, const uint8_t* data, size_t size)
+{
+    if (size < sizeof(kCheckpointMagic) + 1 || memcmp(data, kCheckpointMagic, sizeof(kCheckpointMagic)) != 0
+        || data[sizeof(kCheckpointMagic)] != kCheckpointVersion) {
+        return -1;
+    }
+
+    uint8_t* pos = (uint8_t*)data + sizeof(kCheckpointMagic) + 1;
+    size_t rem = size - sizeof(kCheckpointMagic) - 1;
+    uint64_t crc, crc_out, dict_size, key_count;
+    if (!read_varint(&pos, &rem, &crc) || !read_varint(&pos, &rem, &crc_out) || !read_varint(&pos, &rem, &dict_size)
+        || dict_size > rem || dict_size > (1U << MAX_WBITS)) {
+        return -1;
+    }
+
+    hashset_t set = hashset_create();
+    if (!set) {
+        return -1;
+    }
+
+    const uint8_t* dict = pos;
+    pos += dict_size;
+    rem -= dict_size;
+    size_t key = 0;
+    if (!read_varint(&pos, &rem, &key_count)) {
+        hashset_destroy(set);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < key_count; i++) {
+        uint64_t delta;
+        if (!read_varint(&pos, &rem, &delta)) {
+            hashset_destroy(set);
+            return -1;
+        }
+
+        key += (size_t)delta;
+        if (hashset_add(set, (void*)key) < 0) {
+            hashset_destroy(set);
+            return -1;
+        }
+    }
+
+    // The window goes into a new inflate stream, and the old one is only dropped once that has
+    // worked.  Without a window there is nothing to restore, and the inflate stream is only
+    // created again if a compressed frame comes along.
+    z_stream* previous = connection->decompress_stream;
+    connection->decompress_stream = NULL;
+    if (dict_size > 0) {
+        z_stream* inflater = blip_connection_inflater(connection);
+        if (!inflater || inflateSetDictionary(inflater, dict, (uInt)dict_size) != Z_OK) {
+            blip_connection_release_streams(connection, true, false);
+            connection->decompress_stream = previous;
+            hashset_destroy(set);
+            return -1;
+        }
+    }
+
+    z_stream* restored = connection->decompress_stream;
+    connection->decompress_stream = previous;
+    blip_connection_release_streams(connection, true, false);
+    connection->decompress_stream = restored;
+
+    // The outbound history is not part of the checkpoint.  Compressing without it is still
+    // decodable by the peer, since back references never reach further than the reset.
+    blip_connection_release_streams(connection, false, true);
+    hashset_destroy(connection->started_msg_set);
+    connection->started_msg_set = set;
+    connection->crc = (uint32_t)crc;
+    connection->crc_out = (uint32_t)crc_out;
+    return 0;
+}
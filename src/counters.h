@@ -0,0 +1,36 @@
+//
+//  counters.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Counters that one thread writes while others read them.  Only the writing thread ever
+// writes a counter, so a relaxed load and store is enough and avoids paying for a locked
+// read-modify-write on every message.
+
+static inline void counter_add(atomic_uint_fast64_t* counter, uint64_t value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+static inline uint64_t counter_load(const atomic_uint_fast64_t* counter)
+{
+    return atomic_load_explicit((atomic_uint_fast64_t*)counter, memory_order_relaxed);
+}
@@ -0,0 +1,285 @@
+//
+//  cpu.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cpu.h"
+#include "cblip_cpu.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+static const char* const kCpuLevelNames[kCpuLevelCount] = {
+    "scalar", "sse2", "sse4.2", "avx2", "avx512"
+};
+
+static blip_kernels selected;
+static atomic_int selected_state;   // 0 = not selected, 1 = being selected, 2 = ready
+
+uint32_t crc32_scalar(uint32_t crc, const uint8_t* data, size_t size)
+{
+    // zlib counts in uInt, so very large buffers go in pieces
+    while (size > UINT_MAX) {
+        crc = (uint32_t)crc32(crc, data, UINT_MAX);
+        data += UINT_MAX;
+        size -= UINT_MAX;
+    }
+
+    return size > 0 ? (uint32_t)crc32(crc, data, (uInt)size) : crc;
+}
+
+void replace_byte_scalar(uint8_t* data, size_t size, uint8_t from, uint8_t to)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == from) {
+            data[i] = to;
+        }
+    }
+}
+
+static cpu_level detect_level()
+{
+#ifdef CBLIP_CPU_X86
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2")) {
+        return kCpuScalar;
+    }
+
+    if (!__builtin_cpu_supports("sse4.2") || !__builtin_cpu_supports("pclmul")) {
+        return kCpuSSE2;
+    }
+
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("bmi2")) {
+        return kCpuSSE42;
+    }
+
+    if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512bw")) {
+        return kCpuAVX2;
+    }
+
+    return kCpuAVX512;
+#else
+    return kCpuScalar;
+#endif
+}
+
+// Zen 1 and 2 implement PEXT in microcode at hundreds of cycles, far slower than the loop
+static bool slow_pext()
+{
+#ifdef CBLIP_CPU_X86
+    return __builtin_cpu_is("znver1") || __builtin_cpu_is("znver2");
+#else
+    return false;
+#endif
+}
+
+static void select_kernels(blip_kernels* kernels, cpu_level level, bool include_slow)
+{
+    const char* crc_name = "scalar";
+    const char* varint_name = "scalar";
+    const char* properties_name = "scalar";
+    kernels->crc32 = crc32_scalar;
+    kernels->get_uvarint = get_uvarint_scalar;
+    kernels->replace_byte = replace_byte_scalar;
+#ifdef CBLIP_CPU_X86
+    if (level >= kCpuSSE2) {
+        kernels->replace_byte = replace_byte_sse2;
+        properties_name = "sse2";
+    }
+
+    if (level >= kCpuSSE42) {
+        kernels->crc32 = crc32_pclmul;
+        crc_name = "pclmul";
+    }
+
+    if (level >= kCpuAVX2) {
+        kernels->replace_byte = replace_byte_avx2;
+        properties_name = "avx2";
+        if (include_slow || !slow_pext()) {
+            kernels->get_uvarint = get_uvarint_bmi2;
+            varint_name = "bmi2";
+        }
+    }
+
+    if (level >= kCpuAVX512) {
+        kernels->replace_byte = replace_byte_avx512;
+        properties_name = "avx512";
+    }
+#endif
+
+    snprintf(kernels->name, sizeof(kernels->name), "crc32=%s varint=%s properties=%s", crc_name, varint_name,
+             properties_name);
+}
+
+static cpu_level capped_level(cpu_level detected)
+{
+    const char* cap = getenv("CBLIP_CPU");
+    if (!cap || !*cap) {
+        return detected;
+    }
+
+    for (int i = 0; i < kCpuLevelCount; i++) {
+        if (strcmp(cap, kCpuLevelNames[i]) == 0) {
+            return (cpu_level)i < detected ? (cpu_level)i : detected;
+        }
+    }
+
+    // Unknown values are ignored, and blip_cpu_kernels() shows what was picked instead
+    return detected;
+}
+
+const blip_kernels* blip_get_kernels()
+{
+    if (atomic_load_explicit(&selected_state, memory_order_acquire) == 2) {
+        return &selected;
+    }
+
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&selected_state, &expected, 1)) {
+        // Another thread is selecting, and it won't take long
+        while (atomic_load_explicit(&selected_state, memory_order_acquire) != 2) {
+        }
+
+        return &selected;
+    }
+
+    select_kernels(&selected, capped_level(detect_level()), false);
+    const char* check = getenv("CBLIP_CPU_CHECK");
+    if (check && *check) {
+        if (blip_cpu_self_test() != 0) {
+            select_kernels(&selected, kCpuScalar, false);
+            strncat(selected.name, " (self test failed)", sizeof(selected.name) - strlen(selected.name) - 1);
+        }
+    }
+
+    atomic_store_explicit(&selected_state, 2, memory_order_release);
+    return &selected;
+}
+
+const char* blip_cpu_kernels()
+{
+    return blip_get_kernels()->name;
+}
+
+/********************
+ * Self test        *
+ *******************/
+
+static uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static int check_crc32(const blip_kernels* kernels, uint8_t* buf, size_t capacity, uint64_t* rng)
+{
+    int failures = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        buf[i] = (uint8_t)next_random(rng);
+    }
+
+    for (size_t size = 0; size + 16 <= capacity; size += size < 300 ? 1 : 997) {
+        const size_t offset = next_random(rng) % 16;
+        const uint32_t seed = (uint32_t)next_random(rng);
+        if (kernels->crc32(seed, buf + offset, size) != crc32_scalar(seed, buf + offset, size)) {
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+static int check_varint(const blip_kernels* kernels, uint8_t* buf, uint64_t* rng)
+{
+    int failures = 0;
+    for (int i = 0; i < 20000; i++) {
+        // Mostly well formed varints of every length, some truncated, some random junk
+        const uint64_t value = next_random(rng) >> (next_random(rng) % 64);
+        const size_t length = PutUVarInt(buf, value | 0x80);
+        for (size_t j = length; j < 16; j++) {
+            buf[j] = (uint8_t)next_random(rng);
+        }
+
+        if (i % 7 == 0) {
+            for (size_t j = 0; j < 16; j++) {
+                buf[j] = (uint8_t)next_random(rng) | (j == 0 ? 0x80 : 0);
+            }
+        }
+
+        const size_t size = i % 5 == 0 ? next_random(rng) % 17 : 16;
+        uint64_t expected = 0, actual = 0;
+        const size_t expected_length = get_uvarint_scalar(buf, size, &expected);
+        const size_t actual_length = kernels->get_uvarint(buf, size, &actual);
+        if (expected_length != actual_length || (expected_length != 0 && expected != actual)) {
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+static int check_replace_byte(const blip_kernels* kernels, uint8_t* buf, size_t capacity, uint64_t* rng)
+{
+    static const uint8_t kAlphabet[] = {0, ':', 'a', 0xFF};
+    uint8_t* expected = buf + capacity / 2;
+    int failures = 0;
+    for (size_t size = 0; size + 128 <= capacity / 2; size += size < 300 ? 1 : 331) {
+        const size_t offset = next_random(rng) % 64;
+        for (size_t i = 0; i < size + offset; i++) {
+            buf[i] = kAlphabet[next_random(rng) % sizeof(kAlphabet)];
+        }
+
+        // Include the bytes around the range, to catch writes past either end
+        memcpy(expected, buf, size + 2 * offset);
+        replace_byte_scalar(expected + offset, size, 0, ':');
+        kernels->replace_byte(buf + offset, size, 0, ':');
+        if (memcmp(expected, buf, size + 2 * offset) != 0) {
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+int blip_cpu_self_test()
+{
+    const size_t capacity = 16384;
+    uint8_t* buf = malloc(capacity);
+    if (!buf) {
+        return -1;
+    }
+
+    int failures = 0;
+    const cpu_level detected = detect_level();
+    for (cpu_level level = kCpuSSE2; level <= detected; level++) {
+        blip_kernels kernels;
+        select_kernels(&kernels, level, true);
+        uint64_t rng = 0x9E3779B97F4A7C15ULL + level;
+        failures += check_crc32(&kernels, buf, capacity, &rng)
+                    + check_varint(&kernels, buf, &rng)
+                    + check_replace_byte(&kernels, buf, capacity, &rng);
+    }
+
+    free(buf);
+    return failures;
+}
@@ -0,0 +1,69 @@
+//
+//  cpu.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Runtime dispatch is done with GCC / Clang target attributes, so other compilers (and
+// architectures) only get the scalar kernels
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define CBLIP_CPU_X86 1
+#endif
+
+/** CPU levels, in increasing order of capability (each one implies the previous) */
+typedef enum {
+    kCpuScalar = 0,
+    kCpuSSE2,
+    kCpuSSE42,      ///< SSE4.2 plus PCLMULQDQ
+    kCpuAVX2,       ///< AVX2 plus BMI2
+    kCpuAVX512,     ///< AVX-512 F and BW
+    kCpuLevelCount
+} cpu_level;
+
+/** One implementation of each hot kernel */
+typedef struct {
+    /** zlib compatible CRC-32 of data, continuing from crc */
+    uint32_t (*crc32)(uint32_t crc, const uint8_t* data, size_t size);
+
+    /** Decodes a varint of at least two bytes, with the same contract as _GetUVarInt */
+    size_t (*get_uvarint)(const uint8_t* buf, size_t size, uint64_t* n);
+
+    /** Replaces every occurrence of one byte value with another */
+    void (*replace_byte)(uint8_t* data, size_t size, uint8_t from, uint8_t to);
+
+    char name[64];
+} blip_kernels;
+
+/**
+ * Gets the kernels selected for this CPU, selecting them on first use
+ * @return The selected kernels (never NULL)
+ */
+const blip_kernels* blip_get_kernels(void);
+
+uint32_t crc32_scalar(uint32_t crc, const uint8_t* data, size_t size);
+size_t get_uvarint_scalar(const uint8_t* buf, size_t size, uint64_t* n);
+void replace_byte_scalar(uint8_t* data, size_t size, uint8_t from, uint8_t to);
+
+#ifdef CBLIP_CPU_X86
+uint32_t crc32_pclmul(uint32_t crc, const uint8_t* data, size_t size);
+size_t get_uvarint_bmi2(const uint8_t* buf, size_t size, uint64_t* n);
+void replace_byte_sse2(uint8_t* data, size_t size, uint8_t from, uint8_t to);
+void replace_byte_avx2(uint8_t* data, size_t size, uint8_t from, uint8_t to);
+void replace_byte_avx512(uint8_t* data, size_t size, uint8_t from, uint8_t to);
+#endif
@@ -0,0 +1,68 @@
+//
+//  decode.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+#include "msg_handler.h"
+
+// blip_message_read() in three steps, so that they can run on different threads.  Only
+// frame_decode_ordered touches the connection, and it must see frames in order.
+
+/** What is carried from one decoding step to the next */
+typedef struct {
+    size_t size;                ///< The size of the raw frame
+    normal_msg_state normal;    ///< Left by the ordered step for normal (non-ACK) messages
+} frame_state;
+
+/**
+ * Allocates a message holding a copy of a raw frame
+ * @param connection    The connection the frame was read from
+ * @param data          The raw frame
+ * @param size          The size of the raw frame
+ * @return              The new message, or NULL on failure
+ */
+blip_message_t* frame_copy(const blip_connection_t* connection, const uint8_t* data, size_t size);
+
+/**
+ * Decodes the frame header and runs everything that depends on the connection state
+ * @param msg   The message created by frame_copy
+ * @param size  The size of the raw frame
+ * @param state Receives what frame_decode_post needs
+ * @return      0 on success, negative values on failure
+ */
+int frame_decode_ordered(blip_message_t* msg, size_t size, frame_state* state);
+
+/**
+ * Decodes a frame into an existing message, reusing its buffers (blip_message_read_into())
+ * @param connection    The connection the frame was read from
+ * @param msg           The message to decode into
+ * @param data          The raw frame
+ * @param size          The size of the raw frame
+ * @param inflated      The payload of a compressed frame if it was already inflated, otherwise NULL
+ * @param inflated_size The size of inflated
+ * @return              0 on success, negative values on failure
+ */
+int frame_decode_into(const blip_connection_t* connection, blip_message_t* msg, const uint8_t* data, size_t size,
+                      const uint8_t* inflated, size_t inflated_size);
+
+/**
+ * Finishes decoding a frame (checksum, properties and stats)
+ * @param msg   The message passed to frame_decode_ordered
+ * @param state The state filled in by frame_decode_ordered
+ */
+void frame_decode_post(blip_message_t* msg, const frame_state* state);
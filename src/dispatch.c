@@ -0,0 +1,347 @@
+//
+//  dispatch.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_dispatch.h"
+#include "probe.h"
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Give up on a collision free profile table past this many slots, and just probe
+#define MAX_PERFECT_SLOTS 4096
+
+// Requests whose reply never arrives would otherwise stay pending forever.  Once this many are
+// pending, all but the newest half of them are dropped before another one is added.
+#define MAX_PENDING 65536
+
+typedef struct {
+    uint32_t hash;
+    uint8_t* name;
+    size_t size;
+    blip_message_callback handler;
+    void* context;
+} profile_entry;
+
+// A request that later frames or responses will be routed by.  A handler of 0 marks an empty slot.
+typedef struct {
+    MessageNo msg_no;
+    const blip_connection_t* connection;    // The connection the request arrived on
+    uint32_t handler;                       // 1-based index into the profile entries
+    uint64_t sequence;                      // The order the request was added in
+} pending_entry;
+
+struct blip_dispatcher
+{
+    blip_message_callback fallback;
+    void* fallback_context;
+
+    profile_entry* profiles;
+    size_t profile_count;
+    uint32_t* slots;            // 1-based indexes into profiles, 0 for empty
+    size_t slot_mask;
+
+    pending_entry* pending;
+    size_t pending_count;
+    size_t pending_mask;
+    uint64_t next_sequence;
+};
+
+blip_dispatcher_t* blip_dispatcher_new(blip_message_callback fallback, void* fallback_context)
+{
+    blip_dispatcher_t* retVal = calloc(1, sizeof(blip_dispatcher_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->pending_mask = 15;
+    retVal->pending = calloc(retVal->pending_mask + 1, sizeof(pending_entry));
+    if (!retVal->pending) {
+        free(retVal);
+        return NULL;
+    }
+
+    retVal->fallback = fallback;
+    retVal->fallback_context = fallback_context;
+    return retVal;
+}
+
+void blip_dispatcher_free(blip_dispatcher_t* dispatcher)
+{
+    if (!dispatcher) {
+        return;
+    }
+
+    for (size_t i = 0; i < dispatcher->profile_count; i++) {
+        free(dispatcher->profiles[i].name);
+    }
+
+    free(dispatcher->profiles);
+    free(dispatcher->slots);
+    free(dispatcher->pending);
+    free(dispatcher);
+}
+
+// Lays the profiles out in the smallest table where every hash lands in its own slot, so a
+// lookup is a single probe.  Past MAX_PERFECT_SLOTS collisions are resolved by linear probing.
+static int rebuild_slots(blip_dispatcher_t* dispatcher)
+{
+    size_t capacity = 8;
+    while (capacity < dispatcher->profile_count * 2) {
+        capacity *= 2;
+    }
+
+    while (true) {
+        uint32_t* slots = calloc(capacity, sizeof(uint32_t));
+        if (!slots) {
+            return -1;
+        }
+
+        bool collided = false;
+        for (size_t i = 0; i < dispatcher->profile_count; i++) {
+            size_t slot = dispatcher->profiles[i].hash & (capacity - 1);
+            while (slots[slot] != 0) {
+                collided = true;
+                slot = (slot + 1) & (capacity - 1);
+            }
+
+            slots[slot] = (uint32_t)i + 1;
+        }
+
+        if (!collided || capacity >= MAX_PERFECT_SLOTS) {
+            free(dispatcher->slots);
+            dispatcher->slots = slots;
+            dispatcher->slot_mask = capacity - 1;
+            return 0;
+        }
+
+        free(slots);
+        capacity *= 2;
+    }
+}
+
+static uint32_t find_profile(const blip_dispatcher_t* dispatcher, uint32_t hash, const uint8_t* name, size_t size)
+{
+    if (!dispatcher->slots) {
+        return 0;
+    }
+
+    size_t slot = hash & dispatcher->slot_mask;
+    while (dispatcher->slots[slot] != 0) {
+        const uint32_t index = dispatcher->slots[slot];
+        const profile_entry* entry = &dispatcher->profiles[index - 1];
+        if (entry->hash == hash && entry->size == size && memcmp(entry->name, name, size) == 0) {
+            return index;
+        }
+
+        slot = (slot + 1) & dispatcher->slot_mask;
+    }
+
+    return 0;
+}
+
+int blip_dispatcher_register(blip_dispatcher_t* dispatcher, const char* profile,
+                             blip_message_callback handler, void* context)
+{
+    const size_t size = strlen(profile);
+    const uint32_t hash = blip_profile_hash((const uint8_t*)profile, size);
+    const uint32_t existing = find_profile(dispatcher, hash, (const uint8_t*)profile, size);
+    if (existing != 0) {
+        dispatcher->profiles[existing - 1].handler = handler;
+        dispatcher->profiles[existing - 1].context = context;
+        return 0;
+    }
+
+    profile_entry* grown = realloc(dispatcher->profiles, (dispatcher->profile_count + 1) * sizeof(profile_entry));
+    if (!grown) {
+        return -1;
+    }
+
+    dispatcher->profiles = grown;
+    profile_entry* entry = &grown[dispatcher->profile_count];
+    entry->name = malloc(size + 1);
+    if (!entry->name) {
+        return -1;
+    }
+
+    memcpy(entry->name, profile, size + 1);
+    entry->size = size;
+    entry->hash = hash;
+    entry->handler = handler;
+    entry->context = context;
+    dispatcher->profile_count++;
+    return rebuild_slots(dispatcher);
+}
+
+static size_t pending_slot(MessageNo msg_no, size_t mask)
+{
+    return (size_t)(msg_no * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+}
+
+// Finds the pending request for a message.  Later request frames arrive on the same connection
+// as the first one, while responses arrive on the opposite connection.
+static pending_entry* find_pending(blip_dispatcher_t* dispatcher, MessageNo msg_no,
+                                   const blip_connection_t* connection, bool is_response)
+{
+    size_t slot = pending_slot(msg_no, dispatcher->pending_mask);
+    while (dispatcher->pending[slot].handler != 0) {
+        pending_entry* entry = &dispatcher->pending[slot];
+        if (entry->msg_no == msg_no && (entry->connection == connection) != is_response) {
+            return entry;
+        }
+
+        slot = (slot + 1) & dispatcher->pending_mask;
+    }
+
+    return NULL;
+}
+
+static void insert_pending(pending_entry* table, size_t mask, const pending_entry* entry)
+{
+    size_t slot = pending_slot(entry->msg_no, mask);
+    while (table[slot].handler != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    table[slot] = *entry;
+}
+
+// Moves the pending requests into a table of the given size, skipping those added before
+// oldest (in insertion order)
+static int rehash_pending(blip_dispatcher_t* dispatcher, size_t new_mask, uint64_t oldest)
+{
+    pending_entry* table = calloc(new_mask + 1, sizeof(pending_entry));
+    if (!table) {
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i <= dispatcher->pending_mask; i++) {
+        if (dispatcher->pending[i].handler != 0 && dispatcher->pending[i].sequence >= oldest) {
+            insert_pending(table, new_mask, &dispatcher->pending[i]);
+            count++;
+        }
+    }
+
+    free(dispatcher->pending);
+    dispatcher->pending = table;
+    dispatcher->pending_mask = new_mask;
+    dispatcher->pending_count = count;
+    return 0;
+}
+
+static int add_pending(blip_dispatcher_t* dispatcher, pending_entry* entry)
+{
+    if (dispatcher->pending_count >= MAX_PENDING) {
+        // At most MAX_PENDING / 2 of the pending requests were added this recently
+        if (rehash_pending(dispatcher, dispatcher->pending_mask, dispatcher->next_sequence - MAX_PENDING / 2) < 0) {
+            return -1;
+        }
+    } else if ((dispatcher->pending_count + 1) * 2 > dispatcher->pending_mask + 1) {
+        if (rehash_pending(dispatcher, dispatcher->pending_mask * 2 + 1, 0) < 0) {
+            return -1;
+        }
+    }
+
+    entry->sequence = dispatcher->next_sequence++;
+    insert_pending(dispatcher->pending, dispatcher->pending_mask, entry);
+    dispatcher->pending_count++;
+    return 0;
+}
+
+static bool pending_home(const void* slot, size_t mask, size_t* home)
+{
+    const pending_entry* entry = slot;
+    *home = pending_slot(entry->msg_no, mask);
+    return entry->handler != 0;
+}
+
+static void remove_pending(blip_dispatcher_t* dispatcher, pending_entry* entry)
+{
+    probe_remove(dispatcher->pending, sizeof(pending_entry), dispatcher->pending_mask,
+                 entry - dispatcher->pending, pending_home);
+    dispatcher->pending_count--;
+}
+
+int blip_dispatcher_forget_connection(blip_dispatcher_t* dispatcher, const blip_connection_t* connection)
+{
+    size_t count = 0;
+    size_t i = 0;
+    while (i <= dispatcher->pending_mask) {
+        if (dispatcher->pending[i].handler != 0 && dispatcher->pending[i].connection == connection) {
+            // The backward shift can move a later entry into this slot, so look at it again
+            remove_pending(dispatcher, &dispatcher->pending[i]);
+            count++;
+            continue;
+        }
+
+        i++;
+    }
+
+    return (int)count;
+}
+
+int blip_dispatch(blip_dispatcher_t* dispatcher, blip_message_t* msg)
+{
+    if (msg->type >= kAckRequestType) {
+        if (dispatcher->fallback) {
+            dispatcher->fallback(dispatcher->fallback_context, msg);
+        }
+
+        return 0;
+    }
+
+    const blip_connection_t* connection = (const blip_connection_t*)msg->private[0];
+    const bool is_response = msg->type != kRequestType;
+    const bool final_frame = !(msg->flags & kMoreComing);
+    uint32_t handler = 0;
+    if (!is_response && msg->profile) {
+        handler = find_profile(dispatcher, (uint32_t)msg->private[4], msg->profile, msg->profile_size);
+        if (handler != 0 && (!final_frame || !(msg->flags & kNoReply))) {
+            pending_entry entry = {msg->msg_no, connection, handler, 0};
+            if (add_pending(dispatcher, &entry) < 0) {
+                return -1;
+            }
+        }
+    } else {
+        pending_entry* entry = find_pending(dispatcher, msg->msg_no, connection, is_response);
+        if (entry) {
+            handler = entry->handler;
+            // A request stays pending after its last frame if it still expects a reply
+            if (final_frame && (is_response || (msg->flags & kNoReply))) {
+                remove_pending(dispatcher, entry);
+            }
+        }
+    }
+
+    if (handler == 0) {
+        if (dispatcher->fallback) {
+            dispatcher->fallback(dispatcher->fallback_context, msg);
+        }
+
+        return 0;
+    }
+
+    const profile_entry* profile = &dispatcher->profiles[handler - 1];
+    profile->handler(profile->context, msg);
+    return 1;
+}
+
+void blip_dispatch_message(void* dispatcher, blip_message_t* msg)
+{
+    blip_dispatch((blip_dispatcher_t*)dispatcher, msg);
+}
@@ -0,0 +1,371 @@
+//
+//  export.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_export.h"
+#include "cblip_endian.h"
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PROFILE_SIZE UINT16_MAX
+#define OTHER_PROFILE "(other)"
+#define INITIAL_SLOTS 64
+
+static const char kFileMagic[4] = {'C', 'B', 'C', 'F'};
+static const char kBatchMagic[4] = {'C', 'B', 'C', 'B'};
+
+enum {
+    kColumnMsgNo,
+    kColumnDirection,
+    kColumnType,
+    kColumnFlags,
+    kColumnProfile,
+    kColumnPropertiesSize,
+    kColumnBodySize,
+    kColumnWireSize,
+    kColumnChecksum,
+    kColumnTimestamp,
+    kColumnCount
+};
+
+typedef struct {
+    const char* name;
+    blip_column_type type;
+    uint8_t width;
+} column_info;
+
+static const column_info kColumns[kColumnCount] = {
+    {"msg_no", kBlipColumnU64, 8},
+    {"direction", kBlipColumnU8, 1},
+    {"type", kBlipColumnU8, 1},
+    {"flags", kBlipColumnU8, 1},
+    {"profile", kBlipColumnDictionary, 4},
+    {"properties_size", kBlipColumnU32, 4},
+    {"body_size", kBlipColumnU64, 8},
+    {"wire_size", kBlipColumnU64, 8},
+    {"checksum", kBlipColumnU8, 1},
+    {"timestamp_ns", kBlipColumnU64, 8},
+};
+
+// A dictionary slot, keyed by the profile hash that decoding already computed
+typedef struct {
+    uint32_t hash;
+    uint32_t code;      // 0 for an empty slot
+} profile_slot;
+
+struct blip_export
+{
+    blip_export_write write;
+    void* context;
+    uint64_t offset;            // Bytes written so far
+    bool failed;
+
+    size_t batch_rows;
+    size_t rows;
+    uint8_t* columns[kColumnCount];
+
+    char** profiles;            // profiles[code - 1], with room for half as many as there are slots
+    uint32_t profile_count;
+    uint32_t profiles_written;  // Entries already emitted by earlier batches
+    profile_slot* slots;
+    size_t slot_mask;
+
+    uint64_t* batch_offsets;
+    size_t batch_count;
+    size_t batch_capacity;
+    uint64_t total_rows;
+};
+
+static void emit(blip_export_t* exporter, const void* data, size_t size)
+{
+    if (exporter->failed || size == 0) {
+        return;
+    }
+
+    if (exporter->write(exporter->context, (const uint8_t*)data, size) < 0) {
+        exporter->failed = true;
+        return;
+    }
+
+    exporter->offset += size;
+}
+
+static void emit_u8(blip_export_t* exporter, uint8_t value)
+{
+    emit(exporter, &value, 1);
+}
+
+static void emit_u16(blip_export_t* exporter, uint16_t value)
+{
+    const uint16_t le = _encLittle16(value);
+    emit(exporter, &le, 2);
+}
+
+static void emit_u32(blip_export_t* exporter, uint32_t value)
+{
+    const uint32_t le = _encLittle32(value);
+    emit(exporter, &le, 4);
+}
+
+static void emit_u64(blip_export_t* exporter, uint64_t value)
+{
+    const uint64_t le = _encLittle64(value);
+    emit(exporter, &le, 8);
+}
+
+// Doubles the profile table and its hash slots once the slots are half full
+static bool grow_profiles(blip_export_t* exporter)
+{
+    const size_t slot_count = (exporter->slot_mask + 1) * 2;
+    char** profiles = realloc(exporter->profiles, (slot_count / 2) * sizeof(char*));
+    profile_slot* slots = calloc(slot_count, sizeof(profile_slot));
+    if (!profiles || !slots) {
+        if (profiles) {
+            exporter->profiles = profiles;
+        }
+
+        free(slots);
+        return false;
+    }
+
+    for (size_t i = 0; i <= exporter->slot_mask; i++) {
+        if (exporter->slots[i].code != 0) {
+            size_t j = exporter->slots[i].hash & (slot_count - 1);
+            while (slots[j].code != 0) {
+                j = (j + 1) & (slot_count - 1);
+            }
+
+            slots[j] = exporter->slots[i];
+        }
+    }
+
+    free(exporter->slots);
+    exporter->profiles = profiles;
+    exporter->slots = slots;
+    exporter->slot_mask = slot_count - 1;
+    return true;
+}
+
+static uint32_t add_profile(blip_export_t* exporter, const uint8_t* name, size_t size)
+{
+    char* copy = malloc(size + 1);
+    if (!copy) {
+        return 0;
+    }
+
+    memcpy(copy, name, size);
+    copy[size] = 0;
+    exporter->profiles[exporter->profile_count++] = copy;
+    return exporter->profile_count;
+}
+
+// Finds (or assigns) the dictionary code of a message's profile
+static uint32_t profile_code(blip_export_t* exporter, const blip_message_t* msg)
+{
+    if (!msg->profile || msg->type >= kAckRequestType) {
+        return 0;
+    }
+
+    // Once the table is full it stops growing, and profiles it already names keep their codes
+    const bool full = exporter->profile_count == BLIP_EXPORT_MAX_PROFILES;
+    if (!full && (exporter->profile_count + 1) * 2 > exporter->slot_mask + 1 && !grow_profiles(exporter)) {
+        return 0;
+    }
+
+    const size_t size = msg->profile_size < MAX_PROFILE_SIZE ? msg->profile_size : MAX_PROFILE_SIZE;
+    const uint32_t hash = (uint32_t)msg->private[4];
+    size_t i = hash & exporter->slot_mask;
+    for (; exporter->slots[i].code != 0; i = (i + 1) & exporter->slot_mask) {
+        const char* existing = exporter->profiles[exporter->slots[i].code - 1];
+        if (exporter->slots[i].hash == hash && strncmp(existing, (const char*)msg->profile, size) == 0
+            && existing[size] == 0) {
+            return exporter->slots[i].code;
+        }
+    }
+
+    // The last entry is kept back for everything past the limit
+    if (full) {
+        return BLIP_EXPORT_MAX_PROFILES;
+    }
+
+    if (exporter->profile_count == BLIP_EXPORT_MAX_PROFILES - 1) {
+        return add_profile(exporter, (const uint8_t*)OTHER_PROFILE, strlen(OTHER_PROFILE));
+    }
+
+    const uint32_t code = add_profile(exporter, msg->profile, size);
+    if (code != 0) {
+        exporter->slots[i].hash = hash;
+        exporter->slots[i].code = code;
+    }
+
+    return code;
+}
+
+static void write_batch(blip_export_t* exporter)
+{
+    if (exporter->rows == 0) {
+        return;
+    }
+
+    if (exporter->batch_count == exporter->batch_capacity) {
+        const size_t capacity = exporter->batch_capacity ? exporter->batch_capacity * 2 : 64;
+        uint64_t* grown = realloc(exporter->batch_offsets, capacity * sizeof(uint64_t));
+        if (!grown) {
+            exporter->failed = true;
+            return;
+        }
+
+        exporter->batch_offsets = grown;
+        exporter->batch_capacity = capacity;
+    }
+
+    exporter->batch_offsets[exporter->batch_count++] = exporter->offset;
+    emit(exporter, kBatchMagic, sizeof(kBatchMagic));
+    emit_u32(exporter, (uint32_t)exporter->rows);
+    emit_u32(exporter, exporter->profile_count - exporter->profiles_written);
+    for (uint32_t i = exporter->profiles_written; i < exporter->profile_count; i++) {
+        const size_t size = strlen(exporter->profiles[i]);
+        emit_u16(exporter, (uint16_t)size);
+        emit(exporter, exporter->profiles[i], size);
+    }
+
+    static const uint8_t kPadding[8] = {0};
+    for (int c = 0; c < kColumnCount; c++) {
+        emit(exporter, kPadding, (8 - (exporter->offset & 7)) & 7);
+        emit(exporter, exporter->columns[c], exporter->rows * kColumns[c].width);
+    }
+
+    exporter->profiles_written = exporter->profile_count;
+    exporter->total_rows += exporter->rows;
+    exporter->rows = 0;
+}
+
+blip_export_t* blip_export_new(size_t batch_rows, blip_export_write write, void* context)
+{
+    if (batch_rows == 0 || batch_rows > UINT32_MAX || !write) {
+        return NULL;
+    }
+
+    blip_export_t* retVal = calloc(1, sizeof(blip_export_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->write = write;
+    retVal->context = context;
+    retVal->batch_rows = batch_rows;
+    retVal->slot_mask = INITIAL_SLOTS - 1;
+    retVal->profiles = calloc(INITIAL_SLOTS / 2, sizeof(char*));
+    retVal->slots = calloc(INITIAL_SLOTS, sizeof(profile_slot));
+    bool ok = retVal->profiles && retVal->slots;
+    for (int c = 0; c < kColumnCount && ok; c++) {
+        retVal->columns[c] = malloc(batch_rows * kColumns[c].width);
+        ok = retVal->columns[c] != NULL;
+    }
+
+    if (!ok) {
+        blip_export_free(retVal);
+        return NULL;
+    }
+
+    emit(retVal, kFileMagic, sizeof(kFileMagic));
+    emit_u8(retVal, BLIP_EXPORT_VERSION);
+    emit_u8(retVal, kColumnCount);
+    for (int c = 0; c < kColumnCount; c++) {
+        emit_u8(retVal, (uint8_t)kColumns[c].type);
+        emit_u8(retVal, (uint8_t)strlen(kColumns[c].name));
+        emit(retVal, kColumns[c].name, strlen(kColumns[c].name));
+    }
+
+    if (retVal->failed) {
+        blip_export_free(retVal);
+        return NULL;
+    }
+
+    return retVal;
+}
+
+int blip_export_add(blip_export_t* exporter, const blip_message_t* msg, uint8_t direction, uint64_t timestamp_ns)
+{
+    if (exporter->failed) {
+        return -1;
+    }
+
+    const size_t row = exporter->rows;
+    const bool is_ack = msg->type >= kAckRequestType;
+    const uint64_t msg_no = _encLittle64(msg->msg_no);
+    const uint32_t profile = _encLittle32(profile_code(exporter, msg));
+    const uint32_t properties_size = _encLittle32(!is_ack && msg->properties
+                                                  ? (uint32_t)strlen((const char*)msg->properties) : 0);
+    const uint64_t body_size = _encLittle64(is_ack ? 0 : (uint64_t)msg->body_size);
+    const uint64_t wire_size = _encLittle64((uint64_t)blip_get_message_wire_size(msg));
+    const uint64_t timestamp = _encLittle64(timestamp_ns);
+    memcpy(exporter->columns[kColumnMsgNo] + row * 8, &msg_no, 8);
+    exporter->columns[kColumnDirection][row] = direction;
+    exporter->columns[kColumnType][row] = (uint8_t)msg->type;
+    exporter->columns[kColumnFlags][row] = (uint8_t)msg->flags;
+    memcpy(exporter->columns[kColumnProfile] + row * 4, &profile, 4);
+    memcpy(exporter->columns[kColumnPropertiesSize] + row * 4, &properties_size, 4);
+    memcpy(exporter->columns[kColumnBodySize] + row * 8, &body_size, 8);
+    memcpy(exporter->columns[kColumnWireSize] + row * 8, &wire_size, 8);
+    exporter->columns[kColumnChecksum][row] = is_ack ? 2 : msg->calculated_checksum == msg->checksum;
+    memcpy(exporter->columns[kColumnTimestamp] + row * 8, &timestamp, 8);
+
+    if (++exporter->rows == exporter->batch_rows) {
+        write_batch(exporter);
+    }
+
+    return exporter->failed ? -1 : 0;
+}
+
+int blip_export_finish(blip_export_t* exporter)
+{
+    write_batch(exporter);
+    for (size_t i = 0; i < exporter->batch_count; i++) {
+        emit_u64(exporter, exporter->batch_offsets[i]);
+    }
+
+    emit_u64(exporter, exporter->batch_count);
+    emit_u64(exporter, exporter->total_rows);
+    emit(exporter, kFileMagic, sizeof(kFileMagic));
+    const int retVal = exporter->failed ? -1 : 0;
+    exporter->failed = true;
+    return retVal;
+}
+
+void blip_export_free(blip_export_t* exporter)
+{
+    if (!exporter) {
+        return;
+    }
+
+    for (int c = 0; c < kColumnCount; c++) {
+        free(exporter->columns[c]);
+    }
+
+    if (exporter->profiles) {
+        for (uint32_t i = 0; i < exporter->profile_count; i++) {
+            free(exporter->profiles[i]);
+        }
+    }
+
+    free(exporter->profiles);
+    free(exporter->slots);
+    free(exporter->batch_offsets);
+    free(exporter);
+}
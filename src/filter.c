@@ -0,0 +1,748 @@
+//
+//  filter.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "filter.h"
+#include "decode.h"
+#include "msg_handler.h"
+#include "types.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define FILTER_MAX_STACK 32
+#define FILTER_MAX_NESTING 64
+#define FILTER_MAX_CODE UINT16_MAX
+#define PROFILE_KEY UINT32_MAX      // The key of a kOpString that tests the Profile property
+
+// Filters compile to a little stack machine, whose && and || jump over what can't change the result
+typedef enum {
+    kOpField,           // Push a numeric field of the frame
+    kOpConst,           // Push value
+    kOpCompare,         // Pop two values and push how they compare
+    kOpString,          // Push how a property compares with a literal
+    kOpNot,             // Replace the top value with whether it is zero
+    kOpAndJump,         // Jump (keeping the top value) if it is zero, otherwise pop it
+    kOpOrJump,          // Jump (keeping the top value) if it is non-zero, otherwise pop it
+} filter_op;
+
+typedef enum {
+    kFieldType,
+    kFieldFlags,
+    kFieldMsgNo,
+    kFieldBodySize,
+    kFieldWireSize
+} filter_field;
+
+typedef enum {
+    kCompareEq,
+    kCompareNe,
+    kCompareLt,
+    kCompareLe,
+    kCompareGt,
+    kCompareGe,
+    kCompareAnd,
+    kComparePresent     // kOpString only: whether the property is there at all
+} filter_compare;
+
+typedef struct {
+    uint8_t op;
+    uint8_t arg;            // The field or comparison
+    uint16_t target;        // Where a jump goes
+    uint32_t key;           // kOpString: the property key (string pool offset), or PROFILE_KEY
+    uint32_t key_size;
+    uint32_t literal;       // kOpString: the literal to compare with (string pool offset)
+    uint32_t literal_size;
+    uint64_t value;         // kOpConst: the value
+} filter_insn;
+
+typedef struct {
+    filter_insn* code;
+    size_t count;
+} filter_program;
+
+struct blip_filter_set
+{
+    filter_program programs[BLIP_FILTER_MAX];
+    atomic_uint_fast64_t matches[BLIP_FILTER_MAX];
+    unsigned count;
+    char* strings;              // The property keys and literals of every program
+    size_t strings_size;
+    size_t strings_capacity;
+};
+
+typedef struct {
+    const char* name;
+    filter_field field;
+} named_field;
+
+typedef struct {
+    const char* name;
+    uint64_t value;
+} named_constant;
+
+static const named_field kFields[] = {
+    {"type", kFieldType},
+    {"flags", kFieldFlags},
+    {"msg_no", kFieldMsgNo},
+    {"body_size", kFieldBodySize},
+    {"wire_size", kFieldWireSize},
+};
+
+// The type names match blip_get_message_type()
+static const named_constant kConstants[] = {
+    {"REQ", kRequestType},
+    {"RES", kResponseType},
+    {"ERR", kErrorType},
+    {"ACKREQ", kAckRequestType},
+    {"AKRES", kAckResponseType},
+    {"Compressed", kCompressed},
+    {"Urgent", kUrgent},
+    {"NoReply", kNoReply},
+    {"MoreComing", kMoreComing},
+};
+
+// Comparison operators, longest first so that "<=" isn't read as "<"
+static const struct {
+    const char* text;
+    filter_compare compare;
+} kCompareOps[] = {
+    {"==", kCompareEq}, {"!=", kCompareNe}, {"<=", kCompareLe}, {">=", kCompareGe},
+    {"<", kCompareLt}, {">", kCompareGt}, {"&", kCompareAnd},
+};
+
+typedef enum {
+    kTokenEnd,
+    kTokenNumber,
+    kTokenString,
+    kTokenName,
+    kTokenPunct,
+} token_kind;
+
+typedef enum {
+    kOperandNumber,     // Its code has been emitted
+    kOperandProperty,   // A string field, emitted once it is known what it is compared with
+    kOperandLiteral
+} operand_kind;
+
+typedef struct {
+    operand_kind kind;
+    uint32_t key;
+    uint32_t key_size;
+    uint32_t literal;
+    uint32_t literal_size;
+} operand;
+
+typedef struct {
+    const char* source;
+    const char* pos;
+    token_kind kind;
+    const char* start;          // The text of the current token
+    size_t length;
+    uint64_t number;
+    char* text;                 // The unescaped contents of a string token
+    size_t text_size;
+
+    blip_filter_set_t* filters;
+    filter_program program;
+    size_t capacity;
+    int depth;                  // Of the stack when the code so far runs
+    int nesting;
+    char* error;
+    size_t error_size;
+    bool failed;
+} compiler;
+
+static void fail(compiler* c, const char* format, ...)
+{
+    if (c->failed) {
+        return;
+    }
+
+    c->failed = true;
+    if (c->error && c->error_size > 0) {
+        const int written = snprintf(c->error, c->error_size, "column %d: ", (int)(c->start - c->source) + 1);
+        if (written >= 0 && (size_t)written < c->error_size) {
+            va_list args;
+            va_start(args, format);
+            vsnprintf(c->error + written, c->error_size - written, format, args);
+            va_end(args);
+        }
+    }
+}
+
+static uint64_t size_suffix(const char* suffix, size_t length)
+{
+    static const char* const kSuffixes[] = {"KB", "MB", "GB"};
+    for (int i = 0; i < 3; i++) {
+        if (length == 2 && strncasecmp(suffix, kSuffixes[i], 2) == 0) {
+            return 1ULL << (10 * (i + 1));
+        }
+    }
+
+    return 0;
+}
+
+static void next_token(compiler* c)
+{
+    while (isspace((unsigned char)*c->pos)) {
+        c->pos++;
+    }
+
+    c->start = c->pos;
+    if (*c->pos == 0) {
+        c->kind = kTokenEnd;
+        c->length = 0;
+        return;
+    }
+
+    if (isdigit((unsigned char)*c->pos)) {
+        char* end;
+        c->number = strtoull(c->pos, &end, 0);
+        const char* suffix = end;
+        while (isalpha((unsigned char)*end)) {
+            end++;
+        }
+
+        if (end > suffix) {
+            const uint64_t multiplier = size_suffix(suffix, (size_t)(end - suffix));
+            if (multiplier == 0 || c->number > UINT64_MAX / multiplier) {
+                fail(c, "bad number");
+            }
+
+            c->number *= multiplier;
+        }
+
+        c->kind = kTokenNumber;
+        c->pos = end;
+    } else if (*c->pos == '"') {
+        c->text_size = 0;
+        for (c->pos++; *c->pos != '"'; c->pos++) {
+            if (*c->pos == 0) {
+                fail(c, "unterminated string");
+                break;
+            }
+
+            if (*c->pos == '\\' && c->pos[1] != 0) {
+                c->pos++;
+            }
+
+            c->text[c->text_size++] = *c->pos;
+        }
+
+        c->pos += *c->pos == '"';
+        c->kind = kTokenString;
+    } else if (isalpha((unsigned char)*c->pos) || *c->pos == '_') {
+        while (isalnum((unsigned char)*c->pos) || *c->pos == '_') {
+            c->pos++;
+        }
+
+        c->kind = kTokenName;
+    } else {
+        static const char* const kPuncts[] = {"&&", "||", "==", "!=", "<=", ">=", "<", ">", "&", "!", "(", ")"};
+        c->kind = kTokenPunct;
+        for (size_t i = 0; i < sizeof(kPuncts) / sizeof(kPuncts[0]); i++) {
+            const size_t length = strlen(kPuncts[i]);
+            if (strncmp(c->pos, kPuncts[i], length) == 0) {
+                c->pos += length;
+                break;
+            }
+        }
+
+        if (c->pos == c->start) {
+            fail(c, "unexpected '%c'", *c->pos);
+            c->kind = kTokenEnd;
+        }
+    }
+
+    c->length = (size_t)(c->pos - c->start);
+}
+
+static bool is_token(const compiler* c, token_kind kind, const char* text)
+{
+    return c->kind == kind && c->length == strlen(text) && strncmp(c->start, text, c->length) == 0;
+}
+
+static void emit(compiler* c, const filter_insn* insn, int stack_effect)
+{
+    if (c->failed) {
+        return;
+    }
+
+    if (c->program.count == c->capacity) {
+        const size_t capacity = c->capacity ? c->capacity * 2 : 16;
+        filter_insn* grown = capacity <= FILTER_MAX_CODE ? realloc(c->program.code, capacity * sizeof(filter_insn)) : NULL;
+        if (!grown) {
+            fail(c, "expression too long");
+            return;
+        }
+
+        c->program.code = grown;
+        c->capacity = capacity;
+    }
+
+    c->program.code[c->program.count++] = *insn;
+    c->depth += stack_effect;
+    if (c->depth > FILTER_MAX_STACK) {
+        fail(c, "expression nests too deeply");
+    }
+}
+
+static uint32_t add_string(compiler* c, const char* text, size_t size)
+{
+    blip_filter_set_t* filters = c->filters;
+    if (blip_reserve_output((uint8_t**)&filters->strings, &filters->strings_capacity, filters->strings_size,
+                            size ? size : 1) < 0) {
+        fail(c, "out of memory");
+        return 0;
+    }
+
+    const uint32_t retVal = (uint32_t)filters->strings_size;
+    memcpy(filters->strings + retVal, text, size);
+    filters->strings_size += size;
+    return retVal;
+}
+
+static void parse_or(compiler* c);
+
+static void parse_operand(compiler* c, operand* result)
+{
+    memset(result, 0, sizeof(operand));
+    result->kind = kOperandNumber;
+    if (is_token(c, kTokenPunct, "(")) {
+        if (++c->nesting > FILTER_MAX_NESTING) {
+            fail(c, "expression nests too deeply");
+            return;
+        }
+
+        next_token(c);
+        parse_or(c);
+        c->nesting--;
+        if (!is_token(c, kTokenPunct, ")")) {
+            fail(c, "expected ')'");
+        }
+
+        next_token(c);
+        return;
+    }
+
+    if (c->kind == kTokenNumber) {
+        emit(c, &(filter_insn){.op = kOpConst, .value = c->number}, 1);
+        next_token(c);
+        return;
+    }
+
+    if (c->kind == kTokenString) {
+        result->kind = kOperandLiteral;
+        result->literal = add_string(c, c->text, c->text_size);
+        result->literal_size = (uint32_t)c->text_size;
+        next_token(c);
+        return;
+    }
+
+    if (c->kind != kTokenName) {
+        fail(c, c->kind == kTokenEnd ? "unexpected end" : "expected a value");
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(kFields) / sizeof(kFields[0]); i++) {
+        if (is_token(c, kTokenName, kFields[i].name)) {
+            emit(c, &(filter_insn){.op = kOpField, .arg = (uint8_t)kFields[i].field}, 1);
+            next_token(c);
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(kConstants) / sizeof(kConstants[0]); i++) {
+        if (is_token(c, kTokenName, kConstants[i].name)) {
+            emit(c, &(filter_insn){.op = kOpConst, .value = kConstants[i].value}, 1);
+            next_token(c);
+            return;
+        }
+    }
+
+    if (is_token(c, kTokenName, "profile")) {
+        result->kind = kOperandProperty;
+        result->key = PROFILE_KEY;
+        next_token(c);
+        return;
+    }
+
+    if (is_token(c, kTokenName, "prop")) {
+        next_token(c);
+        if (!is_token(c, kTokenPunct, "(")) {
+            fail(c, "expected '(' after prop");
+            return;
+        }
+
+        next_token(c);
+        if (c->kind != kTokenString) {
+            fail(c, "expected a quoted property name");
+            return;
+        }
+
+        result->kind = kOperandProperty;
+        result->key = add_string(c, c->text, c->text_size);
+        result->key_size = (uint32_t)c->text_size;
+        next_token(c);
+        if (!is_token(c, kTokenPunct, ")")) {
+            fail(c, "expected ')'");
+        }
+
+        next_token(c);
+        return;
+    }
+
+    fail(c, "unknown name '%.*s'", (int)c->length, c->start);
+}
+
+static void emit_string(compiler* c, const operand* property, const operand* literal, filter_compare compare)
+{
+    filter_insn insn = {.op = kOpString, .arg = (uint8_t)compare, .key = property->key,
+                        .key_size = property->key_size};
+    if (literal) {
+        insn.literal = literal->literal;
+        insn.literal_size = literal->literal_size;
+    }
+
+    emit(c, &insn, 1);
+}
+
+static void parse_comparison(compiler* c)
+{
+    operand left;
+    parse_operand(c, &left);
+    int compare = -1;
+    for (size_t i = 0; i < sizeof(kCompareOps) / sizeof(kCompareOps[0]) && c->kind == kTokenPunct; i++) {
+        if (is_token(c, kTokenPunct, kCompareOps[i].text)) {
+            compare = kCompareOps[i].compare;
+        }
+    }
+
+    if (compare < 0) {
+        if (left.kind == kOperandLiteral) {
+            fail(c, "a string on its own is not a condition");
+        } else if (left.kind == kOperandProperty) {
+            emit_string(c, &left, NULL, kComparePresent);
+        }
+
+        return;
+    }
+
+    next_token(c);
+    operand right;
+    parse_operand(c, &right);
+    if (left.kind == kOperandNumber && right.kind == kOperandNumber) {
+        emit(c, &(filter_insn){.op = kOpCompare, .arg = (uint8_t)compare}, -1);
+    } else if (compare != kCompareEq && compare != kCompareNe) {
+        fail(c, "strings can only be compared with == and !=");
+    } else if (left.kind == kOperandProperty && right.kind == kOperandLiteral) {
+        emit_string(c, &left, &right, (filter_compare)compare);
+    } else if (left.kind == kOperandLiteral && right.kind == kOperandProperty) {
+        emit_string(c, &right, &left, (filter_compare)compare);
+    } else {
+        fail(c, "profile and prop() can only be compared with a quoted string");
+    }
+}
+
+static void parse_unary(compiler* c)
+{
+    if (is_token(c, kTokenPunct, "!")) {
+        if (++c->nesting > FILTER_MAX_NESTING) {
+            fail(c, "expression nests too deeply");
+            return;
+        }
+
+        next_token(c);
+        parse_unary(c);
+        c->nesting--;
+        emit(c, &(filter_insn){.op = kOpNot}, 0);
+        return;
+    }
+
+    parse_comparison(c);
+}
+
+// Parses operands joined by an operator that short circuits, pointing all of the jumps past the last one
+static void parse_chain(compiler* c, const char* op_text, filter_op jump, void (*parse_operand)(compiler*))
+{
+    parse_operand(c);
+    const size_t first_jump = c->program.count;
+    while (!c->failed && is_token(c, kTokenPunct, op_text)) {
+        emit(c, &(filter_insn){.op = (uint8_t)jump}, -1);
+        next_token(c);
+        parse_operand(c);
+    }
+
+    for (size_t i = first_jump; i < c->program.count && !c->failed; i++) {
+        if (c->program.code[i].op == jump && c->program.code[i].target == 0) {
+            c->program.code[i].target = (uint16_t)c->program.count;
+        }
+    }
+}
+
+static void parse_and(compiler* c)
+{
+    parse_chain(c, "&&", kOpAndJump, parse_unary);
+}
+
+static void parse_or(compiler* c)
+{
+    parse_chain(c, "||", kOpOrJump, parse_and);
+}
+
+blip_filter_set_t* blip_filter_set_new(void)
+{
+    blip_filter_set_t* retVal = calloc(1, sizeof(blip_filter_set_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    for (int i = 0; i < BLIP_FILTER_MAX; i++) {
+        atomic_init(&retVal->matches[i], 0);
+    }
+
+    return retVal;
+}
+
+int blip_filter_set_add(blip_filter_set_t* filters, const char* expression, char* error, size_t error_size)
+{
+    compiler c;
+    memset(&c, 0, sizeof(c));
+    c.source = c.pos = c.start = expression;
+    c.filters = filters;
+    c.error = error;
+    c.error_size = error_size;
+    if (filters->count == BLIP_FILTER_MAX) {
+        fail(&c, "too many filters");
+        return -1;
+    }
+
+    // A string token is never longer than the expression it came from
+    c.text = malloc(strlen(expression) + 1);
+    if (!c.text) {
+        return -1;
+    }
+
+    const size_t strings_size = filters->strings_size;
+    next_token(&c);
+    parse_or(&c);
+    if (c.kind != kTokenEnd) {
+        fail(&c, "unexpected '%.*s'", (int)c.length, c.start);
+    }
+
+    free(c.text);
+    if (c.failed) {
+        free(c.program.code);
+        filters->strings_size = strings_size;
+        return -1;
+    }
+
+    filters->programs[filters->count] = c.program;
+    return (int)filters->count++;
+}
+
+uint64_t blip_filter_set_matches(const blip_filter_set_t* filters, int index)
+{
+    if (index < 0 || (unsigned)index >= filters->count) {
+        return 0;
+    }
+
+    return atomic_load_explicit(&((blip_filter_set_t*)filters)->matches[index], memory_order_relaxed);
+}
+
+void blip_filter_set_free(blip_filter_set_t* filters)
+{
+    if (!filters) {
+        return;
+    }
+
+    for (unsigned i = 0; i < filters->count; i++) {
+        free(filters->programs[i].code);
+    }
+
+    free(filters->strings);
+    free(filters);
+}
+
+// What the programs have looked up about a frame so far
+typedef struct {
+    const filter_input* input;
+    bool profile_known;
+    bool has_profile;
+    const uint8_t* profile;
+    size_t profile_size;
+} frame_view;
+
+static uint64_t field_value(const filter_input* input, filter_field field)
+{
+    switch (field) {
+        case kFieldType:
+            return input->type;
+        case kFieldFlags:
+            return input->flags;
+        case kFieldMsgNo:
+            return input->msg_no;
+        case kFieldBodySize:
+            return input->body_size;
+        case kFieldWireSize:
+            return input->wire_size;
+    }
+
+    return 0;
+}
+
+static uint64_t compare_values(uint64_t a, uint64_t b, filter_compare compare)
+{
+    switch (compare) {
+        case kCompareEq:
+            return a == b;
+        case kCompareNe:
+            return a != b;
+        case kCompareLt:
+            return a < b;
+        case kCompareLe:
+            return a <= b;
+        case kCompareGt:
+            return a > b;
+        case kCompareGe:
+            return a >= b;
+        case kCompareAnd:
+            return a & b;
+        default:
+            return 0;
+    }
+}
+
+static uint64_t test_string(const blip_filter_set_t* filters, const filter_insn* insn, frame_view* view)
+{
+    const uint8_t* value;
+    size_t value_size;
+    bool found;
+    if (insn->key == PROFILE_KEY) {
+        // Every filter of the set tends to ask about the profile, so it is only looked up once
+        if (!view->profile_known) {
+            const filter_input* input = view->input;
+            view->has_profile = blip_find_wire_property(input->properties, input->properties_size, "Profile", 7,
+                                                        &view->profile, &view->profile_size);
+            view->profile_known = true;
+        }
+
+        found = view->has_profile;
+        value = view->profile;
+        value_size = view->profile_size;
+    } else {
+        found = blip_find_wire_property(view->input->properties, view->input->properties_size,
+                                        filters->strings + insn->key, insn->key_size, &value, &value_size);
+    }
+
+    if (insn->arg == kComparePresent) {
+        return found;
+    }
+
+    const bool equal = found && value_size == insn->literal_size
+                       && memcmp(value, filters->strings + insn->literal, value_size) == 0;
+    return insn->arg == kCompareEq ? equal : !equal;
+}
+
+static bool run_program(const blip_filter_set_t* filters, const filter_program* program, frame_view* view)
+{
+    uint64_t stack[FILTER_MAX_STACK];
+    size_t top = 0;
+    for (size_t pc = 0; pc < program->count; pc++) {
+        const filter_insn* insn = &program->code[pc];
+        switch (insn->op) {
+            case kOpField:
+                stack[top++] = field_value(view->input, (filter_field)insn->arg);
+                break;
+            case kOpConst:
+                stack[top++] = insn->value;
+                break;
+            case kOpCompare:
+                top--;
+                stack[top - 1] = compare_values(stack[top - 1], stack[top], (filter_compare)insn->arg);
+                break;
+            case kOpString:
+                stack[top++] = test_string(filters, insn, view);
+                break;
+            case kOpNot:
+                stack[top - 1] = stack[top - 1] == 0;
+                break;
+            case kOpAndJump:
+            case kOpOrJump:
+                if ((stack[top - 1] != 0) == (insn->op == kOpOrJump)) {
+                    pc = insn->target - 1;
+                } else {
+                    top--;
+                }
+
+                break;
+        }
+    }
+
+    return top > 0 && stack[top - 1] != 0;
+}
+
+uint64_t filter_set_evaluate(const blip_filter_set_t* filters, const filter_input* input)
+{
+    frame_view view;
+    memset(&view, 0, sizeof(view));
+    view.input = input;
+    uint64_t retVal = 0;
+    for (unsigned i = 0; i < filters->count; i++) {
+        if (run_program(filters, &filters->programs[i], &view)) {
+            retVal |= 1ULL << i;
+            atomic_fetch_add_explicit(&((blip_filter_set_t*)filters)->matches[i], 1, memory_order_relaxed);
+        }
+    }
+
+    return retVal;
+}
+
+int blip_message_read_filtered(const blip_connection_t* connection, blip_message_t* msg, const uint8_t* data,
+                               size_t size, const blip_filter_set_t* filters, uint64_t* matched)
+{
+    filter_input input;
+    memset(&input, 0, sizeof(input));
+    input.wire_size = size;
+    uint8_t* pos = (uint8_t*)data;
+    size_t rem = size;
+    pos = get_varint(pos, &rem, &input.msg_no);
+    uint64_t raw_flags;
+    pos = get_varint(pos, &rem, &raw_flags);
+    input.flags = (FrameFlags)(raw_flags & ~kTypeMask);
+    input.type = (MessageType)(raw_flags & kTypeMask);
+
+    // ACKs don't touch the connection, so those only need their header looked at
+    const uint8_t* inflated = NULL;
+    size_t inflated_size = 0;
+    const bool normal = input.type < kAckRequestType;
+    if (normal && filter_normal_msg((blip_connection_t*)connection, pos, rem, &input, &inflated, &inflated_size) < 0) {
+        return -1;
+    }
+
+    *matched = filter_set_evaluate(filters, &input);
+    if (*matched == 0) {
+        return normal ? skip_normal_msg((blip_connection_t*)connection, &input, pos, rem) : 0;
+    }
+
+    return frame_decode_into(connection, msg, data, size, inflated, inflated_size) < 0 ? -1 : 1;
+}
@@ -0,0 +1,39 @@
+//
+//  filter.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip_filter.h"
+
+/** The fields of a frame that filters can test, gathered without decoding the message */
+typedef struct {
+    MessageNo msg_no;
+    MessageType type;
+    FrameFlags flags;
+    size_t wire_size;               ///< The size of the raw frame
+    size_t body_size;               ///< The size of the (inflated) body
+    const uint8_t* properties;      ///< The properties in wire form (NUL separated), or NULL
+    size_t properties_size;         ///< The size of properties, including the final NUL
+} filter_input;
+
+/**
+ * Runs every filter of a set against a frame and counts the ones that match
+ * @param filters   The filters to run
+ * @param input     The fields of the frame
+ * @return          A mask with bit n set if filter n matched
+ */
+uint64_t filter_set_evaluate(const blip_filter_set_t* filters, const filter_input* input);
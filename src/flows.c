@@ -0,0 +1,466 @@
+//
+//  flows.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_flows.h"
+#include "probe.h"
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define NO_ENTRY UINT32_MAX
+#define PACK_LEVEL 1
+#define PACK_MEM_LEVEL 8
+
+typedef struct {
+    uint32_t hash;
+    uint32_t entry;     // Index into entries plus one, 0 for an empty slot
+} flow_slot;
+
+// The live and hibernated flows are kept in separate LRU lists, so either kind can be
+// picked off the cold end without walking past the other
+typedef struct {
+    uint32_t head;      // Most recently used
+    uint32_t tail;      // Least recently used
+} lru_list;
+
+typedef struct {
+    blip_flow_key key;
+    uint32_t hash;
+    uint32_t prev;
+    uint32_t next;      // Also links the free entries together
+    blip_connection_t* connection;
+    uint8_t* blob;      // Compressed checkpoint while hibernated, NULL while live
+    size_t blob_size;
+    size_t raw_size;
+    size_t bytes;       // What the flow counted towards the budget when last measured
+    uint64_t last_used;
+} flow_entry;
+
+struct blip_flow_table
+{
+    blip_flow_table_options options;
+    flow_slot* slots;
+    size_t mask;
+    flow_entry* entries;
+    uint32_t free_head;
+    lru_list live;
+    lru_list hibernated;
+    blip_flow_table_stats stats;
+
+    z_stream* packer;           // Created on the first hibernation
+    z_stream* unpacker;
+    uint8_t* scratch;           // Holds an uncompressed checkpoint
+    size_t scratch_capacity;
+};
+
+static uint32_t flow_hash(const blip_flow_key* key)
+{
+    return blip_profile_hash((const uint8_t*)key, sizeof(blip_flow_key));
+}
+
+static void lru_unlink(blip_flow_table_t* table, lru_list* list, uint32_t index)
+{
+    flow_entry* entry = &table->entries[index];
+    if (entry->prev != NO_ENTRY) {
+        table->entries[entry->prev].next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+
+    if (entry->next != NO_ENTRY) {
+        table->entries[entry->next].prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+}
+
+static void lru_push(blip_flow_table_t* table, lru_list* list, uint32_t index)
+{
+    flow_entry* entry = &table->entries[index];
+    entry->prev = NO_ENTRY;
+    entry->next = list->head;
+    if (list->head != NO_ENTRY) {
+        table->entries[list->head].prev = index;
+    } else {
+        list->tail = index;
+    }
+
+    list->head = index;
+}
+
+static void measure(blip_flow_table_t* table, flow_entry* entry)
+{
+    const size_t bytes = blip_connection_memory_usage(entry->connection) + entry->blob_size;
+    table->stats.memory = table->stats.memory - entry->bytes + bytes;
+    entry->bytes = bytes;
+}
+
+static flow_slot* find_slot(blip_flow_table_t* table, const blip_flow_key* key, uint32_t hash)
+{
+    size_t slot = hash & table->mask;
+    while (table->slots[slot].entry != 0) {
+        const flow_slot* candidate = &table->slots[slot];
+        if (candidate->hash == hash
+            && memcmp(&table->entries[candidate->entry - 1].key, key, sizeof(blip_flow_key)) == 0) {
+            return &table->slots[slot];
+        }
+
+        slot = (slot + 1) & table->mask;
+    }
+
+    return &table->slots[slot];
+}
+
+static bool flow_slot_home(const void* slot, size_t mask, size_t* home)
+{
+    const flow_slot* s = slot;
+    *home = s->hash & mask;
+    return s->entry != 0;
+}
+
+static void remove_slot(blip_flow_table_t* table, flow_slot* removed)
+{
+    probe_remove(table->slots, sizeof(flow_slot), table->mask, removed - table->slots, flow_slot_home);
+}
+
+static void evict(blip_flow_table_t* table, uint32_t index)
+{
+    flow_entry* entry = &table->entries[index];
+    remove_slot(table, find_slot(table, &entry->key, entry->hash));
+    if (entry->blob) {
+        lru_unlink(table, &table->hibernated, index);
+        table->stats.hibernated--;
+    } else {
+        lru_unlink(table, &table->live, index);
+    }
+
+    table->stats.memory -= entry->bytes;
+    table->stats.flows--;
+    blip_connection_free(entry->connection);
+    free(entry->blob);
+    memset(entry, 0, sizeof(flow_entry));
+    entry->next = table->free_head;
+    table->free_head = index;
+}
+
+static int reserve_scratch(blip_flow_table_t* table, size_t size)
+{
+    if (size <= table->scratch_capacity) {
+        return 0;
+    }
+
+    uint8_t* grown = realloc(table->scratch, size);
+    if (!grown) {
+        return -1;
+    }
+
+    table->scratch = grown;
+    table->scratch_capacity = size;
+    return 0;
+}
+
+static int hibernate(blip_flow_table_t* table, uint32_t index)
+{
+    flow_entry* entry = &table->entries[index];
+    if (!table->packer) {
+        table->packer = calloc(1, sizeof(z_stream));
+        if (!table->packer || deflateInit2(table->packer, PACK_LEVEL, Z_DEFLATED, -MAX_WBITS, PACK_MEM_LEVEL,
+                                           Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(table->packer);
+            table->packer = NULL;
+            return -1;
+        }
+    }
+
+    const size_t capacity = blip_connection_checkpoint(entry->connection, NULL, 0);
+    if (reserve_scratch(table, capacity) < 0) {
+        return -1;
+    }
+
+    const size_t raw_size = blip_connection_checkpoint(entry->connection, table->scratch, capacity);
+    if (raw_size == 0 || raw_size > capacity || deflateReset(table->packer) != Z_OK) {
+        return -1;
+    }
+
+    const size_t bound = deflateBound(table->packer, (uLong)raw_size);
+    uint8_t* blob = malloc(bound);
+    if (!blob) {
+        return -1;
+    }
+
+    table->packer->next_in = table->scratch;
+    table->packer->avail_in = (uInt)raw_size;
+    table->packer->next_out = blob;
+    table->packer->avail_out = (uInt)bound;
+    if (deflate(table->packer, Z_FINISH) != Z_STREAM_END) {
+        free(blob);
+        return -1;
+    }
+
+    const size_t blob_size = bound - table->packer->avail_out;
+    uint8_t* shrunk = realloc(blob, blob_size);
+    entry->blob = shrunk ? shrunk : blob;
+    entry->blob_size = blob_size;
+    entry->raw_size = raw_size;
+    blip_connection_release_streams(entry->connection, true, true);
+
+    // The partially received messages are in the blob too (revival swaps in a set rebuilt from
+    // it), so an empty set is all the connection needs to hold on to meanwhile
+    hashset_t empty = hashset_create();
+    if (empty) {
+        hashset_destroy(entry->connection->started_msg_set);
+        entry->connection->started_msg_set = empty;
+    }
+
+    lru_unlink(table, &table->live, index);
+    lru_push(table, &table->hibernated, index);
+    measure(table, entry);
+    table->stats.hibernated++;
+    table->stats.hibernations++;
+    return 0;
+}
+
+static int revive(blip_flow_table_t* table, uint32_t index)
+{
+    flow_entry* entry = &table->entries[index];
+    if (!table->unpacker) {
+        table->unpacker = calloc(1, sizeof(z_stream));
+        if (!table->unpacker || inflateInit2(table->unpacker, -MAX_WBITS) != Z_OK) {
+            free(table->unpacker);
+            table->unpacker = NULL;
+            return -1;
+        }
+    }
+
+    if (reserve_scratch(table, entry->raw_size) < 0 || inflateReset(table->unpacker) != Z_OK) {
+        return -1;
+    }
+
+    table->unpacker->next_in = entry->blob;
+    table->unpacker->avail_in = (uInt)entry->blob_size;
+    table->unpacker->next_out = table->scratch;
+    table->unpacker->avail_out = (uInt)entry->raw_size;
+    if (inflate(table->unpacker, Z_FINISH) != Z_STREAM_END
+        || blip_connection_restore(entry->connection, table->scratch, entry->raw_size) < 0) {
+        return -1;
+    }
+
+    free(entry->blob);
+    entry->blob = NULL;
+    entry->blob_size = 0;
+    lru_unlink(table, &table->hibernated, index);
+    lru_push(table, &table->live, index);
+    table->stats.hibernated--;
+    table->stats.revivals++;
+    return 0;
+}
+
+// Hibernates the coldest live flows, and then evicts the coldest hibernated ones, until the
+// table is back within its budget.  The flow that was just looked up is left alone.
+static void enforce_budget(blip_flow_table_t* table, uint32_t keep)
+{
+    if (table->options.memory_budget == 0) {
+        return;
+    }
+
+    while (table->stats.memory > table->options.memory_budget) {
+        const uint32_t coldest = table->live.tail;
+        if (coldest != NO_ENTRY && coldest != keep) {
+            if (hibernate(table, coldest) < 0) {
+                evict(table, coldest);
+                table->stats.evictions++;
+            }
+
+            continue;
+        }
+
+        if (table->hibernated.tail == NO_ENTRY) {
+            return;
+        }
+
+        evict(table, table->hibernated.tail);
+        table->stats.evictions++;
+    }
+}
+
+blip_flow_table_t* blip_flow_table_new(const blip_flow_table_options* options)
+{
+    if (options->capacity == 0 || options->capacity >= NO_ENTRY / 2) {
+        return NULL;
+    }
+
+    blip_flow_table_t* retVal = calloc(1, sizeof(blip_flow_table_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    size_t slot_count = 16;
+    while (slot_count < options->capacity * 2) {
+        slot_count <<= 1;
+    }
+
+    retVal->options = *options;
+    retVal->mask = slot_count - 1;
+    retVal->slots = calloc(slot_count, sizeof(flow_slot));
+    retVal->entries = calloc(options->capacity, sizeof(flow_entry));
+    if (!retVal->slots || !retVal->entries) {
+        blip_flow_table_free(retVal);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < options->capacity; i++) {
+        retVal->entries[i].next = i + 1 < options->capacity ? (uint32_t)(i + 1) : NO_ENTRY;
+    }
+
+    retVal->free_head = 0;
+    retVal->live.head = retVal->live.tail = NO_ENTRY;
+    retVal->hibernated.head = retVal->hibernated.tail = NO_ENTRY;
+    return retVal;
+}
+
+blip_connection_t* blip_flow_table_get(blip_flow_table_t* table, const blip_flow_key* key, uint64_t now_ns)
+{
+    const uint32_t hash = flow_hash(key);
+    flow_slot* slot = find_slot(table, key, hash);
+    uint32_t index;
+    if (slot->entry != 0) {
+        index = slot->entry - 1;
+        if (!table->entries[index].blob) {
+            lru_unlink(table, &table->live, index);
+            lru_push(table, &table->live, index);
+        } else if (revive(table, index) < 0) {
+            // Its decoding state is gone either way, so rather than failing every later lookup
+            // the flow starts over with a fresh connection
+            evict(table, index);
+            table->stats.evictions++;
+            slot = find_slot(table, key, hash);
+        }
+    }
+
+    if (slot->entry == 0) {
+        if (table->free_head == NO_ENTRY) {
+            // Full, so the coldest flow makes way (hibernated ones first, they are the least active)
+            evict(table, table->hibernated.tail != NO_ENTRY ? table->hibernated.tail : table->live.tail);
+            table->stats.evictions++;
+            slot = find_slot(table, key, hash);
+        }
+
+        blip_connection_t* connection = blip_connection_new();
+        if (!connection) {
+            return NULL;
+        }
+
+        index = table->free_head;
+        flow_entry* entry = &table->entries[index];
+        table->free_head = entry->next;
+        entry->key = *key;
+        entry->hash = hash;
+        entry->connection = connection;
+        slot->hash = hash;
+        slot->entry = index + 1;
+        lru_push(table, &table->live, index);
+        table->stats.flows++;
+    }
+
+    flow_entry* entry = &table->entries[index];
+    entry->last_used = now_ns;
+    measure(table, entry);
+    enforce_budget(table, index);
+    return entry->connection;
+}
+
+int blip_flow_table_remove(blip_flow_table_t* table, const blip_flow_key* key)
+{
+    const flow_slot* slot = find_slot(table, key, flow_hash(key));
+    if (slot->entry == 0) {
+        return -1;
+    }
+
+    evict(table, slot->entry - 1);
+    return 0;
+}
+
+size_t blip_flow_table_expire(blip_flow_table_t* table, uint64_t now_ns)
+{
+    size_t retVal = 0;
+    const uint64_t evict_after = table->options.evict_after_ns;
+    const uint64_t hibernate_after = table->options.hibernate_after_ns;
+    while (evict_after > 0 && table->hibernated.tail != NO_ENTRY
+           && now_ns - table->entries[table->hibernated.tail].last_used >= evict_after) {
+        evict(table, table->hibernated.tail);
+        table->stats.evictions++;
+        retVal++;
+    }
+
+    while (table->live.tail != NO_ENTRY) {
+        const uint32_t coldest = table->live.tail;
+        const uint64_t idle = now_ns - table->entries[coldest].last_used;
+        if (evict_after > 0 && idle >= evict_after) {
+            evict(table, coldest);
+            table->stats.evictions++;
+        } else if (hibernate_after > 0 && idle >= hibernate_after) {
+            if (hibernate(table, coldest) < 0) {
+                evict(table, coldest);
+                table->stats.evictions++;
+            }
+        } else {
+            break;
+        }
+
+        retVal++;
+    }
+
+    return retVal;
+}
+
+void blip_flow_table_get_stats(const blip_flow_table_t* table, blip_flow_table_stats* stats)
+{
+    *stats = table->stats;
+}
+
+void blip_flow_table_free(blip_flow_table_t* table)
+{
+    if (!table) {
+        return;
+    }
+
+    if (table->entries) {
+        for (size_t i = 0; i < table->options.capacity; i++) {
+            if (table->entries[i].connection) {
+                blip_connection_free(table->entries[i].connection);
+                free(table->entries[i].blob);
+            }
+        }
+    }
+
+    if (table->packer) {
+        deflateEnd(table->packer);
+        free(table->packer);
+    }
+
+    if (table->unpacker) {
+        inflateEnd(table->unpacker);
+        free(table->unpacker);
+    }
+
+    free(table->scratch);
+    free(table->entries);
+    free(table->slots);
+    free(table);
+}
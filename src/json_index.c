@@ -0,0 +1,343 @@
+//
+//  json_index.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "json_index.h"
+#include "cblip_json.h"
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+// JSON_INDEX_SCALAR builds the portable classifier even where SSE2 is available, which the
+// tests use to check one against the other
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(JSON_INDEX_SCALAR)
+#include <emmintrin.h>
+#define JSON_INDEX_SSE2 1
+#endif
+
+// Stage one of simdjson (https://arxiv.org/abs/1902.08318), minus UTF-8 validation: classify
+// 64 bytes at a time into bitmasks, resolve escapes and string interiors with carry-less bit
+// tricks, and emit the positions of the structural bits that are left.
+
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;        // { } [ ] : ,
+} block_masks;
+
+#ifndef JSON_INDEX_SSE2
+static uint64_t char_mask(const uint8_t* block, uint8_t c)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i++) {
+        mask |= (uint64_t)(block[i] == c) << i;
+    }
+
+    return mask;
+}
+#endif
+
+static void classify_block(const uint8_t* block, block_masks* masks)
+{
+#ifdef JSON_INDEX_SSE2
+    uint64_t quote = 0, backslash = 0, op = 0;
+    for (int i = 0; i < 4; i++) {
+        const __m128i in = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+        const __m128i ops = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('{')), _mm_cmpeq_epi8(in, _mm_set1_epi8('}'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('[')), _mm_cmpeq_epi8(in, _mm_set1_epi8(']')))),
+            _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(':')), _mm_cmpeq_epi8(in, _mm_set1_epi8(','))));
+        quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('"'))) << (16 * i);
+        backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('\\'))) << (16 * i);
+        op |= (uint64_t)(uint16_t)_mm_movemask_epi8(ops) << (16 * i);
+    }
+
+    masks->quote = quote;
+    masks->backslash = backslash;
+    masks->op = op;
+#else
+    masks->quote = char_mask(block, '"');
+    masks->backslash = char_mask(block, '\\');
+    masks->op = char_mask(block, '{') | char_mask(block, '}')
+                | char_mask(block, '[') | char_mask(block, ']')
+                | char_mask(block, ':') | char_mask(block, ',');
+#endif
+}
+
+// Returns the bits of characters that are escaped, i.e. that follow an odd length run of backslashes
+static uint64_t find_escaped(uint64_t backslash, uint64_t* prev_ends_odd_backslash)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    const uint64_t odd_bits = ~even_bits;
+    const uint64_t start_edges = backslash & ~(backslash << 1);
+    const uint64_t even_start_mask = even_bits ^ *prev_ends_odd_backslash;
+    const uint64_t even_starts = start_edges & even_start_mask;
+    const uint64_t odd_starts = start_edges & ~even_start_mask;
+    const uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries = backslash + odd_starts;
+    const bool ends_odd_backslash = odd_carries < backslash;
+    odd_carries |= *prev_ends_odd_backslash;
+    *prev_ends_odd_backslash = ends_odd_backslash ? 1 : 0;
+    const uint64_t even_carry_ends = even_carries & ~backslash;
+    const uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+// Sets every bit from an opening quote up to (not including) its closing quote
+static uint64_t prefix_xor(uint64_t bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+static int append_positions(json_tape* tape, uint64_t bits, uint32_t base)
+{
+    const size_t needed = tape->count + 64;
+    if (needed > tape->capacity) {
+        size_t new_capacity = tape->capacity ? tape->capacity * 2 : 256;
+        while (new_capacity < needed) {
+            new_capacity *= 2;
+        }
+
+        uint32_t* grown = realloc(tape->positions, new_capacity * sizeof(uint32_t));
+        if (!grown) {
+            return -1;
+        }
+
+        tape->positions = grown;
+        tape->capacity = new_capacity;
+    }
+
+    uint32_t* out = tape->positions + tape->count;
+    while (bits) {
+#if defined(_MSC_VER)
+        unsigned long bit;
+        _BitScanForward64(&bit, bits);
+#else
+        const int bit = __builtin_ctzll(bits);
+#endif
+        *out++ = base + (uint32_t)bit;
+        bits &= bits - 1;
+    }
+
+    tape->count = out - tape->positions;
+    return 0;
+}
+
+int json_index_build(json_tape* tape, const uint8_t* json, size_t size)
+{
+    tape->count = 0;
+    if (size > UINT32_MAX) {
+        return -1;
+    }
+
+    uint64_t prev_ends_odd_backslash = 0;
+    uint64_t prev_in_string = 0;
+    uint8_t tail[64];
+    for (size_t offset = 0; offset < size; offset += 64) {
+        const uint8_t* block = json + offset;
+        if (size - offset < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, size - offset);
+            block = tail;
+        }
+
+        block_masks masks;
+        classify_block(block, &masks);
+        const uint64_t escaped = find_escaped(masks.backslash, &prev_ends_odd_backslash);
+        const uint64_t quotes = masks.quote & ~escaped;
+        const uint64_t in_string = prefix_xor(quotes) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+        if (append_positions(tape, (masks.op & ~in_string) | quotes, (uint32_t)offset) < 0) {
+            return -1;
+        }
+    }
+
+    // An unterminated string means the document is malformed
+    return prev_in_string ? -1 : 0;
+}
+
+void json_index_free(json_tape* tape)
+{
+    free(tape->positions);
+    tape->positions = NULL;
+    tape->count = tape->capacity = 0;
+}
+
+static uint8_t token_at(const json_tape* tape, const uint8_t* json, size_t index)
+{
+    return index < tape->count ? json[tape->positions[index]] : 0;
+}
+
+size_t json_skip_value(const json_tape* tape, const uint8_t* json, size_t index)
+{
+    const uint8_t token = token_at(tape, json, index);
+    if (token == '"') {
+        return index + 2;
+    }
+
+    if (token != '{' && token != '[') {
+        return index;
+    }
+
+    size_t depth = 0;
+    for (; index < tape->count; index++) {
+        const uint8_t c = json[tape->positions[index]];
+        if (c == '"') {
+            index++;    // Skip the closing quote too, so string contents never count
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            return index + 1;
+        }
+    }
+
+    return tape->count;
+}
+
+static bool is_whitespace(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+size_t json_read_value(const json_tape* tape, const uint8_t* json, size_t index,
+                       const uint8_t** value, size_t* value_size)
+{
+    if (index + 1 >= tape->count) {
+        return tape->count;
+    }
+
+    // Find where the value starts, which may or may not be a structural character itself
+    uint32_t start = tape->positions[index] + 1;
+    while (is_whitespace(json[start])) {
+        start++;
+    }
+
+    const bool is_token = tape->positions[index + 1] == start;
+    const uint8_t token = json[start];
+    if (is_token && token != '"' && token != '{' && token != '[') {
+        // Nothing between the separator and the next one, as in an empty array
+        *value = json + start;
+        *value_size = 0;
+        return index + 1;
+    }
+
+    const size_t next = is_token ? json_skip_value(tape, json, index + 1) : index + 1;
+    if (next >= tape->count) {
+        return tape->count;
+    }
+
+    if (is_token && token == '"') {
+        *value = json + start + 1;
+        *value_size = tape->positions[index + 2] - start - 1;
+    } else {
+        uint32_t end = is_token ? tape->positions[next - 1] + 1 : tape->positions[next];
+        while (end > start && is_whitespace(json[end - 1])) {
+            end--;
+        }
+
+        *value = json + start;
+        *value_size = end - start;
+    }
+
+    return next;
+}
+
+bool json_object_find(const json_tape* tape, const uint8_t* json, size_t object, const char* key, size_t key_size,
+                      const uint8_t** value, size_t* value_size)
+{
+    if (token_at(tape, json, object) != '{') {
+        return false;
+    }
+
+    size_t i = object + 1;
+    while (token_at(tape, json, i) == '"' && token_at(tape, json, i + 2) == ':') {
+        const uint32_t key_start = tape->positions[i] + 1;
+        const uint32_t key_end = tape->positions[i + 1];
+        const bool match = key_end - key_start == key_size && memcmp(json + key_start, key, key_size) == 0;
+
+        const uint8_t* found;
+        size_t found_size;
+        const size_t next = json_read_value(tape, json, i + 2, &found, &found_size);
+        if (next >= tape->count) {
+            return false;
+        }
+
+        if (match) {
+            *value = found;
+            *value_size = found_size;
+            return true;
+        }
+
+        if (token_at(tape, json, next) != ',') {
+            return false;
+        }
+
+        i = next + 1;
+    }
+
+    return false;
+}
+
+const json_tape* json_message_tape(blip_message_t* msg)
+{
+    json_tape* tape = (json_tape*)msg->private[5];
+    if (!tape) {
+        if (msg->type >= kAckRequestType || !msg->body) {
+            return NULL;
+        }
+
+        tape = calloc(1, sizeof(json_tape));
+        if (!tape) {
+            return NULL;
+        }
+
+        if (json_index_build(tape, msg->body, msg->body_size) < 0) {
+            json_index_free(tape);
+            free(tape);
+            return NULL;
+        }
+
+        msg->private[5] = (uint64_t)tape;
+    }
+
+    return tape;
+}
+
+int blip_body_find(blip_message_t* msg, const char* key, const uint8_t** value, size_t* value_size)
+{
+    const json_tape* tape = json_message_tape(msg);
+    if (!tape) {
+        return -1;
+    }
+
+    return json_object_find(tape, msg->body, 0, key, strlen(key), value, value_size) ? 0 : -1;
+}
+
+void blip_body_index_free(blip_message_t* msg)
+{
+    json_tape* tape = (json_tape*)msg->private[5];
+    if (tape) {
+        json_index_free(tape);
+        free(tape);
+        msg->private[5] = 0;
+    }
+}
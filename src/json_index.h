@@ -0,0 +1,98 @@
+//
+//  json_index.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The positions of every structural character ({ } [ ] : ,) outside of strings, and of every
+ * unescaped quote, in a JSON document.  This is enough to navigate the document without
+ * tokenizing or materializing it.
+ */
+typedef struct {
+    uint32_t* positions;
+    size_t count;
+    size_t capacity;
+} json_tape;
+
+/**
+ * Builds the structural tape for a JSON document, 64 bytes at a time
+ * @param tape  The tape to fill (its storage is reused if it has any)
+ * @param json  The JSON document
+ * @param size  The size of the JSON document (at most UINT32_MAX)
+ * @return      0 on success, negative values on failure
+ */
+int json_index_build(json_tape* tape, const uint8_t* json, size_t size);
+
+/**
+ * Frees the storage of a tape
+ * @param tape The tape to free
+ */
+void json_index_free(json_tape* tape);
+
+/**
+ * Reads the value that follows a separator ([ , or :).  String values are returned without
+ * their quotes (escape sequences are left as they are), everything else as its raw JSON text,
+ * and nothing before a closing bracket as an empty value.
+ * @param tape          The structural tape of the document
+ * @param json          The JSON document
+ * @param index         The tape index of the separator before the value
+ * @param value         On success, points to the value text
+ * @param value_size    On success, contains the size of the value text
+ * @return              The tape index of the separator or closing bracket after the value,
+ *                      or the tape count if the document ends first
+ */
+size_t json_read_value(const json_tape* tape, const uint8_t* json, size_t index,
+                       const uint8_t** value, size_t* value_size);
+
+/**
+ * Looks up a key of the object that starts at a given tape position.  String values are
+ * returned without their quotes (escape sequences are left as they are), everything else
+ * as its raw JSON text.
+ * @param tape          The structural tape of the document
+ * @param json          The JSON document
+ * @param object        The tape index of the object's opening brace
+ * @param key           The key to look for (compared against the raw key text)
+ * @param key_size      The size of the key
+ * @param value         On success, points to the value text
+ * @param value_size    On success, contains the size of the value text
+ * @return              true if the key was found
+ */
+bool json_object_find(const json_tape* tape, const uint8_t* json, size_t object, const char* key, size_t key_size,
+                      const uint8_t** value, size_t* value_size);
+
+/**
+ * Finds the tape index just past the value that starts at a given tape index (for nested
+ * objects and arrays, past the matching closing bracket)
+ * @param tape  The structural tape of the document
+ * @param json  The JSON document
+ * @param index The tape index of the start of the value
+ * @return      The tape index after the value
+ */
+size_t json_skip_value(const json_tape* tape, const uint8_t* json, size_t index);
+
+/**
+ * Returns the tape of a message body, building it on first use and keeping it in the message
+ * until blip_body_index_free() or blip_message_free()
+ * @param msg   The message whose body to index
+ * @return      The tape, or NULL if the message has no body or it is not well formed
+ */
+const json_tape* json_message_tape(blip_message_t* msg);
@@ -0,0 +1,180 @@
+//
+//  kernels_x86.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cpu.h"
+
+#ifdef CBLIP_CPU_X86
+#include <immintrin.h>
+#include <string.h>
+
+// Every function in here is compiled for a specific instruction set with a target attribute,
+// and must only be called once cpu.c has checked that the CPU supports it.
+
+/*
+ * CRC-32 by carry-less multiplication folding, from Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction".  The constants are for the bit reflected zlib
+ * polynomial, the same ones the Linux crc32-pclmul driver uses:
+ *   k1 = x^(4*128+32) mod P,  k2 = x^(4*128-32) mod P   (fold by 4 x 128 bits)
+ *   k3 = x^(128+32) mod P,    k4 = x^(128-32) mod P     (fold by 128 bits)
+ *   k5 = x^64 mod P                                     (fold 96 bits down to 64)
+ *   P' and u = floor(x^64 / P) for the final Barrett reduction
+ */
+static const uint64_t kFold4[2] __attribute__((aligned(16))) = {0x0154442bd4ULL, 0x01c6e41596ULL};
+static const uint64_t kFold1[2] __attribute__((aligned(16))) = {0x01751997d0ULL, 0x00ccaa009eULL};
+static const uint64_t kFold64[2] __attribute__((aligned(16))) = {0x0163cd6124ULL, 0};
+static const uint64_t kBarrett[2] __attribute__((aligned(16))) = {0x01db710641ULL, 0x01f7011641ULL};
+
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i fold(__m128i acc, __m128i k, __m128i next)
+{
+    const __m128i lo = _mm_clmulepi64_si128(acc, k, 0x00);
+    const __m128i hi = _mm_clmulepi64_si128(acc, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+// Folds a multiple of 16 bytes (at least 64) into a CRC.  The state is the raw (not inverted)
+// CRC register, as opposed to the finished value that zlib takes and returns.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold(uint32_t state, const uint8_t* data, size_t size)
+{
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)state));
+    data += 64;
+    size -= 64;
+
+    __m128i k = _mm_load_si128((const __m128i*)kFold4);
+    while (size >= 64) {
+        x1 = fold(x1, k, _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = fold(x2, k, _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = fold(x3, k, _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = fold(x4, k, _mm_loadu_si128((const __m128i*)(data + 0x30)));
+        data += 64;
+        size -= 64;
+    }
+
+    k = _mm_load_si128((const __m128i*)kFold1);
+    x1 = fold(x1, k, x2);
+    x1 = fold(x1, k, x3);
+    x1 = fold(x1, k, x4);
+    while (size >= 16) {
+        x1 = fold(x1, k, _mm_loadu_si128((const __m128i*)data));
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 -> 96 -> 64 bits
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k, 0x10));
+    k = _mm_loadl_epi64((const __m128i*)kFold64);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k, 0x00));
+
+    // Barrett reduction down to 32 bits
+    k = _mm_load_si128((const __m128i*)kBarrett);
+    __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, low32), k, 0x00);
+    return (uint32_t)_mm_extract_epi32(_mm_xor_si128(x1, t), 1);
+}
+
+uint32_t crc32_pclmul(uint32_t crc, const uint8_t* data, size_t size)
+{
+    if (size < 64) {
+        return crc32_scalar(crc, data, size);
+    }
+
+    const size_t folded = size & ~(size_t)15;
+    crc = ~crc32_fold(~crc, data, folded);
+    return crc32_scalar(crc, data + folded, size - folded);
+}
+
+// Decodes varints of up to eight bytes with one load and a PEXT that drops the continuation
+// bits; anything longer (or too close to the end of the buffer) takes the scalar path
+__attribute__((target("bmi2")))
+size_t get_uvarint_bmi2(const uint8_t* buf, size_t size, uint64_t* n)
+{
+    if (size < 8) {
+        return get_uvarint_scalar(buf, size, n);
+    }
+
+    uint64_t word;
+    memcpy(&word, buf, sizeof(word));
+    const uint64_t stops = ~word & 0x8080808080808080ULL;
+    if (stops == 0) {
+        return get_uvarint_scalar(buf, size, n);
+    }
+
+    const size_t length = ((size_t)__builtin_ctzll(stops) >> 3) + 1;
+    const uint64_t mask = length == 8 ? ~0ULL : (1ULL << (length * 8)) - 1;
+    *n = _pext_u64(word & mask, 0x7F7F7F7F7F7F7F7FULL);
+    return length;
+}
+
+void replace_byte_sse2(uint8_t* data, size_t size, uint8_t from, uint8_t to)
+{
+    const __m128i f = _mm_set1_epi8((char)from);
+    const __m128i t = _mm_set1_epi8((char)to);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        const __m128i eq = _mm_cmpeq_epi8(v, f);
+        if (_mm_movemask_epi8(eq)) {
+            _mm_storeu_si128((__m128i*)(data + i), _mm_or_si128(_mm_and_si128(eq, t), _mm_andnot_si128(eq, v)));
+        }
+    }
+
+    replace_byte_scalar(data + i, size - i, from, to);
+}
+
+__attribute__((target("avx2")))
+void replace_byte_avx2(uint8_t* data, size_t size, uint8_t from, uint8_t to)
+{
+    const __m256i f = _mm256_set1_epi8((char)from);
+    const __m256i t = _mm256_set1_epi8((char)to);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        const __m256i eq = _mm256_cmpeq_epi8(v, f);
+        if (_mm256_movemask_epi8(eq)) {
+            _mm256_storeu_si256((__m256i*)(data + i), _mm256_blendv_epi8(v, t, eq));
+        }
+    }
+
+    replace_byte_sse2(data + i, size - i, from, to);
+}
+
+// Masked loads and stores never touch the bytes outside of the mask, so the tail needs no
+// scalar loop
+__attribute__((target("avx512f,avx512bw")))
+void replace_byte_avx512(uint8_t* data, size_t size, uint8_t from, uint8_t to)
+{
+    const __m512i f = _mm512_set1_epi8((char)from);
+    const __m512i t = _mm512_set1_epi8((char)to);
+    for (size_t i = 0; i < size; i += 64) {
+        const size_t rem = size - i;
+        const __mmask64 in = rem >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << rem) - 1;
+        const __m512i v = _mm512_maskz_loadu_epi8(in, data + i);
+        const __mmask64 eq = _mm512_mask_cmpeq_epi8_mask(in, v, f);
+        if (eq) {
+            _mm512_mask_storeu_epi8(data + i, eq, t);
+        }
+    }
+}
+
+#endif
@@ -17,108 +17,306 @@
 // 
 
 #include "msg_handler.h"
+#include "ack_handler.h"
 #include "hashset.h"
 #include "types.h"
 #include "cblip_endian.h"
+#include "cpu.h"
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <zlib.h>
 #include <stdlib.h>
 
-#define BLIP_BODY_CHECKSUM_SIZE 4
-
-static int blip_connection_saw_msg(blip_connection_t* connection, blip_message_t* msg)
+static int blip_connection_saw_msg(blip_connection_t* connection, MessageNo msg_no, MessageType type,
+                                   FrameFlags flags)
 {
+    // Frames after the first one of a message carry no properties, so remember which
+    // messages are still in flight until their final (non-MoreComing) frame arrives
     const hashset_t set = connection->started_msg_set;
-    const bool found = hashset_is_member(set, &msg->msg_no);
+    void* key = (void*)blip_started_msg_key(msg_no, type);
+    const bool found = hashset_is_member(set, key);
+    const bool more_coming = flags & kMoreComing;
     if (!found) {
-        MessageNo* ptr = (MessageNo*)malloc(sizeof(MessageNo));
-        if (ptr == NULL) {
+        if (more_coming && hashset_add(set, key) < 0) {
             return -1;
         }
 
-        *ptr = msg->msg_no;
-        return hashset_add(set, ptr) == 0;
+        return 0;
+    }
+
+    if (!more_coming) {
+        hashset_remove(set, key);
     }
 
     return 1;
 }
 
-static uint8_t* compress_body(blip_connection_t* connection, uint8_t* data, size_t size, size_t* out_size)
+// Grows a (de)compression output buffer so that at least `needed` more bytes fit after `used`,
+// and re-points the stream's output window at the new free space
+static int grow_output(z_stream* stream, uint8_t** buf, size_t* capacity, size_t used, size_t needed, bool growable)
 {
-    z_stream* compress_stream = connection->recompress_stream;
-    compress_stream->next_in = data;
-    compress_stream->avail_in = (uInt)size;
-    compress_stream->next_out = connection->recompress_buffer;
-    compress_stream->avail_out = (uInt)16384;
-
-    const uLong start = compress_stream->total_out;
-    int err = deflate(compress_stream, Z_SYNC_FLUSH);
-    if (err < 0) {
-        printf("Error compressing: %d\n", err);
-        return NULL;
+    if (blip_reserve_output_in(buf, capacity, used, needed, growable) < 0) {
+        return -1;
     }
 
-    *out_size = compress_stream->total_out - start - 4; // Cut off trailer
-    uint8_t* compressed = malloc(*out_size);
-    memcpy(compressed, connection->recompress_buffer, *out_size);
-    return compressed;
+    const size_t avail = *capacity - used;
+    stream->next_out = *buf + used;
+    stream->avail_out = avail > UINT_MAX ? UINT_MAX : (uInt)avail;
+    return 0;
 }
 
-static uint8_t* decompress_body(blip_connection_t* connection, uint8_t* data, size_t size, size_t* out_size)
+// Runs deflate over one input segment, writing directly into *buf at *used and growing it as needed
+// (when it is growable).  The buffer may be realloc'd, so callers must not hold pointers into it
+// across this call.
+static int deflate_segment(z_stream* stream, const uint8_t* data, size_t size, int flush,
+                           uint8_t** buf, size_t* capacity, size_t* used, bool growable)
+{
+    const size_t chunk_max = UINT_MAX;
+    do {
+        const size_t chunk = size > chunk_max ? chunk_max : size;
+        const int chunk_flush = chunk == size ? flush : Z_NO_FLUSH;
+        stream->next_in = (Bytef*)data;
+        stream->avail_in = (uInt)chunk;
+        do {
+            // Sync flush output is bounded by deflateBound plus the 5 byte empty block marker
+            const size_t needed = stream->avail_out == 0 ? deflateBound(stream, stream->avail_in) + 16 : 0;
+            if (grow_output(stream, buf, capacity, *used, needed, growable) < 0) {
+                return Z_MEM_ERROR;
+            }
+
+            const uInt before = stream->avail_out;
+            const int err = deflate(stream, chunk_flush);
+            *used += before - stream->avail_out;
+            if (err < 0 && err != Z_BUF_ERROR) {
+                printf("Error compressing: %d\n", err);
+                return err;
+            }
+        } while (stream->avail_in > 0 || stream->avail_out == 0);
+
+        data += chunk;
+        size -= chunk;
+    } while (size > 0);
+
+    return Z_OK;
+}
+
+// Payloads are inflated into a scratch buffer owned by the decoding thread, and only the exact
+// result is kept, so neither connections nor messages hold on to spare inflate output space
+#if defined(_MSC_VER)
+#define BLIP_THREAD_LOCAL __declspec(thread)
+#else
+#define BLIP_THREAD_LOCAL _Thread_local
+#endif
+
+#define MAX_RETAINED_SCRATCH (256 * 1024)
+
+static BLIP_THREAD_LOCAL uint8_t* inflate_scratch;
+static BLIP_THREAD_LOCAL size_t inflate_scratch_capacity;
+
+void blip_thread_release_memory(void)
+{
+    free(inflate_scratch);
+    inflate_scratch = NULL;
+    inflate_scratch_capacity = 0;
+}
+
+// Inflates a payload into the thread's scratch buffer, which stays valid until the next inflate
+// or release_scratch() on this thread
+static uint8_t* inflate_payload(blip_connection_t* connection, const uint8_t* data, size_t size, size_t* out_size)
 {
     static Byte trailer[4] = {0x00, 0x00, 0xff, 0xff};
-    z_stream* decompress_stream = connection->decompress_stream;
-    decompress_stream->next_in = data;
-    decompress_stream->avail_in = (uInt)size;
-    decompress_stream->next_out = connection->decompress_buffer;
-    decompress_stream->avail_out = (uInt)16384;
+    z_stream* decompress_stream = blip_connection_inflater(connection);
+    if (!decompress_stream) {
+        return NULL;
+    }
 
-    const uLong start = decompress_stream->total_out;
-    int err = inflate(decompress_stream, Z_NO_FLUSH);
-    if (err < 0) {
-        printf("Error decompressing first step: %d\n", err);
+    uint8_t* scratch = inflate_scratch;
+    size_t capacity = inflate_scratch_capacity;
+    if (blip_reserve_output(&scratch, &capacity, 0, size * 4 > 1024 ? size * 4 : 1024) < 0) {
         return NULL;
     }
 
-    decompress_stream->next_in = trailer;
-    decompress_stream->avail_in = 4;
-    err = inflate(decompress_stream, Z_SYNC_FLUSH);
-    if (err < 0) {
-        printf("Error decompressing second step: %d\n", err);
+    size_t used = 0;
+    decompress_stream->next_in = (Bytef*)data;
+    decompress_stream->avail_in = (uInt)size;
+    decompress_stream->avail_out = 0;
+    bool failed = false;
+    for (int step = 0; step < 2 && !failed; step++) {
+        if (step == 1) {
+            decompress_stream->next_in = trailer;
+            decompress_stream->avail_in = 4;
+        }
+
+        const int flush = step == 0 ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+        int err;
+        do {
+            if (grow_output(decompress_stream, &scratch, &capacity, used,
+                            decompress_stream->avail_out == 0 ? capacity : 0, true) < 0) {
+                failed = true;
+                break;
+            }
+
+            const uInt before = decompress_stream->avail_out;
+            err = inflate(decompress_stream, flush);
+            used += before - decompress_stream->avail_out;
+            if (err < 0 && err != Z_BUF_ERROR) {
+                printf("Error decompressing %s step: %d\n", step == 0 ? "first" : "second", err);
+                failed = true;
+                break;
+            }
+        } while (err != Z_STREAM_END && (decompress_stream->avail_in > 0 || decompress_stream->avail_out == 0));
+    }
+
+    inflate_scratch = scratch;
+    inflate_scratch_capacity = capacity;
+    *out_size = used;
+    return failed ? NULL : scratch;
+}
+
+// One huge message shouldn't pin its size on the thread for good
+static void release_scratch(void)
+{
+    if (inflate_scratch_capacity > MAX_RETAINED_SCRATCH) {
+        blip_thread_release_memory();
+    }
+}
+
+// Copies an inflated payload into the message's payload buffer (private[9]), which is only
+// reallocated when the payload doesn't fit
+static uint8_t* store_payload(blip_message_t* msg, const uint8_t* payload, size_t size)
+{
+    uint8_t* stored = (uint8_t*)msg->private[9];
+    size_t capacity = (size_t)msg->private[10];
+    if (blip_reserve_output(&stored, &capacity, 0, size ? size : 1) < 0) {
         return NULL;
     }
 
-    *out_size = decompress_stream->total_out - start;
-    uint8_t* decompressed = malloc(*out_size);
-    memcpy(decompressed, connection->decompress_buffer, *out_size);
-    return decompressed;
+    memcpy(stored, payload, size);
+    msg->private[9] = (uint64_t)stored;
+    msg->private[10] = capacity;
+    return stored;
 }
 
-static void transform_properties(uint8_t* data, size_t size, bool reverse)
+// Turns the NUL separated wire properties into the colon separated form, picking out (and
+// hashing) the Profile property in the same pass
+static void scan_properties(blip_message_t* msg, uint8_t* data, size_t size)
 {
-    if(size == 0) {
-        return;
+    static const char kProfileKey[] = "Profile";
+    msg->profile = NULL;
+    msg->profile_size = 0;
+    msg->private[4] = 0;
+    size_t field_start = 0;
+    bool is_value = false;
+    bool is_profile = false;
+
+    // Once joined with colons, properties containing colons themselves can't be split apart
+    // again, so for those (rare) messages remember where the real separators were
+    property_separators* separators = NULL;
+    if (size > 1 && memchr(data, ':', size - 1)) {
+        size_t count = 0;
+        for (size_t i = 0; i < size; i++) {
+            count += data[i] == 0;
+        }
+
+        separators = malloc(sizeof(property_separators) + count * sizeof(uint32_t));
+        if (separators) {
+            separators->count = 0;
+        }
+    }
+
+    msg->private[6] = (uint64_t)separators;
+    while (field_start < size) {
+        // memchr is vectorized by the C library, so hop from separator to separator
+        const uint8_t* separator = memchr(data + field_start, 0, size - field_start);
+        if (!separator) {
+            break;
+        }
+
+        const size_t i = separator - data;
+        if (!is_value) {
+            is_profile = msg->profile == NULL && i - field_start == sizeof(kProfileKey) - 1
+                         && memcmp(data + field_start, kProfileKey, sizeof(kProfileKey) - 1) == 0;
+        } else if (is_profile) {
+            msg->profile = data + field_start;
+            msg->profile_size = i - field_start;
+            msg->private[4] = blip_profile_hash(msg->profile, msg->profile_size);
+            is_profile = false;
+        }
+
+        if (separators) {
+            separators->positions[separators->count++] = (uint32_t)i;
+        }
+
+        // The final NUL stays in place to terminate the string
+        if (i < size - 1) {
+            data[i] = ':';
+        }
+
+        field_start = i + 1;
+        is_value = !is_value;
     }
+}
 
-    uint8_t to = ':';
-    uint8_t from = 0;
-    if(reverse) {
-        to = 0;
-        from = ':';
+int blip_message_get_property(const blip_message_t* msg, const char* key, const uint8_t** value, size_t* value_size)
+{
+    if (msg->type >= kAckRequestType || !msg->properties) {
+        return -1;
     }
 
-    for(size_t i = 0; i < size - 1; i++) {
-        if(data[i] == from) {
-            data[i] = to;
+    const property_separators* separators = (const property_separators*)msg->private[6];
+    const size_t key_size = strlen(key);
+    const uint8_t* pos = msg->properties;
+    size_t index = 0;
+    while (*pos != 0) {
+        const uint8_t* key_end;
+        const uint8_t* value_end;
+        if (separators) {
+            if (index + 1 >= separators->count) {
+                break;
+            }
+
+            key_end = msg->properties + separators->positions[index];
+            value_end = msg->properties + separators->positions[index + 1];
+            index += 2;
+        } else {
+            key_end = (const uint8_t*)strchr((const char*)pos, ':');
+            if (!key_end) {
+                break;
+            }
+
+            value_end = (const uint8_t*)strchr((const char*)key_end + 1, ':');
+            if (!value_end) {
+                value_end = key_end + 1 + strlen((const char*)key_end + 1);
+            }
         }
+
+        if ((size_t)(key_end - pos) == key_size && memcmp(pos, key, key_size) == 0) {
+            *value = key_end + 1;
+            *value_size = value_end - key_end - 1;
+            return 0;
+        }
+
+        if (*value_end == 0) {
+            break;
+        }
+
+        pos = value_end + 1;
     }
+
+    return -1;
 }
 
-int handle_normal_msg(blip_message_t* msg, uint8_t* data, size_t size)
+int handle_normal_msg_ordered(blip_message_t* msg, uint8_t* data, size_t size, const uint8_t* inflated,
+                              size_t inflated_size, normal_msg_state* state)
 {
+    // Too short to hold the checksum, so the frame was cut off
+    if (size < BLIP_BODY_CHECKSUM_SIZE) {
+        return -1;
+    }
+
     blip_connection_t* connection = (blip_connection_t*)msg->private[0];
-    const int isFound = blip_connection_saw_msg(connection, msg);
+    const int isFound = blip_connection_saw_msg(connection, msg->msg_no, msg->type, msg->flags);
     if (isFound < 0) {
         return isFound;
     }
@@ -127,7 +325,17 @@ int handle_normal_msg(blip_message_t* msg, uint8_t* data, size_t size)
     uint8_t* data_to_use = data;
     size_t size_to_use = size;
     if (isCompressed) {
-        data_to_use = decompress_body(connection, data, size - BLIP_BODY_CHECKSUM_SIZE, &size_to_use);
+        if (!inflated) {
+            inflated = inflate_payload(connection, data, size - BLIP_BODY_CHECKSUM_SIZE, &inflated_size);
+        }
+
+        data_to_use = inflated ? store_payload(msg, inflated, inflated_size) : NULL;
+        size_to_use = inflated_size;
+        release_scratch();
+        if (!data_to_use) {
+            return -1;
+        }
+
         msg->private[1] = (uint64_t)data_to_use;
     } else {
         msg->private[1] = 0ULL;
@@ -135,7 +343,7 @@ int handle_normal_msg(blip_message_t* msg, uint8_t* data, size_t size)
 
     uint8_t* data_pos = data_to_use;
     size_t remaining = size_to_use;
-    uint64_t properties_length;
+    uint64_t properties_length = 0;
     if (isFound == 0) {
         data_pos = get_varint(data_pos, &remaining, &properties_length);
         msg->properties = properties_length > 0 ? data_pos : NULL;
@@ -152,51 +360,418 @@ int handle_normal_msg(blip_message_t* msg, uint8_t* data, size_t size)
     msg->body = data_pos;
     msg->body_size = remaining;
 
+    // The checksum chain only depends on the checksum stated by the previous frame, so the
+    // connection can move on before this frame's checksum is actually calculated
     int* checksum_area = (int *)(data + size - BLIP_BODY_CHECKSUM_SIZE);
     msg->checksum = _decBig32(*checksum_area);
-    const size_t checksum_exclusion = isCompressed ? 0 : BLIP_BODY_CHECKSUM_SIZE;
-    msg->calculated_checksum = crc32(connection->crc, data_to_use, (uInt)(size_to_use - checksum_exclusion));
+    state->crc = connection->crc;
+    state->crc_data = data_to_use;
+    state->crc_size = size_to_use - (isCompressed ? 0 : BLIP_BODY_CHECKSUM_SIZE);
+    state->properties_length = (size_t)properties_length;
     connection->crc = msg->checksum;
+    return 0;
+}
+
+int filter_normal_msg(blip_connection_t* connection, const uint8_t* data, size_t size, filter_input* input,
+                      const uint8_t** inflated, size_t* inflated_size)
+{
+    *inflated = NULL;
+    *inflated_size = 0;
+    if (size < BLIP_BODY_CHECKSUM_SIZE) {
+        return -1;
+    }
+
+    const uint8_t* payload = data;
+    size_t remaining = size - BLIP_BODY_CHECKSUM_SIZE;
+    if (input->flags & kCompressed) {
+        payload = inflate_payload(connection, data, remaining, &remaining);
+        if (!payload) {
+            return -1;
+        }
+
+        *inflated = payload;
+        *inflated_size = remaining;
+    }
+
+    // Only the first frame of a message carries properties, and looking that up changes nothing
+    void* key = (void*)blip_started_msg_key(input->msg_no, input->type);
+    input->properties = NULL;
+    input->properties_size = 0;
+    if (!hashset_is_member(connection->started_msg_set, key)) {
+        uint64_t properties_length;
+        const size_t length_size = GetUVarInt((uint8_t*)payload, remaining, &properties_length);
+        if (length_size == 0 || properties_length > remaining - length_size) {
+            return -1;
+        }
+
+        input->properties = properties_length > 0 ? payload + length_size : NULL;
+        input->properties_size = (size_t)properties_length;
+        remaining -= length_size + (size_t)properties_length;
+    }
+
+    input->body_size = remaining;
+    return 0;
+}
+
+int skip_normal_msg(blip_connection_t* connection, const filter_input* input, const uint8_t* data, size_t size)
+{
+    release_scratch();
+    if (blip_connection_saw_msg(connection, input->msg_no, input->type, input->flags) < 0) {
+        return -1;
+    }
+
+    // The chain carries on from the checksum the frame states, so nothing has to be calculated
+    int32_t checksum;
+    memcpy(&checksum, data + size - BLIP_BODY_CHECKSUM_SIZE, BLIP_BODY_CHECKSUM_SIZE);
+    connection->crc = _decBig32(checksum);
+    return 0;
+}
+
+void handle_normal_msg_post(blip_message_t* msg, const normal_msg_state* state)
+{
+    msg->calculated_checksum = blip_get_kernels()->crc32(state->crc, state->crc_data, state->crc_size);
 
     // This needs to happen last, after the checksum is calculated since it changes the data
-    transform_properties(msg->properties, (size_t)properties_length, false);
+    scan_properties(msg, msg->properties, state->properties_length);
+}
+
+#define DEFAULT_STREAM_CHUNK (64 * 1024)
 
+/** The progress of a message being streamed out to blip_body_stream callbacks */
+typedef struct {
+    const blip_body_stream* stream;
+    blip_message_t* msg;
+    bool in_header;                     // Still taking the properties off the front
+    uint8_t length_buf[kMaxVarintLen64];
+    size_t length_used;
+    bool have_length;
+    uint64_t properties_length;
+    size_t properties_used;
+    bool stopped;                       // A callback asked for no more
+    bool failed;
+} body_streamer;
+
+static void streamer_finish_header(body_streamer* streamer)
+{
+    blip_message_t* msg = streamer->msg;
+    msg->properties = streamer->properties_length > 0 ? (uint8_t*)msg->private[9] : NULL;
+    msg->private[1] = (uint64_t)msg->properties;
+    scan_properties(msg, msg->properties, streamer->properties_used);
+    streamer->in_header = false;
+    if (streamer->stream->on_properties
+        && streamer->stream->on_properties(streamer->stream->context, msg) < 0) {
+        streamer->stopped = true;
+    }
+}
+
+// Takes the properties length and the properties off the front of the payload, and returns how
+// many of the bytes they took up (the rest belong to the body).  The properties are copied into
+// the payload buffer so that they can be joined with colons without touching the caller's data.
+static size_t streamer_header(body_streamer* streamer, const uint8_t* data, size_t size)
+{
+    size_t pos = 0;
+    while (!streamer->have_length && pos < size) {
+        if (streamer->length_used == kMaxVarintLen64) {
+            streamer->failed = true;
+            return size;
+        }
+
+        const uint8_t byte = data[pos++];
+        streamer->length_buf[streamer->length_used++] = byte;
+        if ((byte & 0x80) == 0) {
+            if (GetUVarInt(streamer->length_buf, streamer->length_used, &streamer->properties_length) == 0) {
+                streamer->failed = true;
+                return size;
+            }
+
+            streamer->have_length = true;
+        }
+    }
+
+    if (!streamer->have_length) {
+        return pos;
+    }
+
+    const uint64_t wanted = streamer->properties_length - streamer->properties_used;
+    const size_t take = wanted < size - pos ? (size_t)wanted : size - pos;
+    if (take > 0) {
+        // Grown as the bytes arrive, so a bogus length can't allocate more than was sent
+        uint8_t* properties = (uint8_t*)streamer->msg->private[9];
+        size_t capacity = (size_t)streamer->msg->private[10];
+        if (blip_reserve_output(&properties, &capacity, streamer->properties_used, take) < 0) {
+            streamer->failed = true;
+            return size;
+        }
+
+        streamer->msg->private[9] = (uint64_t)properties;
+        streamer->msg->private[10] = capacity;
+        memcpy(properties + streamer->properties_used, data + pos, take);
+        streamer->properties_used += take;
+        pos += take;
+    }
+
+    if (streamer->properties_used == streamer->properties_length) {
+        streamer_finish_header(streamer);
+    }
+
+    return pos;
+}
+
+static void streamer_body(body_streamer* streamer, const uint8_t* data, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+
+    streamer->msg->body_size += size;
+    if (!streamer->stopped && streamer->stream->on_body(streamer->stream->context, streamer->msg, data, size) < 0) {
+        streamer->stopped = true;
+    }
+}
+
+// Inflates the payload one chunk at a time, running the checksum and the callbacks over each
+// chunk as it comes out.  Once stopped, inflating still carries on to keep the connection in step.
+static uint32_t stream_compressed(body_streamer* streamer, blip_connection_t* connection, const uint8_t* data,
+                                  size_t size, size_t chunk_size, uint32_t crc)
+{
+    static Byte trailer[4] = {0x00, 0x00, 0xff, 0xff};
+    z_stream* decompress_stream = blip_connection_inflater(connection);
+    if (!decompress_stream) {
+        streamer->failed = true;
+        return crc;
+    }
+
+    // Taken off the thread while in use, in case a callback decodes other messages
+    uint8_t* scratch = inflate_scratch;
+    size_t capacity = inflate_scratch_capacity;
+    inflate_scratch = NULL;
+    inflate_scratch_capacity = 0;
+    if (blip_reserve_output(&scratch, &capacity, 0, chunk_size) < 0) {
+        inflate_scratch = scratch;
+        inflate_scratch_capacity = capacity;
+        streamer->failed = true;
+        return crc;
+    }
+
+    const blip_kernels* kernels = blip_get_kernels();
+    size_t fill = 0;
+    size_t body_from = 0;
+    decompress_stream->next_in = (Bytef*)data;
+    decompress_stream->avail_in = (uInt)size;
+    for (int step = 0; step < 2 && !streamer->failed; step++) {
+        if (step == 1) {
+            decompress_stream->next_in = trailer;
+            decompress_stream->avail_in = 4;
+        }
+
+        const int flush = step == 0 ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+        int err;
+        do {
+            if (fill == chunk_size) {
+                streamer_body(streamer, scratch + body_from, fill - body_from);
+                fill = body_from = 0;
+            }
+
+            decompress_stream->next_out = scratch + fill;
+            decompress_stream->avail_out = (uInt)(chunk_size - fill);
+            err = inflate(decompress_stream, flush);
+            const size_t produced = chunk_size - fill - decompress_stream->avail_out;
+            if (err < 0 && err != Z_BUF_ERROR) {
+                printf("Error decompressing %s step: %d\n", step == 0 ? "first" : "second", err);
+                streamer->failed = true;
+                break;
+            }
+
+            crc = kernels->crc32(crc, scratch + fill, produced);
+            if (streamer->in_header) {
+                body_from = fill + streamer_header(streamer, scratch + fill, produced);
+            }
+
+            fill += produced;
+        } while (err != Z_STREAM_END && (decompress_stream->avail_in > 0 || decompress_stream->avail_out == 0));
+    }
+
+    if (!streamer->failed && !streamer->in_header) {
+        streamer_body(streamer, scratch + body_from, fill - body_from);
+    }
+
+    if (capacity > MAX_RETAINED_SCRATCH || inflate_scratch) {
+        free(scratch);
+    } else {
+        inflate_scratch = scratch;
+        inflate_scratch_capacity = capacity;
+    }
+
+    return crc;
+}
+
+int handle_normal_msg_streaming(blip_message_t* msg, const uint8_t* data, size_t size,
+                                const blip_body_stream* stream)
+{
+    blip_connection_t* connection = (blip_connection_t*)msg->private[0];
+    const int isFound = blip_connection_saw_msg(connection, msg->msg_no, msg->type, msg->flags);
+    if (isFound < 0 || size < BLIP_BODY_CHECKSUM_SIZE) {
+        return -1;
+    }
+
+    const size_t payload_size = size - BLIP_BODY_CHECKSUM_SIZE;
+    size_t chunk_size = stream->chunk_size ? stream->chunk_size : DEFAULT_STREAM_CHUNK;
+    if (chunk_size > UINT_MAX) {
+        chunk_size = UINT_MAX;
+    }
+
+    body_streamer streamer;
+    memset(&streamer, 0, sizeof(body_streamer));
+    streamer.stream = stream;
+    streamer.msg = msg;
+    streamer.in_header = isFound == 0;
+    msg->private[1] = 0ULL;
+    msg->properties = NULL;
+    msg->body = NULL;
+    msg->body_size = 0;
+    if (!streamer.in_header) {
+        streamer_finish_header(&streamer);
+    }
+
+    int32_t checksum;
+    memcpy(&checksum, data + payload_size, BLIP_BODY_CHECKSUM_SIZE);
+    msg->checksum = _decBig32(checksum);
+    uint32_t crc = connection->crc;
+    if (msg->flags & kCompressed) {
+        crc = stream_compressed(&streamer, connection, data, payload_size, chunk_size, crc);
+    } else {
+        crc = blip_get_kernels()->crc32(crc, data, payload_size);
+        const size_t header_size = streamer.in_header ? streamer_header(&streamer, data, payload_size) : 0;
+        for (size_t pos = header_size; pos < payload_size && !streamer.failed && !streamer.in_header; pos += chunk_size) {
+            streamer_body(&streamer, data + pos, payload_size - pos < chunk_size ? payload_size - pos : chunk_size);
+        }
+    }
+
+    if (streamer.failed || streamer.in_header) {
+        return -1;
+    }
+
+    msg->calculated_checksum = crc;
+    connection->crc = msg->checksum;
+    return streamer.stopped ? 1 : 0;
+}
+
+int serialize_wire_append(blip_connection_t* connection, MessageNo msg_no, MessageType type, FrameFlags* sent_flags,
+                          const uint8_t* properties, size_t prop_size, const uint8_t* body, size_t body_size,
+                          uint8_t** buf, size_t* capacity, size_t* used, bool growable, int32_t* checksum) {
+    const size_t start = *used;
+    const size_t payload_size = SizeOfVarInt(prop_size) + prop_size + body_size;
+    FrameFlags flags = *sent_flags;
+    if ((flags & kCompressed) && payload_size < connection->compression.min_size) {
+        flags &= ~kCompressed;
+    }
+
+    const size_t header_size = SizeOfVarInt(msg_no) + SizeOfVarInt(flags | type);
+    uint8_t prop_size_buf[kMaxVarintLen64];
+    const size_t prop_size_len = PutUVarInt(prop_size_buf, prop_size);
+    const blip_kernels* kernels = blip_get_kernels();
+    uint32_t crc = kernels->crc32(connection->crc_out, prop_size_buf, prop_size_len);
+    if (prop_size > 0) {
+        crc = kernels->crc32(crc, properties, prop_size);
+    }
+
+    if (body_size > 0) {
+        crc = kernels->crc32(crc, body, body_size);
+    }
+
+    uint8_t* pos;
+    if(flags & kCompressed) {
+        // Deflate each segment straight into the outgoing buffer, so no uncompressed copy of the
+        // payload is ever made and the only working memory is the deflate state itself
+        z_stream* compress_stream = blip_connection_deflater(connection);
+        if (!compress_stream) {
+            return -1;
+        }
+
+        const size_t reserve = header_size + deflateBound(compress_stream, payload_size) + 16 + BLIP_BODY_CHECKSUM_SIZE;
+        if (blip_reserve_output_in(buf, capacity, *used, reserve, growable) < 0) {
+            return -1;
+        }
+
+        pos = put_varint(msg_no, *buf + *used);
+        pos = put_varint(flags | type, pos);
+        *used = pos - *buf;
+        compress_stream->avail_out = 0;
+        const bool has_body = body_size > 0;
+        if (deflate_segment(compress_stream, prop_size_buf, prop_size_len, Z_NO_FLUSH,
+                            buf, capacity, used, growable) != Z_OK
+            || deflate_segment(compress_stream, properties, prop_size, has_body ? Z_NO_FLUSH : Z_SYNC_FLUSH,
+                               buf, capacity, used, growable) != Z_OK
+            || (has_body && deflate_segment(compress_stream, body, body_size, Z_SYNC_FLUSH,
+                                            buf, capacity, used, growable) != Z_OK)) {
+            // The deflate stream has taken in input that will never reach the peer, so drop it.
+            // The next compressed message starts a new stream, which the peer's inflater reads
+            // on from the sync flush that ended the last message sent.
+            blip_connection_release_streams(connection, false, true);
+            *used = start;
+            return -1;
+        }
+
+        // Cut off the 00 00 FF FF sync flush trailer, its space is reused for the checksum
+        *used -= 4;
+        pos = *buf + *used;
+    } else {
+        if (blip_reserve_output_in(buf, capacity, *used, header_size + payload_size + BLIP_BODY_CHECKSUM_SIZE,
+                                   growable) < 0) {
+            return -1;
+        }
+
+        pos = put_varint(msg_no, *buf + *used);
+        pos = put_varint(flags | type, pos);
+        memcpy(pos, prop_size_buf, prop_size_len);
+        pos += prop_size_len;
+        memcpy(pos, properties, prop_size);
+        pos += prop_size;
+        memcpy(pos, body, body_size);
+        pos += body_size;
+    }
+
+    // Only a frame that made it into the buffer moves the checksum chain on
+    connection->crc_out = crc;
+    *sent_flags = flags;
+    *checksum = crc;
+    (*(int*)pos) = _encBig32(crc);
+    *used = pos + BLIP_BODY_CHECKSUM_SIZE - *buf;
     return 0;
 }
 
-uint8_t* serialize_normal_msg(blip_connection_t* connection, blip_message_t* msg, size_t* out_size) {
+#define PROPERTIES_STACK_SIZE 256
+
+int serialize_normal_msg_append(blip_connection_t* connection, blip_message_t* msg, uint8_t** buf, size_t* capacity,
+                                size_t* used, bool growable) {
+    // Properties are colon separated in memory but NUL separated on the wire.  The caller's string
+    // may well be read-only (or shared), so a copy is translated rather than the original.
     const size_t prop_size = msg->properties ? strlen((const char*)msg->properties) + 1 : 0;
-    const size_t payload_size = SizeOfVarInt(prop_size) + prop_size + msg->body_size ;
-    *out_size += payload_size + BLIP_BODY_CHECKSUM_SIZE;
-    uint8_t* write_buf = (uint8_t*)malloc(*out_size);
-    uint8_t* pos = put_varint(msg->msg_no, write_buf);
-    uint8_t* payload = pos = put_varint(msg->flags | msg->type, pos);
-    pos = put_varint(prop_size, pos);
-    transform_properties(msg->properties, prop_size, true);
-    memcpy(pos, msg->properties, prop_size);
-    pos += prop_size;
-    memcpy(pos, msg->body, msg->body_size);
-    pos += msg->body_size;
-
-    connection->crc_out = crc32(connection->crc_out, payload, (uInt)payload_size);
-    msg->checksum = connection->crc_out;
-
-    if(msg->flags & kCompressed) {
-        size_t final_size;
-        uint8_t* compressed = compress_body((blip_connection_t *)msg->private[0], payload, pos - payload, &final_size);
-        *out_size = payload - write_buf + final_size + 4;
-        uint8_t* final_write_buf = pos = (uint8_t*)malloc(*out_size);
-        memcpy(pos, write_buf, payload - write_buf);
-        pos += (payload - write_buf);
-        memcpy(pos, compressed, final_size);
-        pos += final_size;
-        free(write_buf);
-        write_buf = final_write_buf;
-    }
-
-    
-
-    (*(int*)pos) = _encBig32(msg->checksum);
-    msg->private[2] = (uint64_t)write_buf;
-    return write_buf;
+    uint8_t stack_properties[PROPERTIES_STACK_SIZE];
+    uint8_t* properties = prop_size <= sizeof(stack_properties) ? stack_properties : malloc(prop_size);
+    if (!properties) {
+        return -1;
+    }
+
+    if (prop_size > 0) {
+        memcpy(properties, msg->properties, prop_size);
+        blip_get_kernels()->replace_byte(properties, prop_size - 1, ':', 0);
+    }
+
+    const int retVal = serialize_wire_append(connection, msg->msg_no, msg->type, &msg->flags, properties, prop_size,
+                                             msg->body, msg->body_size, buf, capacity, used, growable, &msg->checksum);
+    if (properties != stack_properties) {
+        free(properties);
+    }
+
+    return retVal;
+}
+
+int serialize_msg_append(blip_connection_t* connection, blip_message_t* msg, uint8_t** buf, size_t* capacity,
+                         size_t* used, bool growable) {
+    if(msg->type >= kAckRequestType) {
+        return serialize_ack_msg_append(msg, buf, capacity, used, growable);
+    }
+
+    return serialize_normal_msg_append(connection, msg, buf, capacity, used, growable);
 }
@@ -18,21 +18,124 @@
 
 #pragma once
 #include "cblip.h"
+#include "filter.h"
+
+/** The size of the CRC32 checksum that ends the payload of every non-ACK frame */
+#define BLIP_BODY_CHECKSUM_SIZE 4
+
+/** What the ordered half of decoding a non-ACK message leaves for the post-processing half */
+typedef struct {
+    uint32_t crc;               ///< The checksum this frame chains from
+    uint8_t* crc_data;          ///< The (decompressed) data the checksum covers
+    size_t crc_size;            ///< The size of crc_data
+    size_t properties_length;   ///< The size of the properties on the wire
+} normal_msg_state;
+
+/**
+ * The half of decoding a non-ACK message that reads and updates the connection state (message
+ * tracking, inflate and the checksum chain), so it must run in frame order
+ * @param msg           The message received over the wire
+ * @param data          The data contained in the frame body
+ * @param size          The size of the data contained in the frame body
+ * @param inflated      The payload of a compressed frame if it was already inflated (by
+ *                      filter_normal_msg), otherwise NULL
+ * @param inflated_size The size of inflated
+ * @param state         Receives what handle_normal_msg_post needs
+ * @returns             0 on success, negative values on failure
+ */
+int handle_normal_msg_ordered(blip_message_t* msg, uint8_t* data, size_t size, const uint8_t* inflated,
+                              size_t inflated_size, normal_msg_state* state);
+
+/**
+ * The half of decoding a non-ACK message that only touches the message itself (checksum calculation
+ * and property scanning), so it can run on any thread once the ordered half is done
+ * @param msg   The message passed to handle_normal_msg_ordered
+ * @param state The state filled in by handle_normal_msg_ordered
+ */
+void handle_normal_msg_post(blip_message_t* msg, const normal_msg_state* state);
+
+/**
+ * Fills in the payload fields of a filter input from a non-ACK frame, without touching the
+ * connection other than inflating a compressed payload (which has to happen in order anyway)
+ * @param connection    The connection the frame arrived on
+ * @param data          The data contained in the frame body
+ * @param size          The size of the data contained in the frame body
+ * @param input         Has its header fields filled in already, receives the rest
+ * @param inflated      Receives the inflated payload of a compressed frame (in thread scratch
+ *                      memory, valid until the next inflate on the thread), otherwise NULL
+ * @param inflated_size Receives the size of inflated
+ * @returns             0 on success, negative values on failure
+ */
+int filter_normal_msg(blip_connection_t* connection, const uint8_t* data, size_t size, filter_input* input,
+                      const uint8_t** inflated, size_t* inflated_size);
 
 /**
- * Processes a non-ACK style BLIP message
- * @param msg   The message received over the wire
- * @param data  The data contained in the frame body
- * @param size  The size of the data contained in the frame body
- * @returns     0 on success, negative values on failure
+ * Moves the connection past a non-ACK frame that is not going to be decoded (message tracking
+ * and the checksum chain, the inflate stream having been moved on by filter_normal_msg)
+ * @param connection    The connection the frame arrived on
+ * @param input         The fields of the frame, as filled in by filter_normal_msg
+ * @param data          The data contained in the frame body
+ * @param size          The size of the data contained in the frame body
+ * @returns             0 on success, negative values on failure
+ */
+int skip_normal_msg(blip_connection_t* connection, const filter_input* input, const uint8_t* data, size_t size);
+
+/**
+ * Decodes a non-ACK message in one go, handing the body to callbacks rather than keeping it
+ * @param msg       The message received over the wire (its header already decoded)
+ * @param data      The data contained in the frame body
+ * @param size      The size of the data contained in the frame body
+ * @param stream    The callbacks to deliver the properties and body to
+ * @returns         0 on success, 1 if a callback stopped delivery, negative values on failure
+ */
+int handle_normal_msg_streaming(blip_message_t* msg, const uint8_t* data, size_t size,
+                                const blip_body_stream* stream);
+
+/**
+ * Serializes a non-ACK type BLIP message whose properties are already in wire form (NUL
+ * separated), appending it to a growable buffer
+ * @param connection    The connection to use during serialization (CRC / GZIP)
+ * @param msg_no        The message number
+ * @param type          The message type
+ * @param sent_flags    The frame flags, on success updated to the flags written into the frame
+ *                      (Compressed is dropped below the connection's minimum size)
+ * @param properties    The NUL separated properties, including the final NUL
+ * @param prop_size     The size of properties
+ * @param body          The body
+ * @param body_size     The size of the body
+ * @param buf           The buffer to append to (may be realloc'd if growable, and may then start out NULL)
+ * @param capacity      The allocated size of *buf
+ * @param used          The number of bytes of *buf in use, advanced past the message
+ * @param growable      Whether *buf may be realloc'd, false for buffers the caller owns
+ * @param checksum      Receives the checksum written into the frame
+ * @return              0 on success, negative values on failure
+ */
+int serialize_wire_append(blip_connection_t* connection, MessageNo msg_no, MessageType type, FrameFlags* sent_flags,
+                          const uint8_t* properties, size_t prop_size, const uint8_t* body, size_t body_size,
+                          uint8_t** buf, size_t* capacity, size_t* used, bool growable, int32_t* checksum);
+
+/**
+ * Serializes a non-ACK type BLIP message, appending it to a buffer
+ * @param connection    The connection to use during serialization (CRC / GZIP)
+ * @param msg           The message to serialize
+ * @param buf           The buffer to append to (may be realloc'd if growable, and may then start out NULL)
+ * @param capacity      The allocated size of *buf
+ * @param used          The number of bytes of *buf in use, advanced past the message
+ * @param growable      Whether *buf may be realloc'd, false for buffers the caller owns
+ * @return              0 on success, negative values on failure
  */
-int handle_normal_msg(blip_message_t* msg, uint8_t* data, size_t size);
+int serialize_normal_msg_append(blip_connection_t* connection, blip_message_t* msg, uint8_t** buf, size_t* capacity,
+                                size_t* used, bool growable);
 
 /**
- * Serializes a non-ACK type BLIP message
+ * Serializes any type of BLIP message, appending it to a buffer
  * @param connection    The connection to use during serialization (CRC / GZIP)
  * @param msg           The message to serialize
- * @param out_size      Holds the size of the returned data on completion
- * @return              The serialized byte data of the message
+ * @param buf           The buffer to append to (may be realloc'd if growable, and may then start out NULL)
+ * @param capacity      The allocated size of *buf
+ * @param used          The number of bytes of *buf in use, advanced past the message
+ * @param growable      Whether *buf may be realloc'd, false for buffers the caller owns
+ * @return              0 on success, negative values on failure
  */
-uint8_t* serialize_normal_msg(blip_connection_t* connection, blip_message_t* msg, size_t* out_size);
\ No newline at end of file
+int serialize_msg_append(blip_connection_t* connection, blip_message_t* msg, uint8_t** buf, size_t* capacity,
+                         size_t* used, bool growable);
@@ -0,0 +1,387 @@
+//
+//  parser.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_parser.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WS_MAX_HEADER_SIZE 14
+#define WS_MAX_CONTROL_PAYLOAD 125
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+#define WS_FLAG_FIN 0x80
+#define WS_FLAGS_RSV 0x70
+#define WS_FLAG_MASK 0x80
+
+typedef enum {
+    kParserStateHandshake,  // Skipping an HTTP upgrade header
+    kParserStateHeader,     // Collecting a WebSocket frame header
+    kParserStatePayload,    // Consuming a WebSocket frame payload
+    kParserStateClosed,     // Saw a close frame, everything after it is ignored
+    kParserStateError,
+} parser_state;
+
+struct blip_parser
+{
+    blip_connection_t* connection;
+    blip_message_callback callback;
+    void* context;
+    parser_state state;
+
+    uint8_t header[WS_MAX_HEADER_SIZE];
+    size_t header_used;
+    size_t header_needed;
+    bool in_handshake;
+    size_t handshake_matched;   // How much of the "\r\n\r\n" terminator has been seen
+
+    bool fin;
+    bool control;
+    bool in_fragments;          // A data frame without FIN was seen, continuation frames follow
+    bool masked;
+    uint8_t mask[4];
+    uint64_t payload_remaining;
+    uint64_t payload_offset;    // Position within the current WebSocket frame (for unmasking)
+
+    uint8_t* staging;           // Holds a BLIP frame that could not be decoded in place
+    size_t staging_used;
+    size_t staging_capacity;
+    bool staging_handed_out;    // The staged frame was returned by blip_parser_next, clear it next time
+    blip_message_t* msg;        // Reused for every frame delivered to the callback
+};
+
+blip_parser_t* blip_parser_new(blip_connection_t* connection, blip_message_callback callback, void* context)
+{
+    blip_parser_t* retVal = calloc(1, sizeof(blip_parser_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->connection = connection;
+    retVal->callback = callback;
+    retVal->context = context;
+    retVal->state = kParserStateHandshake;
+    return retVal;
+}
+
+void blip_parser_free(blip_parser_t* parser)
+{
+    if (!parser) {
+        return;
+    }
+
+    if (parser->msg) {
+        blip_message_free(parser->msg);
+    }
+
+    free(parser->staging);
+    free(parser);
+}
+
+static int deliver(blip_parser_t* parser, const uint8_t* data, size_t size)
+{
+    // Decoding copies the frame into the message (properties are rewritten in place), so the
+    // input is never written to, and one message is reused so that the copy goes into a buffer
+    // that is already big enough after the first few frames
+    if (!parser->msg && !(parser->msg = blip_message_new())) {
+        return -1;
+    }
+
+    if (blip_message_read_into(parser->connection, parser->msg, data, size) < 0) {
+        return -1;
+    }
+
+    parser->callback(parser->context, parser->msg);
+    return 0;
+}
+
+static int stage(blip_parser_t* parser, const uint8_t* data, size_t size)
+{
+    if (parser->staging_capacity - parser->staging_used < size) {
+        size_t new_capacity = parser->staging_capacity ? parser->staging_capacity * 2 : 4096;
+        while (new_capacity - parser->staging_used < size) {
+            new_capacity *= 2;
+        }
+
+        uint8_t* grown = realloc(parser->staging, new_capacity);
+        if (!grown) {
+            return -1;
+        }
+
+        parser->staging = grown;
+        parser->staging_capacity = new_capacity;
+    }
+
+    uint8_t* dst = parser->staging + parser->staging_used;
+    if (parser->masked) {
+        for (size_t i = 0; i < size; i++) {
+            dst[i] = data[i] ^ parser->mask[(parser->payload_offset + i) & 3];
+        }
+    } else {
+        memcpy(dst, data, size);
+    }
+
+    parser->staging_used += size;
+    return 0;
+}
+
+// Checks the first two bytes of a frame header against the framing rules: no extension is
+// negotiated (so the RSV bits must be clear), only the defined opcodes, control frames
+// unfragmented and short, and continuation frames only inside a fragmented message
+static bool header_valid(const blip_parser_t* parser, const uint8_t* header)
+{
+    const uint8_t opcode = header[0] & 0x0F;
+    if (header[0] & WS_FLAGS_RSV) {
+        return false;
+    }
+
+    switch (opcode) {
+        case WS_OPCODE_CONTINUATION:
+            return parser->in_fragments;
+        case WS_OPCODE_TEXT:
+        case WS_OPCODE_BINARY:
+            return !parser->in_fragments;
+        case WS_OPCODE_CLOSE:
+        case WS_OPCODE_PING:
+        case WS_OPCODE_PONG:
+            return (header[0] & WS_FLAG_FIN) && (header[1] & 0x7F) <= WS_MAX_CONTROL_PAYLOAD;
+        default:
+            return false;
+    }
+}
+
+// Returns the full header size once the first two bytes are known
+static size_t header_size(const uint8_t* header)
+{
+    const uint8_t len7 = header[1] & 0x7F;
+    size_t size = 2;
+    if (len7 == 126) {
+        size += 2;
+    } else if (len7 == 127) {
+        size += 8;
+    }
+
+    if (header[1] & WS_FLAG_MASK) {
+        size += 4;
+    }
+
+    return size;
+}
+
+static void begin_payload(blip_parser_t* parser)
+{
+    const uint8_t* header = parser->header;
+    const uint8_t len7 = header[1] & 0x7F;
+    const uint8_t* pos = header + 2;
+    uint64_t length = len7;
+    if (len7 == 126) {
+        length = ((uint64_t)pos[0] << 8) | pos[1];
+        pos += 2;
+    } else if (len7 == 127) {
+        length = 0;
+        for (int i = 0; i < 8; i++) {
+            length = (length << 8) | pos[i];
+        }
+
+        pos += 8;
+    }
+
+    parser->masked = header[1] & WS_FLAG_MASK;
+    if (parser->masked) {
+        memcpy(parser->mask, pos, 4);
+    }
+
+    const uint8_t opcode = header[0] & 0x0F;
+    parser->fin = header[0] & WS_FLAG_FIN;
+    parser->control = opcode >= WS_OPCODE_CLOSE;
+    parser->payload_remaining = length;
+    parser->payload_offset = 0;
+    if (!parser->control) {
+        parser->in_fragments = !parser->fin;
+    }
+
+    if (opcode == WS_OPCODE_CLOSE) {
+        parser->state = kParserStateClosed;
+    } else {
+        parser->state = kParserStatePayload;
+    }
+}
+
+// Called once the last byte of a WebSocket frame has been consumed, returns whether that
+// completed a staged BLIP frame
+static bool end_payload(blip_parser_t* parser)
+{
+    parser->state = kParserStateHeader;
+    parser->header_used = 0;
+    parser->header_needed = 2;
+    return !parser->control && parser->fin && parser->staging_used > 0;
+}
+
+static size_t skip_handshake(blip_parser_t* parser, const uint8_t* data, size_t size)
+{
+    static const char kTerminator[] = "\r\n\r\n";
+    if (!parser->in_handshake) {
+        if (data[0] != 'G' && data[0] != 'H') {
+            // Not an HTTP request or response line, so the stream starts straight with frames
+            parser->state = kParserStateHeader;
+            parser->header_needed = 2;
+            return 0;
+        }
+
+        parser->in_handshake = true;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == (uint8_t)kTerminator[parser->handshake_matched]) {
+            if (++parser->handshake_matched == 4) {
+                parser->state = kParserStateHeader;
+                parser->header_needed = 2;
+                return i + 1;
+            }
+        } else {
+            parser->handshake_matched = data[i] == '\r' ? 1 : 0;
+        }
+    }
+
+    return size;
+}
+
+int blip_parser_next(blip_parser_t* parser, const uint8_t* data, size_t size, size_t* consumed,
+                     const uint8_t** frame, size_t* frame_size)
+{
+    if (parser->staging_handed_out) {
+        parser->staging_used = 0;
+        parser->staging_handed_out = false;
+    }
+
+    size_t pos = 0;
+    *consumed = 0;
+    while (pos < size) {
+        size_t step = 0;
+        bool staged_complete = false;
+        switch (parser->state) {
+            case kParserStateHandshake:
+                step = skip_handshake(parser, data + pos, size - pos);
+                break;
+            case kParserStateHeader:
+                while (pos + step < size && parser->header_used < parser->header_needed) {
+                    parser->header[parser->header_used++] = data[pos + step++];
+                    if (parser->header_used == 2) {
+                        if (!header_valid(parser, parser->header)) {
+                            parser->state = kParserStateError;
+                            return -1;
+                        }
+
+                        parser->header_needed = header_size(parser->header);
+                    }
+                }
+
+                if (parser->header_used == parser->header_needed) {
+                    begin_payload(parser);
+                    staged_complete = parser->state == kParserStatePayload && parser->payload_remaining == 0
+                                      && end_payload(parser);
+                }
+
+                break;
+            case kParserStatePayload: {
+                const size_t available = parser->payload_remaining < size - pos
+                                         ? (size_t)parser->payload_remaining : size - pos;
+                if (parser->control) {
+                    // Ping / pong payloads are of no interest
+                } else if (parser->fin && !parser->masked && parser->staging_used == 0
+                           && parser->payload_offset == 0 && available == parser->payload_remaining) {
+                    // The whole BLIP frame is in this chunk, so hand it out in place
+                    parser->payload_remaining = 0;
+                    parser->state = kParserStateHeader;
+                    parser->header_used = 0;
+                    parser->header_needed = 2;
+                    *frame = data + pos;
+                    *frame_size = available;
+                    *consumed = pos + available;
+                    return 1;
+                } else if (stage(parser, data + pos, available) < 0) {
+                    parser->state = kParserStateError;
+                    return -1;
+                }
+
+                step = available;
+                parser->payload_remaining -= available;
+                parser->payload_offset += available;
+                staged_complete = parser->payload_remaining == 0 && end_payload(parser);
+                break;
+            }
+            case kParserStateClosed:
+                *consumed = size;
+                return 0;
+            case kParserStateError:
+                return -1;
+        }
+
+        pos += step;
+        if (staged_complete) {
+            parser->staging_handed_out = true;
+            *frame = parser->staging;
+            *frame_size = parser->staging_used;
+            *consumed = pos;
+            return 1;
+        }
+    }
+
+    *consumed = pos;
+    return 0;
+}
+
+int blip_parser_feed(blip_parser_t* parser, const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        size_t consumed;
+        const uint8_t* frame;
+        size_t frame_size;
+        const int rc = blip_parser_next(parser, data, size, &consumed, &frame, &frame_size);
+        if (rc <= 0) {
+            return rc;
+        }
+
+        data += consumed;
+        size -= consumed;
+        if (deliver(parser, frame, frame_size) < 0) {
+            parser->state = kParserStateError;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int blip_parser_finish(const blip_parser_t* parser)
+{
+    switch (parser->state) {
+        case kParserStateHandshake:
+            return parser->in_handshake ? -1 : 0;
+        case kParserStateHeader:
+            return parser->header_used == 0 && !parser->in_fragments
+                   && (parser->staging_used == 0 || parser->staging_handed_out) ? 0 : -1;
+        case kParserStateClosed:
+            return 0;
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,304 @@
+//
+//  pipeline.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "cblip_pipeline.h"
+#include "decode.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+#define SPIN_LIMIT 256
+#define STAGE_COUNT 3
+
+typedef struct {
+    blip_message_t* msg;        // NULL marks the end of the stream
+    frame_state state;
+    int status;                 // Negative once a stage has failed the frame
+} pipeline_item;
+
+// A bounded single producer / single consumer ring.  Each side keeps its own copy of the other
+// side's index and only re-reads the shared one when that copy says the ring is full (or
+// empty), so in the steady state the two threads rarely touch each other's cache lines.
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_size_t head;    // Next slot to write, stored only by the producer
+    size_t cached_tail;
+    _Alignas(CACHE_LINE) atomic_size_t tail;    // Next slot to read, stored only by the consumer
+    size_t cached_head;
+    _Alignas(CACHE_LINE) pipeline_item* items;
+    size_t mask;
+} spsc_ring;
+
+struct blip_pipeline
+{
+    spsc_ring rings[STAGE_COUNT];       // push -> ordered -> post -> consumer
+    pthread_t threads[STAGE_COUNT];
+    size_t thread_count;
+    blip_connection_t* connection;
+    blip_message_callback callback;
+    void* context;
+    size_t failures;                    // Only written by the consumer thread
+    bool finished;
+};
+
+// Spin briefly, then yield, then sleep, so an idle stage doesn't burn a core
+static void backoff(unsigned* spins)
+{
+    if (*spins < SPIN_LIMIT) {
+        (*spins)++;
+    } else if (*spins < 2 * SPIN_LIMIT) {
+        (*spins)++;
+        sched_yield();
+    } else {
+        const struct timespec pause = {0, 50000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+static int ring_init(spsc_ring* ring, size_t capacity)
+{
+    size_t slots = 2;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    ring->items = calloc(slots, sizeof(pipeline_item));
+    if (!ring->items) {
+        return -1;
+    }
+
+    ring->mask = slots - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->cached_head = ring->cached_tail = 0;
+    return 0;
+}
+
+static void ring_push(spsc_ring* ring, const pipeline_item* item)
+{
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned spins = 0;
+    while (head - ring->cached_tail > ring->mask) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail > ring->mask) {
+            backoff(&spins);
+        }
+    }
+
+    ring->items[head & ring->mask] = *item;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Waits until the ring has something in it, and returns how many items can be taken as one
+// batch (the slots are only handed back to the producer by ring_release)
+static size_t ring_wait(spsc_ring* ring)
+{
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned spins = 0;
+    while (ring->cached_head == tail) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (ring->cached_head == tail) {
+            backoff(&spins);
+        }
+    }
+
+    return ring->cached_head - tail;
+}
+
+static pipeline_item* ring_peek(spsc_ring* ring, size_t index)
+{
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return &ring->items[(tail + index) & ring->mask];
+}
+
+static void ring_release(spsc_ring* ring, size_t count)
+{
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+}
+
+static void* ordered_stage(void* arg)
+{
+    blip_pipeline_t* pipeline = (blip_pipeline_t*)arg;
+    bool done = false;
+    while (!done) {
+        const size_t count = ring_wait(&pipeline->rings[0]);
+        for (size_t i = 0; i < count; i++) {
+            pipeline_item item = *ring_peek(&pipeline->rings[0], i);
+            if (item.msg) {
+                item.status = frame_decode_ordered(item.msg, item.state.size, &item.state);
+            } else {
+                done = true;
+            }
+
+            ring_push(&pipeline->rings[1], &item);
+        }
+
+        ring_release(&pipeline->rings[0], count);
+    }
+
+    blip_thread_release_memory();
+    return NULL;
+}
+
+static void* post_stage(void* arg)
+{
+    blip_pipeline_t* pipeline = (blip_pipeline_t*)arg;
+    bool done = false;
+    while (!done) {
+        const size_t count = ring_wait(&pipeline->rings[1]);
+        for (size_t i = 0; i < count; i++) {
+            pipeline_item* item = ring_peek(&pipeline->rings[1], i);
+            if (!item->msg) {
+                done = true;
+            } else if (item->status == 0) {
+                frame_decode_post(item->msg, &item->state);
+            }
+
+            ring_push(&pipeline->rings[2], item);
+        }
+
+        ring_release(&pipeline->rings[1], count);
+    }
+
+    return NULL;
+}
+
+static void* consumer_stage(void* arg)
+{
+    blip_pipeline_t* pipeline = (blip_pipeline_t*)arg;
+    bool done = false;
+    while (!done) {
+        const size_t count = ring_wait(&pipeline->rings[2]);
+        for (size_t i = 0; i < count; i++) {
+            pipeline_item* item = ring_peek(&pipeline->rings[2], i);
+            if (!item->msg) {
+                done = true;
+                continue;
+            }
+
+            if (item->status == 0) {
+                pipeline->callback(pipeline->context, item->msg);
+            } else {
+                pipeline->failures++;
+            }
+
+            blip_message_free(item->msg);
+        }
+
+        ring_release(&pipeline->rings[2], count);
+    }
+
+    return NULL;
+}
+
+static void stop_threads(blip_pipeline_t* pipeline)
+{
+    const pipeline_item end = {NULL};
+    ring_push(&pipeline->rings[0], &end);
+    for (size_t i = 0; i < pipeline->thread_count; i++) {
+        pthread_join(pipeline->threads[i], NULL);
+    }
+
+    pipeline->thread_count = 0;
+    pipeline->finished = true;
+}
+
+blip_pipeline_t* blip_pipeline_new(blip_connection_t* connection, size_t capacity,
+                                   blip_message_callback callback, void* context)
+{
+    // The rings are cache line aligned, so the pipeline has to be too
+    const size_t size = (sizeof(blip_pipeline_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    blip_pipeline_t* retVal = aligned_alloc(CACHE_LINE, size);
+    if (!retVal) {
+        return NULL;
+    }
+
+    memset(retVal, 0, size);
+    retVal->connection = connection;
+    retVal->callback = callback;
+    retVal->context = context;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        if (ring_init(&retVal->rings[i], capacity) < 0) {
+            blip_pipeline_free(retVal);
+            return NULL;
+        }
+    }
+
+    void* (*const stages[STAGE_COUNT])(void*) = {ordered_stage, post_stage, consumer_stage};
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        if (pthread_create(&retVal->threads[i], NULL, stages[i], retVal) != 0) {
+            // The end marker still makes it through the stages that did start
+            stop_threads(retVal);
+            blip_pipeline_free(retVal);
+            return NULL;
+        }
+
+        retVal->thread_count++;
+    }
+
+    return retVal;
+}
+
+int blip_pipeline_push(blip_pipeline_t* pipeline, const uint8_t* data, size_t size)
+{
+    if (pipeline->finished) {
+        return -1;
+    }
+
+    pipeline_item item;
+    memset(&item, 0, sizeof(item));
+    item.msg = frame_copy(pipeline->connection, data, size);
+    if (!item.msg) {
+        return -1;
+    }
+
+    item.state.size = size;
+    ring_push(&pipeline->rings[0], &item);
+    return 0;
+}
+
+size_t blip_pipeline_finish(blip_pipeline_t* pipeline)
+{
+    if (!pipeline->finished) {
+        stop_threads(pipeline);
+    }
+
+    return pipeline->failures;
+}
+
+void blip_pipeline_free(blip_pipeline_t* pipeline)
+{
+    if (!pipeline) {
+        return;
+    }
+
+    if (pipeline->thread_count > 0) {
+        stop_threads(pipeline);
+    }
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        free(pipeline->rings[i].items);
+    }
+
+    free(pipeline);
+}
@@ -0,0 +1,48 @@
+//
+//  probe.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Finds where a slot of an open addressing table would be placed if its probe chain were
+// empty.  Returns false if the slot is empty.
+typedef bool (*probe_home_fn)(const void* slot, size_t mask, size_t* home);
+
+// Removes a slot from a linear probing table of mask + 1 slots, each slot_size bytes, in which
+// an all zero slot is empty.  Backward shift deletion, which keeps linear probe chains intact
+// without tombstones.
+static inline void probe_remove(void* slots, size_t slot_size, size_t mask, size_t removed, probe_home_fn home_of)
+{
+    uint8_t* base = slots;
+    size_t hole = removed;
+    size_t slot = (hole + 1) & mask;
+    size_t home;
+    while (home_of(base + slot * slot_size, mask, &home)) {
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            memcpy(base + hole * slot_size, base + slot * slot_size, slot_size);
+            hole = slot;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    memset(base + hole * slot_size, 0, slot_size);
+}
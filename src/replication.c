@@ -0,0 +1,262 @@
+//
+//  replication.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_replication.h"
+#include "json_index.h"
+#include <string.h>
+
+#define MAX_CHANGE_FIELDS 5
+
+static bool profile_is(const blip_message_t* msg, const char* profile)
+{
+    const size_t size = strlen(profile);
+    return msg->type == kRequestType && msg->profile && msg->profile_size == size
+           && memcmp(msg->profile, profile, size) == 0;
+}
+
+static blip_slice_t property(const blip_message_t* msg, const char* key)
+{
+    blip_slice_t retVal = {NULL, 0};
+    if (blip_message_get_property(msg, key, &retVal.buf, &retVal.size) < 0) {
+        retVal.buf = NULL;
+        retVal.size = 0;
+    }
+
+    return retVal;
+}
+
+static bool slice_equals(blip_slice_t slice, const char* str)
+{
+    const size_t size = strlen(str);
+    return slice.size == size && memcmp(slice.buf, str, size) == 0;
+}
+
+static uint64_t parse_uint(blip_slice_t slice)
+{
+    uint64_t retVal = 0;
+    for (size_t i = 0; i < slice.size && slice.buf[i] >= '0' && slice.buf[i] <= '9'; i++) {
+        retVal = retVal * 10 + (slice.buf[i] - '0');
+    }
+
+    return retVal;
+}
+
+// Booleans show up as true/false in JSON and properties, and as 0/1 (or flag bits) in older peers
+static bool parse_bool(blip_slice_t slice)
+{
+    return slice_equals(slice, "true") || parse_uint(slice) != 0;
+}
+
+static bool only_whitespace(const uint8_t* buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (buf[i] != ' ' && buf[i] != '\t' && buf[i] != '\n' && buf[i] != '\r') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static blip_slice_t body(const blip_message_t* msg)
+{
+    const blip_slice_t retVal = {msg->body, msg->body_size};
+    return retVal;
+}
+
+int blip_changes_begin(const blip_message_t* msg, blip_changes_iter_t* iter)
+{
+    const bool proposed = profile_is(msg, "proposeChanges");
+    if (!proposed && !profile_is(msg, "changes")) {
+        return -1;
+    }
+
+    // The tape is a cache of the body kept in the message, the same one blip_body_find() uses
+    const json_tape* tape = json_message_tape((blip_message_t*)msg);
+    iter->proposed = proposed;
+    iter->json = msg->body;
+    iter->tape = tape;
+    iter->index = 1;
+    if (!tape || tape->count == 0) {
+        // No body at all is as good as an empty list
+        return msg->body_size == 0 || (tape && only_whitespace(msg->body, msg->body_size)) ? 0 : -1;
+    }
+
+    if (msg->body[tape->positions[0]] != '[' || !only_whitespace(msg->body, tape->positions[0])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int blip_changes_next(blip_changes_iter_t* iter, blip_change_t* change)
+{
+    const json_tape* tape = iter->tape;
+    if (!tape || iter->index >= tape->count || iter->json[tape->positions[iter->index]] == ']') {
+        iter->tape = NULL;
+        return 0;
+    }
+
+    const uint8_t* json = iter->json;
+    size_t i = iter->index;
+    if (json[tape->positions[i]] != '[') {
+        return -1;
+    }
+
+    blip_slice_t fields[MAX_CHANGE_FIELDS];
+    memset(fields, 0, sizeof(fields));
+    size_t count = 0;
+    while (true) {
+        blip_slice_t value;
+        const size_t next = json_read_value(tape, json, i, &value.buf, &value.size);
+        if (next >= tape->count) {
+            return -1;
+        }
+
+        if (count < MAX_CHANGE_FIELDS) {
+            fields[count] = value;
+        }
+
+        count++;
+        i = next;
+        if (json[tape->positions[i]] == ']') {
+            break;
+        }
+
+        if (json[tape->positions[i]] != ',') {
+            return -1;
+        }
+    }
+
+    i++;
+    if (i < tape->count && json[tape->positions[i]] == ',') {
+        i++;
+    }
+
+    iter->index = i;
+    memset(change, 0, sizeof(blip_change_t));
+    if (iter->proposed) {
+        // [docID, revID, parentRevID, bodySize]
+        change->doc_id = fields[0];
+        change->rev_id = fields[1];
+        change->parent_rev_id = fields[2];
+        change->body_size = parse_uint(fields[3]);
+    } else {
+        // [sequence, docID, revID, deleted, bodySize]
+        change->sequence = fields[0];
+        change->doc_id = fields[1];
+        change->rev_id = fields[2];
+        change->deleted = parse_bool(fields[3]);
+        change->body_size = parse_uint(fields[4]);
+    }
+
+    return 1;
+}
+
+int blip_decode_rev(const blip_message_t* msg, blip_rev_t* rev)
+{
+    if (!profile_is(msg, "rev")) {
+        return -1;
+    }
+
+    rev->doc_id = property(msg, "id");
+    rev->rev_id = property(msg, "rev");
+    rev->sequence = property(msg, "sequence");
+    rev->history = property(msg, "history");
+    rev->deleted = parse_bool(property(msg, "deleted"));
+    rev->body = body(msg);
+    return rev->doc_id.buf && rev->rev_id.buf ? 0 : -1;
+}
+
+bool blip_history_next(blip_slice_t* history, blip_slice_t* rev_id)
+{
+    if (history->size == 0) {
+        return false;
+    }
+
+    const uint8_t* comma = memchr(history->buf, ',', history->size);
+    const size_t length = comma ? (size_t)(comma - history->buf) : history->size;
+    rev_id->buf = history->buf;
+    rev_id->size = length;
+    history->buf += comma ? length + 1 : length;
+    history->size -= comma ? length + 1 : length;
+    return true;
+}
+
+int blip_decode_sub_changes(const blip_message_t* msg, blip_sub_changes_t* sub)
+{
+    if (!profile_is(msg, "subChanges")) {
+        return -1;
+    }
+
+    sub->since = property(msg, "since");
+    sub->filter = property(msg, "filter");
+    sub->channels = property(msg, "channels");
+    sub->batch = parse_uint(property(msg, "batch"));
+    sub->continuous = parse_bool(property(msg, "continuous"));
+    sub->active_only = parse_bool(property(msg, "activeOnly"));
+    sub->body = body(msg);
+    return 0;
+}
+
+int blip_decode_attachment_request(const blip_message_t* msg, blip_attachment_request_t* request)
+{
+    const bool prove = profile_is(msg, "proveAttachment");
+    if (!prove && !profile_is(msg, "getAttachment")) {
+        return -1;
+    }
+
+    memset(request, 0, sizeof(blip_attachment_request_t));
+    request->digest = property(msg, "digest");
+    if (prove) {
+        request->nonce = body(msg);
+    } else {
+        request->doc_id = property(msg, "docID");
+    }
+
+    return request->digest.buf ? 0 : -1;
+}
+
+int blip_message_doc_ids(const blip_message_t* msg, blip_doc_id_visit visit, void* context)
+{
+    static const char* const kDocProperties[] = {"id", "docID"};
+    if (msg->type >= kAckRequestType) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(kDocProperties) / sizeof(kDocProperties[0]); i++) {
+        const blip_slice_t doc_id = property(msg, kDocProperties[i]);
+        const int retVal = doc_id.buf ? visit(context, doc_id) : 0;
+        if (retVal != 0) {
+            return retVal;
+        }
+    }
+
+    blip_changes_iter_t iter;
+    blip_change_t change;
+    if (msg->type == kRequestType && blip_changes_begin(msg, &iter) == 0) {
+        while (blip_changes_next(&iter, &change) == 1) {
+            const int retVal = visit(context, change.doc_id);
+            if (retVal != 0) {
+                return retVal;
+            }
+        }
+    }
+
+    return 0;
+}
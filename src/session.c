@@ -0,0 +1,324 @@
+//
+//  session.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_session.h"
+#include "probe.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Requests whose response never arrives would otherwise stay outstanding forever.  Once this
+// many are outstanding, all but the newest half of them are dropped before another one is added.
+#define MAX_OUTSTANDING 65536
+
+// A request waiting for its response.  A key of 0 marks an empty slot.
+typedef struct {
+    uint64_t key;                   // See outstanding_key
+    uint64_t request_first_ns;
+    uint64_t request_last_ns;
+    uint64_t response_first_ns;
+    uint64_t request_size;
+    uint64_t response_size;
+    uint64_t sequence;              // The order the request was added in
+    bool responding;                // Whether the first response frame has been seen
+    char profile[BLIP_SESSION_MAX_PROFILE + 1];
+} outstanding_entry;
+
+struct blip_session
+{
+    blip_connection_t* connections[2];
+    blip_exchange_callback callback;
+    void* context;
+
+    outstanding_entry* outstanding;
+    size_t outstanding_count;
+    size_t outstanding_mask;
+    uint64_t next_sequence;
+};
+
+// Both directions number their requests independently, so the direction of the request is
+// part of the key.  The +1 keeps keys clear of 0, which marks empty slots.
+static uint64_t outstanding_key(MessageNo msg_no, int direction)
+{
+    return ((msg_no << 1) | (uint64_t)direction) + 1;
+}
+
+static size_t outstanding_slot(uint64_t key, size_t mask)
+{
+    return (size_t)(key * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+}
+
+blip_session_t* blip_session_new(blip_exchange_callback callback, void* context)
+{
+    blip_session_t* retVal = calloc(1, sizeof(blip_session_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->outstanding_mask = 15;
+    retVal->outstanding = calloc(retVal->outstanding_mask + 1, sizeof(outstanding_entry));
+    retVal->connections[0] = blip_connection_new();
+    retVal->connections[1] = blip_connection_new();
+    if (!retVal->outstanding || !retVal->connections[0] || !retVal->connections[1]) {
+        blip_session_free(retVal);
+        return NULL;
+    }
+
+    retVal->callback = callback;
+    retVal->context = context;
+    return retVal;
+}
+
+void blip_session_free(blip_session_t* session)
+{
+    if (!session) {
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (session->connections[i]) {
+            blip_connection_free(session->connections[i]);
+        }
+    }
+
+    free(session->outstanding);
+    free(session);
+}
+
+blip_connection_t* blip_session_connection(blip_session_t* session, int direction)
+{
+    return direction == 0 || direction == 1 ? session->connections[direction] : NULL;
+}
+
+size_t blip_session_outstanding(const blip_session_t* session)
+{
+    return session->outstanding_count;
+}
+
+static outstanding_entry* find_outstanding(blip_session_t* session, uint64_t key)
+{
+    size_t slot = outstanding_slot(key, session->outstanding_mask);
+    while (session->outstanding[slot].key != 0) {
+        if (session->outstanding[slot].key == key) {
+            return &session->outstanding[slot];
+        }
+
+        slot = (slot + 1) & session->outstanding_mask;
+    }
+
+    return NULL;
+}
+
+static outstanding_entry* insert_outstanding(outstanding_entry* table, size_t mask, uint64_t key)
+{
+    size_t slot = outstanding_slot(key, mask);
+    while (table[slot].key != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    table[slot].key = key;
+    return &table[slot];
+}
+
+// Moves the outstanding requests into a table of the given size, skipping those added before
+// oldest (in insertion order)
+static int rehash_outstanding(blip_session_t* session, size_t new_mask, uint64_t oldest)
+{
+    outstanding_entry* table = calloc(new_mask + 1, sizeof(outstanding_entry));
+    if (!table) {
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i <= session->outstanding_mask; i++) {
+        if (session->outstanding[i].key != 0 && session->outstanding[i].sequence >= oldest) {
+            *insert_outstanding(table, new_mask, session->outstanding[i].key) = session->outstanding[i];
+            count++;
+        }
+    }
+
+    free(session->outstanding);
+    session->outstanding = table;
+    session->outstanding_mask = new_mask;
+    session->outstanding_count = count;
+    return 0;
+}
+
+static outstanding_entry* add_outstanding(blip_session_t* session, uint64_t key)
+{
+    if (session->outstanding_count >= MAX_OUTSTANDING) {
+        // At most MAX_OUTSTANDING / 2 of the outstanding requests were added this recently
+        if (rehash_outstanding(session, session->outstanding_mask, session->next_sequence - MAX_OUTSTANDING / 2) < 0) {
+            return NULL;
+        }
+    } else if ((session->outstanding_count + 1) * 2 > session->outstanding_mask + 1) {
+        if (rehash_outstanding(session, session->outstanding_mask * 2 + 1, 0) < 0) {
+            return NULL;
+        }
+    }
+
+    outstanding_entry* retVal = insert_outstanding(session->outstanding, session->outstanding_mask, key);
+    retVal->sequence = session->next_sequence++;
+    session->outstanding_count++;
+    return retVal;
+}
+
+static bool outstanding_home(const void* slot, size_t mask, size_t* home)
+{
+    const outstanding_entry* entry = slot;
+    *home = outstanding_slot(entry->key, mask);
+    return entry->key != 0;
+}
+
+static void remove_outstanding(blip_session_t* session, outstanding_entry* entry)
+{
+    probe_remove(session->outstanding, sizeof(outstanding_entry), session->outstanding_mask,
+                 entry - session->outstanding, outstanding_home);
+    session->outstanding_count--;
+}
+
+int blip_session_forget(blip_session_t* session, int direction)
+{
+    size_t count = 0;
+    size_t i = 0;
+    while (i <= session->outstanding_mask) {
+        const uint64_t key = session->outstanding[i].key;
+        if (key != 0 && (int)((key - 1) & 1) == direction) {
+            // The backward shift can move a later entry into this slot, so look at it again
+            remove_outstanding(session, &session->outstanding[i]);
+            count++;
+            continue;
+        }
+
+        i++;
+    }
+
+    return (int)count;
+}
+
+static uint64_t elapsed(uint64_t from, uint64_t to)
+{
+    return to > from ? to - from : 0;
+}
+
+static int track_request(blip_session_t* session, const blip_message_t* msg, int direction, uint64_t timestamp_ns)
+{
+    const uint64_t key = outstanding_key(msg->msg_no, direction);
+    outstanding_entry* entry = find_outstanding(session, key);
+    if (!entry) {
+        // Nothing will ever answer a NoReply request, so there is no point in holding on to it
+        if (msg->flags & kNoReply) {
+            return 0;
+        }
+
+        entry = add_outstanding(session, key);
+        if (!entry) {
+            return -1;
+        }
+
+        const size_t size = msg->profile_size < BLIP_SESSION_MAX_PROFILE ? msg->profile_size : BLIP_SESSION_MAX_PROFILE;
+        if (msg->profile && size > 0) {
+            memcpy(entry->profile, msg->profile, size);
+        }
+
+        entry->profile[msg->profile ? size : 0] = 0;
+        entry->request_first_ns = timestamp_ns;
+    }
+
+    entry->request_last_ns = timestamp_ns;
+    entry->request_size += msg->body_size;
+    return 0;
+}
+
+static int track_response(blip_session_t* session, const blip_message_t* msg, int direction, uint64_t timestamp_ns)
+{
+    // The request travelled the other way
+    outstanding_entry* entry = find_outstanding(session, outstanding_key(msg->msg_no, !direction));
+    if (!entry) {
+        return 0;
+    }
+
+    if (!entry->responding) {
+        entry->responding = true;
+        entry->response_first_ns = timestamp_ns;
+    }
+
+    entry->response_size += msg->body_size;
+    if (msg->flags & kMoreComing) {
+        return 0;
+    }
+
+    blip_exchange_t exchange;
+    exchange.msg_no = msg->msg_no;
+    exchange.direction = !direction;
+    exchange.profile = entry->profile;
+    exchange.response_type = msg->type;
+    exchange.request_first_ns = entry->request_first_ns;
+    exchange.request_last_ns = entry->request_last_ns;
+    exchange.response_first_ns = entry->response_first_ns;
+    exchange.response_last_ns = timestamp_ns;
+    exchange.rtt_ns = elapsed(entry->request_first_ns, timestamp_ns);
+    exchange.ttfb_ns = elapsed(entry->request_last_ns, entry->response_first_ns);
+    exchange.request_size = entry->request_size;
+    exchange.response_size = entry->response_size;
+    if (session->callback) {
+        session->callback(session->context, &exchange);
+    }
+
+    remove_outstanding(session, entry);
+    return 1;
+}
+
+int blip_session_track(blip_session_t* session, const blip_message_t* msg, uint64_t timestamp_ns)
+{
+    const blip_connection_t* connection = (const blip_connection_t*)msg->private[0];
+    const int direction = connection == session->connections[0] ? 0 : 1;
+    if (connection != session->connections[direction]) {
+        return -1;
+    }
+
+    if (msg->type >= kAckRequestType) {
+        return 0;
+    }
+
+    if (msg->type == kRequestType) {
+        return track_request(session, msg, direction, timestamp_ns);
+    }
+
+    return track_response(session, msg, direction, timestamp_ns);
+}
+
+blip_message_t* blip_session_read(blip_session_t* session, int direction, uint8_t* data, size_t size,
+                                  uint64_t timestamp_ns)
+{
+    blip_connection_t* connection = blip_session_connection(session, direction);
+    if (!connection) {
+        return NULL;
+    }
+
+    blip_message_t* retVal = blip_message_read(connection, data, size);
+    if (!retVal) {
+        return NULL;
+    }
+
+    if (blip_session_track(session, retVal, timestamp_ns) < 0) {
+        blip_message_free(retVal);
+        return NULL;
+    }
+
+    return retVal;
+}
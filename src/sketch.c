@@ -0,0 +1,1182 @@
+//
+//  sketch.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_sketch.h"
+#include "cblip_endian.h"
+#include "cblip_replication.h"
+#include "counters.h"
+#include "types.h"
+#include "xxhash.h"
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_HLL_PRECISION 14
+#define DEFAULT_TOP_K 64
+#define DEFAULT_CMS_WIDTH 2048
+#define DEFAULT_CMS_DEPTH 4
+#define DEFAULT_QUANTILE_BITS 5
+#define MAX_TOP_K 4096
+#define MAX_CMS_WIDTH (1u << 24)
+#define MAX_CMS_DEPTH 16
+#define KEY_WORDS ((BLIP_SKETCH_MAX_KEY + 8) / 8)
+#define HLL_HEADER_SIZE 8
+#define TOPK_HEADER_SIZE 32
+#define TOPK_ENTRY_SIZE 25
+#define QUANTILES_HEADER_SIZE 36
+#define QUANTILES_BUCKET_SIZE 12
+#define TRAFFIC_HEADER_SIZE 8
+#define TRAFFIC_SKETCHES 4
+
+static const char kHllMagic[4] = {'C', 'B', 'H', 'L'};
+static const char kTopkMagic[4] = {'C', 'B', 'T', 'K'};
+static const char kQuantilesMagic[4] = {'C', 'B', 'Q', 'S'};
+static const char kTrafficMagic[4] = {'C', 'B', 'T', 'S'};
+
+struct blip_hll
+{
+    unsigned precision;
+    atomic_uchar registers[];
+};
+
+// A tracked key.  Replacing the key bumps seq to an odd value and back, so that a reader
+// copying the slot can tell it raced with a replacement and retry.  Adding to the count of
+// the same key doesn't, since any value of it belongs with the key.
+typedef struct {
+    atomic_uint seq;
+    atomic_uint key_size;
+    atomic_uint_fast64_t hash;
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t error;
+    atomic_uint_fast64_t key[KEY_WORDS];
+} topk_slot;
+
+struct blip_topk
+{
+    uint32_t capacity;
+    uint32_t width;
+    uint32_t depth;
+    atomic_uint used;                   // Slots filled in, published (release) after the slot is
+    atomic_uint_fast64_t total;
+    topk_slot* slots;
+    atomic_uint_fast64_t* counters;     // The Count-Min rows, one after the other
+
+    // Only touched by the writing thread
+    uint32_t* heap;                     // Slot numbers, ordered as a min-heap by count
+    uint32_t* heap_pos;                 // Where each slot is in the heap
+    uint32_t* index;                    // Slot number + 1 by hash, linearly probed (0 is empty)
+    uint32_t index_mask;
+};
+
+struct blip_quantiles
+{
+    unsigned bits;
+    uint32_t bucket_count;
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t min;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[];
+};
+
+// A copy of a tracked key, as read by a thread other than the writer
+typedef struct {
+    uint64_t hash;
+    blip_topk_entry_t entry;
+} topk_item;
+
+static unsigned leading_zeros(uint64_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long bit;
+    _BitScanReverse64(&bit, value);
+    return 63 - bit;
+#else
+    return __builtin_clzll(value);
+#endif
+}
+
+static void put_u32(uint8_t* out, uint32_t value)
+{
+    const uint32_t le = _encLittle32(value);
+    memcpy(out, &le, 4);
+}
+
+static void put_u64(uint8_t* out, uint64_t value)
+{
+    const uint64_t le = _encLittle64(value);
+    memcpy(out, &le, 8);
+}
+
+static uint32_t get_u32(const uint8_t* in)
+{
+    uint32_t le;
+    memcpy(&le, in, 4);
+    return _decLittle32(le);
+}
+
+static uint64_t get_u64(const uint8_t* in)
+{
+    uint64_t le;
+    memcpy(&le, in, 8);
+    return _decLittle64(le);
+}
+
+static void put_header(uint8_t* out, const char magic[4], uint8_t parameter)
+{
+    memcpy(out, magic, 4);
+    out[4] = BLIP_SKETCH_VERSION;
+    out[5] = parameter;
+    out[6] = out[7] = 0;
+}
+
+static bool check_header(const uint8_t* data, size_t size, const char magic[4], size_t header_size)
+{
+    return size >= header_size && memcmp(data, magic, 4) == 0 && data[4] == BLIP_SKETCH_VERSION;
+}
+
+/******************
+ * HyperLogLog    *
+ *****************/
+
+blip_hll_t* blip_hll_new(unsigned precision)
+{
+    if (precision < 4 || precision > 18) {
+        return NULL;
+    }
+
+    blip_hll_t* retVal = calloc(1, sizeof(blip_hll_t) + ((size_t)1 << precision));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->precision = precision;
+    return retVal;
+}
+
+static void hll_add_hash(blip_hll_t* hll, uint64_t hash)
+{
+    // The top bits pick the register, which keeps the longest run of leading zeros seen in the
+    // rest (the sentinel bit caps the run)
+    const unsigned p = hll->precision;
+    const uint8_t rank = (uint8_t)(leading_zeros((hash << p) | (1ULL << (p - 1))) + 1);
+    atomic_uchar* reg = &hll->registers[hash >> (64 - p)];
+    if (rank > atomic_load_explicit(reg, memory_order_relaxed)) {
+        atomic_store_explicit(reg, rank, memory_order_relaxed);
+    }
+}
+
+void blip_hll_add(blip_hll_t* hll, const uint8_t* key, size_t size)
+{
+    hll_add_hash(hll, blip_xxh64(key, size, 0));
+}
+
+uint64_t blip_hll_estimate(const blip_hll_t* hll)
+{
+    const size_t m = (size_t)1 << hll->precision;
+    double sum = 0;
+    size_t zeros = 0;
+    for (size_t i = 0; i < m; i++) {
+        const uint8_t rank = atomic_load_explicit((atomic_uchar*)&hll->registers[i], memory_order_relaxed);
+        sum += 1.0 / (double)(1ULL << rank);
+        zeros += rank == 0;
+    }
+
+    double alpha;
+    switch (hll->precision) {
+        case 4:
+            alpha = 0.673;
+            break;
+        case 5:
+            alpha = 0.697;
+            break;
+        case 6:
+            alpha = 0.709;
+            break;
+        default:
+            alpha = 0.7213 / (1.0 + 1.079 / (double)m);
+            break;
+    }
+
+    // With a 64-bit hash only the small range needs correcting, by linear counting
+    double estimate = alpha * (double)m * (double)m / sum;
+    if (estimate <= 2.5 * (double)m && zeros > 0) {
+        estimate = (double)m * log((double)m / (double)zeros);
+    }
+
+    return (uint64_t)(estimate + 0.5);
+}
+
+int blip_hll_merge(blip_hll_t* into, const blip_hll_t* from)
+{
+    if (into->precision != from->precision) {
+        return -1;
+    }
+
+    const size_t m = (size_t)1 << into->precision;
+    for (size_t i = 0; i < m; i++) {
+        const uint8_t rank = atomic_load_explicit((atomic_uchar*)&from->registers[i], memory_order_relaxed);
+        if (rank > atomic_load_explicit(&into->registers[i], memory_order_relaxed)) {
+            atomic_store_explicit(&into->registers[i], rank, memory_order_relaxed);
+        }
+    }
+
+    return 0;
+}
+
+size_t blip_hll_serialize(const blip_hll_t* hll, uint8_t* buf, size_t capacity)
+{
+    const size_t m = (size_t)1 << hll->precision;
+    const size_t retVal = HLL_HEADER_SIZE + m;
+    if (!buf || capacity < retVal) {
+        return retVal;
+    }
+
+    put_header(buf, kHllMagic, (uint8_t)hll->precision);
+    for (size_t i = 0; i < m; i++) {
+        buf[HLL_HEADER_SIZE + i] = atomic_load_explicit((atomic_uchar*)&hll->registers[i], memory_order_relaxed);
+    }
+
+    return retVal;
+}
+
+blip_hll_t* blip_hll_deserialize(const uint8_t* data, size_t size)
+{
+    if (!check_header(data, size, kHllMagic, HLL_HEADER_SIZE)) {
+        return NULL;
+    }
+
+    blip_hll_t* retVal = blip_hll_new(data[5]);
+    if (!retVal) {
+        return NULL;
+    }
+
+    const size_t m = (size_t)1 << retVal->precision;
+    if (size != HLL_HEADER_SIZE + m) {
+        blip_hll_free(retVal);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < m; i++) {
+        const uint8_t rank = data[HLL_HEADER_SIZE + i];
+        if (rank > 65 - retVal->precision) {
+            blip_hll_free(retVal);
+            return NULL;
+        }
+
+        atomic_store_explicit(&retVal->registers[i], rank, memory_order_relaxed);
+    }
+
+    return retVal;
+}
+
+void blip_hll_free(blip_hll_t* hll)
+{
+    free(hll);
+}
+
+/******************
+ * Top-k          *
+ *****************/
+
+blip_topk_t* blip_topk_new(unsigned k, unsigned width, unsigned depth)
+{
+    if (k == 0 || k > MAX_TOP_K || width == 0 || width > MAX_CMS_WIDTH || depth == 0 || depth > MAX_CMS_DEPTH) {
+        return NULL;
+    }
+
+    blip_topk_t* retVal = calloc(1, sizeof(blip_topk_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    uint32_t rounded = 1;
+    while (rounded < width) {
+        rounded <<= 1;
+    }
+
+    uint32_t index_size = 16;
+    while (index_size < k * 2) {
+        index_size <<= 1;
+    }
+
+    retVal->capacity = k;
+    retVal->width = rounded;
+    retVal->depth = depth;
+    retVal->index_mask = index_size - 1;
+    retVal->slots = calloc(k, sizeof(topk_slot));
+    retVal->counters = calloc((size_t)rounded * depth, sizeof(atomic_uint_fast64_t));
+    retVal->heap = calloc(k, sizeof(uint32_t));
+    retVal->heap_pos = calloc(k, sizeof(uint32_t));
+    retVal->index = calloc(index_size, sizeof(uint32_t));
+    if (!retVal->slots || !retVal->counters || !retVal->heap || !retVal->heap_pos || !retVal->index) {
+        blip_topk_free(retVal);
+        return NULL;
+    }
+
+    return retVal;
+}
+
+// The Count-Min rows are indexed by double hashing the one 64-bit hash of the key
+static inline size_t cms_position(const blip_topk_t* topk, uint64_t hash, uint32_t row)
+{
+    const uint32_t h1 = (uint32_t)hash;
+    const uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    return (size_t)row * topk->width + ((h1 + row * h2) & (topk->width - 1));
+}
+
+static uint64_t cms_estimate(const blip_topk_t* topk, uint64_t hash)
+{
+    uint64_t retVal = UINT64_MAX;
+    for (uint32_t row = 0; row < topk->depth; row++) {
+        const uint64_t value = counter_load(&topk->counters[cms_position(topk, hash, row)]);
+        retVal = value < retVal ? value : retVal;
+    }
+
+    return retVal;
+}
+
+static inline uint64_t slot_count(const blip_topk_t* topk, uint32_t slot)
+{
+    return counter_load(&topk->slots[slot].count);
+}
+
+static inline uint64_t slot_hash(const blip_topk_t* topk, uint32_t slot)
+{
+    return counter_load(&topk->slots[slot].hash);
+}
+
+static void slot_write(topk_slot* slot, uint64_t hash, const uint8_t* key, size_t size, uint64_t count,
+                       uint64_t error)
+{
+    uint64_t words[KEY_WORDS] = {0};
+    const size_t kept = size < BLIP_SKETCH_MAX_KEY ? size : BLIP_SKETCH_MAX_KEY;
+    if (kept > 0) {
+        memcpy(words, key, kept);
+    }
+
+    const unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->hash, hash, memory_order_relaxed);
+    atomic_store_explicit(&slot->count, count, memory_order_relaxed);
+    atomic_store_explicit(&slot->error, error, memory_order_relaxed);
+    atomic_store_explicit(&slot->key_size, (unsigned)kept, memory_order_relaxed);
+    for (size_t i = 0; i < KEY_WORDS; i++) {
+        atomic_store_explicit(&slot->key[i], words[i], memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+static void slot_read(const topk_slot* slot, topk_item* item)
+{
+    topk_slot* s = (topk_slot*)slot;
+    uint64_t words[KEY_WORDS];
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&s->seq, memory_order_acquire);
+        item->hash = atomic_load_explicit(&s->hash, memory_order_relaxed);
+        item->entry.count = atomic_load_explicit(&s->count, memory_order_relaxed);
+        item->entry.error = atomic_load_explicit(&s->error, memory_order_relaxed);
+        item->entry.key_size = atomic_load_explicit(&s->key_size, memory_order_relaxed);
+        for (size_t i = 0; i < KEY_WORDS; i++) {
+            words[i] = atomic_load_explicit(&s->key[i], memory_order_relaxed);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    memcpy(item->entry.key, words, sizeof(item->entry.key));
+    item->entry.key[item->entry.key_size] = 0;
+}
+
+static void heap_swap(blip_topk_t* topk, uint32_t a, uint32_t b)
+{
+    const uint32_t slot = topk->heap[a];
+    topk->heap[a] = topk->heap[b];
+    topk->heap[b] = slot;
+    topk->heap_pos[topk->heap[a]] = a;
+    topk->heap_pos[topk->heap[b]] = b;
+}
+
+static void heap_down(blip_topk_t* topk, uint32_t pos, uint32_t used)
+{
+    while (true) {
+        uint32_t smallest = pos;
+        const uint32_t left = pos * 2 + 1;
+        const uint32_t right = left + 1;
+        if (left < used && slot_count(topk, topk->heap[left]) < slot_count(topk, topk->heap[smallest])) {
+            smallest = left;
+        }
+
+        if (right < used && slot_count(topk, topk->heap[right]) < slot_count(topk, topk->heap[smallest])) {
+            smallest = right;
+        }
+
+        if (smallest == pos) {
+            return;
+        }
+
+        heap_swap(topk, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void heap_up(blip_topk_t* topk, uint32_t pos)
+{
+    while (pos > 0) {
+        const uint32_t parent = (pos - 1) / 2;
+        if (slot_count(topk, topk->heap[parent]) <= slot_count(topk, topk->heap[pos])) {
+            return;
+        }
+
+        heap_swap(topk, pos, parent);
+        pos = parent;
+    }
+}
+
+// Finds the position of a hash in the index, or of the empty entry that ends its probe
+static uint32_t index_find(const blip_topk_t* topk, uint64_t hash)
+{
+    uint32_t i = (uint32_t)hash & topk->index_mask;
+    while (topk->index[i] && slot_hash(topk, topk->index[i] - 1) != hash) {
+        i = (i + 1) & topk->index_mask;
+    }
+
+    return i;
+}
+
+// Removes an index entry by shifting the rest of its probe run back over it
+static void index_remove(blip_topk_t* topk, uint32_t i)
+{
+    uint32_t j = i;
+    while (true) {
+        j = (j + 1) & topk->index_mask;
+        if (!topk->index[j]) {
+            break;
+        }
+
+        const uint32_t home = (uint32_t)slot_hash(topk, topk->index[j] - 1) & topk->index_mask;
+        const bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            topk->index[i] = topk->index[j];
+            i = j;
+        }
+    }
+
+    topk->index[i] = 0;
+}
+
+static void topk_add_hash(blip_topk_t* topk, uint64_t hash, const uint8_t* key, size_t size, uint64_t weight)
+{
+    for (uint32_t row = 0; row < topk->depth; row++) {
+        counter_add(&topk->counters[cms_position(topk, hash, row)], weight);
+    }
+
+    counter_add(&topk->total, weight);
+    const uint32_t pos = index_find(topk, hash);
+    if (topk->index[pos]) {
+        const uint32_t slot = topk->index[pos] - 1;
+        counter_add(&topk->slots[slot].count, weight);
+        heap_down(topk, topk->heap_pos[slot], atomic_load_explicit(&topk->used, memory_order_relaxed));
+        return;
+    }
+
+    const uint32_t used = atomic_load_explicit(&topk->used, memory_order_relaxed);
+    if (used < topk->capacity) {
+        slot_write(&topk->slots[used], hash, key, size, weight, 0);
+        topk->heap[used] = used;
+        topk->heap_pos[used] = used;
+        heap_up(topk, used);
+        topk->index[pos] = used + 1;
+        atomic_store_explicit(&topk->used, used + 1, memory_order_release);
+        return;
+    }
+
+    // SpaceSaving: the new key takes over the lightest slot, inheriting its count as error
+    const uint32_t slot = topk->heap[0];
+    const uint64_t floor = slot_count(topk, slot);
+    index_remove(topk, index_find(topk, slot_hash(topk, slot)));
+    slot_write(&topk->slots[slot], hash, key, size, floor + weight, floor);
+    topk->index[index_find(topk, hash)] = slot + 1;
+    heap_down(topk, 0, used);
+}
+
+void blip_topk_add(blip_topk_t* topk, const uint8_t* key, size_t size, uint64_t weight)
+{
+    topk_add_hash(topk, blip_xxh64(key, size, 0), key, size, weight);
+}
+
+uint64_t blip_topk_estimate(const blip_topk_t* topk, const uint8_t* key, size_t size)
+{
+    return cms_estimate(topk, blip_xxh64(key, size, 0));
+}
+
+uint64_t blip_topk_total(const blip_topk_t* topk)
+{
+    return counter_load(&topk->total);
+}
+
+// Copies out the tracked keys with their SpaceSaving counts, safely against the writer
+static uint32_t topk_snapshot(const blip_topk_t* topk, topk_item* items)
+{
+    const uint32_t retVal = atomic_load_explicit((atomic_uint*)&topk->used, memory_order_acquire);
+    for (uint32_t i = 0; i < retVal; i++) {
+        slot_read(&topk->slots[i], &items[i]);
+    }
+
+    return retVal;
+}
+
+static int compare_items(const void* a, const void* b)
+{
+    const uint64_t count_a = ((const topk_item*)a)->entry.count;
+    const uint64_t count_b = ((const topk_item*)b)->entry.count;
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+size_t blip_topk_list(const blip_topk_t* topk, blip_topk_entry_t* entries, size_t max)
+{
+    topk_item* items = malloc(topk->capacity * sizeof(topk_item));
+    if (!items) {
+        return 0;
+    }
+
+    // Both counts are upper bounds, so the lower one is the better
+    const uint32_t used = topk_snapshot(topk, items);
+    for (uint32_t i = 0; i < used; i++) {
+        blip_topk_entry_t* entry = &items[i].entry;
+        const uint64_t lower = entry->count - entry->error;
+        const uint64_t estimate = cms_estimate(topk, items[i].hash);
+        entry->count = estimate < entry->count ? estimate : entry->count;
+        entry->error = entry->count > lower ? entry->count - lower : 0;
+    }
+
+    qsort(items, used, sizeof(topk_item), compare_items);
+    const size_t retVal = used < max ? used : max;
+    for (size_t i = 0; i < retVal; i++) {
+        entries[i] = items[i].entry;
+    }
+
+    free(items);
+    return retVal;
+}
+
+// Replaces the tracked keys of a sketch, which the writing thread must not be touching
+static void topk_fill(blip_topk_t* topk, const topk_item* items, uint32_t count)
+{
+    memset(topk->index, 0, (topk->index_mask + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        const blip_topk_entry_t* entry = &items[i].entry;
+        slot_write(&topk->slots[i], items[i].hash, (const uint8_t*)entry->key, entry->key_size, entry->count,
+                   entry->error);
+        topk->heap[i] = i;
+        topk->heap_pos[i] = i;
+        topk->index[index_find(topk, items[i].hash)] = i + 1;
+    }
+
+    for (uint32_t i = count / 2; i-- > 0;) {
+        heap_down(topk, i, count);
+    }
+
+    atomic_store_explicit(&topk->used, count, memory_order_release);
+}
+
+static bool topk_compatible(const blip_topk_t* a, const blip_topk_t* b)
+{
+    return a->capacity == b->capacity && a->width == b->width && a->depth == b->depth;
+}
+
+int blip_topk_merge(blip_topk_t* into, const blip_topk_t* from)
+{
+    if (!topk_compatible(into, from)) {
+        return -1;
+    }
+
+    topk_item* items = malloc(into->capacity * 2 * sizeof(topk_item));
+    bool* matched = calloc(into->capacity, sizeof(bool));
+    if (!items || !matched) {
+        free(items);
+        free(matched);
+        return -1;
+    }
+
+    const uint32_t into_used = topk_snapshot(into, items);
+    const uint32_t from_used = topk_snapshot(from, items + into_used);
+
+    // A key missing from a full summary may have weighed up to its smallest count there
+    uint64_t into_floor = 0, from_floor = UINT64_MAX;
+    if (into_used == into->capacity) {
+        into_floor = slot_count(into, into->heap[0]);
+    }
+
+    for (uint32_t i = 0; i < from_used; i++) {
+        const uint64_t count = items[into_used + i].entry.count;
+        from_floor = count < from_floor ? count : from_floor;
+    }
+
+    if (from_used < from->capacity) {
+        from_floor = 0;
+    }
+
+    uint32_t count = into_used;
+    for (uint32_t i = 0; i < from_used; i++) {
+        const topk_item* item = &items[into_used + i];
+        const uint32_t pos = index_find(into, item->hash);
+        if (into->index[pos]) {
+            const uint32_t slot = into->index[pos] - 1;
+            items[slot].entry.count += item->entry.count;
+            items[slot].entry.error += item->entry.error;
+            matched[slot] = true;
+        } else {
+            items[count] = *item;
+            items[count].entry.count += into_floor;
+            items[count].entry.error += into_floor;
+            count++;
+        }
+    }
+
+    for (uint32_t i = 0; i < into_used; i++) {
+        if (!matched[i]) {
+            items[i].entry.count += from_floor;
+            items[i].entry.error += from_floor;
+        }
+    }
+
+    qsort(items, count, sizeof(topk_item), compare_items);
+    topk_fill(into, items, count < into->capacity ? count : into->capacity);
+    const size_t counters = (size_t)into->width * into->depth;
+    for (size_t i = 0; i < counters; i++) {
+        counter_add(&into->counters[i], counter_load(&from->counters[i]));
+    }
+
+    counter_add(&into->total, counter_load(&from->total));
+    free(items);
+    free(matched);
+    return 0;
+}
+
+size_t blip_topk_serialize(const blip_topk_t* topk, uint8_t* buf, size_t capacity)
+{
+    topk_item* items = malloc(topk->capacity * sizeof(topk_item));
+    if (!items) {
+        return 0;
+    }
+
+    const uint32_t used = topk_snapshot(topk, items);
+    const size_t counters = (size_t)topk->width * topk->depth;
+    size_t retVal = TOPK_HEADER_SIZE + counters * 8;
+    for (uint32_t i = 0; i < used; i++) {
+        retVal += TOPK_ENTRY_SIZE + items[i].entry.key_size;
+    }
+
+    if (!buf || capacity < retVal) {
+        free(items);
+        return retVal;
+    }
+
+    put_header(buf, kTopkMagic, 0);
+    put_u32(buf + 8, topk->capacity);
+    put_u32(buf + 12, topk->width);
+    put_u32(buf + 16, topk->depth);
+    put_u32(buf + 20, used);
+    put_u64(buf + 24, counter_load(&topk->total));
+    uint8_t* pos = buf + TOPK_HEADER_SIZE;
+    for (uint32_t i = 0; i < used; i++) {
+        const blip_topk_entry_t* entry = &items[i].entry;
+        put_u64(pos, items[i].hash);
+        put_u64(pos + 8, entry->count);
+        put_u64(pos + 16, entry->error);
+        pos[24] = (uint8_t)entry->key_size;
+        memcpy(pos + TOPK_ENTRY_SIZE, entry->key, entry->key_size);
+        pos += TOPK_ENTRY_SIZE + entry->key_size;
+    }
+
+    for (size_t i = 0; i < counters; i++) {
+        put_u64(pos, counter_load(&topk->counters[i]));
+        pos += 8;
+    }
+
+    free(items);
+    return retVal;
+}
+
+blip_topk_t* blip_topk_deserialize(const uint8_t* data, size_t size)
+{
+    if (!check_header(data, size, kTopkMagic, TOPK_HEADER_SIZE)) {
+        return NULL;
+    }
+
+    const uint32_t width = get_u32(data + 12);
+    const uint32_t used = get_u32(data + 20);
+    blip_topk_t* retVal = blip_topk_new(get_u32(data + 8), width, get_u32(data + 16));
+    if (!retVal) {
+        return NULL;
+    }
+
+    topk_item* items = calloc(retVal->capacity, sizeof(topk_item));
+    if (!items || retVal->width != width || used > retVal->capacity) {
+        free(items);
+        blip_topk_free(retVal);
+        return NULL;
+    }
+
+    const uint8_t* pos = data + TOPK_HEADER_SIZE;
+    const uint8_t* end = data + size;
+    for (uint32_t i = 0; i < used; i++) {
+        if (end - pos < TOPK_ENTRY_SIZE || pos[24] > BLIP_SKETCH_MAX_KEY || end - pos < TOPK_ENTRY_SIZE + pos[24]) {
+            free(items);
+            blip_topk_free(retVal);
+            return NULL;
+        }
+
+        blip_topk_entry_t* entry = &items[i].entry;
+        items[i].hash = get_u64(pos);
+        entry->count = get_u64(pos + 8);
+        entry->error = get_u64(pos + 16);
+        entry->key_size = pos[24];
+        memcpy(entry->key, pos + TOPK_ENTRY_SIZE, entry->key_size);
+        pos += TOPK_ENTRY_SIZE + entry->key_size;
+    }
+
+    const size_t counters = (size_t)retVal->width * retVal->depth;
+    if ((size_t)(end - pos) != counters * 8) {
+        free(items);
+        blip_topk_free(retVal);
+        return NULL;
+    }
+
+    // The heap only orders by count, so the serialized order doesn't matter
+    topk_fill(retVal, items, used);
+    for (size_t i = 0; i < counters; i++) {
+        atomic_store_explicit(&retVal->counters[i], get_u64(pos + i * 8), memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&retVal->total, get_u64(data + 24), memory_order_relaxed);
+    free(items);
+    return retVal;
+}
+
+void blip_topk_free(blip_topk_t* topk)
+{
+    if (!topk) {
+        return;
+    }
+
+    free(topk->slots);
+    free(topk->counters);
+    free(topk->heap);
+    free(topk->heap_pos);
+    free(topk->index);
+    free(topk);
+}
+
+/******************
+ * Quantiles      *
+ *****************/
+
+blip_quantiles_t* blip_quantiles_new(unsigned bits)
+{
+    if (bits < 1 || bits > 10) {
+        return NULL;
+    }
+
+    // Values below 2^bits get a bucket each, then every power of two gets 2^bits buckets
+    const uint32_t bucket_count = (65 - bits) << bits;
+    blip_quantiles_t* retVal = calloc(1, sizeof(blip_quantiles_t) + bucket_count * sizeof(atomic_uint_fast64_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->bits = bits;
+    retVal->bucket_count = bucket_count;
+    atomic_store_explicit(&retVal->min, UINT64_MAX, memory_order_relaxed);
+    return retVal;
+}
+
+static inline uint32_t bucket_of(unsigned bits, uint64_t value)
+{
+    if (value < (1ULL << bits)) {
+        return (uint32_t)value;
+    }
+
+    const unsigned shift = 63 - leading_zeros(value) - bits;
+    return ((shift + 1) << bits) + (uint32_t)((value >> shift) - (1ULL << bits));
+}
+
+// The middle of the values that land in a bucket
+static uint64_t bucket_value(unsigned bits, uint32_t bucket)
+{
+    if (bucket < (1u << bits)) {
+        return bucket;
+    }
+
+    const unsigned shift = (bucket >> bits) - 1;
+    const uint64_t low = ((uint64_t)(bucket & ((1u << bits) - 1)) + (1ULL << bits)) << shift;
+    return low + (((1ULL << shift) - 1) >> 1);
+}
+
+void blip_quantiles_add(blip_quantiles_t* quantiles, uint64_t value)
+{
+    counter_add(&quantiles->buckets[bucket_of(quantiles->bits, value)], 1);
+    counter_add(&quantiles->count, 1);
+    if (value < counter_load(&quantiles->min)) {
+        atomic_store_explicit(&quantiles->min, value, memory_order_relaxed);
+    }
+
+    if (value > counter_load(&quantiles->max)) {
+        atomic_store_explicit(&quantiles->max, value, memory_order_relaxed);
+    }
+}
+
+uint64_t blip_quantiles_count(const blip_quantiles_t* quantiles)
+{
+    return counter_load(&quantiles->count);
+}
+
+uint64_t blip_quantiles_get(const blip_quantiles_t* quantiles, double q)
+{
+    // Sum the buckets rather than trust count, which a concurrent writer may have moved on
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < quantiles->bucket_count; i++) {
+        total += counter_load(&quantiles->buckets[i]);
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    q = q < 0 ? 0 : q > 1 ? 1 : q;
+    const uint64_t rank = (uint64_t)(q * (double)(total - 1)) + 1;
+    const uint64_t min = counter_load(&quantiles->min);
+    const uint64_t max = counter_load(&quantiles->max);
+    if (rank == 1 || rank == total) {
+        return rank == 1 ? min : max;
+    }
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < quantiles->bucket_count; i++) {
+        seen += counter_load(&quantiles->buckets[i]);
+        if (seen >= rank) {
+            const uint64_t value = bucket_value(quantiles->bits, i);
+            return value < min ? min : value > max ? max : value;
+        }
+    }
+
+    return max;
+}
+
+int blip_quantiles_merge(blip_quantiles_t* into, const blip_quantiles_t* from)
+{
+    if (into->bits != from->bits) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < into->bucket_count; i++) {
+        counter_add(&into->buckets[i], counter_load(&from->buckets[i]));
+    }
+
+    counter_add(&into->count, counter_load(&from->count));
+    const uint64_t min = counter_load(&from->min);
+    const uint64_t max = counter_load(&from->max);
+    if (min < counter_load(&into->min)) {
+        atomic_store_explicit(&into->min, min, memory_order_relaxed);
+    }
+
+    if (max > counter_load(&into->max)) {
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+size_t blip_quantiles_serialize(const blip_quantiles_t* quantiles, uint8_t* buf, size_t capacity)
+{
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < quantiles->bucket_count; i++) {
+        used += counter_load(&quantiles->buckets[i]) != 0;
+    }
+
+    // A concurrent writer can fill buckets between the two passes, so leave them out rather
+    // than overrun the size that was reported
+    const size_t retVal = QUANTILES_HEADER_SIZE + (size_t)used * QUANTILES_BUCKET_SIZE;
+    if (!buf || capacity < retVal) {
+        return retVal;
+    }
+
+    put_header(buf, kQuantilesMagic, (uint8_t)quantiles->bits);
+    put_u64(buf + 8, counter_load(&quantiles->count));
+    put_u64(buf + 16, counter_load(&quantiles->min));
+    put_u64(buf + 24, counter_load(&quantiles->max));
+    uint8_t* pos = buf + QUANTILES_HEADER_SIZE;
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < quantiles->bucket_count && written < used; i++) {
+        const uint64_t count = counter_load(&quantiles->buckets[i]);
+        if (count != 0) {
+            put_u32(pos, i);
+            put_u64(pos + 4, count);
+            pos += QUANTILES_BUCKET_SIZE;
+            written++;
+        }
+    }
+
+    put_u32(buf + 32, written);
+    return QUANTILES_HEADER_SIZE + (size_t)written * QUANTILES_BUCKET_SIZE;
+}
+
+blip_quantiles_t* blip_quantiles_deserialize(const uint8_t* data, size_t size)
+{
+    if (!check_header(data, size, kQuantilesMagic, QUANTILES_HEADER_SIZE)) {
+        return NULL;
+    }
+
+    blip_quantiles_t* retVal = blip_quantiles_new(data[5]);
+    if (!retVal) {
+        return NULL;
+    }
+
+    const uint32_t used = get_u32(data + 32);
+    if (size != QUANTILES_HEADER_SIZE + (size_t)used * QUANTILES_BUCKET_SIZE) {
+        blip_quantiles_free(retVal);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < used; i++) {
+        const uint8_t* pos = data + QUANTILES_HEADER_SIZE + (size_t)i * QUANTILES_BUCKET_SIZE;
+        const uint32_t bucket = get_u32(pos);
+        if (bucket >= retVal->bucket_count) {
+            blip_quantiles_free(retVal);
+            return NULL;
+        }
+
+        atomic_store_explicit(&retVal->buckets[bucket], get_u64(pos + 4), memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&retVal->count, get_u64(data + 8), memory_order_relaxed);
+    atomic_store_explicit(&retVal->min, get_u64(data + 16), memory_order_relaxed);
+    atomic_store_explicit(&retVal->max, get_u64(data + 24), memory_order_relaxed);
+    return retVal;
+}
+
+void blip_quantiles_free(blip_quantiles_t* quantiles)
+{
+    free(quantiles);
+}
+
+/******************
+ * Traffic        *
+ *****************/
+
+void blip_sketch_default_options(blip_sketch_options* options)
+{
+    options->hll_precision = DEFAULT_HLL_PRECISION;
+    options->top_k = DEFAULT_TOP_K;
+    options->cms_width = DEFAULT_CMS_WIDTH;
+    options->cms_depth = DEFAULT_CMS_DEPTH;
+    options->quantile_bits = DEFAULT_QUANTILE_BITS;
+}
+
+int blip_traffic_sketches_new(const blip_sketch_options* options, blip_traffic_sketches_t* sketches)
+{
+    blip_sketch_options defaults;
+    if (!options) {
+        blip_sketch_default_options(&defaults);
+        options = &defaults;
+    }
+
+    sketches->doc_ids = blip_hll_new(options->hll_precision);
+    sketches->hot_docs = blip_topk_new(options->top_k, options->cms_width, options->cms_depth);
+    sketches->client_bytes = blip_topk_new(options->top_k, options->cms_width, options->cms_depth);
+    sketches->body_sizes = blip_quantiles_new(options->quantile_bits);
+    if (!sketches->doc_ids || !sketches->hot_docs || !sketches->client_bytes || !sketches->body_sizes) {
+        blip_traffic_sketches_free(sketches);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int record_doc_id(void* context, blip_slice_t doc_id)
+{
+    blip_traffic_sketches_t* sketches = context;
+    const uint64_t hash = blip_xxh64(doc_id.buf, doc_id.size, 0);
+    hll_add_hash(sketches->doc_ids, hash);
+    topk_add_hash(sketches->hot_docs, hash, doc_id.buf, doc_id.size, 1);
+    return 0;
+}
+
+void blip_traffic_sketches_record(blip_traffic_sketches_t* sketches, const blip_message_t* msg, size_t wire_size)
+{
+    if (msg->type < kAckRequestType) {
+        blip_quantiles_add(sketches->body_sizes, msg->body_size);
+        blip_message_doc_ids(msg, record_doc_id, sketches);
+    }
+
+    const blip_connection_t* connection = (const blip_connection_t*)msg->private[0];
+    if (connection && connection->client) {
+        blip_topk_add(sketches->client_bytes, (const uint8_t*)connection->client, connection->client_size,
+                      wire_size);
+    }
+}
+
+int blip_traffic_sketches_merge(blip_traffic_sketches_t* into, const blip_traffic_sketches_t* from)
+{
+    // Check everything up front so that a mismatch leaves the destination untouched
+    if (into->doc_ids->precision != from->doc_ids->precision || !topk_compatible(into->hot_docs, from->hot_docs)
+        || !topk_compatible(into->client_bytes, from->client_bytes)
+        || into->body_sizes->bits != from->body_sizes->bits) {
+        return -1;
+    }
+
+    blip_hll_merge(into->doc_ids, from->doc_ids);
+    blip_quantiles_merge(into->body_sizes, from->body_sizes);
+    if (blip_topk_merge(into->hot_docs, from->hot_docs) < 0
+        || blip_topk_merge(into->client_bytes, from->client_bytes) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+size_t blip_traffic_sketches_serialize(const blip_traffic_sketches_t* sketches, uint8_t* buf, size_t capacity)
+{
+    size_t sizes[TRAFFIC_SKETCHES] = {
+        blip_hll_serialize(sketches->doc_ids, NULL, 0),
+        blip_topk_serialize(sketches->hot_docs, NULL, 0),
+        blip_topk_serialize(sketches->client_bytes, NULL, 0),
+        blip_quantiles_serialize(sketches->body_sizes, NULL, 0),
+    };
+
+    size_t retVal = TRAFFIC_HEADER_SIZE;
+    for (size_t i = 0; i < TRAFFIC_SKETCHES; i++) {
+        retVal += 4 + sizes[i];
+    }
+
+    if (!buf || capacity < retVal) {
+        return retVal;
+    }
+
+    // The sketches may still be growing, so each section records what was actually written
+    put_header(buf, kTrafficMagic, 0);
+    uint8_t* pos = buf + TRAFFIC_HEADER_SIZE;
+    const uint8_t* end = buf + retVal;
+    for (size_t i = 0; i < TRAFFIC_SKETCHES; i++) {
+        const size_t room = end - pos - 4;
+        switch (i) {
+            case 0:
+                sizes[i] = blip_hll_serialize(sketches->doc_ids, pos + 4, room);
+                break;
+            case 1:
+                sizes[i] = blip_topk_serialize(sketches->hot_docs, pos + 4, room);
+                break;
+            case 2:
+                sizes[i] = blip_topk_serialize(sketches->client_bytes, pos + 4, room);
+                break;
+            default:
+                sizes[i] = blip_quantiles_serialize(sketches->body_sizes, pos + 4, room);
+                break;
+        }
+
+        if (sizes[i] == 0 || sizes[i] > room) {
+            return 0;
+        }
+
+        put_u32(pos, (uint32_t)sizes[i]);
+        pos += 4 + sizes[i];
+    }
+
+    return pos - buf;
+}
+
+int blip_traffic_sketches_deserialize(const uint8_t* data, size_t size, blip_traffic_sketches_t* sketches)
+{
+    memset(sketches, 0, sizeof(blip_traffic_sketches_t));
+    if (!check_header(data, size, kTrafficMagic, TRAFFIC_HEADER_SIZE)) {
+        return -1;
+    }
+
+    const uint8_t* pos = data + TRAFFIC_HEADER_SIZE;
+    const uint8_t* end = data + size;
+    for (size_t i = 0; i < TRAFFIC_SKETCHES; i++) {
+        if (end - pos < 4 || (size_t)(end - pos - 4) < get_u32(pos)) {
+            blip_traffic_sketches_free(sketches);
+            return -1;
+        }
+
+        const uint32_t section = get_u32(pos);
+        bool ok;
+        switch (i) {
+            case 0:
+                ok = (sketches->doc_ids = blip_hll_deserialize(pos + 4, section)) != NULL;
+                break;
+            case 1:
+                ok = (sketches->hot_docs = blip_topk_deserialize(pos + 4, section)) != NULL;
+                break;
+            case 2:
+                ok = (sketches->client_bytes = blip_topk_deserialize(pos + 4, section)) != NULL;
+                break;
+            default:
+                ok = (sketches->body_sizes = blip_quantiles_deserialize(pos + 4, section)) != NULL;
+                break;
+        }
+
+        if (!ok) {
+            blip_traffic_sketches_free(sketches);
+            return -1;
+        }
+
+        pos += 4 + section;
+    }
+
+    if (pos != end) {
+        blip_traffic_sketches_free(sketches);
+        return -1;
+    }
+
+    return 0;
+}
+
+void blip_traffic_sketches_free(blip_traffic_sketches_t* sketches)
+{
+    blip_hll_free(sketches->doc_ids);
+    blip_topk_free(sketches->hot_docs);
+    blip_topk_free(sketches->client_bytes);
+    blip_quantiles_free(sketches->body_sizes);
+    memset(sketches, 0, sizeof(blip_traffic_sketches_t));
+}
+
+int blip_connection_set_client(blip_connection_t* connection, const char* client)
+{
+    char* copy = NULL;
+    if (client) {
+        const size_t size = strlen(client);
+        copy = malloc(size + 1);
+        if (!copy) {
+            return -1;
+        }
+
+        memcpy(copy, client, size + 1);
+        connection->client_size = size;
+    }
+
+    free(connection->client);
+    connection->client = copy;
+    return 0;
+}
@@ -0,0 +1,565 @@
+//
+//  stats.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip_stats.h"
+#include "cblip_sketch.h"
+#include "counters.h"
+#include "msg_handler.h"
+#include "types.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Counter layout of an entry: six totals followed by the size histogram
+#define COUNTER_MESSAGES 0
+#define COUNTER_COMPRESSED 1
+#define COUNTER_WIRE_BYTES 2
+#define COUNTER_BODY_BYTES 3
+#define COUNTER_COMPRESSED_BODY_BYTES 4
+#define COUNTER_DEFLATED_BYTES 5
+#define COUNTER_HISTOGRAM 6
+#define COUNTER_COUNT (COUNTER_HISTOGRAM + BLIP_STATS_HISTOGRAM_BUCKETS)
+
+// The requests remembered per shard so that their replies are attributed to their profile, in
+// buckets of four.  Older requests are overwritten when a bucket is full, so a reply to a
+// request that was never answered cannot hold a slot forever.
+#define PENDING_SLOTS 1024
+#define PENDING_WAYS 4
+
+// The life cycle of an entry.  Only the owning thread moves an entry out of kEntryEmpty,
+// kEntryLive or kEntryRetired, and only the flusher moves it out of kEntryClosing.
+enum {
+    kEntryEmpty = 0,
+    kEntryLive,         // The key is filled in and the counters are being written
+    kEntryClosing,      // The connection went away, its last counts still need to be flushed
+    kEntryRetired       // Flushed for the last time, the owning thread may reuse the slot
+};
+
+typedef struct {
+    MessageNo msg_no;
+    const blip_connection_t* connection;    // The connection the request was read from, NULL for an empty slot
+    uint32_t profile_hash;
+    uint8_t profile_size;
+    char profile[BLIP_STATS_MAX_PROFILE];
+} pending_request;
+
+typedef struct {
+    atomic_uint state;                      // Set (release) to kEntryLive once the key below is filled in
+    uint32_t profile_hash;
+    const blip_connection_t* connection;
+    MessageType type;
+    int32_t error_code;
+    char profile[BLIP_STATS_MAX_PROFILE + 1];
+    atomic_uint_fast64_t counters[COUNTER_COUNT];
+} stats_entry;
+
+struct blip_stats_shard
+{
+    stats_entry* entries;       // capacity slots, then the overflow entry
+    size_t mask;
+    size_t used;                // Only touched by the owning thread
+    size_t limit;
+    pending_request* pending;   // PENDING_SLOTS requests awaiting a reply, only touched by the owning thread
+    uint64_t (*flushed)[COUNTER_COUNT];   // Counter values at the previous flush, only touched by the flusher
+    blip_traffic_sketches_t sketches;       // All NULL unless blip_stats_enable_sketches() was called
+};
+
+struct blip_stats
+{
+    blip_stats_shard_t** shards;
+    size_t shard_count;
+    uint64_t interval_ms;
+    uint64_t last_flush_ms;
+    blip_stats_callback callback;
+    void* context;
+};
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t entry_hash(uint32_t profile_hash, const blip_connection_t* connection, MessageType type,
+                         int32_t error_code)
+{
+    uint64_t h = ((uint64_t)profile_hash << 32) ^ (uint64_t)(uintptr_t)connection ^ ((uint64_t)type << 24)
+                 ^ (uint32_t)error_code;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static unsigned size_bucket(size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+#if defined(_MSC_VER)
+    unsigned long bit;
+    _BitScanReverse64(&bit, size);
+    const unsigned bucket = bit + 1;
+#else
+    const unsigned bucket = 64 - __builtin_clzll(size);
+#endif
+    return bucket < BLIP_STATS_HISTOGRAM_BUCKETS ? bucket : BLIP_STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+static int32_t parse_error_code(const blip_message_t* msg)
+{
+    const uint8_t* value;
+    size_t value_size;
+    if (blip_message_get_property(msg, "Error-Code", &value, &value_size) < 0) {
+        return 0;
+    }
+
+    int32_t retVal = 0;
+    const bool negative = value_size > 0 && value[0] == '-';
+    for (size_t i = negative ? 1 : 0; i < value_size && value[i] >= '0' && value[i] <= '9'; i++) {
+        retVal = retVal * 10 + (value[i] - '0');
+    }
+
+    return negative ? -retVal : retVal;
+}
+
+static void fill_key(stats_entry* entry, uint32_t profile_hash, const blip_connection_t* connection,
+                     MessageType type, int32_t error_code, const uint8_t* profile, size_t profile_size)
+{
+    const size_t size = profile_size < BLIP_STATS_MAX_PROFILE ? profile_size : BLIP_STATS_MAX_PROFILE;
+    entry->profile_hash = profile_hash;
+    entry->connection = connection;
+    entry->type = type;
+    entry->error_code = error_code;
+    if (size > 0) {
+        memcpy(entry->profile, profile, size);
+    }
+
+    entry->profile[size] = 0;
+}
+
+static bool profile_matches(const stats_entry* entry, const uint8_t* profile, size_t profile_size)
+{
+    const size_t size = profile_size < BLIP_STATS_MAX_PROFILE ? profile_size : BLIP_STATS_MAX_PROFILE;
+    return entry->profile[size] == 0 && (size == 0 || memcmp(entry->profile, profile, size) == 0);
+}
+
+// A retired slot is only reused by a key whose probe chain passes it, so on its own it acts as a
+// tombstone.  Those that only lead up to an empty slot are on no other entry's chain, and can be
+// emptied, working back from each empty slot.  Returns whether any were.
+static bool reclaim_retired(blip_stats_shard_t* shard)
+{
+    const size_t before = shard->used;
+    for (size_t i = 0; i <= shard->mask; i++) {
+        if (atomic_load_explicit(&shard->entries[i].state, memory_order_relaxed) != kEntryEmpty) {
+            continue;
+        }
+
+        size_t j = (i - 1) & shard->mask;
+        while (atomic_load_explicit(&shard->entries[j].state, memory_order_relaxed) == kEntryRetired) {
+            atomic_store_explicit(&shard->entries[j].state, kEntryEmpty, memory_order_relaxed);
+            shard->used--;
+            j = (j - 1) & shard->mask;
+        }
+    }
+
+    return shard->used < before;
+}
+
+static stats_entry* find_entry(blip_stats_shard_t* shard, const blip_message_t* msg, uint32_t profile_hash,
+                               const uint8_t* profile, size_t profile_size, int32_t error_code)
+{
+    const blip_connection_t* connection = (const blip_connection_t*)msg->private[0];
+    const size_t home = entry_hash(profile_hash, connection, msg->type, error_code) & shard->mask;
+    size_t i = home;
+    stats_entry* reusable = NULL;
+    while (true) {
+        stats_entry* entry = &shard->entries[i];
+        const unsigned state = atomic_load_explicit(&entry->state, memory_order_acquire);
+        if (state == kEntryEmpty) {
+            break;
+        }
+
+        if (state == kEntryRetired && !reusable) {
+            reusable = entry;
+        } else if (state == kEntryLive && entry->profile_hash == profile_hash && entry->connection == connection
+                   && entry->type == msg->type && entry->error_code == error_code
+                   && profile_matches(entry, profile, profile_size)) {
+            return entry;
+        }
+
+        i = (i + 1) & shard->mask;
+    }
+
+    stats_entry* entry = reusable;
+    if (!entry) {
+        if (shard->used >= shard->limit && !reclaim_retired(shard)) {
+            return &shard->entries[shard->mask + 1];
+        }
+
+        // Reclaiming can empty slots between home and i, and the entry has to go in the first
+        // empty one to stay reachable
+        i = home;
+        while (atomic_load_explicit(&shard->entries[i].state, memory_order_relaxed) != kEntryEmpty) {
+            i = (i + 1) & shard->mask;
+        }
+
+        entry = &shard->entries[i];
+        shard->used++;
+    }
+
+    // Publish the key only after it is complete, so that a concurrent flush never sees half of it.
+    // The counters of a reused slot carry on from where they were flushed for the last time.
+    fill_key(entry, profile_hash, connection, msg->type, error_code, profile, profile_size);
+    atomic_store_explicit(&entry->state, kEntryLive, memory_order_release);
+    return entry;
+}
+
+static pending_request* pending_bucket(blip_stats_shard_t* shard, MessageNo msg_no)
+{
+    const size_t bucket = (size_t)(msg_no * 0x9E3779B97F4A7C15ULL >> 32) & (PENDING_SLOTS / PENDING_WAYS - 1);
+    return &shard->pending[bucket * PENDING_WAYS];
+}
+
+// Remembers the profile of a request that expects a reply
+static void remember_request(blip_stats_shard_t* shard, const blip_message_t* msg, uint32_t profile_hash)
+{
+    const blip_connection_t* connection = (const blip_connection_t*)msg->private[0];
+    pending_request* bucket = pending_bucket(shard, msg->msg_no);
+    pending_request* slot = &bucket[msg->msg_no % PENDING_WAYS];
+    for (size_t i = 0; i < PENDING_WAYS; i++) {
+        if (!bucket[i].connection || (bucket[i].msg_no == msg->msg_no && bucket[i].connection == connection)) {
+            slot = &bucket[i];
+            break;
+        }
+    }
+
+    const size_t size = msg->profile_size < BLIP_STATS_MAX_PROFILE ? msg->profile_size : BLIP_STATS_MAX_PROFILE;
+    slot->msg_no = msg->msg_no;
+    slot->connection = connection;
+    slot->profile_hash = profile_hash;
+    slot->profile_size = (uint8_t)size;
+    memcpy(slot->profile, msg->profile, size);
+}
+
+// Finds the request a reply answers, which was read from the opposite connection
+static pending_request* find_request(blip_stats_shard_t* shard, const blip_message_t* msg)
+{
+    const blip_connection_t* connection = (const blip_connection_t*)msg->private[0];
+    pending_request* bucket = pending_bucket(shard, msg->msg_no);
+    for (size_t i = 0; i < PENDING_WAYS; i++) {
+        if (bucket[i].connection && bucket[i].connection != connection && bucket[i].msg_no == msg->msg_no) {
+            return &bucket[i];
+        }
+    }
+
+    return NULL;
+}
+
+static blip_stats_shard_t* shard_new(size_t capacity)
+{
+    blip_stats_shard_t* retVal = calloc(1, sizeof(blip_stats_shard_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    size_t slots = 16;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    retVal->mask = slots - 1;
+    retVal->limit = slots - slots / 4;
+    retVal->entries = calloc(slots + 1, sizeof(stats_entry));
+    retVal->flushed = calloc(slots + 1, sizeof(*retVal->flushed));
+    retVal->pending = calloc(PENDING_SLOTS, sizeof(pending_request));
+    if (!retVal->entries || !retVal->flushed || !retVal->pending) {
+        free(retVal->entries);
+        free(retVal->flushed);
+        free(retVal->pending);
+        free(retVal);
+        return NULL;
+    }
+
+    stats_entry* overflow = &retVal->entries[slots];
+    fill_key(overflow, 0, NULL, kRequestType, 0, (const uint8_t*)"(other)", 7);
+    atomic_store_explicit(&overflow->state, kEntryLive, memory_order_release);
+    return retVal;
+}
+
+blip_stats_t* blip_stats_new(size_t shard_count, size_t shard_capacity, uint64_t interval_ms,
+                             blip_stats_callback callback, void* context)
+{
+    if (shard_count == 0 || !callback) {
+        return NULL;
+    }
+
+    blip_stats_t* retVal = calloc(1, sizeof(blip_stats_t));
+    if (!retVal) {
+        return NULL;
+    }
+
+    retVal->shards = calloc(shard_count, sizeof(blip_stats_shard_t*));
+    if (!retVal->shards) {
+        free(retVal);
+        return NULL;
+    }
+
+    retVal->shard_count = shard_count;
+    for (size_t i = 0; i < shard_count; i++) {
+        retVal->shards[i] = shard_new(shard_capacity);
+        if (!retVal->shards[i]) {
+            blip_stats_free(retVal);
+            return NULL;
+        }
+    }
+
+    retVal->interval_ms = interval_ms;
+    retVal->last_flush_ms = now_ms();
+    retVal->callback = callback;
+    retVal->context = context;
+    return retVal;
+}
+
+blip_stats_shard_t* blip_stats_shard(blip_stats_t* stats, size_t index)
+{
+    return index < stats->shard_count ? stats->shards[index] : NULL;
+}
+
+void blip_stats_forget_connection(blip_stats_shard_t* shard, const blip_connection_t* connection)
+{
+    for (size_t i = 0; i <= shard->mask; i++) {
+        stats_entry* entry = &shard->entries[i];
+        if (atomic_load_explicit(&entry->state, memory_order_relaxed) == kEntryLive && entry->connection == connection) {
+            atomic_store_explicit(&entry->state, kEntryClosing, memory_order_release);
+        }
+    }
+
+    for (size_t i = 0; i < PENDING_SLOTS; i++) {
+        if (shard->pending[i].connection == connection) {
+            shard->pending[i].connection = NULL;
+        }
+    }
+}
+
+void blip_connection_set_stats(blip_connection_t* connection, blip_stats_shard_t* shard)
+{
+    if (connection->stats && connection->stats != shard) {
+        blip_stats_forget_connection(connection->stats, connection);
+    }
+
+    connection->stats = shard;
+}
+
+void blip_stats_record(blip_stats_shard_t* shard, const blip_message_t* msg, size_t wire_size)
+{
+    const int32_t error_code = msg->type == kErrorType ? parse_error_code(msg) : 0;
+    uint32_t profile_hash = msg->profile ? (uint32_t)msg->private[4] : 0;
+    const uint8_t* profile = msg->profile;
+    size_t profile_size = msg->profile_size;
+    if (msg->type == kRequestType) {
+        if (msg->profile && !(msg->flags & kNoReply)) {
+            remember_request(shard, msg, profile_hash);
+        }
+    } else if (msg->type < kAckRequestType) {
+        pending_request* request = find_request(shard, msg);
+        if (request) {
+            profile_hash = request->profile_hash;
+            profile = (const uint8_t*)request->profile;
+            profile_size = request->profile_size;
+            if (!(msg->flags & kMoreComing)) {
+                request->connection = NULL;
+            }
+        }
+    }
+
+    stats_entry* entry = find_entry(shard, msg, profile_hash, profile, profile_size, error_code);
+    const size_t body_size = msg->type < kAckRequestType ? msg->body_size : 0;
+    const bool compressed = msg->type < kAckRequestType && (msg->flags & kCompressed);
+    counter_add(&entry->counters[COUNTER_MESSAGES], 1);
+    counter_add(&entry->counters[COUNTER_COMPRESSED], compressed ? 1 : 0);
+    counter_add(&entry->counters[COUNTER_WIRE_BYTES], wire_size);
+    counter_add(&entry->counters[COUNTER_BODY_BYTES], body_size);
+    if (compressed) {
+        // Everything after the two varints and before the checksum trailer is deflated
+        const size_t framing = SizeOfVarInt(msg->msg_no) + SizeOfVarInt(msg->flags | msg->type) + BLIP_BODY_CHECKSUM_SIZE;
+        counter_add(&entry->counters[COUNTER_COMPRESSED_BODY_BYTES], body_size);
+        counter_add(&entry->counters[COUNTER_DEFLATED_BYTES], wire_size > framing ? wire_size - framing : 0);
+    }
+
+    counter_add(&entry->counters[COUNTER_HISTOGRAM + size_bucket(body_size)], 1);
+    if (shard->sketches.doc_ids) {
+        blip_traffic_sketches_record(&shard->sketches, msg, wire_size);
+    }
+}
+
+int blip_stats_enable_sketches(blip_stats_t* stats, const blip_sketch_options* options)
+{
+    for (size_t i = 0; i < stats->shard_count; i++) {
+        if (blip_traffic_sketches_new(options, &stats->shards[i]->sketches) < 0) {
+            while (i-- > 0) {
+                blip_traffic_sketches_free(&stats->shards[i]->sketches);
+            }
+
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int blip_stats_merge_sketches(blip_stats_t* stats, blip_traffic_sketches_t* into)
+{
+    for (size_t i = 0; i < stats->shard_count; i++) {
+        const blip_traffic_sketches_t* sketches = &stats->shards[i]->sketches;
+        if (!sketches->doc_ids || blip_traffic_sketches_merge(into, sketches) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static bool same_key(const blip_stats_record_t* record, const stats_entry* entry)
+{
+    return record->connection == entry->connection && record->type == entry->type
+           && record->error_code == entry->error_code && strcmp(record->profile, entry->profile) == 0;
+}
+
+void blip_stats_flush(blip_stats_t* stats)
+{
+    stats->last_flush_ms = now_ms();
+
+    // The same combination can live in several shards, so merge them by key first
+    size_t total = 0;
+    for (size_t s = 0; s < stats->shard_count; s++) {
+        total += stats->shards[s]->mask + 2;
+    }
+
+    size_t slots = 16;
+    while (slots < total * 2) {
+        slots <<= 1;
+    }
+
+    // Entries whose connection is gone are reported one last time, after which the owning
+    // thread may reuse them.  Records point at the profile names in the entries, so they are
+    // only handed back once the callbacks are done.
+    blip_stats_record_t* merged = calloc(slots, sizeof(blip_stats_record_t));
+    stats_entry** closing = malloc(total * sizeof(stats_entry*));
+    size_t closing_count = 0;
+    if (!merged || !closing) {
+        free(merged);
+        free(closing);
+        return;
+    }
+
+    for (size_t s = 0; s < stats->shard_count; s++) {
+        blip_stats_shard_t* shard = stats->shards[s];
+        for (size_t e = 0; e <= shard->mask + 1; e++) {
+            stats_entry* entry = &shard->entries[e];
+            const unsigned state = atomic_load_explicit(&entry->state, memory_order_acquire);
+            if (state != kEntryLive && state != kEntryClosing) {
+                continue;
+            }
+
+            uint64_t delta[COUNTER_COUNT];
+            bool any = false;
+            for (size_t c = 0; c < COUNTER_COUNT; c++) {
+                const uint64_t value = atomic_load_explicit(&entry->counters[c], memory_order_relaxed);
+                delta[c] = value - shard->flushed[e][c];
+                shard->flushed[e][c] = value;
+                any = any || delta[c] != 0;
+            }
+
+            if (state == kEntryClosing) {
+                closing[closing_count++] = entry;
+            }
+
+            if (!any) {
+                continue;
+            }
+
+            size_t i = entry_hash(entry->profile_hash, entry->connection, entry->type, entry->error_code)
+                       & (slots - 1);
+            while (merged[i].profile && !same_key(&merged[i], entry)) {
+                i = (i + 1) & (slots - 1);
+            }
+
+            blip_stats_record_t* record = &merged[i];
+            if (!record->profile) {
+                record->connection = entry->connection;
+                record->profile = entry->profile;
+                record->type = entry->type;
+                record->error_code = entry->error_code;
+            }
+
+            record->messages += delta[COUNTER_MESSAGES];
+            record->compressed_messages += delta[COUNTER_COMPRESSED];
+            record->wire_bytes += delta[COUNTER_WIRE_BYTES];
+            record->body_bytes += delta[COUNTER_BODY_BYTES];
+            record->compressed_body_bytes += delta[COUNTER_COMPRESSED_BODY_BYTES];
+            record->deflated_bytes += delta[COUNTER_DEFLATED_BYTES];
+            for (size_t b = 0; b < BLIP_STATS_HISTOGRAM_BUCKETS; b++) {
+                record->body_size_histogram[b] += delta[COUNTER_HISTOGRAM + b];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < slots; i++) {
+        if (merged[i].profile) {
+            stats->callback(stats->context, &merged[i]);
+        }
+    }
+
+    for (size_t i = 0; i < closing_count; i++) {
+        atomic_store_explicit(&closing[i]->state, kEntryRetired, memory_order_release);
+    }
+
+    free(merged);
+    free(closing);
+}
+
+bool blip_stats_poll(blip_stats_t* stats)
+{
+    if (now_ms() - stats->last_flush_ms < stats->interval_ms) {
+        return false;
+    }
+
+    blip_stats_flush(stats);
+    return true;
+}
+
+void blip_stats_free(blip_stats_t* stats)
+{
+    for (size_t i = 0; i < stats->shard_count; i++) {
+        blip_stats_shard_t* shard = stats->shards[i];
+        if (shard) {
+            free(shard->entries);
+            free(shard->flushed);
+            free(shard->pending);
+            blip_traffic_sketches_free(&shard->sketches);
+            free(shard);
+        }
+    }
+
+    free(stats->shards);
+    free(stats);
+}
@@ -1,15 +1,144 @@
 #pragma once
+#include "cblip.h"
 #include "hashset.h"
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 
 struct blip_connection
 {
-    z_stream* decompress_stream;
-    z_stream* recompress_stream;
+    z_stream* decompress_stream;    ///< NULL until the first compressed frame is read (see blip_connection_inflater)
+    z_stream* recompress_stream;    ///< NULL until the first compressed message is sent (see blip_connection_deflater)
+    blip_compression_options compression;
+    size_t zlib_bytes;              ///< What zlib currently has allocated for the two streams
     uint32_t crc;
     uint32_t crc_out;
-    hashset_t started_msg_set;
-    Byte decompress_buffer[16384];
-    Byte recompress_buffer[16384];
-};
\ No newline at end of file
+    hashset_t started_msg_set;      ///< Keys (see blip_started_msg_key) of messages with more frames coming
+    struct blip_stats_shard* stats; ///< Where blip_message_read records messages (see blip_connection_set_stats), or NULL
+    char* client;                   ///< The name of the peer for traffic sketches (see blip_connection_set_client), or NULL
+    size_t client_size;
+};
+
+/**
+ * Gets the inflate stream of a connection, creating it on first use
+ * @param connection    The connection to get the stream of
+ * @return              The stream, or NULL if it could not be created
+ */
+z_stream* blip_connection_inflater(blip_connection_t* connection);
+
+/**
+ * Gets the deflate stream of a connection, creating it on first use with the connection's
+ * compression options
+ * @param connection    The connection to get the stream of
+ * @return              The stream, or NULL if it could not be created
+ */
+z_stream* blip_connection_deflater(blip_connection_t* connection);
+
+/**
+ * Frees the zlib streams of a connection (they are created again when next needed)
+ * @param connection    The connection to release the streams of
+ * @param inflater      Whether to release the inflate stream
+ * @param deflater      Whether to release the deflate stream
+ */
+void blip_connection_release_streams(blip_connection_t* connection, bool inflater, bool deflater);
+
+/*
+ * Slots of blip_message.private:
+ *   [0] The connection the message was read from
+ *   [1] Decompressed payload, pointing into [9] (normal messages) or acknowledged byte count (ACK messages)
+ *   [2] Buffer returned from blip_message_serialize
+ *   [3] Copy of the raw frame
+ *   [4] Hash of the Profile property (see blip_profile_hash)
+ *   [5] Structural index of the body (json_tape, see blip_body_find)
+ *   [6] Property separator positions, only when a property contains a colon (property_separators)
+ *   [7] Size of the frame the message was read from
+ *   [8] Allocated size of [3]
+ *   [9] Buffer for the decompressed payload (or streamed properties), kept when the message is recycled
+ *   [10] Allocated size of [9]
+ */
+
+typedef struct {
+    uint32_t count;
+    uint32_t positions[];   // Offsets of the NULs that separated the properties on the wire
+} property_separators;
+
+// Requests and responses share message numbers, so the type class is folded into the key.
+// The +2 offset keeps keys clear of the values that hashset reserves (0 and 1)
+static inline size_t blip_started_msg_key(MessageNo msg_no, MessageType type)
+{
+    return (size_t)(((msg_no << 1) | (type != kRequestType)) + 2);
+}
+
+// 32-bit FNV-1a, used to intern Profile property values while the properties are scanned
+#define BLIP_PROFILE_HASH_SEED 2166136261U
+#define BLIP_PROFILE_HASH_PRIME 16777619U
+
+static inline uint32_t blip_profile_hash(const uint8_t* data, size_t size)
+{
+    uint32_t hash = BLIP_PROFILE_HASH_SEED;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * BLIP_PROFILE_HASH_PRIME;
+    }
+
+    return hash;
+}
+
+// Looks a property up in the NUL separated wire form (key\0value\0key\0value\0...)
+static inline bool blip_find_wire_property(const uint8_t* properties, size_t size, const char* key, size_t key_size,
+                                           const uint8_t** value, size_t* value_size)
+{
+    const uint8_t* pos = properties;
+    const uint8_t* end = pos + size;
+    while (pos && pos < end) {
+        const uint8_t* key_end = (const uint8_t*)memchr(pos, 0, (size_t)(end - pos));
+        const uint8_t* value_end = key_end && key_end + 1 < end
+                                   ? (const uint8_t*)memchr(key_end + 1, 0, (size_t)(end - key_end - 1)) : NULL;
+        if (!value_end) {
+            break;
+        }
+
+        if ((size_t)(key_end - pos) == key_size && memcmp(pos, key, key_size) == 0) {
+            *value = key_end + 1;
+            *value_size = (size_t)(value_end - key_end - 1);
+            return true;
+        }
+
+        pos = value_end + 1;
+    }
+
+    return false;
+}
+
+// Makes room for at least `needed` more bytes after `used` in a growable output buffer
+static inline int blip_reserve_output(uint8_t** buf, size_t* capacity, size_t used, size_t needed)
+{
+    if (*capacity - used >= needed) {
+        return 0;
+    }
+
+    size_t new_capacity = *capacity * 2;
+    if (new_capacity - used < needed) {
+        new_capacity = used + needed;
+    }
+
+    uint8_t* grown = (uint8_t*)realloc(*buf, new_capacity);
+    if (!grown) {
+        return -1;
+    }
+
+    *buf = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Same as blip_reserve_output, except that a buffer which may not grow (one the caller owns)
+// is never realloc'd, and running out of room in it fails instead
+static inline int blip_reserve_output_in(uint8_t** buf, size_t* capacity, size_t used, size_t needed, bool growable)
+{
+    if (!growable) {
+        return *capacity - used >= needed ? 0 : -1;
+    }
+
+    return blip_reserve_output(buf, capacity, used, needed);
+}
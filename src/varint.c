@@ -17,6 +17,7 @@
 //
 
 #include "varint.h"
+#include "cpu.h"
 #ifndef MIN
 # define MIN(A,B) ((A)<(B)?(A):(B))
 #endif
@@ -33,11 +34,11 @@ size_t SizeOfVarInt(uint64_t n) {
     return size;
 }
 
-size_t _GetUVarInt(uint8_t* buf, size_t size, uint64_t *n) {
+size_t get_uvarint_scalar(const uint8_t* buf, size_t size, uint64_t *n) {
     // NOTE: The public inline function GetUVarInt already decodes 1-byte varints,
     // so if we get here we can assume the varint is at least 2 bytes.
-    uint8_t* pos = buf;
-    uint8_t* end = pos + MIN(size, (size_t)kMaxVarintLen64);
+    const uint8_t* pos = buf;
+    const uint8_t* end = pos + MIN(size, (size_t)kMaxVarintLen64);
     uint64_t result = *pos++ & 0x7F;
     int shift = 7;
     while (pos < end) {
@@ -57,6 +58,10 @@ size_t _GetUVarInt(uint8_t* buf, size_t size, uint64_t *n) {
     return 0; // buffer too short
 }
 
+size_t _GetUVarInt(uint8_t* buf, size_t size, uint64_t *n) {
+    return blip_get_kernels()->get_uvarint(buf, size, n);
+}
+
 size_t _GetUVarInt32(uint8_t* buf, size_t size, uint32_t *n) {
     uint64_t n64;
     const size_t s = _GetUVarInt(buf, size, &n64);
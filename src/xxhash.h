@@ -0,0 +1,115 @@
+//
+//  xxhash.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include "cblip_endian.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// XXH64 (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md), for hashing whole
+// bodies and sketch keys, where FNV-1a would be too slow or too weak
+#define XXH_PRIME64_1 11400714785074694791ULL
+#define XXH_PRIME64_2 14029467366897019727ULL
+#define XXH_PRIME64_3 1609587929392839161ULL
+#define XXH_PRIME64_4 9650029242287828579ULL
+#define XXH_PRIME64_5 2870177450012600261ULL
+
+static inline uint64_t xxh_rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t xxh_read64(const uint8_t* data)
+{
+    uint64_t le;
+    memcpy(&le, data, 8);
+    return _decLittle64(le);
+}
+
+static inline uint32_t xxh_read32(const uint8_t* data)
+{
+    uint32_t le;
+    memcpy(&le, data, 4);
+    return _decLittle32(le);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline uint64_t blip_xxh64(const void* input, size_t size, uint64_t seed)
+{
+    const uint8_t* data = (const uint8_t*)input;
+    const uint8_t* const end = data + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        const uint8_t* const limit = end - 32;
+        do {
+            v1 = xxh64_round(v1, xxh_read64(data));
+            v2 = xxh64_round(v2, xxh_read64(data + 8));
+            v3 = xxh64_round(v3, xxh_read64(data + 16));
+            v4 = xxh64_round(v4, xxh_read64(data + 24));
+            data += 32;
+        } while (data <= limit);
+
+        hash = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        hash = xxh64_merge(hash, v1);
+        hash = xxh64_merge(hash, v2);
+        hash = xxh64_merge(hash, v3);
+        hash = xxh64_merge(hash, v4);
+    } else {
+        hash = seed + XXH_PRIME64_5;
+    }
+
+    hash += (uint64_t)size;
+    for (; data + 8 <= end; data += 8) {
+        hash ^= xxh64_round(0, xxh_read64(data));
+        hash = xxh_rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if (data + 4 <= end) {
+        hash ^= (uint64_t)xxh_read32(data) * XXH_PRIME64_1;
+        hash = xxh_rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        data += 4;
+    }
+
+    for (; data < end; data++) {
+        hash ^= *data * XXH_PRIME64_5;
+        hash = xxh_rotl64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
@@ -0,0 +1,199 @@
+//
+//  archive_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_archive.h"
+#include "test.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    MessageNo msg_no;
+    MessageType type;
+    uint8_t* body;
+    size_t body_size;
+} archived;
+
+typedef struct {
+    const archived* expected;
+    size_t visited;
+    bool in_order;
+} visit_context;
+
+static archived messages[TEST_PACKET_COUNT];
+
+static void count_report(void* context, const char* message)
+{
+    printf("  reported: %s\n", message);
+    (*(int*)context)++;
+}
+
+// Checks that the records come back as the archived messages, in order from the first
+static int check_record(void* context, const blip_archive_record_t* record)
+{
+    visit_context* ctx = context;
+    const archived* expected = &ctx->expected[ctx->visited % TEST_PACKET_COUNT];
+    ctx->in_order = ctx->in_order && record->msg_no == expected->msg_no && record->type == expected->type
+                    && record->body_size == expected->body_size
+                    && (record->body_size == 0 || memcmp(record->body, expected->body, record->body_size) == 0);
+    ctx->visited++;
+    return 0;
+}
+
+static int64_t query_all(const char* directory, visit_context* ctx, int* reports)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->expected = messages;
+    ctx->in_order = true;
+    blip_archive_t* archive = blip_archive_open(directory, count_report, reports);
+    CHECK(archive);
+    if (!archive) {
+        return -1;
+    }
+
+    blip_archive_query_t query;
+    memset(&query, 0, sizeof(query));
+    const int64_t retVal = blip_archive_query(archive, &query, check_record, ctx);
+    blip_archive_close(archive);
+    return retVal;
+}
+
+static void append_capture(blip_archive_writer_t* writer)
+{
+    blip_connection_t* connection = blip_connection_new();
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i + 1, &length);
+        blip_message_t* msg = data ? blip_message_read(connection, data, length) : NULL;
+        CHECK(msg);
+        if (msg) {
+            CHECK(blip_archive_append(writer, msg, 0, (uint64_t)(i + 1) * 1000) == 0);
+            archived* saved = &messages[i];
+            free(saved->body);
+            saved->msg_no = msg->msg_no;
+            saved->type = msg->type;
+            saved->body_size = msg->type < kAckRequestType ? msg->body_size : 0;
+            saved->body = malloc(saved->body_size + 1);
+            memcpy(saved->body, msg->body, saved->body_size);
+            blip_message_free(msg);
+        }
+
+        free(data);
+    }
+
+    blip_connection_free(connection);
+}
+
+static void path_of(char* path, size_t size, const char* directory, const char* name)
+{
+    snprintf(path, size, "%s/%s", directory, name);
+}
+
+static void remove_directory(const char* directory)
+{
+    DIR* dir = opendir(directory);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            char path[1024];
+            path_of(path, sizeof(path), directory, entry->d_name);
+            unlink(path);
+        }
+    }
+
+    if (dir) {
+        closedir(dir);
+    }
+
+    rmdir(directory);
+}
+
+int main(void)
+{
+    char directory[] = "/tmp/cblip-archive-XXXXXX";
+    if (!mkdtemp(directory)) {
+        printf("Unable to create a temporary directory\n");
+        return 1;
+    }
+
+    // Small blocks, so that the capture spans several of them
+    blip_archive_options options;
+    blip_archive_default_options(&options);
+    options.block_size = 256;
+    int reports = 0;
+    options.report = count_report;
+    options.report_context = &reports;
+
+    blip_archive_writer_t* writer = blip_archive_writer_open(directory, &options);
+    CHECK(writer);
+    append_capture(writer);
+    CHECK(blip_archive_writer_close(writer) == 0);
+
+    visit_context ctx;
+    CHECK(query_all(directory, &ctx, &reports) == TEST_PACKET_COUNT);
+    CHECK(ctx.visited == TEST_PACKET_COUNT && ctx.in_order);
+    CHECK(reports == 0);
+
+    // Tear the write: unseal the segment and cut its last block short, as a crash mid-block would
+    char data_path[1024];
+    char index_path[1024];
+    path_of(data_path, sizeof(data_path), directory, "00000001.cbad");
+    path_of(index_path, sizeof(index_path), directory, "00000001.cbai");
+    struct stat st;
+    CHECK(stat(data_path, &st) == 0);
+    CHECK(unlink(index_path) == 0);
+    const off_t torn_size = st.st_size - 10;
+    CHECK(truncate(data_path, torn_size) == 0);
+
+    // Reopening cuts the torn block off and seals what is left
+    writer = blip_archive_writer_open(directory, &options);
+    CHECK(writer);
+    CHECK(reports == 1);
+    CHECK(stat(data_path, &st) == 0 && st.st_size < torn_size);
+    CHECK(stat(index_path, &st) == 0);
+
+    // Whatever survived is a prefix of what was archived, and the archive takes appends again
+    const int64_t recovered = query_all(directory, &ctx, &reports);
+    CHECK(recovered > 0 && recovered < TEST_PACKET_COUNT);
+    CHECK(ctx.in_order);
+    append_capture(writer);
+    CHECK(blip_archive_writer_close(writer) == 0);
+    CHECK(query_all(directory, &ctx, &reports) == recovered + TEST_PACKET_COUNT);
+
+    // A damaged block fails the query that reaches it, and is reported
+    const int fd = open(data_path, O_WRONLY);
+    CHECK(fd >= 0);
+    CHECK(pwrite(fd, "XXXXXXXX", 8, 16) == 8);
+    close(fd);
+    reports = 0;
+    CHECK(query_all(directory, &ctx, &reports) < 0);
+    CHECK(reports == 1);
+
+    remove_directory(directory);
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        free(messages[i].body);
+    }
+
+    return test_result();
+}
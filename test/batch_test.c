@@ -0,0 +1,199 @@
+//
+//  batch_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip.h"
+#include "cblip_batch.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGE_COUNT 40
+#define BIG_BODY_SIZE 70000
+
+// What the write callback has been handed so far, with the next write optionally failing
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    int writes;
+    bool fail_next;
+} output;
+
+static int collect(void* context, const uint8_t* data, size_t size)
+{
+    output* out = context;
+    if (out->fail_next) {
+        out->fail_next = false;
+        return -1;
+    }
+
+    out->data = realloc(out->data, out->size + size);
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+    out->writes++;
+    return 0;
+}
+
+static char properties[] = "Profile:changes:since:42";
+
+static void make_message(blip_message_t* msg, int n, uint8_t* body)
+{
+    msg->msg_no = (MessageNo)n;
+    msg->type = n % 7 == 3 ? kResponseType : kRequestType;
+    msg->flags = n % 2 ? kCompressed : 0;
+    msg->properties = (uint8_t*)properties;
+    msg->body = body;
+    msg->body_size = n == 5 ? BIG_BODY_SIZE : (size_t)(n * 37) % 500;
+}
+
+// Takes the next frame off the batch output, undoing the framing
+static const uint8_t* next_frame(blip_batch_framing framing, const uint8_t** pos, const uint8_t* end, size_t* size)
+{
+    const uint8_t* p = *pos;
+    uint64_t length = 0;
+    if (framing == kBlipBatchLengthPrefixed) {
+        for (int shift = 0; p < end; shift += 7) {
+            const uint8_t byte = *p++;
+            length |= (uint64_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+        }
+    } else {
+        // An unmasked, final, binary message
+        if (end - p < 2 || p[0] != 0x82 || (p[1] & 0x80)) {
+            return NULL;
+        }
+
+        length = p[1];
+        p += 2;
+        const int extra = length == 126 ? 2 : length == 127 ? 8 : 0;
+        if (extra > 0) {
+            if (end - p < extra) {
+                return NULL;
+            }
+
+            length = 0;
+            for (int i = 0; i < extra; i++) {
+                length = length << 8 | *p++;
+            }
+        }
+    }
+
+    if ((uint64_t)(end - p) < length) {
+        return NULL;
+    }
+
+    *pos = p + length;
+    *size = (size_t)length;
+    return p;
+}
+
+// Sends the messages through a batch that flushes every few messages, with one flush failing
+// part of the way, and reads everything written back through blip_message_read().  Each frame
+// must match what blip_message_serialize() makes for the same message on a twin connection,
+// and the checksum chain has to hold across batch boundaries.
+static void test_framing(blip_batch_framing framing, uint8_t* body)
+{
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* twin = blip_connection_new();
+    output out;
+    memset(&out, 0, sizeof(out));
+    blip_batch_t* batch = blip_batch_new(sender, framing, 0, 7, collect, &out);
+    CHECK(batch);
+    blip_message_t* msg = blip_message_new();
+    uint8_t* expected[MESSAGE_COUNT];
+    size_t expected_sizes[MESSAGE_COUNT];
+    int added_unflushed = 0;
+    for (int n = 1; n <= MESSAGE_COUNT; n++) {
+        make_message(msg, n, body);
+        out.fail_next = n == 14;
+        const int result = blip_batch_add(batch, msg);
+        if (n == 14) {
+            // The message went in, and stays there with the six before it
+            CHECK(result == 1);
+            size_t count;
+            CHECK(blip_batch_pending(batch, &count) > 0 && count == 7);
+            added_unflushed = 1;
+        } else {
+            CHECK(result == 0);
+        }
+
+        make_message(msg, n, body);
+        size_t size;
+        const uint8_t* frame = blip_message_serialize(twin, msg, &size);
+        CHECK(frame);
+        expected[n - 1] = malloc(size);
+        memcpy(expected[n - 1], frame, size);
+        expected_sizes[n - 1] = size;
+    }
+
+    CHECK(added_unflushed == 1);
+    CHECK(blip_batch_flush(batch) == 0);
+    CHECK(blip_batch_pending(batch, NULL) == 0);
+
+    blip_connection_t* receiver = blip_connection_new();
+    const uint8_t* pos = out.data;
+    const uint8_t* end = out.data + out.size;
+    int decoded = 0;
+    for (int n = 1; n <= MESSAGE_COUNT; n++) {
+        size_t size;
+        const uint8_t* frame = next_frame(framing, &pos, end, &size);
+        CHECK(frame && size == expected_sizes[n - 1] && memcmp(frame, expected[n - 1], size) == 0);
+        if (!frame) {
+            break;
+        }
+
+        uint8_t* copy = malloc(size);
+        memcpy(copy, frame, size);
+        blip_message_t* received = blip_message_read(receiver, copy, size);
+        make_message(msg, n, body);
+        CHECK(received && received->checksum == received->calculated_checksum);
+        CHECK(received && received->msg_no == (MessageNo)n && received->body_size == msg->body_size
+              && (msg->body_size == 0 || memcmp(received->body, body, msg->body_size) == 0));
+        decoded += received != NULL;
+        if (received) {
+            blip_message_free(received);
+        }
+
+        free(copy);
+        free(expected[n - 1]);
+    }
+
+    CHECK(decoded == MESSAGE_COUNT && pos == end);
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+    blip_batch_free(batch);
+    blip_connection_free(sender);
+    blip_connection_free(twin);
+    blip_connection_free(receiver);
+    free(out.data);
+}
+
+int main(void)
+{
+    uint8_t* body = malloc(BIG_BODY_SIZE);
+    for (int i = 0; i < BIG_BODY_SIZE; i++) {
+        body[i] = (uint8_t)('a' + (i * 13 + i / 100) % 26);
+    }
+
+    test_framing(kBlipBatchLengthPrefixed, body);
+    test_framing(kBlipBatchWebSocket, body);
+    free(body);
+    return test_result();
+}
@@ -0,0 +1,147 @@
+//
+//  body_store_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_body_store.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BODY_SIZE 5000
+#define COPIES 1000
+
+// Many references to one body cost one copy, which is only dropped once idle and over budget
+static void test_dedup(void)
+{
+    blip_body_store_t* store = blip_body_store_new(0);
+    uint8_t body[BODY_SIZE];
+    memset(body, 'x', sizeof(body));
+    blip_body_ref_t* refs[COPIES];
+    for (int i = 0; i < COPIES; i++) {
+        refs[i] = blip_body_store_intern(store, body, sizeof(body));
+        CHECK(refs[i] == refs[0]);
+    }
+
+    blip_body_store_stats_t stats;
+    blip_body_store_get_stats(store, &stats);
+    CHECK(stats.distinct == 1 && stats.stored_bytes == BODY_SIZE);
+    CHECK(stats.references == COPIES && stats.referenced_bytes == (uint64_t)BODY_SIZE * COPIES);
+    CHECK(stats.hits == COPIES - 1 && stats.misses == 1);
+
+    // Same size, different bytes: a separate body
+    body[BODY_SIZE / 2] = 'y';
+    blip_body_ref_t* other = blip_body_store_intern(store, body, sizeof(body));
+    size_t size;
+    const uint8_t* data = blip_body_ref_data(other, &size);
+    CHECK(other != refs[0] && size == BODY_SIZE && data[BODY_SIZE / 2] == 'y');
+    CHECK(blip_body_ref_data(refs[0], &size)[BODY_SIZE / 2] == 'x');
+    CHECK(blip_body_ref_hash(other) != blip_body_ref_hash(refs[0]));
+
+    CHECK(blip_body_ref_retain(store, other) == other);
+    blip_body_ref_release(store, other);
+    for (int i = 0; i < COPIES; i++) {
+        blip_body_ref_release(store, refs[i]);
+    }
+
+    // With a budget of 0 the body is dropped as soon as it is idle, the other is still in use
+    blip_body_store_get_stats(store, &stats);
+    CHECK(stats.distinct == 1 && stats.evictions == 1 && stats.references == 1);
+    blip_body_ref_release(store, other);
+    blip_body_store_get_stats(store, &stats);
+    CHECK(stats.distinct == 0 && stats.stored_bytes == 0 && stats.references == 0);
+    blip_body_store_free(store);
+}
+
+// Idle bodies stay findable while the store is within its budget, least recently released first
+// to go
+static void test_budget(void)
+{
+    blip_body_store_t* store = blip_body_store_new(3 * BODY_SIZE);
+    uint8_t body[BODY_SIZE];
+    for (int i = 0; i < 4; i++) {
+        memset(body, 'a' + i, sizeof(body));
+        blip_body_ref_release(store, blip_body_store_intern(store, body, sizeof(body)));
+    }
+
+    blip_body_store_stats_t stats;
+    blip_body_store_get_stats(store, &stats);
+    CHECK(stats.distinct == 3 && stats.idle_bytes == 3 * BODY_SIZE && stats.evictions == 1);
+    memset(body, 'd', sizeof(body));
+    blip_body_ref_release(store, blip_body_store_intern(store, body, sizeof(body)));
+    memset(body, 'a', sizeof(body));
+    blip_body_ref_release(store, blip_body_store_intern(store, body, sizeof(body)));
+    blip_body_store_get_stats(store, &stats);
+    CHECK(stats.hits == 1 && stats.misses == 5 && stats.evictions == 2);
+    blip_body_store_free(store);
+}
+
+// The bodies of decoded messages outlive the messages, compressed or not
+static void test_messages(void)
+{
+    blip_body_store_t* store = blip_body_store_new(1024 * 1024);
+    blip_connection_t* connection = blip_connection_new();
+    blip_body_ref_t* refs[TEST_PACKET_COUNT];
+    uint8_t* bodies[TEST_PACKET_COUNT];
+    size_t sizes[TEST_PACKET_COUNT];
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i + 1, &length);
+        blip_message_t* msg = data ? blip_message_read(connection, data, length) : NULL;
+        CHECK(msg);
+        refs[i] = msg ? blip_body_store_retain_message(store, msg) : NULL;
+        bodies[i] = NULL;
+        sizes[i] = 0;
+        if (msg && msg->type < kAckRequestType) {
+            CHECK(refs[i]);
+            sizes[i] = msg->body_size;
+            bodies[i] = malloc(sizes[i] + 1);
+            memcpy(bodies[i], msg->body, sizes[i]);
+        } else {
+            CHECK(!refs[i]);
+        }
+
+        if (msg) {
+            blip_message_free(msg);
+        }
+
+        free(data);
+    }
+
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        if (refs[i]) {
+            size_t size;
+            const uint8_t* data = blip_body_ref_data(refs[i], &size);
+            CHECK(size == sizes[i] && (size == 0 || memcmp(data, bodies[i], size) == 0));
+        }
+
+        blip_body_ref_release(store, refs[i]);
+        free(bodies[i]);
+    }
+
+    blip_connection_free(connection);
+    blip_body_store_free(store);
+}
+
+int main(void)
+{
+    test_dedup();
+    test_budget();
+    test_messages();
+    return test_result();
+}
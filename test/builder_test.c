@@ -0,0 +1,151 @@
+//
+//  builder_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip.h"
+#include "cblip_builder.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGES_PER_RUN 3
+
+static const char kProperties[] = "Profile:getCheckpoint:client:abc";
+
+// Builds the same messages with the builder on one connection and with blip_message_serialize()
+// on another.  The frames have to be byte for byte the same, which also keeps the two deflate
+// streams and checksum chains in step, and a third connection has to decode what was built.
+static void check_body(bool compressed, size_t body_size, size_t min_size)
+{
+    const blip_compression_options options = {6, 0, 8, 15, min_size};
+    blip_connection_t* serialized = blip_connection_new();
+    blip_connection_t* built = blip_connection_new();
+    blip_connection_t* receiver = blip_connection_new();
+    CHECK(blip_connection_set_compression(serialized, &options) == 0);
+    CHECK(blip_connection_set_compression(built, &options) == 0);
+    uint8_t* body = malloc(body_size + 1);
+    for (size_t i = 0; i < body_size; i++) {
+        body[i] = (uint8_t)"abcabcxyz"[i % 9];
+    }
+
+    blip_message_builder_t* builder = blip_message_builder_new();
+    CHECK(builder);
+    char properties[sizeof(kProperties)];
+    for (MessageNo n = 1; n <= MESSAGES_PER_RUN; n++) {
+        memcpy(properties, kProperties, sizeof(kProperties));
+        blip_message_t* msg = blip_message_new();
+        msg->msg_no = n;
+        msg->type = kRequestType;
+        msg->flags = compressed ? kCompressed : 0;
+        msg->properties = (uint8_t*)properties;
+        msg->body = body;
+        msg->body_size = body_size;
+        // The serialized frame belongs to msg, which is kept until the frames are compared
+        size_t expected_size;
+        const uint8_t* expected = blip_message_serialize(serialized, msg, &expected_size);
+        CHECK(expected);
+
+        // The body goes in as two segments
+        CHECK(blip_message_builder_begin(builder, n, kRequestType, compressed ? kCompressed : 0) == 0);
+        CHECK(blip_message_builder_add_property(builder, "Profile", "getCheckpoint") == 0);
+        CHECK(blip_message_builder_add_property(builder, "client", "abc") == 0);
+        CHECK(blip_message_builder_append_body(builder, body, body_size / 2) == 0);
+        CHECK(blip_message_builder_append_body(builder, body + body_size / 2, body_size - body_size / 2) == 0);
+        size_t size;
+        const uint8_t* frame = blip_message_builder_finish(builder, built, &size);
+        CHECK(frame && expected && size == expected_size && memcmp(frame, expected, size) == 0);
+        msg->properties = NULL;
+        msg->body = NULL;
+        blip_message_free(msg);
+        if (!frame) {
+            break;
+        }
+
+        uint8_t* copy = malloc(size);
+        memcpy(copy, frame, size);
+        blip_message_t* received = blip_message_read(receiver, copy, size);
+        CHECK(received && received->checksum == received->calculated_checksum);
+        CHECK(received && received->body_size == body_size && (body_size == 0 || memcmp(received->body, body, body_size) == 0));
+        const uint8_t* value;
+        size_t value_size;
+        CHECK(received && blip_message_get_property(received, "client", &value, &value_size) == 0 && value_size == 3
+              && memcmp(value, "abc", 3) == 0);
+        if (received) {
+            blip_message_free(received);
+        }
+
+        free(copy);
+    }
+
+    blip_message_builder_free(builder);
+    free(body);
+    blip_connection_free(serialized);
+    blip_connection_free(built);
+    blip_connection_free(receiver);
+}
+
+// Property values may hold colons, properties can't follow the body, a frame is only finished
+// once and ACKs can't be built
+static void test_usage(void)
+{
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* receiver = blip_connection_new();
+    blip_message_builder_t* builder = blip_message_builder_new();
+    CHECK(blip_message_builder_begin(builder, 1, kRequestType, 0) == 0);
+    CHECK(blip_message_builder_add_property(builder, "url", "ws://host:4984/db") == 0);
+    CHECK(blip_message_builder_append_body(builder, "{}", 2) == 0);
+    CHECK(blip_message_builder_add_property(builder, "late", "no") < 0);
+    size_t size;
+    const uint8_t* frame = blip_message_builder_finish(builder, sender, &size);
+    CHECK(frame);
+    if (frame) {
+        uint8_t* copy = malloc(size);
+        memcpy(copy, frame, size);
+        blip_message_t* received = blip_message_read(receiver, copy, size);
+        const uint8_t* value;
+        size_t value_size;
+        CHECK(received && received->checksum == received->calculated_checksum);
+        CHECK(received && blip_message_get_property(received, "url", &value, &value_size) == 0 && value_size == 17
+              && memcmp(value, "ws://host:4984/db", 17) == 0);
+        if (received) {
+            blip_message_free(received);
+        }
+
+        free(copy);
+    }
+
+    CHECK(blip_message_builder_finish(builder, sender, &size) == NULL);
+    CHECK(blip_message_builder_begin(builder, 2, kAckRequestType, 0) < 0);
+    blip_message_builder_free(builder);
+    blip_connection_free(sender);
+    blip_connection_free(receiver);
+}
+
+int main(void)
+{
+    static const size_t kBodySizes[] = {0, 1, 100, 5000, 200000};
+    for (int compressed = 0; compressed < 2; compressed++) {
+        for (size_t i = 0; i < sizeof(kBodySizes) / sizeof(kBodySizes[0]); i++) {
+            // Without a minimum size, and with one that leaves the smaller bodies uncompressed
+            check_body(compressed, kBodySizes[i], 0);
+            check_body(compressed, kBodySizes[i], 1000);
+        }
+    }
+
+    test_usage();
+    return test_result();
+}
@@ -0,0 +1,77 @@
+//
+//  cblip_hpp_test.cpp
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+extern "C" {
+#include "capture.h"
+}
+#include "cblip.hpp"
+#include "test.h"
+#include <cstdlib>
+#include <vector>
+
+// Reads the capture with one recycled blip::Message and serializes each message again with
+// blip::serialize().  Read and written on the same connection, every frame has to come out
+// byte for byte as it went in, and a second connection has to read the copies back.
+int main()
+{
+    blip::Connection connection;
+    blip::Connection receiver;
+    CHECK(connection && receiver);
+    blip::Message msg;
+    blip::Message received;
+    std::vector<uint8_t> buffer;
+    int compressed = 0;
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        CHECK(data);
+        if (!data) {
+            continue;
+        }
+
+        CHECK(msg.read(connection, blip::Bytes(data, length)));
+        CHECK(msg.checksum_valid() && msg.wire_size() == length);
+        compressed += (msg.flags() & kCompressed) != 0;
+        if (i == 1) {
+            CHECK(msg.type() == kRequestType && msg.number() == 1 && msg.profile() == "getCheckpoint");
+            CHECK(msg.property("Profile") == msg.profile() && !msg.property("NoSuchProperty"));
+        }
+
+        buffer.resize(blip::serialize_bound(*msg.get()));
+        const std::optional<size_t> size = blip::serialize(connection, *msg.get(), buffer.data(), buffer.size());
+        CHECK(size && *size == length && std::memcmp(buffer.data(), data, length) == 0);
+        if (size) {
+            CHECK(received.read(receiver, buffer.data(), *size) && received.checksum_valid());
+            CHECK(received.number() == msg.number() && received.type() == msg.type());
+            CHECK(received.properties() == msg.properties());
+            CHECK(received.body().as_string() == msg.body().as_string());
+        }
+
+        free(data);
+    }
+
+    CHECK(compressed == 6);
+
+    // A frame cut short doesn't decode
+    size_t length;
+    uint8_t* data = read_packet(TEST_PACKETS, 1, &length);
+    blip::Connection fresh;
+    CHECK(data && !msg.read(fresh, data, 1));
+    free(data);
+    return test_result();
+}
@@ -0,0 +1,219 @@
+//
+//  changes_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_replication.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CHANGES 4
+
+static const char kDoc1[] = "-mO3CoJS_O0eaoLjvVSU4rQ";
+static const char kRev1[] = "1-d3a896054e4a15e89558f545b412161b449eb0a2";
+static const char kDoc2[] = "-1FINCGYH4UmtaBs4r4Ri0w";
+
+static bool slice_is(blip_slice_t slice, const char* text)
+{
+    return slice.size == strlen(text) && (slice.size == 0 || memcmp(slice.buf, text, slice.size) == 0);
+}
+
+// Iterates a message's changes into an array, returning what blip_changes_next() ended with,
+// or what blip_changes_begin() failed with
+static int collect_changes(const blip_message_t* msg, blip_change_t* changes, int* count)
+{
+    *count = 0;
+    blip_changes_iter_t iter;
+    int retVal = blip_changes_begin(msg, &iter);
+    if (retVal < 0) {
+        return retVal;
+    }
+
+    blip_change_t change;
+    while ((retVal = blip_changes_next(&iter, &change)) == 1) {
+        if (*count < MAX_CHANGES) {
+            changes[*count] = change;
+        }
+
+        (*count)++;
+    }
+
+    return retVal;
+}
+
+// Serializes a request and reads it back on a receiving connection
+static blip_message_t* make_request(blip_connection_t* sender, blip_connection_t* receiver, const char* properties,
+                                    const char* body)
+{
+    static MessageNo next_msg_no = 1;
+    char props[128];
+    strcpy(props, properties);
+    char text[256];
+    strcpy(text, body);
+    blip_message_t* msg = blip_message_new();
+    msg->msg_no = next_msg_no++;
+    msg->type = kRequestType;
+    msg->properties = (uint8_t*)props;
+    msg->body = (uint8_t*)text;
+    msg->body_size = strlen(text);
+    size_t size;
+    const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+    CHECK(frame);
+    uint8_t* copy = malloc(size);
+    memcpy(copy, frame, size);
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+
+    blip_message_t* retVal = blip_message_read(receiver, copy, size);
+    CHECK(retVal && retVal->checksum == retVal->calculated_checksum);
+    free(copy);
+    return retVal;
+}
+
+// blip_message_free() doesn't take NULL
+static void free_message(blip_message_t* msg)
+{
+    if (msg) {
+        blip_message_free(msg);
+    }
+}
+
+static int count_doc_id(void* context, blip_slice_t doc_id)
+{
+    (void)doc_id;
+    (*(int*)context)++;
+    return 0;
+}
+
+// The capture proposes two revisions, one per proposeChanges request, and then sends them
+static void test_capture(void)
+{
+    blip_connection_t* connection = blip_connection_new();
+    int proposed = 0;
+    int revs = 0;
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        blip_message_t* msg = data ? blip_message_read(connection, data, length) : NULL;
+        CHECK(msg);
+        if (!msg) {
+            free(data);
+            continue;
+        }
+
+        blip_change_t changes[MAX_CHANGES];
+        int count;
+        const int result = collect_changes(msg, changes, &count);
+        const bool is_propose = msg->profile_size == 14 && memcmp(msg->profile, "proposeChanges", 14) == 0;
+        CHECK(is_propose ? result == 0 : result < 0);
+        if (is_propose && count > 0) {
+            CHECK(count == 1);
+            CHECK(slice_is(changes[0].doc_id, proposed == 0 ? kDoc1 : kDoc2));
+            CHECK(proposed > 0 || slice_is(changes[0].rev_id, kRev1));
+            CHECK(changes[0].parent_rev_id.size == 0 && changes[0].body_size == 14 && !changes[0].deleted);
+            proposed++;
+        }
+
+        blip_rev_t rev;
+        if (blip_decode_rev(msg, &rev) == 0) {
+            CHECK(slice_is(rev.doc_id, revs == 0 ? kDoc1 : kDoc2));
+            CHECK(slice_is(rev.sequence, revs == 0 ? "1" : "2") && !rev.deleted);
+            CHECK(rev.body.size > 0 && rev.body.buf[0] == '{');
+            revs++;
+        }
+
+        int doc_ids = 0;
+        CHECK(blip_message_doc_ids(msg, count_doc_id, &doc_ids) == 0);
+        CHECK(doc_ids == (is_propose ? count : 0) + (msg->profile_size == 3 ? 1 : 0));
+        blip_message_free(msg);
+        free(data);
+    }
+
+    CHECK(proposed == 2 && revs == 2);
+    blip_connection_free(connection);
+}
+
+static void test_bodies(void)
+{
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* receiver = blip_connection_new();
+    blip_change_t changes[MAX_CHANGES];
+    int count;
+
+    // Changes give a sequence of any JSON type, and optionally deleted and a body size
+    blip_message_t* msg = make_request(sender, receiver, "Profile:changes",
+                                       "[[1,\"a\",\"1-x\"],[ 2 , \"b\\\"q\" , \"2-y\" , true , 99 ] ,"
+                                       "[{\"s\":[1,2]},\"c\",\"3-z\",false]]");
+    CHECK(msg && collect_changes(msg, changes, &count) == 0 && count == 3);
+    if (msg && count == 3) {
+        CHECK(slice_is(changes[0].sequence, "1") && slice_is(changes[0].doc_id, "a") && slice_is(changes[0].rev_id, "1-x"));
+        CHECK(!changes[0].deleted && changes[0].body_size == 0);
+        CHECK(slice_is(changes[1].doc_id, "b\\\"q") && changes[1].deleted && changes[1].body_size == 99);
+        CHECK(slice_is(changes[2].sequence, "{\"s\":[1,2]}") && slice_is(changes[2].rev_id, "3-z"));
+        CHECK(!changes[2].deleted);
+    }
+
+    free_message(msg);
+
+    // Proposed changes have no sequence, and a parent revision instead of the deleted flag
+    msg = make_request(sender, receiver, "Profile:proposeChanges", "[[\"d\",\"1-a\",\"\",12],[\"e\",\"2-b\",\"1-a\"]]");
+    CHECK(msg && collect_changes(msg, changes, &count) == 0 && count == 2);
+    if (msg && count == 2) {
+        CHECK(changes[0].sequence.size == 0 && slice_is(changes[0].doc_id, "d") && changes[0].parent_rev_id.size == 0);
+        CHECK(changes[0].body_size == 12);
+        CHECK(slice_is(changes[1].rev_id, "2-b") && slice_is(changes[1].parent_rev_id, "1-a"));
+    }
+
+    free_message(msg);
+
+    // No changes at all
+    msg = make_request(sender, receiver, "Profile:changes", " [ ] ");
+    CHECK(msg && collect_changes(msg, changes, &count) == 0 && count == 0);
+    free_message(msg);
+
+    // Bodies that aren't an array of changes, and a truncated one
+    msg = make_request(sender, receiver, "Profile:changes", "{}");
+    CHECK(msg && collect_changes(msg, changes, &count) < 0);
+    free_message(msg);
+    msg = make_request(sender, receiver, "Profile:changes", "[\"a");
+    CHECK(msg && collect_changes(msg, changes, &count) < 0);
+    free_message(msg);
+    msg = make_request(sender, receiver, "Profile:changes", "[[1,\"a\"");
+    CHECK(msg && collect_changes(msg, changes, &count) < 0 && count == 0);
+    free_message(msg);
+    msg = make_request(sender, receiver, "Profile:changes", "[[1 \"a\"]]");
+    CHECK(msg && collect_changes(msg, changes, &count) < 0);
+    free_message(msg);
+
+    // Only changes and proposeChanges requests can be iterated
+    msg = make_request(sender, receiver, "Profile:rev:id:a:rev:1-x", "[]");
+    CHECK(msg && collect_changes(msg, changes, &count) < 0);
+    free_message(msg);
+
+    blip_connection_free(sender);
+    blip_connection_free(receiver);
+}
+
+int main(void)
+{
+    test_capture();
+    test_bodies();
+    return test_result();
+}
@@ -0,0 +1,108 @@
+//
+//  checkpoint_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint8_t* packets[TEST_PACKET_COUNT + 1];
+static size_t packet_sizes[TEST_PACKET_COUNT + 1];
+
+static bool read_ok(blip_connection_t* connection, int packet)
+{
+    uint8_t* copy = malloc(packet_sizes[packet]);
+    memcpy(copy, packets[packet], packet_sizes[packet]);
+    blip_message_t* msg = blip_message_read(connection, copy, packet_sizes[packet]);
+    const bool retVal = msg && (msg->type >= kAckRequestType || msg->checksum == msg->calculated_checksum);
+    if (msg) {
+        blip_message_free(msg);
+    }
+
+    free(copy);
+    return retVal;
+}
+
+static uint8_t* checkpoint(const blip_connection_t* connection, size_t* size)
+{
+    const size_t capacity = blip_connection_checkpoint(connection, NULL, 0);
+    uint8_t* retVal = malloc(capacity);
+    *size = blip_connection_checkpoint(connection, retVal, capacity);
+    CHECK(*size > 0 && *size <= capacity);
+    return retVal;
+}
+
+int main(void)
+{
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        packets[i] = read_packet(TEST_PACKETS, i, &packet_sizes[i]);
+        CHECK(packets[i]);
+    }
+
+    // A connection restored from the state before any packet decodes the rest of the capture
+    blip_connection_t* original = blip_connection_new();
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t size;
+        uint8_t* saved = checkpoint(original, &size);
+        blip_connection_t* restored = blip_connection_new();
+        CHECK(blip_connection_restore(restored, saved, size) == 0);
+        for (int j = i; j <= TEST_PACKET_COUNT; j++) {
+            CHECK(read_ok(restored, j));
+        }
+
+        blip_connection_free(restored);
+        free(saved);
+        CHECK(read_ok(original, i));
+    }
+
+    blip_connection_free(original);
+
+    // A checkpoint that fails to restore leaves the connection as it was, part of the way
+    // through the compressed conversation
+    blip_connection_t* connection = blip_connection_new();
+    for (int i = 1; i <= 8; i++) {
+        CHECK(read_ok(connection, i));
+    }
+
+    blip_connection_t* other = blip_connection_new();
+    for (int i = 1; i <= 4; i++) {
+        CHECK(read_ok(other, i));
+    }
+
+    size_t size;
+    uint8_t* saved = checkpoint(other, &size);
+    for (size_t cut = 0; cut < size; cut += 1 + cut / 4) {
+        CHECK(blip_connection_restore(connection, saved, cut) < 0);
+    }
+
+    saved[0] = 'X';
+    CHECK(blip_connection_restore(connection, saved, size) < 0);
+    for (int i = 9; i <= TEST_PACKET_COUNT; i++) {
+        CHECK(read_ok(connection, i));
+    }
+
+    free(saved);
+    blip_connection_free(other);
+    blip_connection_free(connection);
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        free(packets[i]);
+    }
+
+    return test_result();
+}
@@ -0,0 +1,117 @@
+//
+//  compress_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LARGEST_BODY (4 * 1024 * 1024)
+
+static char properties[] = "Profile:rev:id:doc";
+
+// Compressible text for even sizes, noise that deflate can't shrink for odd ones
+static void fill_body(uint8_t* body, size_t size, bool random)
+{
+    uint32_t state = (uint32_t)size;
+    for (size_t i = 0; i < size; i++) {
+        state = state * 1103515245 + 12345;
+        body[i] = random ? (uint8_t)(state >> 16) : (uint8_t)"{\"rev\":\"1-abc\"}"[i % 15];
+    }
+}
+
+// Sends bodies well past the old 16 KiB limit, compressed, over one deflate stream, and checks
+// that each comes back byte for byte with a matching checksum
+static void test_sizes(uint8_t* body)
+{
+    static const size_t kSizes[] = {0, 1, 16383, 16384, 16385, 100000, 1024 * 1024, LARGEST_BODY - 1, LARGEST_BODY};
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* receiver = blip_connection_new();
+    for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); i++) {
+        const size_t size = kSizes[i];
+        fill_body(body, size, size % 2 == 1);
+        blip_message_t* msg = blip_message_new();
+        msg->msg_no = (MessageNo)i + 1;
+        msg->type = kRequestType;
+        msg->flags = kCompressed;
+        msg->properties = (uint8_t*)properties;
+        msg->body = body;
+        msg->body_size = size;
+
+        size_t frame_size;
+        const uint8_t* frame = blip_message_serialize(sender, msg, &frame_size);
+        CHECK(frame);
+        if (frame) {
+            uint8_t* copy = malloc(frame_size);
+            memcpy(copy, frame, frame_size);
+            blip_message_t* received = blip_message_read(receiver, copy, frame_size);
+            CHECK(received && received->checksum == received->calculated_checksum);
+            CHECK(received && (received->flags & kCompressed) && received->body_size == size);
+            CHECK(received && (size == 0 || memcmp(received->body, body, size) == 0));
+            if (received) {
+                blip_message_free(received);
+            }
+
+            free(copy);
+        }
+
+        blip_message_free(msg);
+    }
+
+    blip_connection_free(sender);
+    blip_connection_free(receiver);
+}
+
+// The compressed frames of the capture re-encode byte for byte on a connection that has seen
+// the same conversation
+static void test_capture(void)
+{
+    blip_connection_t* connection = blip_connection_new();
+    int compressed = 0;
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        uint8_t* original = malloc(length);
+        memcpy(original, data, length);
+        blip_message_t* msg = blip_message_read(connection, data, length);
+        CHECK(msg && msg->checksum == msg->calculated_checksum);
+        if (msg) {
+            compressed += (msg->flags & kCompressed) != 0;
+            size_t size;
+            const uint8_t* frame = blip_message_serialize(connection, msg, &size);
+            CHECK(frame && size == length && memcmp(frame, original, length) == 0);
+            blip_message_free(msg);
+        }
+
+        free(original);
+        free(data);
+    }
+
+    CHECK(compressed > 0);
+    blip_connection_free(connection);
+}
+
+int main(void)
+{
+    uint8_t* body = malloc(LARGEST_BODY);
+    test_sizes(body);
+    test_capture();
+    free(body);
+    return test_result();
+}
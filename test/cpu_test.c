@@ -0,0 +1,51 @@
+//
+//  cpu_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_cpu.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+int main(void)
+{
+    // Every kernel variant this CPU runs agrees with the scalar one
+    CHECK(blip_cpu_self_test() == 0);
+    const char* kernels = blip_cpu_kernels();
+    printf("Kernels: %s\n", kernels);
+    CHECK(strstr(kernels, "crc32=") == kernels);
+    CHECK(!strstr(kernels, "self test failed"));
+
+    // And the ones picked decode the capture with matching checksums
+    blip_connection_t* connection = blip_connection_new();
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        blip_message_t* msg = data ? blip_message_read(connection, data, length) : NULL;
+        CHECK(msg && msg->checksum == msg->calculated_checksum);
+        if (msg) {
+            blip_message_free(msg);
+        }
+
+        free(data);
+    }
+
+    blip_connection_free(connection);
+    return test_result();
+}
@@ -0,0 +1,237 @@
+//
+//  dispatch_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_dispatch.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FLOOD_COUNT 70000
+
+// Counts the messages a handler was given, and the number of the last one
+typedef struct {
+    int count;
+    MessageNo last;
+} handler_log;
+
+static void log_message(void* context, blip_message_t* msg)
+{
+    handler_log* log = context;
+    log->count++;
+    log->last = msg->msg_no;
+}
+
+typedef struct {
+    handler_log fallback;
+    handler_log propose;
+    handler_log rev;
+    handler_log checkpoint;
+} routing;
+
+static blip_dispatcher_t* new_dispatcher(routing* logs)
+{
+    memset(logs, 0, sizeof(routing));
+    blip_dispatcher_t* retVal = blip_dispatcher_new(log_message, &logs->fallback);
+    CHECK(retVal);
+    CHECK(blip_dispatcher_register(retVal, "proposeChanges", log_message, &logs->propose) == 0);
+    CHECK(blip_dispatcher_register(retVal, "rev", log_message, &logs->rev) == 0);
+    CHECK(blip_dispatcher_register(retVal, "setCheckpoint", log_message, &logs->checkpoint) == 0);
+    return retVal;
+}
+
+// Serializes a message on a sending connection and reads it on the receiving one
+static blip_message_t* make_message(blip_connection_t* sender, blip_connection_t* receiver, MessageNo msg_no,
+                                    MessageType type, const char* properties)
+{
+    char props[64];
+    strcpy(props, properties);
+    uint8_t body[] = "{}";
+    blip_message_t* msg = blip_message_new();
+    msg->msg_no = msg_no;
+    msg->type = type;
+    msg->properties = props[0] ? (uint8_t*)props : NULL;
+    msg->body = body;
+    msg->body_size = 2;
+    size_t size;
+    const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+    CHECK(frame);
+    uint8_t* copy = malloc(size);
+    memcpy(copy, frame, size);
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+
+    blip_message_t* retVal = blip_message_read(receiver, copy, size);
+    CHECK(retVal && retVal->checksum == retVal->calculated_checksum);
+    free(copy);
+    return retVal;
+}
+
+// Returns what blip_dispatch() did with a response from the peer, and frees it
+static int dispatch_response(blip_dispatcher_t* dispatcher, blip_connection_t* sender, blip_connection_t* receiver,
+                             MessageNo msg_no)
+{
+    blip_message_t* msg = make_message(sender, receiver, msg_no, kResponseType, "");
+    if (!msg) {
+        return -1;
+    }
+
+    const int retVal = blip_dispatch(dispatcher, msg);
+    blip_message_free(msg);
+    return retVal;
+}
+
+// The capture is one side of a conversation: requests 1 to 11 (request 3 NoReply) and the
+// responses to requests 2 and 3 of the other side, which this side never sent.  Its
+// getCheckpoint and subChanges profiles are left to the fallback.
+static void test_capture(void)
+{
+    routing logs;
+    blip_dispatcher_t* dispatcher = new_dispatcher(&logs);
+    blip_connection_t* connection = blip_connection_new();
+    blip_connection_t* peer_sender = blip_connection_new();
+    blip_connection_t* peer = blip_connection_new();
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        CHECK(data);
+        blip_message_t* msg = data ? blip_message_read(connection, data, length) : NULL;
+        CHECK(msg);
+        if (msg) {
+            CHECK(blip_dispatch(dispatcher, msg) >= 0);
+            blip_message_free(msg);
+        }
+
+        free(data);
+    }
+
+    CHECK(logs.propose.count == 3 && logs.rev.count == 2 && logs.checkpoint.count == 4);
+    CHECK(logs.fallback.count == 4);
+
+    // The peer's responses go to the handler of the request they answer, once
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, 4) == 1 && logs.propose.count == 4);
+    CHECK(logs.propose.last == 4);
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, 6) == 1 && logs.checkpoint.count == 5);
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, 4) == 0 && logs.fallback.count == 5);
+
+    // Nothing waits for the NoReply request or the unregistered profile
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, 3) == 0);
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, 1) == 0 && logs.fallback.count == 7);
+
+    // A response travelling the same way as the request isn't its reply
+    blip_connection_t* same_sender = blip_connection_new();
+    blip_connection_t* same = blip_connection_new();
+    blip_message_t* msg = make_message(same_sender, same, 5, kResponseType, "");
+    if (msg) {
+        msg->private[0] = (uint64_t)connection;
+        CHECK(blip_dispatch(dispatcher, msg) == 0 && logs.rev.count == 2);
+        blip_message_free(msg);
+    }
+
+    // Requests 5, 7 to 11 still wait for a reply
+    CHECK(blip_dispatcher_forget_connection(dispatcher, peer) == 0);
+    CHECK(blip_dispatcher_forget_connection(dispatcher, connection) == 6);
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, 5) == 0 && logs.rev.count == 2);
+
+    blip_connection_free(same_sender);
+    blip_connection_free(same);
+    blip_connection_free(connection);
+    blip_connection_free(peer_sender);
+    blip_connection_free(peer);
+    blip_dispatcher_free(dispatcher);
+}
+
+// The later frames of a request carry no properties and are routed by message number, and the
+// request is only done with after its last frame if it is NoReply
+static void test_frames(void)
+{
+    routing logs;
+    blip_dispatcher_t* dispatcher = new_dispatcher(&logs);
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* connection = blip_connection_new();
+    blip_message_t* msg = make_message(sender, connection, 9, kRequestType, "Profile:rev:id:doc");
+    CHECK(msg && msg->profile_size == 3);
+    if (msg) {
+        const uint8_t* profile = msg->profile;
+        msg->flags |= kMoreComing;
+        CHECK(blip_dispatch(dispatcher, msg) == 1);
+        msg->profile = NULL;
+        msg->profile_size = 0;
+        CHECK(blip_dispatch(dispatcher, msg) == 1);
+        msg->flags = (msg->flags & ~kMoreComing) | kNoReply;
+        CHECK(blip_dispatch(dispatcher, msg) == 1 && logs.rev.count == 3);
+        CHECK(blip_dispatch(dispatcher, msg) == 0 && logs.fallback.count == 1);
+
+        // Without NoReply the last frame leaves the request waiting for its reply
+        msg->profile = profile;
+        msg->profile_size = 3;
+        msg->flags = kMoreComing;
+        CHECK(blip_dispatch(dispatcher, msg) == 1);
+        msg->profile = NULL;
+        msg->profile_size = 0;
+        msg->flags = 0;
+        CHECK(blip_dispatch(dispatcher, msg) == 1 && logs.rev.count == 5);
+        CHECK(blip_dispatcher_forget_connection(dispatcher, connection) == 1);
+        blip_message_free(msg);
+    }
+
+    blip_connection_free(sender);
+    blip_connection_free(connection);
+    blip_dispatcher_free(dispatcher);
+}
+
+// Requests that are never answered are dropped, oldest first, once too many are pending
+static void test_cap(void)
+{
+    routing logs;
+    blip_dispatcher_t* dispatcher = new_dispatcher(&logs);
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* connection = blip_connection_new();
+    blip_connection_t* peer_sender = blip_connection_new();
+    blip_connection_t* peer = blip_connection_new();
+    blip_message_t* msg = make_message(sender, connection, 1, kRequestType, "Profile:rev:id:doc");
+    if (msg) {
+        for (MessageNo n = 1; n <= FLOOD_COUNT; n++) {
+            msg->msg_no = n;
+            CHECK(blip_dispatch(dispatcher, msg) == 1);
+        }
+
+        blip_message_free(msg);
+    }
+
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, 1) == 0);
+    CHECK(dispatch_response(dispatcher, peer_sender, peer, FLOOD_COUNT) == 1 && logs.rev.last == FLOOD_COUNT);
+    const int dropped = blip_dispatcher_forget_connection(dispatcher, connection);
+    CHECK(dropped > 0 && dropped < 65536);
+
+    blip_connection_free(sender);
+    blip_connection_free(connection);
+    blip_connection_free(peer_sender);
+    blip_connection_free(peer);
+    blip_dispatcher_free(dispatcher);
+}
+
+int main(void)
+{
+    test_capture();
+    test_frames();
+    test_cap();
+    return test_result();
+}
@@ -0,0 +1,407 @@
+//
+//  export_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_export.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define COLUMN_COUNT 10
+#define MAX_ROWS 70000
+#define FLOOD_COUNT 66000
+
+// The file blip_export_finish() completed, with the writes optionally failing from some point
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    int writes;
+    int fail_at;
+} output;
+
+static int collect(void* context, const uint8_t* data, size_t size)
+{
+    output* out = context;
+    if (out->fail_at > 0 && out->writes >= out->fail_at) {
+        return -1;
+    }
+
+    out->data = realloc(out->data, out->size + size);
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+    out->writes++;
+    return 0;
+}
+
+// A row as it was added, or as it was read back from a file
+typedef struct {
+    uint64_t msg_no;
+    uint8_t direction;
+    uint8_t type;
+    uint8_t flags;
+    char profile[32];
+    uint32_t properties_size;
+    uint64_t body_size;
+    uint64_t wire_size;
+    uint8_t checksum;
+    uint64_t timestamp_ns;
+} row;
+
+static row expected[MAX_ROWS];
+static row actual[MAX_ROWS];
+
+static uint64_t get_le(const uint8_t* p, int width)
+{
+    uint64_t retVal = 0;
+    for (int i = width - 1; i >= 0; i--) {
+        retVal = retVal << 8 | p[i];
+    }
+
+    return retVal;
+}
+
+static void add_row(blip_export_t* exporter, const blip_message_t* msg, size_t n, uint8_t direction,
+                    uint64_t timestamp_ns)
+{
+    row* r = &expected[n];
+    memset(r, 0, sizeof(row));
+    const bool is_ack = msg->type >= kAckRequestType;
+    r->msg_no = msg->msg_no;
+    r->direction = direction;
+    r->type = (uint8_t)msg->type;
+    r->flags = (uint8_t)msg->flags;
+    if (msg->profile && !is_ack) {
+        const size_t size = msg->profile_size < sizeof(r->profile) - 1 ? msg->profile_size : sizeof(r->profile) - 1;
+        memcpy(r->profile, msg->profile, size);
+    }
+
+    r->properties_size = !is_ack && msg->properties ? (uint32_t)strlen((const char*)msg->properties) : 0;
+    r->body_size = is_ack ? 0 : msg->body_size;
+    r->wire_size = blip_get_message_wire_size(msg);
+    r->checksum = is_ack ? 2 : msg->checksum == msg->calculated_checksum;
+    r->timestamp_ns = timestamp_ns;
+    CHECK(blip_export_add(exporter, msg, direction, timestamp_ns) == 0);
+}
+
+// Reads a finished file back from its footer: every batch has to start where the footer says,
+// follow straight on from the one before, and add up to the row count in the footer.  Returns
+// the number of rows read into actual, or -1 if the file doesn't hold together.
+static long read_export(const uint8_t* data, size_t size, size_t* batch_count, size_t* profile_count)
+{
+    static const uint8_t kWidths[COLUMN_COUNT] = {8, 1, 1, 1, 4, 4, 8, 8, 1, 8};
+    static const char* const kNames[COLUMN_COUNT] = {"msg_no", "direction", "type", "flags", "profile",
+                                                     "properties_size", "body_size", "wire_size", "checksum",
+                                                     "timestamp_ns"};
+
+    // Header
+    if (size < 6 || memcmp(data, "CBCF", 4) != 0 || data[4] != BLIP_EXPORT_VERSION || data[5] != COLUMN_COUNT) {
+        return -1;
+    }
+
+    size_t pos = 6;
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        const size_t length = strlen(kNames[c]);
+        const uint8_t type = c == 4 ? kBlipColumnDictionary : kWidths[c];
+        if (pos + 2 + length > size || data[pos] != type || data[pos + 1] != length
+            || memcmp(data + pos + 2, kNames[c], length) != 0) {
+            return -1;
+        }
+
+        pos += 2 + length;
+    }
+
+    // Footer
+    if (size < pos + 20 || memcmp(data + size - 4, "CBCF", 4) != 0) {
+        return -1;
+    }
+
+    const uint64_t total_rows = get_le(data + size - 12, 8);
+    const uint64_t batches = get_le(data + size - 20, 8);
+    if (batches > (size - pos - 20) / 8) {
+        return -1;
+    }
+
+    const size_t footer = size - 20 - (size_t)batches * 8;
+    char** dictionary = NULL;
+    size_t entries = 0;
+    size_t rows = 0;
+    for (uint64_t b = 0; b < batches; b++) {
+        if (get_le(data + footer + b * 8, 8) != pos || pos + 12 > footer || memcmp(data + pos, "CBCB", 4) != 0) {
+            break;
+        }
+
+        const size_t batch_rows = (size_t)get_le(data + pos + 4, 4);
+        const size_t new_entries = (size_t)get_le(data + pos + 8, 4);
+        pos += 12;
+        dictionary = realloc(dictionary, (entries + new_entries) * sizeof(char*));
+        for (size_t i = 0; i < new_entries && pos + 2 <= footer; i++) {
+            const size_t length = (size_t)get_le(data + pos, 2);
+            dictionary[entries] = calloc(1, length + 1);
+            memcpy(dictionary[entries++], data + pos + 2, pos + 2 + length <= footer ? length : 0);
+            pos += 2 + length;
+        }
+
+        if (batch_rows == 0 || rows + batch_rows > MAX_ROWS) {
+            break;
+        }
+
+        for (int c = 0; c < COLUMN_COUNT; c++) {
+            pos = (pos + 7) & ~(size_t)7;
+            if (pos + batch_rows * kWidths[c] > footer) {
+                break;
+            }
+
+            for (size_t i = 0; i < batch_rows; i++) {
+                row* r = &actual[rows + i];
+                const uint64_t value = get_le(data + pos + i * kWidths[c], kWidths[c]);
+                switch (c) {
+                    case 0: r->msg_no = value; break;
+                    case 1: r->direction = (uint8_t)value; break;
+                    case 2: r->type = (uint8_t)value; break;
+                    case 3: r->flags = (uint8_t)value; break;
+                    case 4:
+                        r->profile[0] = 0;
+                        if (value > entries) {
+                            r->profile[0] = '?';
+                        } else if (value > 0) {
+                            strncat(r->profile, dictionary[value - 1], sizeof(r->profile) - 1);
+                        }
+                        break;
+                    case 5: r->properties_size = (uint32_t)value; break;
+                    case 6: r->body_size = value; break;
+                    case 7: r->wire_size = value; break;
+                    case 8: r->checksum = (uint8_t)value; break;
+                    default: r->timestamp_ns = value; break;
+                }
+            }
+
+            pos += batch_rows * kWidths[c];
+        }
+
+        rows += batch_rows;
+    }
+
+    for (size_t i = 0; i < entries; i++) {
+        free(dictionary[i]);
+    }
+
+    free(dictionary);
+    *batch_count = (size_t)batches;
+    *profile_count = entries;
+    return pos == footer && rows == total_rows ? (long)rows : -1;
+}
+
+static bool same_rows(size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const row* e = &expected[i];
+        const row* a = &actual[i];
+        if (a->msg_no != e->msg_no || a->direction != e->direction || a->type != e->type || a->flags != e->flags
+            || strcmp(a->profile, e->profile) != 0 || a->properties_size != e->properties_size
+            || a->body_size != e->body_size || a->wire_size != e->wire_size || a->checksum != e->checksum
+            || a->timestamp_ns != e->timestamp_ns) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Exports the capture, as seen in one direction, in batches of every size from one row to more
+// than the capture holds
+static void test_capture(void)
+{
+    uint8_t* packets[TEST_PACKET_COUNT];
+    size_t packet_sizes[TEST_PACKET_COUNT];
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        packets[i] = read_packet(TEST_PACKETS, i + 1, &packet_sizes[i]);
+        CHECK(packets[i]);
+    }
+
+    for (size_t batch_rows = 1; batch_rows <= TEST_PACKET_COUNT + 1; batch_rows++) {
+        output out;
+        memset(&out, 0, sizeof(out));
+        blip_export_t* exporter = blip_export_new(batch_rows, collect, &out);
+        CHECK(exporter);
+        blip_connection_t* connection = blip_connection_new();
+        for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+            uint8_t* copy = malloc(packet_sizes[i]);
+            memcpy(copy, packets[i], packet_sizes[i]);
+            blip_message_t* msg = blip_message_read(connection, copy, packet_sizes[i]);
+            CHECK(msg);
+            if (msg) {
+                add_row(exporter, msg, (size_t)i, 1, (uint64_t)(i + 1) * 1000);
+                blip_message_free(msg);
+            }
+
+            free(copy);
+        }
+
+        CHECK(blip_export_finish(exporter) == 0);
+        CHECK(blip_export_add(exporter, NULL, 0, 0) < 0);
+        blip_export_free(exporter);
+        blip_connection_free(connection);
+
+        size_t batch_count;
+        size_t profile_count;
+        CHECK(read_export(out.data, out.size, &batch_count, &profile_count) == TEST_PACKET_COUNT);
+        CHECK(batch_count == (TEST_PACKET_COUNT + batch_rows - 1) / batch_rows);
+        CHECK(same_rows(TEST_PACKET_COUNT));
+
+        // getCheckpoint, subChanges, proposeChanges, setCheckpoint and rev, each once
+        CHECK(profile_count == 5);
+        CHECK(strcmp(actual[0].profile, "getCheckpoint") == 0 && actual[0].checksum == 1);
+        CHECK(strcmp(actual[4].profile, "rev") == 0 && (actual[4].flags & kCompressed));
+        CHECK(actual[6].type == kResponseType && actual[6].profile[0] == 0);
+        free(out.data);
+    }
+
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        free(packets[i]);
+    }
+}
+
+// More distinct profiles than a file can name, with ACKs among them
+static void test_profiles(void)
+{
+    output out;
+    memset(&out, 0, sizeof(out));
+    blip_export_t* exporter = blip_export_new(4096, collect, &out);
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* receiver = blip_connection_new();
+    blip_message_t* msg = blip_message_new();
+    uint8_t body[] = "{}";
+    for (size_t n = 0; n < FLOOD_COUNT; n++) {
+        char properties[32];
+        snprintf(properties, sizeof(properties), "Profile:p%zu", n % 1000 == 999 || n == FLOOD_COUNT - 1 ? 0 : n);
+        msg->msg_no = (MessageNo)n + 1;
+        msg->type = n % 5000 == 7 ? kAckRequestType : kRequestType;
+        msg->flags = 0;
+        msg->properties = (uint8_t*)properties;
+        msg->body = body;
+        msg->body_size = 2;
+        size_t size;
+        const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+        uint8_t* copy = malloc(size);
+        memcpy(copy, frame, size);
+        blip_message_t* received = blip_message_read(receiver, copy, size);
+        CHECK(received);
+        if (received) {
+            add_row(exporter, received, n, 0, 0);
+            blip_message_free(received);
+        }
+
+        free(copy);
+    }
+
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+    blip_connection_free(sender);
+    blip_connection_free(receiver);
+    CHECK(blip_export_finish(exporter) == 0);
+    blip_export_free(exporter);
+
+    // New profiles past the limit share the last entry, ones named before it keep theirs
+    size_t named = 0;
+    size_t other = 0;
+    for (size_t n = 0; n < FLOOD_COUNT; n++) {
+        if (expected[n].profile[0] && strcmp(expected[n].profile, "p0") != 0) {
+            if (named < BLIP_EXPORT_MAX_PROFILES - 2) {
+                named++;
+            } else {
+                strcpy(expected[n].profile, "(other)");
+                other++;
+            }
+        }
+    }
+
+    size_t batch_count;
+    size_t profile_count;
+    CHECK(read_export(out.data, out.size, &batch_count, &profile_count) == FLOOD_COUNT);
+    CHECK(batch_count == (FLOOD_COUNT + 4095) / 4096 && profile_count == BLIP_EXPORT_MAX_PROFILES);
+    CHECK(other > 0 && strcmp(actual[FLOOD_COUNT - 1].profile, "p0") == 0);
+    CHECK(actual[7].profile[0] == 0 && actual[7].checksum == 2);
+    CHECK(same_rows(FLOOD_COUNT));
+    free(out.data);
+}
+
+// A write that fails makes the exporter unusable, and finishing reports it
+static void test_failure(void)
+{
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* receiver = blip_connection_new();
+    blip_message_t* msg = blip_message_new();
+    uint8_t body[] = "{}";
+    char properties[] = "Profile:rev";
+    msg->type = kRequestType;
+    msg->properties = (uint8_t*)properties;
+    msg->body = body;
+    msg->body_size = 2;
+    size_t size;
+    const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+    uint8_t* copy = malloc(size);
+    memcpy(copy, frame, size);
+    blip_message_t* received = blip_message_read(receiver, copy, size);
+    CHECK(received);
+
+    output out;
+    memset(&out, 0, sizeof(out));
+    CHECK(blip_export_new(0, collect, &out) == NULL);
+    CHECK(blip_export_new(4, NULL, &out) == NULL);
+    out.fail_at = 1;
+    CHECK(blip_export_new(4, collect, &out) == NULL);
+    free(out.data);
+
+    for (int fail_at = 2; fail_at < 60; fail_at += 3) {
+        memset(&out, 0, sizeof(out));
+        out.fail_at = fail_at;
+        blip_export_t* exporter = blip_export_new(2, collect, &out);
+        int result = exporter ? 0 : -1;
+        for (int n = 0; n < 5 && result == 0; n++) {
+            result = blip_export_add(exporter, received, 0, 0);
+        }
+
+        if (exporter) {
+            CHECK(blip_export_finish(exporter) < 0);
+            blip_export_free(exporter);
+        }
+
+        size_t batch_count;
+        size_t profile_count;
+        CHECK(read_export(out.data, out.size, &batch_count, &profile_count) < 0);
+        free(out.data);
+    }
+
+    blip_message_free(received);
+    free(copy);
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+    blip_connection_free(sender);
+    blip_connection_free(receiver);
+}
+
+int main(void)
+{
+    test_capture();
+    test_profiles();
+    test_failure();
+    return test_result();
+}
@@ -0,0 +1,187 @@
+//
+//  filter_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_builder.h"
+#include "cblip_filter.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define GENERATED_COUNT 300
+
+static const char* const kExpressions[] = {
+    "type == REQ && profile == \"rev\" && body_size > 1KB",
+    "flags & Urgent",
+    "!(type == ACKREQ || type == AKRES) && prop(\"client\") != \"b\"",
+    "prop(\"client\")",
+    "msg_no >= 16 && wire_size < 2KB || type == RES",
+};
+
+static const char* const kProfiles[] = {"rev", "getCheckpoint", "changes", "subChanges"};
+
+static bool property_is(const blip_message_t* msg, const char* key, const char* expected)
+{
+    const uint8_t* value;
+    size_t size;
+    return msg->type < kAckRequestType && blip_message_get_property(msg, key, &value, &size) == 0
+           && size == strlen(expected) && memcmp(value, expected, size) == 0;
+}
+
+static bool has_property(const blip_message_t* msg, const char* key)
+{
+    const uint8_t* value;
+    size_t size;
+    return msg->type < kAckRequestType && blip_message_get_property(msg, key, &value, &size) == 0;
+}
+
+// The filters of kExpressions, evaluated in C against the fully decoded message
+static uint64_t expected_mask(const blip_message_t* msg, size_t wire_size)
+{
+    const bool is_ack = msg->type >= kAckRequestType;
+    const bool is_rev = property_is(msg, "Profile", "rev");
+    const bool client_b = property_is(msg, "client", "b");
+    uint64_t retVal = 0;
+    retVal |= (uint64_t)(msg->type == kRequestType && is_rev && msg->body_size > 1024) << 0;
+    retVal |= (uint64_t)((msg->flags & kUrgent) != 0) << 1;
+    retVal |= (uint64_t)(!is_ack && !client_b) << 2;
+    retVal |= (uint64_t)has_property(msg, "client") << 3;
+    retVal |= (uint64_t)((msg->msg_no >= 16 && wire_size < 2048) || msg->type == kResponseType) << 4;
+    return retVal;
+}
+
+// Runs the frames through blip_message_read_filtered() on one connection and blip_message_read()
+// on another, and checks that every frame matches exactly the filters its decoded form does
+static void check_frames(const blip_filter_set_t* filters, uint8_t** frames, const size_t* sizes, size_t count,
+                         uint64_t* matches)
+{
+    blip_connection_t* full = blip_connection_new();
+    blip_connection_t* filtered = blip_connection_new();
+    blip_message_t* msg = blip_message_new();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t mask = 0;
+        const int result = blip_message_read_filtered(filtered, msg, frames[i], sizes[i], filters, &mask);
+        uint8_t* copy = malloc(sizes[i]);
+        memcpy(copy, frames[i], sizes[i]);
+        blip_message_t* decoded = blip_message_read(full, copy, sizes[i]);
+        CHECK(decoded && result >= 0);
+        if (!decoded || result < 0) {
+            free(copy);
+            continue;
+        }
+
+        const uint64_t expected = expected_mask(decoded, sizes[i]);
+        CHECK(mask == expected);
+        CHECK(result == (expected != 0));
+        for (int bit = 0; bit < 5; bit++) {
+            matches[bit] += (expected >> bit) & 1;
+        }
+
+        // A frame that matched is decoded just as blip_message_read() decodes it
+        if (result == 1) {
+            CHECK(msg->msg_no == decoded->msg_no && msg->type == decoded->type);
+            CHECK(msg->checksum == msg->calculated_checksum);
+            CHECK(msg->body_size == decoded->body_size
+                  && (msg->body_size == 0 || memcmp(msg->body, decoded->body, msg->body_size) == 0));
+        }
+
+        blip_message_free(decoded);
+        free(copy);
+    }
+
+    blip_message_free(msg);
+    blip_connection_free(full);
+    blip_connection_free(filtered);
+}
+
+int main(void)
+{
+    char error[128];
+    blip_filter_set_t* filters = blip_filter_set_new();
+    for (int i = 0; i < 5; i++) {
+        CHECK(blip_filter_set_add(filters, kExpressions[i], error, sizeof(error)) == i);
+    }
+
+    const char* const invalid[] = {"", "type ==", "profile > \"x\"", "foo == 1", "(type", "profile == 3", "\"abc"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        error[0] = 0;
+        CHECK(blip_filter_set_add(filters, invalid[i], error, sizeof(error)) < 0 && error[0] != 0);
+    }
+
+    // Messages with every mix of the fields the filters look at, a third of them compressed
+    blip_compression_options compression = {6, 0, 8, 15, 0};
+    blip_connection_t* sender = blip_connection_new();
+    CHECK(blip_connection_set_compression(sender, &compression) == 0);
+    blip_message_builder_t* builder = blip_message_builder_new();
+    uint8_t* body = malloc(5000);
+    for (int i = 0; i < 5000; i++) {
+        body[i] = (uint8_t)"revisions!"[i % 10];
+    }
+
+    uint8_t* frames[GENERATED_COUNT];
+    size_t sizes[GENERATED_COUNT];
+    for (int i = 0; i < GENERATED_COUNT; i++) {
+        const MessageType type = i % 5 == 4 ? kResponseType : kRequestType;
+        const FrameFlags flags = (i % 3 == 0 ? kCompressed : 0) | (i % 4 == 0 ? kUrgent : 0);
+        blip_message_builder_begin(builder, (MessageNo)i + 1, type, flags);
+        if (i % 6 != 0) {
+            blip_message_builder_add_property(builder, "Profile", kProfiles[i % 4]);
+        }
+
+        if (i % 5 != 0) {
+            blip_message_builder_add_property(builder, "client", i % 2 ? "a" : "b");
+        }
+
+        blip_message_builder_append_body(builder, body, (size_t)(i * 997) % 5000);
+        const uint8_t* frame = blip_message_builder_finish(builder, sender, &sizes[i]);
+        CHECK(frame);
+        frames[i] = malloc(sizes[i]);
+        memcpy(frames[i], frame, sizes[i]);
+    }
+
+    uint64_t matches[5] = {0};
+    check_frames(filters, frames, sizes, GENERATED_COUNT, matches);
+    for (int i = 0; i < 5; i++) {
+        CHECK(blip_filter_set_matches(filters, i) == matches[i]);
+        CHECK(matches[i] > 0 && matches[i] < GENERATED_COUNT);
+    }
+
+    for (int i = 0; i < GENERATED_COUNT; i++) {
+        free(frames[i]);
+    }
+
+    // And the capture the driver checks, a conversation with compressed requests and responses
+    uint8_t* packets[TEST_PACKET_COUNT];
+    size_t packet_sizes[TEST_PACKET_COUNT];
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        packets[i] = read_packet(TEST_PACKETS, i + 1, &packet_sizes[i]);
+        CHECK(packets[i]);
+    }
+
+    check_frames(filters, packets, packet_sizes, TEST_PACKET_COUNT, matches);
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        free(packets[i]);
+    }
+
+    blip_message_builder_free(builder);
+    blip_connection_free(sender);
+    blip_filter_set_free(filters);
+    free(body);
+    return test_result();
+}
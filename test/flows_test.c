@@ -0,0 +1,142 @@
+//
+//  flows_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_flows.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FLOW_COUNT 40
+
+static uint8_t* packets[TEST_PACKET_COUNT + 1];
+static size_t packet_sizes[TEST_PACKET_COUNT + 1];
+
+static void flow_key(blip_flow_key* key, int flow)
+{
+    const uint8_t client[4] = {10, 0, (uint8_t)(flow >> 8), (uint8_t)flow};
+    const uint8_t server[4] = {10, 0, 255, 1};
+    blip_flow_key_ipv4(key, client, (uint16_t)(40000 + flow), server, 4984);
+}
+
+static bool read_ok(blip_connection_t* connection, int packet)
+{
+    uint8_t* copy = malloc(packet_sizes[packet]);
+    memcpy(copy, packets[packet], packet_sizes[packet]);
+    blip_message_t* msg = connection ? blip_message_read(connection, copy, packet_sizes[packet]) : NULL;
+    const bool retVal = msg && (msg->type >= kAckRequestType || msg->checksum == msg->calculated_checksum);
+    if (msg) {
+        blip_message_free(msg);
+    }
+
+    free(copy);
+    return retVal;
+}
+
+// Interleaves the capture over many flows in a table whose budget only fits a few of them, so
+// flows keep being hibernated and revived between their frames, and every frame still decodes
+static void test_hibernation(void)
+{
+    blip_flow_table_options options;
+    memset(&options, 0, sizeof(options));
+    options.capacity = 64;
+    options.memory_budget = 256 * 1024;
+    blip_flow_table_t* table = blip_flow_table_new(&options);
+    CHECK(table);
+    uint64_t now = 0;
+    for (int packet = 1; packet <= TEST_PACKET_COUNT; packet++) {
+        for (int flow = 0; flow < FLOW_COUNT; flow++) {
+            blip_flow_key key;
+            flow_key(&key, flow);
+            CHECK(read_ok(blip_flow_table_get(table, &key, ++now), packet));
+        }
+    }
+
+    blip_flow_table_stats stats;
+    blip_flow_table_get_stats(table, &stats);
+    CHECK(stats.flows == FLOW_COUNT);
+    CHECK(stats.hibernations > 0 && stats.revivals > 0);
+    CHECK(stats.evictions == 0);
+    CHECK(stats.memory <= options.memory_budget);
+    blip_flow_table_free(table);
+}
+
+// Capacity evicts the least recently used flow, and idle flows are hibernated, then evicted
+static void test_eviction(void)
+{
+    blip_flow_table_options options;
+    memset(&options, 0, sizeof(options));
+    options.capacity = 8;
+    options.hibernate_after_ns = 10;
+    options.evict_after_ns = 100;
+    blip_flow_table_t* table = blip_flow_table_new(&options);
+    blip_flow_key key;
+    blip_connection_t* first = NULL;
+    for (int flow = 0; flow < 8; flow++) {
+        flow_key(&key, flow);
+        blip_connection_t* connection = blip_flow_table_get(table, &key, (uint64_t)flow);
+        CHECK(read_ok(connection, 1));
+        first = flow == 0 ? connection : first;
+    }
+
+    // Looking flow 0 up again returns the same connection, and makes flow 1 the oldest
+    flow_key(&key, 0);
+    CHECK(blip_flow_table_get(table, &key, 8) == first);
+    flow_key(&key, 8);
+    CHECK(blip_flow_table_get(table, &key, 9));
+    blip_flow_table_stats stats;
+    blip_flow_table_get_stats(table, &stats);
+    CHECK(stats.flows == 8 && stats.evictions == 1);
+    flow_key(&key, 1);
+    CHECK(blip_flow_table_remove(table, &key) < 0);
+    flow_key(&key, 8);
+    CHECK(blip_flow_table_remove(table, &key) == 0);
+    CHECK(blip_flow_table_remove(table, &key) < 0);
+
+    // At 20 all seven flows left have been idle for longer than 10
+    CHECK(blip_flow_table_expire(table, 20) == 7);
+    blip_flow_table_get_stats(table, &stats);
+    CHECK(stats.hibernated == 7);
+    flow_key(&key, 0);
+    CHECK(blip_flow_table_get(table, &key, 21) == first);
+    CHECK(read_ok(first, 2));
+
+    // At 120 the six that weren't revived have been idle for longer than 100, flow 0 only long
+    // enough to hibernate again
+    CHECK(blip_flow_table_expire(table, 120) == 7);
+    blip_flow_table_get_stats(table, &stats);
+    CHECK(stats.flows == 1 && stats.hibernated == 1);
+    blip_flow_table_free(table);
+}
+
+int main(void)
+{
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        packets[i] = read_packet(TEST_PACKETS, i, &packet_sizes[i]);
+        CHECK(packets[i]);
+    }
+
+    test_hibernation();
+    test_eviction();
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        free(packets[i]);
+    }
+
+    return test_result();
+}
@@ -0,0 +1,121 @@
+//
+//  frames_test.cpp
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+extern "C" {
+#include "capture.h"
+}
+#include "cblip_frames.hpp"
+#include "test.h"
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Runs a coroutine to completion from main(), which works because BufferSource never suspends
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::abort(); }
+    };
+};
+
+struct Result
+{
+    int messages {0};
+    int valid {0};
+    bool failed {false};
+};
+
+static const char kUpgrade[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                               "Sec-WebSocket-Protocol: BLIP_3+CBMobile_2\r\n\r\n";
+
+// The capture as the server side of a WebSocket would send it: unmasked binary messages, one
+// frame each, after the upgrade response
+static std::vector<uint8_t> framed_capture()
+{
+    std::vector<uint8_t> retVal(kUpgrade, kUpgrade + sizeof(kUpgrade) - 1);
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        CHECK(data);
+        if (!data) {
+            continue;
+        }
+
+        retVal.push_back(0x82);
+        if (length < 126) {
+            retVal.push_back((uint8_t)length);
+        } else {
+            CHECK(length <= UINT16_MAX);
+            retVal.push_back(126);
+            retVal.push_back((uint8_t)(length >> 8));
+            retVal.push_back((uint8_t)length);
+        }
+
+        retVal.insert(retVal.end(), data, data + length);
+        free(data);
+    }
+
+    return retVal;
+}
+
+static Task decode(const uint8_t* data, size_t size, size_t buffer_size, Result& result)
+{
+    blip::BufferSource source(data, size);
+    blip::Frames frames = blip::frames(source, buffer_size);
+    while (const blip::Message* msg = co_await frames.next()) {
+        result.messages++;
+        result.valid += msg->checksum_valid() && msg->number() > 0;
+    }
+
+    result.failed = frames.failed();
+}
+
+static Result run(const std::vector<uint8_t>& stream, size_t size, size_t buffer_size)
+{
+    Result retVal;
+    decode(stream.data(), size, buffer_size, retVal);
+    return retVal;
+}
+
+int main()
+{
+    const std::vector<uint8_t> stream = framed_capture();
+
+    // However the reads split the stream, down to a byte at a time
+    static const size_t kBufferSizes[] = {1, 7, 64, 1000, 64 * 1024};
+    for (size_t buffer_size : kBufferSizes) {
+        const Result result = run(stream, stream.size(), buffer_size);
+        CHECK(result.messages == TEST_PACKET_COUNT && result.valid == TEST_PACKET_COUNT && !result.failed);
+    }
+
+    // A stream that stops partway through the last frame, or the upgrade header, is corrupt
+    Result result = run(stream, stream.size() - 1, 64);
+    CHECK(result.messages == TEST_PACKET_COUNT - 1 && result.failed);
+    result = run(stream, sizeof(kUpgrade) - 3, 64);
+    CHECK(result.messages == 0 && result.failed);
+
+    // An empty stream is not
+    result = run(stream, 0, 64);
+    CHECK(result.messages == 0 && !result.failed);
+    return test_result();
+}
@@ -0,0 +1,167 @@
+//
+//  ingest_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include "ingest.h"
+#include "test.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE (3 * 1024 * 1024 + 1234)
+#define DEPTH 8
+#define BUFFER_SIZE (64 * 1024)
+
+// Reads a whole file through a backend, DEPTH reads at a time, and returns the copy
+static uint8_t* read_through(ingest_t* ingest, int fd, size_t size)
+{
+    uint8_t* retVal = calloc(1, size + 1);
+    uint64_t next = 0;
+    unsigned in_flight = 0;
+    for (unsigned buffer = 0; buffer < DEPTH && next < size; buffer++) {
+        CHECK(ingest_submit(ingest, fd, next, buffer, BUFFER_SIZE, (void*)(uintptr_t)next) == 0);
+        next += BUFFER_SIZE;
+        in_flight++;
+    }
+
+    while (in_flight > 0) {
+        ingest_completion completion;
+        CHECK(ingest_wait(ingest, &completion) == 0);
+        in_flight--;
+        const uint64_t offset = (uint64_t)(uintptr_t)completion.tag;
+        const size_t expected = size - offset < BUFFER_SIZE ? (size_t)(size - offset) : BUFFER_SIZE;
+        CHECK(completion.result == (int64_t)expected);
+        if (completion.result > 0) {
+            memcpy(retVal + offset, ingest_buffer(ingest, completion.buffer), (size_t)completion.result);
+        }
+
+        if (next < size) {
+            CHECK(ingest_submit(ingest, fd, next, completion.buffer, BUFFER_SIZE, (void*)(uintptr_t)next) == 0);
+            next += BUFFER_SIZE;
+            in_flight++;
+        }
+    }
+
+    ingest_completion completion;
+    CHECK(ingest_wait(ingest, &completion) < 0);
+    return retVal;
+}
+
+// Reads one buffer's worth at an offset, returning the result
+static int64_t read_one(ingest_t* ingest, int fd, uint64_t offset, size_t size)
+{
+    if (ingest_submit(ingest, fd, offset, 0, size, NULL) < 0) {
+        return INT64_MIN;
+    }
+
+    ingest_completion completion;
+    CHECK(ingest_wait(ingest, &completion) == 0 && completion.buffer == 0);
+    return completion.result;
+}
+
+static void check_backend(ingest_t* ingest, int fd, const uint8_t* content)
+{
+    uint8_t* copy = read_through(ingest, fd, FILE_SIZE);
+    CHECK(memcmp(copy, content, FILE_SIZE) == 0);
+    free(copy);
+
+    // Short reads only at the end of the file, and nothing past it
+    CHECK(read_one(ingest, fd, FILE_SIZE - 10, 100) == 10);
+    CHECK(memcmp(ingest_buffer(ingest, 0), content + FILE_SIZE - 10, 10) == 0);
+    CHECK(read_one(ingest, fd, FILE_SIZE + 5, 100) == 0);
+
+    // Failures come back as a negative errno in the completion
+    CHECK(read_one(ingest, -1, 0, 100) == -EBADF);
+
+    // Reads that don't fit a buffer, or into a buffer that doesn't exist, are refused
+    CHECK(ingest_submit(ingest, fd, 0, 0, BUFFER_SIZE + 1, NULL) < 0);
+    CHECK(ingest_submit(ingest, fd, 0, DEPTH, 100, NULL) < 0);
+
+    // The capture reads back as read_file() sees it
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/BLIP_Packet%d", TEST_PACKETS, i);
+        size_t length;
+        uint8_t* expected = read_file(path, &length);
+        const int packet = open(path, O_RDONLY);
+        CHECK(expected && packet >= 0);
+        if (expected && packet >= 0) {
+            CHECK(read_one(ingest, packet, 0, BUFFER_SIZE) == (int64_t)length);
+            CHECK(memcmp(ingest_buffer(ingest, 0), expected, length) == 0);
+        }
+
+        if (packet >= 0) {
+            close(packet);
+        }
+
+        free(expected);
+    }
+}
+
+int main(void)
+{
+    uint8_t* content = malloc(FILE_SIZE);
+    uint32_t state = 1;
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        state = state * 1103515245 + 12345;
+        content[i] = (uint8_t)(state >> 16);
+    }
+
+    FILE* file = tmpfile();
+    CHECK(file && fwrite(content, 1, FILE_SIZE, file) == FILE_SIZE && fflush(file) == 0);
+    const int fd = fileno(file);
+
+    // The pread() pool is always there
+    ingest_t* threads = ingest_new(kIngestThreads, DEPTH, BUFFER_SIZE);
+    CHECK(threads && strcmp(ingest_name(threads), "pread threads") == 0);
+    if (threads) {
+        check_backend(threads, fd, content);
+        ingest_free(threads);
+    }
+
+    // io_uring depends on the kernel (and on seccomp policy), and has to read the same bytes
+    // when it is there.  Auto falls back to the pool when it isn't.
+    ingest_t* uring = ingest_new(kIngestUring, DEPTH, BUFFER_SIZE);
+    ingest_t* automatic = ingest_new(kIngestAuto, DEPTH, BUFFER_SIZE);
+    CHECK(automatic);
+    if (uring) {
+        CHECK(strncmp(ingest_name(uring), "io_uring", 8) == 0);
+        CHECK(strcmp(ingest_name(automatic), ingest_name(uring)) == 0);
+        check_backend(uring, fd, content);
+        ingest_free(uring);
+    } else {
+        printf("io_uring is not available, only the thread pool was tested\n");
+        CHECK(strcmp(ingest_name(automatic), "pread threads") == 0);
+    }
+
+    if (automatic) {
+        check_backend(automatic, fd, content);
+        ingest_free(automatic);
+    }
+
+    CHECK(ingest_new(kIngestThreads, 0, BUFFER_SIZE) == NULL);
+    if (file) {
+        fclose(file);
+    }
+
+    free(content);
+    return test_result();
+}
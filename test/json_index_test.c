@@ -0,0 +1,156 @@
+//
+//  json_index_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "json_index.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Built twice, with json_index.c compiled in: once as the library builds it (SSE2 where the
+ * target has it) and once with JSON_INDEX_SCALAR.  Both builds have to find the same structural
+ * positions as a byte at a time reading of the document.
+ */
+
+#define MAX_DOCUMENT 1024
+#define RANDOM_DOCUMENTS 100000
+
+// The structural positions found one byte at a time, or -1 if a string is left open
+static long reference_index(const uint8_t* json, size_t size, uint32_t* positions)
+{
+    long count = 0;
+    bool in_string = false;
+    for (size_t i = 0; i < size; i++) {
+        const uint8_t c = json[i];
+        if (in_string) {
+            if (c == '\\') {
+                i++;
+            } else if (c == '"') {
+                in_string = false;
+                positions[count++] = (uint32_t)i;
+            }
+        } else if (c == '"') {
+            in_string = true;
+            positions[count++] = (uint32_t)i;
+        } else if (c != 0 && strchr("{}[]:,", c)) {
+            positions[count++] = (uint32_t)i;
+        }
+    }
+
+    return in_string ? -1 : count;
+}
+
+static void check_document(json_tape* tape, const uint8_t* json, size_t size)
+{
+    static uint32_t expected[MAX_DOCUMENT];
+    const long count = reference_index(json, size, expected);
+    const int result = json_index_build(tape, json, size);
+    if (count < 0) {
+        CHECK(result < 0);
+        return;
+    }
+
+    CHECK(result == 0 && tape->count == (size_t)count);
+    CHECK(result != 0 || memcmp(tape->positions, expected, (size_t)count * sizeof(uint32_t)) == 0);
+}
+
+// Documents made mostly of quotes, backslashes and structural characters, so that escapes and
+// strings keep crossing the 64 byte blocks.  Backslashes only appear inside strings, as in JSON.
+static void test_random(json_tape* tape)
+{
+    static const char kStructural[] = "{}[]:,";
+    uint8_t json[MAX_DOCUMENT];
+    uint32_t state = 7;
+    for (int n = 0; n < RANDOM_DOCUMENTS; n++) {
+        state = state * 1103515245 + 12345;
+        const size_t size = (state >> 8) % (n < RANDOM_DOCUMENTS / 2 ? 200 : MAX_DOCUMENT);
+        bool in_string = false;
+        for (size_t i = 0; i < size; i++) {
+            state = state * 1103515245 + 12345;
+            const uint32_t r = (state >> 16) % 10;
+            if (r < 2 && in_string) {
+                json[i] = '\\';
+                if (i + 1 < size) {
+                    json[++i] = (uint8_t)"\\\"nu"[(state >> 20) % 4];
+                }
+            } else if (r < 4) {
+                json[i] = '"';
+                in_string = !in_string;
+            } else {
+                json[i] = r < 6 ? (uint8_t)kStructural[(state >> 20) % 6] : (uint8_t)('a' + r % 3);
+            }
+        }
+
+        check_document(tape, json, size);
+    }
+}
+
+// A run of backslashes that ends at every position around a block boundary, escaping the quote
+// after it or not depending on its length
+static void test_backslash_runs(json_tape* tape)
+{
+    uint8_t json[200];
+    for (size_t run = 1; run < 140; run++) {
+        for (size_t start = 1; start + run + 3 < sizeof(json); start += 13) {
+            memset(json, ' ', sizeof(json));
+            json[0] = '"';
+            memset(json + start, '\\', run);
+            json[start + run] = '"';
+            json[start + run + 1] = ',';
+            json[sizeof(json) - 1] = '"';
+            check_document(tape, json, sizeof(json));
+        }
+    }
+}
+
+static void test_lookup(json_tape* tape)
+{
+    static const char kDocument[] = "{\"docID\" : \"doc\\\"1\", \"rev\":\"1-abc\",\"nested\":{\"docID\":\"x\","
+                                    "\"a\":[1,{\"b\":2}]}, \"sequence\": 42 , \"deleted\":true}";
+    const uint8_t* json = (const uint8_t*)kDocument;
+    CHECK(json_index_build(tape, json, sizeof(kDocument) - 1) == 0);
+    static const char* kKeys[] = {"docID", "rev", "nested", "sequence", "deleted"};
+    static const char* kValues[] = {"doc\\\"1", "1-abc", "{\"docID\":\"x\",\"a\":[1,{\"b\":2}]}", "42", "true"};
+    for (size_t i = 0; i < sizeof(kKeys) / sizeof(kKeys[0]); i++) {
+        const uint8_t* value;
+        size_t value_size;
+        CHECK(json_object_find(tape, json, 0, kKeys[i], strlen(kKeys[i]), &value, &value_size));
+        CHECK(value_size == strlen(kValues[i]) && memcmp(value, kValues[i], value_size) == 0);
+    }
+
+    // Keys of nested objects aren't keys of the outer one
+    const uint8_t* value;
+    size_t value_size;
+    CHECK(!json_object_find(tape, json, 0, "a", 1, &value, &value_size));
+    CHECK(!json_object_find(tape, json, 0, "missing", 7, &value, &value_size));
+    CHECK(json_skip_value(tape, json, 0) == tape->count);
+
+    // An unterminated string
+    CHECK(json_index_build(tape, (const uint8_t*)"{\"a\":\"b}", 8) < 0);
+}
+
+int main(void)
+{
+    json_tape tape;
+    memset(&tape, 0, sizeof(tape));
+    test_random(&tape);
+    test_backslash_runs(&tape);
+    test_lookup(&tape);
+    json_index_free(&tape);
+    return test_result();
+}
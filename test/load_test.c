@@ -0,0 +1,303 @@
+//
+//  load_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _GNU_SOURCE
+#include "cblip.h"
+#include "cblip_parser.h"
+#include "load.h"
+#include "responder.h"
+#include "test.h"
+#include "websocket.h"
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_OUTPUT 65536
+#define BIG_BODY_SIZE 50000
+#define REQUEST_COUNT 6
+
+static char properties[] = "Profile:rev";
+
+static int connect_to(int port)
+{
+    const int retVal = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    CHECK(retVal >= 0 && connect(retVal, (struct sockaddr*)&address, sizeof(address)) == 0);
+    return retVal;
+}
+
+// Appends a request to out as a masked WebSocket message, as a client has to send it
+static size_t put_request(uint8_t* out, blip_connection_t* sender, MessageNo msg_no, FrameFlags flags,
+                          uint8_t* body, size_t body_size)
+{
+    static const uint8_t kMaskKey[4] = {0x12, 0x34, 0x56, 0x78};
+    blip_message_t* msg = blip_message_new();
+    msg->msg_no = msg_no;
+    msg->type = kRequestType;
+    msg->flags = flags;
+    msg->properties = (uint8_t*)properties;
+    msg->body = body;
+    msg->body_size = body_size;
+    size_t size;
+    const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+    CHECK(frame);
+    const size_t header_size = ws_put_header(out, size, kMaskKey);
+    memcpy(out + header_size, frame, size);
+    ws_mask(out + header_size, size, kMaskKey);
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+    return header_size + size;
+}
+
+// Talks to the responder directly: the upgrade request arrives together with the first request,
+// one request arrives a few bytes at a time, and the NoReply one is not answered.  Every
+// response has to carry its request's body back, compressed if the request was.
+static void test_responder(int port, uint8_t* body)
+{
+    static const struct {
+        FrameFlags flags;
+        size_t body_size;
+    } kRequests[REQUEST_COUNT] = {
+        {0, 5}, {kCompressed, BIG_BODY_SIZE}, {kNoReply, 10}, {0, 0}, {kCompressed, 3}, {0, BIG_BODY_SIZE},
+    };
+
+    const int fd = connect_to(port);
+    uint8_t* out = malloc(512 + REQUEST_COUNT * (BIG_BODY_SIZE + 64));
+    char accept[WS_KEY_SIZE];
+    const int request_size = ws_client_request((char*)out, 512, port, "/db/_blipsync", 42, accept);
+    CHECK(request_size > 0);
+    blip_connection_t* sender = blip_connection_new();
+    size_t size = (size_t)request_size;
+    size += put_request(out + size, sender, 1, kRequests[0].flags, body, kRequests[0].body_size);
+    CHECK(ws_send_all(fd, out, size) == 0);
+
+    // The start byte by byte, with a pause so that each part has a read of its own
+    size = put_request(out, sender, 2, kRequests[1].flags, body, kRequests[1].body_size);
+    const struct timespec pause = {0, 1000000};
+    for (size_t sent = 0; sent < 20; sent++) {
+        CHECK(ws_send_all(fd, out + sent, 1) == 0);
+        nanosleep(&pause, NULL);
+    }
+
+    CHECK(ws_send_all(fd, out + 20, size - 20) == 0);
+
+    // The rest in one go
+    size = 0;
+    for (int i = 2; i < REQUEST_COUNT; i++) {
+        size += put_request(out + size, sender, (MessageNo)i + 1, kRequests[i].flags, body, kRequests[i].body_size);
+    }
+
+    CHECK(ws_send_all(fd, out, size) == 0);
+
+    // The upgrade response first, then the answers in order
+    blip_connection_t* receiver = blip_connection_new();
+    blip_parser_t* parser = blip_parser_new(receiver, NULL, NULL);
+    blip_message_t* response = blip_message_new();
+    uint8_t buffer[16384];
+    size_t used = 0;
+    size_t header_size = 0;
+    int answered = 0;
+    int next = 0;
+    while (answered < REQUEST_COUNT - 1) {
+        const ssize_t received = recv(fd, buffer + used, sizeof(buffer) - used, 0);
+        CHECK(received > 0);
+        if (received <= 0) {
+            break;
+        }
+
+        const uint8_t* data = buffer;
+        size_t available = used + (size_t)received;
+        if (header_size == 0) {
+            used = available;
+            header_size = ws_header_end(buffer, used);
+            if (header_size == 0) {
+                continue;
+            }
+
+            CHECK(strncmp((const char*)buffer, "HTTP/1.1 101", 12) == 0);
+            CHECK(memmem(buffer, header_size, accept, strlen(accept)) != NULL);
+            data += header_size;
+            available -= header_size;
+        }
+
+        used = 0;
+        while (available > 0) {
+            size_t consumed;
+            const uint8_t* frame;
+            size_t frame_size;
+            const int rc = blip_parser_next(parser, data, available, &consumed, &frame, &frame_size);
+            CHECK(rc >= 0);
+            data += consumed;
+            available -= consumed;
+            if (rc <= 0) {
+                break;
+            }
+
+            CHECK(blip_message_read_into(receiver, response, frame, frame_size) == 0);
+            next += kRequests[next].flags & kNoReply ? 1 : 0;
+            CHECK(response->type == kResponseType && response->msg_no == (MessageNo)next + 1);
+            CHECK(response->checksum == response->calculated_checksum);
+            CHECK((response->flags & kCompressed) == (kRequests[next].flags & kCompressed));
+            CHECK(response->body_size == kRequests[next].body_size
+                  && (response->body_size == 0 || memcmp(response->body, body, response->body_size) == 0));
+            next++;
+            answered++;
+        }
+    }
+
+    CHECK(answered == REQUEST_COUNT - 1 && next == REQUEST_COUNT);
+    blip_message_free(response);
+    blip_parser_free(parser);
+    blip_connection_free(receiver);
+    blip_connection_free(sender);
+    free(out);
+    close(fd);
+}
+
+// Anything but a WebSocket upgrade gets the connection closed
+static void test_refused(int port)
+{
+    const int fd = connect_to(port);
+    static const char kRequest[] = "GET /db/_blipsync HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    CHECK(ws_send_all(fd, (const uint8_t*)kRequest, strlen(kRequest)) == 0);
+    uint8_t buffer[256];
+    ssize_t received;
+    size_t total = 0;
+    while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        total += (size_t)received;
+    }
+
+    CHECK(received == 0 && (total == 0 || strncmp((const char*)buffer, "HTTP/1.1 101", 12) != 0));
+    close(fd);
+}
+
+// Runs the load command with its report going into output instead of stdout
+static int run(char* output, const char* const* args, int count)
+{
+    char* argv[32];
+    argv[0] = "load";
+    for (int i = 0; i < count; i++) {
+        argv[i + 1] = (char*)args[i];
+    }
+
+    fflush(stdout);
+    FILE* file = tmpfile();
+    const int saved = dup(STDOUT_FILENO);
+    CHECK(file && saved >= 0 && dup2(fileno(file), STDOUT_FILENO) >= 0);
+    const int retVal = run_load(count + 1, argv);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    rewind(file);
+    const size_t size = fread(output, 1, MAX_OUTPUT - 1, file);
+    output[size] = 0;
+    fclose(file);
+    return retVal;
+}
+
+// Checks that every request of a load run was answered, and that percentiles were reported for
+// each profile in the mix
+static void check_report(const char* output, const char* const* profiles, int profile_count)
+{
+    const char* totals = strstr(output, " requests (");
+    while (totals && totals > output && totals[-1] != '\n') {
+        totals--;
+    }
+
+    uint64_t requests = 0, bytes_out, responses = 1, bytes_in, errors = 1, unanswered = 1, failed = 1;
+    CHECK(totals && sscanf(totals, "%" SCNu64 " requests (%" SCNu64 " bytes), %" SCNu64 " responses (%" SCNu64
+                           " bytes), %" SCNu64 " errors, %" SCNu64 " unanswered, %" SCNu64 " failed sessions",
+                           &requests, &bytes_out, &responses, &bytes_in, &errors, &unanswered, &failed) == 7);
+    CHECK(requests > 0 && responses == requests && bytes_in > 0 && bytes_out > 0);
+    CHECK(errors == 0 && unanswered == 0 && failed == 0);
+    CHECK(strstr(output, "\ncorrected ") != NULL && strstr(output, "\nuncorrected ") != NULL);
+    for (int i = 0; i < profile_count; i++) {
+        char label[64];
+        snprintf(label, sizeof(label), "\n  %s ", profiles[i]);
+        CHECK(strstr(output, label) != NULL);
+    }
+}
+
+int main(void)
+{
+    uint8_t* body = malloc(BIG_BODY_SIZE);
+    for (int i = 0; i < BIG_BODY_SIZE; i++) {
+        body[i] = (uint8_t)('a' + (i * 7 + i / 300) % 26);
+    }
+
+    responder_t* responder = responder_start(0, 2);
+    CHECK(responder && responder_port(responder) > 0);
+    if (!responder) {
+        free(body);
+        return test_result();
+    }
+
+    const int port = responder_port(responder);
+    test_responder(port, body);
+    test_refused(port);
+    test_responder(port, body);
+    free(body);
+
+    // Against the responder started above, then against one the load command starts itself
+    static char output[MAX_OUTPUT];
+    char port_value[16];
+    snprintf(port_value, sizeof(port_value), "%d", port);
+    const char* external[] = {"--sessions", "3", "--threads", "2", "--rate", "600", "--duration", "0.5",
+                              "--warmup", "0.1", "--mix", "rev=3,changes=1", "--body", "1-3000", "--port",
+                              port_value};
+    CHECK(run(output, external, 16) == 0);
+    CHECK(strstr(output, "3 sessions on 2 threads against ws://127.0.0.1:") != NULL);
+    CHECK(strstr(output, "(bundled responder)") == NULL);
+    const char* mix[] = {"rev", "changes"};
+    check_report(output, mix, 2);
+
+    const char* bundled[] = {"--sessions", "4", "--rate", "800", "--duration", "0.5", "--warmup", "0.1",
+                             "--body", "exp:500", "--compress"};
+    CHECK(run(output, bundled, 11) == 0);
+    CHECK(strstr(output, "(bundled responder)") != NULL && strstr(output, ", compressed") != NULL);
+    const char* default_mix[] = {"changes", "rev", "getCheckpoint", "setCheckpoint"};
+    check_report(output, default_mix, 4);
+    responder_stop(responder);
+
+    // Settings that don't make sense are refused before anything starts
+    static const char* const kInvalid[][2] = {
+        {"--sessions", "0"}, {"--rate", "0"}, {"--duration", "-1"}, {"--warmup", "20"}, {"--threads", "-2"},
+        {"--port", "70000"}, {"--mix", "rev=0"}, {"--mix", ""}, {"--body", "10-5"}, {"--colour", "blue"},
+    };
+
+    for (size_t i = 0; i < sizeof(kInvalid) / sizeof(kInvalid[0]); i++) {
+        CHECK(run(output, kInvalid[i], 2) < 0);
+    }
+
+    const char* missing[] = {"--rate"};
+    CHECK(run(output, missing, 1) < 0 && strstr(output, "Missing value for --rate") != NULL);
+    const char* extra[] = {"--rate", "10", "capture"};
+    CHECK(run(output, extra, 3) < 0 && strstr(output, "Usage:") != NULL);
+    return test_result();
+}
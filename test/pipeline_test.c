@@ -0,0 +1,189 @@
+//
+//  pipeline_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_pipeline.h"
+#include "cblip_stats.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define GENERATED_COUNT 20000
+
+// A message as blip_message_read() decoded it
+typedef struct {
+    MessageNo msg_no;
+    MessageType type;
+    FrameFlags flags;
+    uint32_t calculated_checksum;
+    char* properties;
+    uint8_t* body;
+    size_t body_size;
+} expected_message;
+
+typedef struct {
+    const expected_message* expected;
+    size_t count;
+    size_t seen;
+} compare_context;
+
+// Runs on the pipeline's consumer thread, while the main thread waits in blip_pipeline_finish()
+static void compare(void* context, blip_message_t* msg)
+{
+    compare_context* ctx = context;
+    CHECK(ctx->seen < ctx->count);
+    if (ctx->seen >= ctx->count) {
+        return;
+    }
+
+    const expected_message* e = &ctx->expected[ctx->seen++];
+    CHECK(msg->msg_no == e->msg_no && msg->type == e->type && msg->flags == e->flags);
+    if (msg->type >= kAckRequestType) {
+        return;
+    }
+
+    CHECK(msg->checksum == msg->calculated_checksum && msg->calculated_checksum == e->calculated_checksum);
+    CHECK(msg->body_size == e->body_size && (e->body_size == 0 || memcmp(msg->body, e->body, e->body_size) == 0));
+    CHECK(msg->properties ? e->properties && strcmp((const char*)msg->properties, e->properties) == 0
+                          : !e->properties);
+}
+
+static void count_stats(void* context, const blip_stats_record_t* record)
+{
+    *(uint64_t*)context += record->messages;
+}
+
+// Decodes the frames with blip_message_read() on one connection, then through a pipeline on
+// another with a stats shard of its own, and checks the pipeline hands over the same messages
+// in the same order
+static void check_frames(uint8_t** frames, const size_t* sizes, size_t count, size_t ring_capacity)
+{
+    expected_message* expected = calloc(count, sizeof(expected_message));
+    blip_connection_t* connection = blip_connection_new();
+    for (size_t i = 0; i < count; i++) {
+        uint8_t* copy = malloc(sizes[i]);
+        memcpy(copy, frames[i], sizes[i]);
+        blip_message_t* msg = blip_message_read(connection, copy, sizes[i]);
+        CHECK(msg);
+        if (msg) {
+            expected_message* e = &expected[i];
+            e->msg_no = msg->msg_no;
+            e->type = msg->type;
+            e->flags = msg->flags;
+            e->calculated_checksum = msg->calculated_checksum;
+            if (msg->type < kAckRequestType) {
+                e->properties = msg->properties ? strdup((const char*)msg->properties) : NULL;
+                e->body_size = msg->body_size;
+                e->body = malloc(msg->body_size + 1);
+                memcpy(e->body, msg->body, msg->body_size);
+            }
+
+            blip_message_free(msg);
+        }
+
+        free(copy);
+    }
+
+    blip_connection_free(connection);
+
+    uint64_t recorded = 0;
+    blip_stats_t* stats = blip_stats_new(1, 64, 0, count_stats, &recorded);
+    blip_connection_t* pipelined = blip_connection_new();
+    blip_connection_set_stats(pipelined, blip_stats_shard(stats, 0));
+    compare_context ctx = {expected, count, 0};
+    blip_pipeline_t* pipeline = blip_pipeline_new(pipelined, ring_capacity, compare, &ctx);
+    CHECK(pipeline);
+    if (pipeline) {
+        for (size_t i = 0; i < count; i++) {
+            CHECK(blip_pipeline_push(pipeline, frames[i], sizes[i]) == 0);
+        }
+
+        CHECK(blip_pipeline_finish(pipeline) == 0);
+        blip_pipeline_free(pipeline);
+    }
+
+    CHECK(ctx.seen == count);
+    blip_stats_flush(stats);
+    CHECK(recorded == count);
+    blip_connection_free(pipelined);
+    blip_stats_free(stats);
+    for (size_t i = 0; i < count; i++) {
+        free(expected[i].properties);
+        free(expected[i].body);
+    }
+
+    free(expected);
+}
+
+int main(void)
+{
+    uint8_t* packets[TEST_PACKET_COUNT];
+    size_t packet_sizes[TEST_PACKET_COUNT];
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        packets[i] = read_packet(TEST_PACKETS, i + 1, &packet_sizes[i]);
+        CHECK(packets[i]);
+    }
+
+    // Rings of two slots make every stage wait on its neighbours
+    check_frames(packets, packet_sizes, TEST_PACKET_COUNT, 2);
+    check_frames(packets, packet_sizes, TEST_PACKET_COUNT, 1024);
+    for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+        free(packets[i]);
+    }
+
+    // Enough traffic, a third of it uncompressed, to keep all three stages busy at once
+    uint8_t** frames = malloc(GENERATED_COUNT * sizeof(uint8_t*));
+    size_t* sizes = malloc(GENERATED_COUNT * sizeof(size_t));
+    blip_connection_t* sender = blip_connection_new();
+    blip_message_t* msg = blip_message_new();
+    char body[2048];
+    for (int i = 0; i < GENERATED_COUNT; i++) {
+        char properties[64];
+        snprintf(properties, sizeof(properties), "Profile:rev:id:doc%d", i);
+        int length = snprintf(body, sizeof(body), "{\"_id\":\"doc%d\",\"v\":%d}", i, i * 7);
+        for (int k = 0; k < (i % 20) * 50; k++) {
+            body[length++] = (char)('a' + k % 26);
+        }
+
+        msg->msg_no = (MessageNo)i + 1;
+        msg->type = kRequestType;
+        msg->flags = i % 3 ? kCompressed : 0;
+        msg->properties = (uint8_t*)properties;
+        msg->body = (uint8_t*)body;
+        msg->body_size = (size_t)length;
+        const uint8_t* frame = blip_message_serialize(sender, msg, &sizes[i]);
+        CHECK(frame);
+        frames[i] = malloc(sizes[i]);
+        memcpy(frames[i], frame, sizes[i]);
+    }
+
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+    blip_connection_free(sender);
+    check_frames(frames, sizes, GENERATED_COUNT, 64);
+    for (int i = 0; i < GENERATED_COUNT; i++) {
+        free(frames[i]);
+    }
+
+    free(frames);
+    free(sizes);
+    return test_result();
+}
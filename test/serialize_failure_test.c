@@ -0,0 +1,113 @@
+//
+//  serialize_failure_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "cblip.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Built from the library sources and linked with --wrap=deflate, so that a chosen call to
+ * deflate() fails part of the way through compressing a frame.
+ */
+
+#define BODY_SIZE (256 * 1024)
+#define MESSAGE_COUNT 8
+
+static char properties[] = "Profile:rev:id:doc";
+static int fail_call = -1;
+static int calls = 0;
+
+int __real_deflate(z_streamp stream, int flush);
+
+int __wrap_deflate(z_streamp stream, int flush)
+{
+    return calls++ == fail_call ? Z_STREAM_ERROR : __real_deflate(stream, flush);
+}
+
+static blip_message_t* make_message(MessageNo msg_no, uint8_t* body)
+{
+    blip_message_t* retVal = blip_message_new();
+    retVal->msg_no = msg_no;
+    retVal->type = kRequestType;
+    retVal->flags = kCompressed;
+    retVal->properties = (uint8_t*)properties;
+    retVal->body = body;
+    retVal->body_size = BODY_SIZE;
+    return retVal;
+}
+
+// Fails the deflate call given by fail_at while the message numbered fail_msg is serialized,
+// and checks that every other message still reaches the receiver intact
+static void run(MessageNo fail_msg, int fail_at, uint8_t* body)
+{
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* receiver = blip_connection_new();
+    int failed = 0;
+    for (MessageNo n = 1; n <= MESSAGE_COUNT; n++) {
+        blip_message_t* msg = make_message(n, body);
+        calls = 0;
+        fail_call = n == fail_msg ? fail_at : -1;
+        size_t size;
+        const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+        if (!frame) {
+            CHECK(n == fail_msg);
+            failed++;
+        } else {
+            // A frame takes one deflate call for the properties and one for the body, so the
+            // failing call fell part of the way through one
+            CHECK(n != fail_msg && calls > fail_at);
+            uint8_t* copy = malloc(size);
+            memcpy(copy, frame, size);
+            blip_message_t* received = blip_message_read(receiver, copy, size);
+            CHECK(received && received->checksum == received->calculated_checksum);
+            CHECK(received && received->body_size == BODY_SIZE && memcmp(received->body, body, BODY_SIZE) == 0);
+            if (received) {
+                blip_message_free(received);
+            }
+
+            free(copy);
+        }
+
+        blip_message_free(msg);
+    }
+
+    CHECK(failed == 1);
+    blip_connection_free(sender);
+    blip_connection_free(receiver);
+}
+
+int main(void)
+{
+    // Compressible, but not so much that it fits the output of the first deflate call
+    uint8_t* body = malloc(BODY_SIZE);
+    uint32_t state = 12345;
+    for (size_t i = 0; i < BODY_SIZE; i++) {
+        state = state * 1103515245 + 12345;
+        body[i] = (uint8_t)"abcdefgh"[(state >> 16) % 8];
+    }
+
+    // Fail compressing the properties, then the body, once the frame is well under way
+    run(1, 0, body);
+    run(3, 0, body);
+    run(3, 1, body);
+    run(MESSAGE_COUNT, 1, body);
+    free(body);
+    return test_result();
+}
@@ -0,0 +1,202 @@
+//
+//  session_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_session.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_EXCHANGES 8
+#define FLOOD_COUNT 70000
+
+typedef struct {
+    blip_exchange_t exchanges[MAX_EXCHANGES];
+    char profiles[MAX_EXCHANGES][BLIP_SESSION_MAX_PROFILE + 1];
+    int count;
+} exchange_log;
+
+static void log_exchange(void* context, const blip_exchange_t* exchange)
+{
+    exchange_log* log = context;
+    if (log->count < MAX_EXCHANGES) {
+        log->exchanges[log->count] = *exchange;
+        strcpy(log->profiles[log->count], exchange->profile);
+        log->exchanges[log->count].profile = log->profiles[log->count];
+    }
+
+    log->count++;
+}
+
+// Reads a frame travelling in one direction of the session
+static int read_frame(blip_session_t* session, int direction, uint8_t* data, size_t size, uint64_t timestamp_ns)
+{
+    blip_message_t* msg = blip_session_read(session, direction, data, size, timestamp_ns);
+    CHECK(msg && (msg->type >= kAckRequestType || msg->checksum == msg->calculated_checksum));
+    if (!msg) {
+        return -1;
+    }
+
+    blip_message_free(msg);
+    return 0;
+}
+
+// Serializes a message on the sending connection of one direction, reads it with the session's
+// connection and tracks it, as one frame seen at last_ns or (when first_ns is earlier) as two
+// frames seen at first_ns and last_ns.  Returns how much the number of outstanding requests
+// changed by.
+static int send_frame(blip_session_t* session, blip_connection_t* sender, int direction, MessageNo msg_no,
+                      MessageType type, FrameFlags flags, const char* properties, uint64_t first_ns,
+                      uint64_t last_ns)
+{
+    char props[128];
+    strcpy(props, properties);
+    uint8_t body[] = "{}";
+    blip_message_t* msg = blip_message_new();
+    msg->msg_no = msg_no;
+    msg->type = type;
+    msg->flags = flags;
+    msg->properties = props[0] ? (uint8_t*)props : NULL;
+    msg->body = body;
+    msg->body_size = 2;
+    size_t size;
+    const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+    CHECK(frame);
+    uint8_t* copy = malloc(size);
+    memcpy(copy, frame, size);
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+
+    const size_t before = blip_session_outstanding(session);
+    blip_message_t* received = blip_message_read(blip_session_connection(session, direction), copy, size);
+    CHECK(received && received->checksum == received->calculated_checksum);
+    int retVal = -1;
+    if (received) {
+        // The serializer only writes whole messages, so the first of two frames is this one
+        // tracked with MoreComing set
+        if (first_ns < last_ns) {
+            received->flags |= kMoreComing;
+            CHECK(blip_session_track(session, received, first_ns) == 0);
+            received->flags &= ~kMoreComing;
+        }
+
+        retVal = blip_session_track(session, received, last_ns) < 0 ? -1 : 0;
+        blip_message_free(received);
+    }
+
+    free(copy);
+    return retVal < 0 ? retVal : (int)blip_session_outstanding(session) - (int)before;
+}
+
+// The capture is one side of a conversation (direction 0): eleven requests, one of them
+// NoReply, and responses to requests 2 and 3 of the other side.  The other side (direction 1)
+// is made up around it: it sends those two requests, the second in two frames, and answers
+// requests 1, 3 and 6 of the capture.  Capture packet n is seen at n microseconds.
+static void test_capture(void)
+{
+    exchange_log log;
+    memset(&log, 0, sizeof(log));
+    blip_session_t* session = blip_session_new(log_exchange, &log);
+    blip_connection_t* peer = blip_connection_new();
+
+    CHECK(send_frame(session, peer, 1, 1, kRequestType, kNoReply, "Profile:ping", 100, 100) == 0);
+    CHECK(send_frame(session, peer, 1, 2, kRequestType, 0, "Profile:getRev", 200, 200) == 1);
+    CHECK(send_frame(session, peer, 1, 3, kRequestType, 0, "Profile:putRev", 300, 400) == 1);
+    CHECK(blip_session_outstanding(session) == 2);
+
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        CHECK(data);
+        if (data) {
+            read_frame(session, 0, data, length, (uint64_t)i * 1000);
+            free(data);
+        }
+
+        // Each response arrives in two frames, 150 and 250 after its request
+        const uint64_t reply_at = (uint64_t)i * 1000 + 250;
+        if (i == 1 || i == 3 || i == 6) {
+            const int count = log.count;
+            const int change = send_frame(session, peer, 1, (MessageNo)i, kResponseType, 0, "", reply_at - 100,
+                                          reply_at);
+            CHECK(change == (i == 3 ? 0 : -1));
+            CHECK(log.count == count + (i == 3 ? 0 : 1));
+        }
+    }
+
+    // In order of completion
+    CHECK(log.count == 4);
+    const blip_exchange_t* e = log.exchanges;
+    CHECK(e[0].msg_no == 1 && e[0].direction == 0 && strcmp(e[0].profile, "getCheckpoint") == 0);
+    CHECK(e[0].rtt_ns == 250 && e[0].ttfb_ns == 150 && e[0].response_type == kResponseType);
+    CHECK(e[0].response_first_ns == 1150 && e[0].response_size == 4);
+    CHECK(e[1].msg_no == 6 && e[1].direction == 0 && strcmp(e[1].profile, "setCheckpoint") == 0);
+    CHECK(e[1].request_first_ns == 6000 && e[1].response_last_ns == 6250 && e[1].rtt_ns == 250);
+    CHECK(e[2].msg_no == 2 && e[2].direction == 1 && strcmp(e[2].profile, "getRev") == 0);
+    CHECK(e[2].rtt_ns == 7000 - 200 && e[2].ttfb_ns == 7000 - 200 && e[2].response_size == 2);
+    CHECK(e[3].msg_no == 3 && e[3].direction == 1 && strcmp(e[3].profile, "putRev") == 0);
+    CHECK(e[3].request_first_ns == 300 && e[3].request_last_ns == 400 && e[3].request_size == 4);
+    CHECK(e[3].rtt_ns == 12000 - 300 && e[3].ttfb_ns == 12000 - 400);
+
+    // Eleven capture requests, less the NoReply one and the two answered
+    CHECK(blip_session_outstanding(session) == 8);
+    CHECK(blip_session_forget(session, 1) == 0);
+    CHECK(blip_session_forget(session, 0) == 8);
+    CHECK(blip_session_outstanding(session) == 0);
+
+    blip_connection_free(peer);
+    blip_session_free(session);
+}
+
+// Requests that are never answered are dropped, oldest first, once too many are outstanding
+static void test_cap(void)
+{
+    exchange_log log;
+    memset(&log, 0, sizeof(log));
+    blip_session_t* session = blip_session_new(log_exchange, &log);
+    blip_connection_t* requester = blip_connection_new();
+    blip_connection_t* responder = blip_connection_new();
+    size_t most = 0;
+    for (MessageNo n = 1; n <= FLOOD_COUNT; n++) {
+        send_frame(session, requester, 0, n, kRequestType, 0, "Profile:rev", n, n);
+        const size_t outstanding = blip_session_outstanding(session);
+        most = outstanding > most ? outstanding : most;
+    }
+
+    CHECK(most == 65536);
+    CHECK(blip_session_outstanding(session) < FLOOD_COUNT);
+
+    // The oldest request has been dropped, the newest can still be answered
+    send_frame(session, responder, 1, 1, kResponseType, 0, "", FLOOD_COUNT + 1, FLOOD_COUNT + 1);
+    CHECK(log.count == 0);
+    send_frame(session, responder, 1, FLOOD_COUNT, kResponseType, 0, "", FLOOD_COUNT + 2, FLOOD_COUNT + 2);
+    CHECK(log.count == 1 && log.exchanges[0].msg_no == FLOOD_COUNT && log.exchanges[0].rtt_ns == 2);
+
+    blip_connection_free(requester);
+    blip_connection_free(responder);
+    blip_session_free(session);
+}
+
+int main(void)
+{
+    test_capture();
+    test_cap();
+    return test_result();
+}
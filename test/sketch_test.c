@@ -0,0 +1,222 @@
+//
+//  sketch_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_sketch.h"
+#include "test.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_COUNT 20000
+
+static size_t key_of(char* key, size_t size, int number)
+{
+    return (size_t)snprintf(key, size, "doc-%d", number);
+}
+
+// Serializes a set of sketches, checking that the size asked for up front is what gets written
+static uint8_t* serialize(const blip_traffic_sketches_t* sketches, size_t* size)
+{
+    *size = blip_traffic_sketches_serialize(sketches, NULL, 0);
+    uint8_t* retVal = malloc(*size);
+    CHECK(retVal && blip_traffic_sketches_serialize(sketches, retVal, *size) == *size);
+    return retVal;
+}
+
+static void check_same(const blip_traffic_sketches_t* a, const blip_traffic_sketches_t* b)
+{
+    size_t a_size;
+    size_t b_size;
+    uint8_t* a_data = serialize(a, &a_size);
+    uint8_t* b_data = serialize(b, &b_size);
+    CHECK(a_size == b_size && memcmp(a_data, b_data, a_size) == 0);
+    free(a_data);
+    free(b_data);
+}
+
+// Splitting keys over two sketches and merging them gives the sketch of all the keys
+static void test_merge(void)
+{
+    blip_hll_t* whole = blip_hll_new(12);
+    blip_hll_t* first = blip_hll_new(12);
+    blip_hll_t* second = blip_hll_new(12);
+    blip_quantiles_t* whole_sizes = blip_quantiles_new(5);
+    blip_quantiles_t* first_sizes = blip_quantiles_new(5);
+    blip_quantiles_t* second_sizes = blip_quantiles_new(5);
+    blip_topk_t* whole_top = blip_topk_new(64, 1024, 4);
+    blip_topk_t* first_top = blip_topk_new(64, 1024, 4);
+    blip_topk_t* second_top = blip_topk_new(64, 1024, 4);
+    char key[32];
+    for (int i = 0; i < KEY_COUNT; i++) {
+        // The halves overlap, so the merge has duplicates to see through
+        const size_t size = key_of(key, sizeof(key), i % (KEY_COUNT * 3 / 4));
+        blip_hll_add(whole, (const uint8_t*)key, size);
+        blip_hll_add(i % 2 ? first : second, (const uint8_t*)key, size);
+        blip_quantiles_add(whole_sizes, (uint64_t)i * 7);
+        blip_quantiles_add(i % 2 ? first_sizes : second_sizes, (uint64_t)i * 7);
+        const size_t hot = key_of(key, sizeof(key), i % 40);
+        blip_topk_add(whole_top, (const uint8_t*)key, hot, 1);
+        blip_topk_add(i % 2 ? first_top : second_top, (const uint8_t*)key, hot, 1);
+    }
+
+    CHECK(blip_hll_merge(first, second) == 0);
+    CHECK(blip_hll_estimate(first) == blip_hll_estimate(whole));
+    CHECK(fabs((double)blip_hll_estimate(first) - KEY_COUNT * 3 / 4) < KEY_COUNT * 3 / 4 * 0.05);
+    CHECK(blip_quantiles_merge(first_sizes, second_sizes) == 0);
+    CHECK(blip_quantiles_count(first_sizes) == KEY_COUNT);
+    CHECK(blip_quantiles_get(first_sizes, 0.5) == blip_quantiles_get(whole_sizes, 0.5));
+    CHECK(blip_quantiles_get(first_sizes, 0.99) == blip_quantiles_get(whole_sizes, 0.99));
+    CHECK(blip_topk_merge(first_top, second_top) == 0);
+    CHECK(blip_topk_total(first_top) == blip_topk_total(whole_top));
+    blip_topk_entry_t merged[64];
+    blip_topk_entry_t expected[64];
+    const size_t count = blip_topk_list(first_top, merged, 64);
+    CHECK(count == 40 && blip_topk_list(whole_top, expected, 64) == count);
+    for (size_t i = 0; i < count; i++) {
+        CHECK(merged[i].count == KEY_COUNT / 40);
+        CHECK(blip_topk_estimate(whole_top, (const uint8_t*)merged[i].key, merged[i].key_size) == merged[i].count);
+    }
+
+    // Sketches of different sizes don't merge
+    blip_hll_t* other = blip_hll_new(10);
+    blip_topk_t* other_top = blip_topk_new(32, 1024, 4);
+    CHECK(blip_hll_merge(first, other) < 0);
+    CHECK(blip_topk_merge(first_top, other_top) < 0);
+    blip_hll_free(other);
+    blip_topk_free(other_top);
+
+    blip_hll_free(whole);
+    blip_hll_free(first);
+    blip_hll_free(second);
+    blip_quantiles_free(whole_sizes);
+    blip_quantiles_free(first_sizes);
+    blip_quantiles_free(second_sizes);
+    blip_topk_free(whole_top);
+    blip_topk_free(first_top);
+    blip_topk_free(second_top);
+}
+
+// Traffic sketches of the capture, split between two "nodes" and merged after a round trip
+// through the serialized form, match the sketches of the whole capture
+static void test_traffic(void)
+{
+    blip_traffic_sketches_t whole;
+    blip_traffic_sketches_t nodes[2];
+    CHECK(blip_traffic_sketches_new(NULL, &whole) == 0);
+    CHECK(blip_traffic_sketches_new(NULL, &nodes[0]) == 0);
+    CHECK(blip_traffic_sketches_new(NULL, &nodes[1]) == 0);
+    blip_connection_t* connection = blip_connection_new();
+    CHECK(blip_connection_set_client(connection, "client") == 0);
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        blip_message_t* msg = data ? blip_message_read(connection, data, length) : NULL;
+        CHECK(msg);
+        if (msg) {
+            blip_traffic_sketches_record(&whole, msg, length);
+            blip_traffic_sketches_record(&nodes[i % 2], msg, length);
+            blip_message_free(msg);
+        }
+
+        free(data);
+    }
+
+    blip_connection_free(connection);
+    size_t size;
+    uint8_t* data = serialize(&nodes[1], &size);
+    blip_traffic_sketches_t received;
+    blip_traffic_sketches_t rejected;
+    CHECK(blip_traffic_sketches_deserialize(data, size, &received) == 0);
+    check_same(&received, &nodes[1]);
+    CHECK(blip_traffic_sketches_deserialize(data, size - 1, &rejected) < 0);
+    free(data);
+
+    CHECK(blip_traffic_sketches_merge(&nodes[0], &received) == 0);
+    CHECK(blip_quantiles_count(nodes[0].body_sizes) == blip_quantiles_count(whole.body_sizes));
+    CHECK(blip_hll_estimate(nodes[0].doc_ids) == blip_hll_estimate(whole.doc_ids));
+    CHECK(blip_topk_total(nodes[0].client_bytes) == blip_topk_total(whole.client_bytes));
+    check_same(&nodes[0], &whole);
+
+    blip_traffic_sketches_free(&received);
+    blip_traffic_sketches_free(&whole);
+    blip_traffic_sketches_free(&nodes[0]);
+    blip_traffic_sketches_free(&nodes[1]);
+}
+
+// Each sketch reads back to one that serializes to the same bytes, and rejects truncated input
+static void test_round_trip(void)
+{
+    blip_hll_t* hll = blip_hll_new(14);
+    blip_topk_t* topk = blip_topk_new(16, 256, 3);
+    blip_quantiles_t* quantiles = blip_quantiles_new(4);
+    char key[32];
+    for (int i = 0; i < KEY_COUNT; i++) {
+        const size_t size = key_of(key, sizeof(key), i % 500);
+        blip_hll_add(hll, (const uint8_t*)key, size);
+        blip_topk_add(topk, (const uint8_t*)key, size, (uint64_t)(i % 3) + 1);
+        blip_quantiles_add(quantiles, (uint64_t)i * i);
+    }
+
+    size_t size = blip_hll_serialize(hll, NULL, 0);
+    uint8_t* data = malloc(size);
+    uint8_t* again = malloc(size);
+    CHECK(blip_hll_serialize(hll, data, size) == size);
+    blip_hll_t* hll_copy = blip_hll_deserialize(data, size);
+    CHECK(hll_copy && blip_hll_serialize(hll_copy, again, size) == size && memcmp(data, again, size) == 0);
+    CHECK(!blip_hll_deserialize(data, size - 1));
+    free(data);
+    free(again);
+
+    size = blip_topk_serialize(topk, NULL, 0);
+    data = malloc(size);
+    again = malloc(size);
+    CHECK(blip_topk_serialize(topk, data, size) == size);
+    blip_topk_t* topk_copy = blip_topk_deserialize(data, size);
+    CHECK(topk_copy && blip_topk_serialize(topk_copy, again, size) == size && memcmp(data, again, size) == 0);
+    CHECK(!blip_topk_deserialize(data, size - 1));
+    free(data);
+    free(again);
+
+    size = blip_quantiles_serialize(quantiles, NULL, 0);
+    data = malloc(size);
+    again = malloc(size);
+    CHECK(blip_quantiles_serialize(quantiles, data, size) == size);
+    blip_quantiles_t* quantiles_copy = blip_quantiles_deserialize(data, size);
+    CHECK(quantiles_copy && blip_quantiles_serialize(quantiles_copy, again, size) == size
+          && memcmp(data, again, size) == 0);
+    CHECK(!blip_quantiles_deserialize(data, size - 1));
+    free(data);
+    free(again);
+
+    blip_hll_free(hll);
+    blip_hll_free(hll_copy);
+    blip_topk_free(topk);
+    blip_topk_free(topk_copy);
+    blip_quantiles_free(quantiles);
+    blip_quantiles_free(quantiles_copy);
+}
+
+int main(void)
+{
+    test_merge();
+    test_traffic();
+    test_round_trip();
+    return test_result();
+}
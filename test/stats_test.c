@@ -0,0 +1,234 @@
+//
+//  stats_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_stats.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARD_CAPACITY 16
+#define CHURN_COUNT 500
+
+// Totals of what one flush reported
+typedef struct {
+    int records;
+    uint64_t messages;
+    uint64_t wire_bytes;
+    uint64_t other;         // Messages folded into the "(other)" overflow record
+    const blip_connection_t* connection;    // Set while all records name the same connection
+    bool mixed;
+} flush_totals;
+
+static void add_record(void* context, const blip_stats_record_t* record)
+{
+    flush_totals* totals = context;
+    if (totals->records == 0) {
+        totals->connection = record->connection;
+    } else if (record->connection != totals->connection) {
+        totals->mixed = true;
+    }
+
+    totals->records++;
+    totals->messages += record->messages;
+    totals->wire_bytes += record->wire_bytes;
+    if (strcmp(record->profile, "(other)") == 0) {
+        totals->other += record->messages;
+    }
+}
+
+static void flush(blip_stats_t* stats, flush_totals* totals)
+{
+    memset(totals, 0, sizeof(flush_totals));
+    blip_stats_flush(stats);
+}
+
+// Serializes a request with its own profile and reads it on the receiving connection
+static void read_request(blip_connection_t* sender, blip_connection_t* receiver, MessageNo msg_no, int profile)
+{
+    char properties[32];
+    snprintf(properties, sizeof(properties), "Profile:p%d", profile);
+    uint8_t body[] = "{}";
+    blip_message_t* msg = blip_message_new();
+    msg->msg_no = msg_no;
+    msg->type = kRequestType;
+    msg->properties = (uint8_t*)properties;
+    msg->body = body;
+    msg->body_size = 2;
+    size_t size;
+    const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+    CHECK(frame);
+    uint8_t* copy = malloc(size);
+    memcpy(copy, frame, size);
+    msg->properties = NULL;
+    msg->body = NULL;
+    blip_message_free(msg);
+
+    blip_message_t* received = blip_message_read(receiver, copy, size);
+    CHECK(received);
+    if (received) {
+        blip_message_free(received);
+    }
+
+    free(copy);
+}
+
+// A connection's counts are flushed as they come in, and once more after it is freed
+static void test_capture(void)
+{
+    flush_totals totals;
+    blip_stats_t* stats = blip_stats_new(1, SHARD_CAPACITY, 0, add_record, &totals);
+    CHECK(stats);
+    blip_connection_t* connection = blip_connection_new();
+    blip_connection_set_stats(connection, blip_stats_shard(stats, 0));
+    uint64_t wire_bytes = 0;
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        blip_message_t* msg = data ? blip_message_read(connection, data, length) : NULL;
+        CHECK(msg);
+        if (msg) {
+            blip_message_free(msg);
+        }
+
+        wire_bytes += length;
+        free(data);
+        if (i == 6) {
+            flush(stats, &totals);
+            CHECK(totals.messages == 6 && totals.connection == connection && !totals.mixed);
+        }
+    }
+
+    // The last seven messages are reported after the connection is gone, then nothing more
+    blip_connection_free(connection);
+    flush(stats, &totals);
+    CHECK(totals.messages == TEST_PACKET_COUNT - 6 && totals.other == 0);
+    flush(stats, &totals);
+    CHECK(totals.records == 0);
+
+    // Everything added up
+    blip_connection_t* again = blip_connection_new();
+    blip_connection_set_stats(again, blip_stats_shard(stats, 0));
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        blip_message_t* msg = data ? blip_message_read(again, data, length) : NULL;
+        if (msg) {
+            blip_message_free(msg);
+        }
+
+        free(data);
+    }
+
+    blip_connection_free(again);
+    flush(stats, &totals);
+    CHECK(totals.messages == TEST_PACKET_COUNT && totals.wire_bytes == wire_bytes);
+    blip_stats_free(stats);
+}
+
+// Connections come and go far more often than the shard has slots.  Each one's slot is
+// reported one last time and then reused, as long as flushes keep up, whether the connection
+// is freed, detached, or recorded by hand and forgotten.
+static void test_churn(void)
+{
+    flush_totals totals;
+    blip_stats_t* stats = blip_stats_new(1, SHARD_CAPACITY, 0, add_record, &totals);
+    blip_stats_shard_t* shard = blip_stats_shard(stats, 0);
+    blip_connection_t* sender = blip_connection_new();
+    uint64_t messages = 0;
+    uint64_t other = 0;
+    for (int n = 0; n < CHURN_COUNT; n++) {
+        blip_connection_t* connection = blip_connection_new();
+        const int way = n % 3;
+        if (way < 2) {
+            blip_connection_set_stats(connection, shard);
+            read_request(sender, connection, (MessageNo)n + 1, n);
+            if (way == 1) {
+                blip_connection_set_stats(connection, NULL);
+            }
+        } else {
+            blip_connection_t* sender2 = blip_connection_new();
+            blip_message_t* msg = blip_message_new();
+            uint8_t body[] = "{}";
+            char properties[] = "Profile:byhand";
+            msg->msg_no = 1;
+            msg->type = kRequestType;
+            msg->properties = (uint8_t*)properties;
+            msg->body = body;
+            msg->body_size = 2;
+            size_t size;
+            const uint8_t* frame = blip_message_serialize(sender2, msg, &size);
+            uint8_t* copy = malloc(size);
+            memcpy(copy, frame, size);
+            msg->properties = NULL;
+            msg->body = NULL;
+            blip_message_free(msg);
+            blip_message_t* received = blip_message_read(connection, copy, size);
+            CHECK(received);
+            if (received) {
+                blip_stats_record(shard, received, size);
+                blip_message_free(received);
+            }
+
+            blip_stats_forget_connection(shard, connection);
+            free(copy);
+            blip_connection_free(sender2);
+        }
+
+        blip_connection_free(connection);
+        flush(stats, &totals);
+        CHECK(totals.records == 1 && totals.messages == 1);
+        messages += totals.messages;
+        other += totals.other;
+    }
+
+    CHECK(messages == CHURN_COUNT && other == 0);
+
+    // Without flushes, the slots of connections that are gone can't be reused yet, and the
+    // overflow record takes what doesn't fit
+    for (int n = 0; n < SHARD_CAPACITY * 2; n++) {
+        blip_connection_t* connection = blip_connection_new();
+        blip_connection_set_stats(connection, shard);
+        read_request(sender, connection, (MessageNo)n + 1, n);
+        blip_connection_free(connection);
+    }
+
+    flush(stats, &totals);
+    CHECK(totals.messages == SHARD_CAPACITY * 2 && totals.other > 0);
+
+    // Once that flush has retired them, they are reused again
+    for (int n = 0; n < SHARD_CAPACITY * 2; n++) {
+        blip_connection_t* connection = blip_connection_new();
+        blip_connection_set_stats(connection, shard);
+        read_request(sender, connection, (MessageNo)n + 1, n);
+        blip_connection_free(connection);
+        flush(stats, &totals);
+        CHECK(totals.messages == 1 && totals.other == 0);
+    }
+
+    blip_connection_free(sender);
+    blip_stats_free(stats);
+}
+
+int main(void)
+{
+    test_capture();
+    test_churn();
+    return test_result();
+}
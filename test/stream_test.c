@@ -0,0 +1,255 @@
+//
+//  stream_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#include "capture.h"
+#include "cblip.h"
+#include "cblip_stats.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LARGE_BODY_SIZE (4 * 1024 * 1024)
+
+// Collects what blip_message_read_streaming() delivers
+typedef struct {
+    uint8_t* body;
+    size_t size;
+    size_t largest_chunk;
+    int properties_calls;
+    bool properties_first;
+    size_t stop_after;      // Stop delivery once this many body bytes arrived (0 to never stop)
+} sink;
+
+static int on_properties(void* context, const blip_message_t* msg)
+{
+    sink* s = context;
+    s->properties_calls++;
+    s->properties_first = s->size == 0 && msg->properties != NULL;
+    return 0;
+}
+
+static int on_body(void* context, const blip_message_t* msg, const uint8_t* chunk, size_t size)
+{
+    (void)msg;
+    sink* s = context;
+    uint8_t* grown = realloc(s->body, s->size + size);
+    if (!grown) {
+        return -1;
+    }
+
+    s->body = grown;
+    memcpy(s->body + s->size, chunk, size);
+    s->size += size;
+    s->largest_chunk = size > s->largest_chunk ? size : s->largest_chunk;
+    return s->stop_after > 0 && s->size >= s->stop_after ? -1 : 0;
+}
+
+// Streams the capture in chunks of the given size and checks every message against the same
+// one read whole
+static void test_capture(size_t chunk_size)
+{
+    blip_connection_t* whole = blip_connection_new();
+    blip_connection_t* streamed = blip_connection_new();
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        CHECK(data);
+        if (!data) {
+            continue;
+        }
+
+        sink s;
+        memset(&s, 0, sizeof(s));
+        const blip_body_stream stream = {chunk_size, on_properties, on_body, &s};
+        blip_message_t* msg;
+        const int result = blip_message_read_streaming(streamed, data, length, &stream, &msg);
+        blip_message_t* expected = blip_message_read(whole, data, length);
+        CHECK(result == 1 && msg && expected);
+        if (msg && expected) {
+            CHECK(msg->msg_no == expected->msg_no && msg->type == expected->type);
+            CHECK(msg->checksum == msg->calculated_checksum);
+            CHECK(msg->calculated_checksum == expected->calculated_checksum);
+            CHECK(msg->body == NULL && msg->body_size == expected->body_size);
+            CHECK(s.largest_chunk <= (chunk_size ? chunk_size : 65536));
+            if (expected->type < kAckRequestType) {
+                CHECK(s.properties_calls == 1 && s.properties_first);
+                CHECK(strcmp((const char*)msg->properties, (const char*)expected->properties) == 0);
+                CHECK(s.size == expected->body_size
+                      && (s.size == 0 || memcmp(s.body, expected->body, s.size) == 0));
+            } else {
+                CHECK(s.properties_calls == 0 && s.size == 0);
+            }
+        }
+
+        if (msg) {
+            blip_message_free(msg);
+        }
+
+        if (expected) {
+            blip_message_free(expected);
+        }
+
+        free(s.body);
+        free(data);
+    }
+
+    blip_connection_free(whole);
+    blip_connection_free(streamed);
+}
+
+static void count_stats(void* context, const blip_stats_record_t* record)
+{
+    *(uint64_t*)context += record->messages;
+}
+
+// A callback that stops a message part of the way through leaves the connection able to read
+// the messages after it, and the stopped message is still complete and counted
+static void test_stop(void)
+{
+    uint64_t recorded = 0;
+    blip_stats_t* stats = blip_stats_new(1, 64, 0, count_stats, &recorded);
+    blip_connection_t* connection = blip_connection_new();
+    blip_connection_set_stats(connection, blip_stats_shard(stats, 0));
+    blip_connection_t* whole = blip_connection_new();
+    int stopped = 0;
+    for (int i = 1; i <= TEST_PACKET_COUNT; i++) {
+        size_t length;
+        uint8_t* data = read_packet(TEST_PACKETS, i, &length);
+        CHECK(data);
+        if (!data) {
+            continue;
+        }
+
+        sink s;
+        memset(&s, 0, sizeof(s));
+        s.stop_after = i % 2 ? 3 : 0;
+        const blip_body_stream stream = {2, NULL, on_body, &s};
+        blip_message_t* msg;
+        const int result = blip_message_read_streaming(connection, data, length, &stream, &msg);
+        blip_message_t* expected = blip_message_read(whole, data, length);
+        CHECK(result >= 0 && msg && expected);
+        if (result == 0) {
+            CHECK(s.stop_after > 0 && s.size >= s.stop_after);
+            stopped++;
+        } else {
+            CHECK(s.stop_after == 0 || s.size < s.stop_after);
+        }
+
+        if (msg && expected) {
+            CHECK(msg->checksum == msg->calculated_checksum || msg->type >= kAckRequestType);
+            CHECK(msg->body_size == expected->body_size);
+        }
+
+        if (msg) {
+            blip_message_free(msg);
+        }
+
+        if (expected) {
+            blip_message_free(expected);
+        }
+
+        free(s.body);
+        free(data);
+    }
+
+    CHECK(stopped > 0);
+    blip_stats_flush(stats);
+    CHECK(recorded == TEST_PACKET_COUNT);
+
+    // A frame cut short fails, and hands back no message
+    blip_connection_t* fresh = blip_connection_new();
+    size_t length;
+    uint8_t* data = read_packet(TEST_PACKETS, 1, &length);
+    sink s;
+    memset(&s, 0, sizeof(s));
+    const blip_body_stream stream = {0, NULL, on_body, &s};
+    blip_message_t* msg = (blip_message_t*)&s;
+    CHECK(data && blip_message_read_streaming(fresh, data, 3, &stream, &msg) < 0 && msg == NULL);
+    free(s.body);
+    free(data);
+    blip_connection_free(fresh);
+    blip_connection_free(connection);
+    blip_connection_free(whole);
+    blip_stats_free(stats);
+}
+
+// A body far bigger than any one buffer goes out compressed and comes back in bounded chunks
+static void test_large_body(void)
+{
+    uint8_t* body = malloc(LARGE_BODY_SIZE);
+    for (size_t i = 0; i < LARGE_BODY_SIZE; i++) {
+        body[i] = (uint8_t)"abcdefghij"[(i * 7 + i / 1000) % 10];
+    }
+
+    blip_connection_t* sender = blip_connection_new();
+    blip_connection_t* streamed = blip_connection_new();
+    blip_connection_t* whole = blip_connection_new();
+    char properties[] = "Profile:getAttachment:digest:sha1-xyz";
+    blip_message_t* msg = blip_message_new();
+    msg->msg_no = 1;
+    msg->type = kRequestType;
+    msg->flags = kCompressed;
+    msg->properties = (uint8_t*)properties;
+    msg->body = body;
+    msg->body_size = LARGE_BODY_SIZE;
+    size_t size;
+    const uint8_t* frame = blip_message_serialize(sender, msg, &size);
+    CHECK(frame && size < LARGE_BODY_SIZE / 4);
+    CHECK(msg->flags & kCompressed);
+
+    sink s;
+    memset(&s, 0, sizeof(s));
+    const blip_body_stream stream = {0, on_properties, on_body, &s};
+    blip_message_t* received = NULL;
+    CHECK(frame && blip_message_read_streaming(streamed, frame, size, &stream, &received) == 1);
+    CHECK(received && received->checksum == received->calculated_checksum);
+    CHECK(s.size == LARGE_BODY_SIZE && memcmp(s.body, body, LARGE_BODY_SIZE) == 0);
+    CHECK(s.largest_chunk <= 65536);
+
+    uint8_t* copy = malloc(size);
+    memcpy(copy, frame, size);
+    blip_message_t* read_whole = blip_message_read(whole, copy, size);
+    CHECK(read_whole && read_whole->body_size == LARGE_BODY_SIZE
+          && memcmp(read_whole->body, body, LARGE_BODY_SIZE) == 0);
+
+    if (read_whole) {
+        blip_message_free(read_whole);
+    }
+
+    if (received) {
+        blip_message_free(received);
+    }
+
+    blip_message_free(msg);
+    blip_connection_free(sender);
+    blip_connection_free(streamed);
+    blip_connection_free(whole);
+    free(copy);
+    free(s.body);
+    free(body);
+}
+
+int main(void)
+{
+    test_capture(1);
+    test_capture(7);
+    test_capture(0);
+    test_stop();
+    test_large_body();
+    return test_result();
+}
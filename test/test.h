@@ -0,0 +1,47 @@
+//
+//  test.h
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#pragma once
+#include <stdio.h>
+
+/*
+ * Each test is one program that runs its checks and exits with a nonzero status if any of them
+ * failed.  TEST_PACKETS is the directory of the capture the driver checks (BLIP_Packet1 to
+ * BLIP_Packet13, one frame each), which the build points at test_packets in the source tree.
+ */
+
+#define TEST_PACKET_COUNT 13
+
+static int test_failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            test_failures++; \
+        } \
+    } while (0)
+
+static inline int test_result(void)
+{
+    if (test_failures > 0) {
+        printf("%d checks failed\n", test_failures);
+    }
+
+    return test_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+//
+//  whatif_test.c
+//
+//  Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#define _POSIX_C_SOURCE 200809L
+#include "test.h"
+#include "whatif.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_OUTPUT 65536
+
+// Runs the what-if command with its report going into output instead of stdout
+static int run(char* output, const char* const* args, int count)
+{
+    char* argv[16];
+    argv[0] = "what-if";
+    for (int i = 0; i < count; i++) {
+        argv[i + 1] = (char*)args[i];
+    }
+
+    fflush(stdout);
+    FILE* file = tmpfile();
+    const int saved = dup(STDOUT_FILENO);
+    CHECK(file && saved >= 0 && dup2(fileno(file), STDOUT_FILENO) >= 0);
+    const int retVal = run_what_if(count + 1, argv);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    rewind(file);
+    const size_t size = fread(output, 1, MAX_OUTPUT - 1, file);
+    output[size] = 0;
+    fclose(file);
+    return retVal;
+}
+
+// Finds the report line of a configuration: wire bytes, compressed frames and bad frames
+static bool config_line(const char* output, const char* spec, uint64_t* wire_bytes, uint64_t* compressed,
+                        uint64_t* bad)
+{
+    const size_t length = strlen(spec);
+    for (const char* line = output; line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (strncmp(line, spec, length) == 0 && line[length] == ' ') {
+            double percent, cpu, speed;
+            return sscanf(line + length, "%" SCNu64 " %lf%% %" SCNu64 " %lf %lf %" SCNu64 " bad", wire_bytes, &percent,
+                          compressed, &cpu, &speed, bad) == 6;
+        }
+    }
+
+    return false;
+}
+
+int main(void)
+{
+    static char output[MAX_OUTPUT];
+    uint64_t wire_bytes, compressed, bad;
+
+    // The settings the capture was made with re-encode it to the same size, and every
+    // configuration decodes again
+    const char* defaults[] = {"--verify", TEST_PACKETS};
+    CHECK(run(output, defaults, 2) == 0);
+    CHECK(strstr(output, "1 captures, 13 frames (6 compressed), 883 bytes on the wire") != NULL);
+    CHECK(config_line(output, "level=6", &wire_bytes, &compressed, &bad));
+    CHECK(wire_bytes == 883 && compressed == 6 && bad == 0);
+    CHECK(config_line(output, "level=1", &wire_bytes, &compressed, &bad) && bad == 0);
+
+    // Nothing in the capture is as big as the minimum size
+    CHECK(config_line(output, "level=6,min=256", &wire_bytes, &compressed, &bad));
+    CHECK(wire_bytes > 883 && compressed == 0 && bad == 0);
+
+    // Forcing compression compresses every frame, and the same capture twice doubles the
+    // totals
+    const char* forced[] = {"--verify", "--config", "level=6,force", "--config", "strategy=rle,mem=9,window=10",
+                            TEST_PACKETS, TEST_PACKETS};
+    CHECK(run(output, forced, 7) == 0);
+    CHECK(strstr(output, "2 captures, 26 frames (12 compressed), 1766 bytes on the wire") != NULL);
+    CHECK(config_line(output, "level=6,force", &wire_bytes, &compressed, &bad));
+    CHECK(compressed == 26 && wire_bytes < 1766 && bad == 0);
+    CHECK(config_line(output, "strategy=rle,mem=9,window=10", &wire_bytes, &compressed, &bad));
+    CHECK(compressed == 12 && bad == 0);
+    CHECK(strstr(output, "\nsetCheckpoint ") != NULL && strstr(output, "\n(response) ") != NULL);
+
+    // Bad settings, options and captures fail before anything is reported
+    const char* invalid[] = {"--config", "level=12", TEST_PACKETS};
+    CHECK(run(output, invalid, 3) < 0 && strstr(output, "Invalid configuration level=12") != NULL);
+    const char* unknown[] = {"--config", "colour=blue", TEST_PACKETS};
+    CHECK(run(output, unknown, 3) < 0);
+    const char* option[] = {"--fast", TEST_PACKETS};
+    CHECK(run(output, option, 2) < 0);
+    const char* usage[] = {"--verify"};
+    CHECK(run(output, usage, 1) < 0 && strstr(output, "Usage:") != NULL);
+    const char* missing[] = {TEST_PACKETS "/no_such_capture"};
+    CHECK(run(output, missing, 1) != 0);
+    return test_result();
+}